@@ -5,8 +5,16 @@
 #include <stdint.h>
 
 #include "abstractfile.h"
+#include "mmapfile.h"
 #include "common.h"
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 size_t freadWrapper(AbstractFile* file, void* data, size_t len) {
   return fread(data, 1, len, (FILE*) (file->data));
 }
@@ -309,3 +317,189 @@ AbstractFile* createAbstractFileFromMemoryFileBuffer(void** buffer, size_t* size
 	return toReturn;
 }
 
+#ifndef WIN32
+
+typedef struct MmapWrapperInfo {
+	int fd;
+	uint8_t* map;
+	size_t length;
+	size_t offset;
+	int writable;
+} MmapWrapperInfo;
+
+static MmapWrapperInfo* mapFile(const char* fileName, int writable, int advice) {
+	MmapWrapperInfo* info;
+	struct stat status;
+	void* map;
+	int fd;
+
+	fd = open(fileName, writable ? O_RDWR : O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	if(fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0 || (off_t)(size_t)status.st_size != status.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)status.st_size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if(map == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	madvise(map, (size_t)status.st_size, advice);
+
+	info = (MmapWrapperInfo*) malloc(sizeof(MmapWrapperInfo));
+	info->fd = fd;
+	info->map = (uint8_t*) map;
+	info->length = (size_t)status.st_size;
+	info->offset = 0;
+	info->writable = writable;
+
+	return info;
+}
+
+static void unmapFile(MmapWrapperInfo* info) {
+	munmap(info->map, info->length);
+	close(info->fd);
+	free(info);
+}
+
+size_t mmapRead(AbstractFile* file, void* data, size_t len) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) (file->data);
+
+	if(info->offset >= info->length)
+		return 0;
+
+	if(len > (info->length - info->offset))
+		len = info->length - info->offset;
+
+	memcpy(data, info->map + info->offset, len);
+	info->offset += len;
+	return len;
+}
+
+size_t mmapWrite(AbstractFile* file, const void* data, size_t len) {
+	return 0;
+}
+
+int mmapSeek(AbstractFile* file, off_t offset) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) (file->data);
+	info->offset = (size_t)offset;
+	return 0;
+}
+
+off_t mmapTell(AbstractFile* file) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) (file->data);
+	return (off_t)info->offset;
+}
+
+off_t mmapGetLength(AbstractFile* file) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) (file->data);
+	return (off_t)info->length;
+}
+
+void mmapClose(AbstractFile* file) {
+	unmapFile((MmapWrapperInfo*) (file->data));
+	free(file);
+}
+
+AbstractFile* createAbstractFileFromMmap(const char* fileName) {
+	MmapWrapperInfo* info;
+	AbstractFile* toReturn;
+
+	info = mapFile(fileName, FALSE, MADV_RANDOM);
+	if(info == NULL)
+		return NULL;
+
+	toReturn = (AbstractFile*) malloc(sizeof(AbstractFile));
+	toReturn->data = info;
+	toReturn->read = mmapRead;
+	toReturn->write = mmapWrite;
+	toReturn->seek = mmapSeek;
+	toReturn->tell = mmapTell;
+	toReturn->getLength = mmapGetLength;
+	toReturn->close = mmapClose;
+	toReturn->type = AbstractFileTypeFile;
+	return toReturn;
+}
+
+static int mmapFileRead(io_func* io, off_t location, size_t size, void *buffer) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) io->data;
+
+	if(size == 0)
+		return TRUE;
+
+	if(location < 0 || (uint64_t)location + size > info->length)
+		return FALSE;
+
+	memcpy(buffer, info->map + location, size);
+	return TRUE;
+}
+
+static int mmapFileWrite(io_func* io, off_t location, size_t size, void *buffer) {
+	MmapWrapperInfo* info = (MmapWrapperInfo*) io->data;
+	void* map;
+
+	if(size == 0)
+		return TRUE;
+
+	if(!info->writable || location < 0)
+		return FALSE;
+
+	if((uint64_t)location + size > info->length) {
+		// writing past the end grows the file, like fwrite would
+		if(ftruncate(info->fd, location + size) != 0)
+			return FALSE;
+
+		munmap(info->map, info->length);
+		map = mmap(NULL, (size_t)(location + size), PROT_READ | PROT_WRITE, MAP_SHARED, info->fd, 0);
+		if(map == MAP_FAILED) {
+			info->map = NULL;
+			info->length = 0;
+			return FALSE;
+		}
+
+		info->map = (uint8_t*) map;
+		info->length = (size_t)(location + size);
+		madvise(info->map, info->length, MADV_RANDOM);
+	}
+
+	memcpy(info->map + location, buffer, size);
+	return TRUE;
+}
+
+static void closeMmapFile(io_func* io) {
+	unmapFile((MmapWrapperInfo*) io->data);
+	free(io);
+}
+
+io_func* openMmapFile(const char* fileName, int writable) {
+	MmapWrapperInfo* info;
+	io_func* io;
+
+	info = mapFile(fileName, writable, MADV_RANDOM);
+	if(info == NULL)
+		return NULL;
+
+	io = (io_func*) malloc(sizeof(io_func));
+	io->data = info;
+	io->read = &mmapFileRead;
+	io->write = &mmapFileWrite;
+	io->close = &closeMmapFile;
+
+	return io;
+}
+
+#else
+
+AbstractFile* createAbstractFileFromMmap(const char* fileName) {
+	return NULL;
+}
+
+io_func* openMmapFile(const char* fileName, int writable) {
+	return NULL;
+}
+
+#endif
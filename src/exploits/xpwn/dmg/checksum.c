@@ -2,6 +2,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <dmg/dmg.h>
 
 void BlockSHA1CRC(void* token, const unsigned char* data, size_t len) {
@@ -122,9 +126,364 @@ static uint64_t crc_table[256] = {
 
 /* ========================================================================= */
 #define DO1(buf) crc = crc_table[((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
-#define DO2(buf)  DO1(buf); DO1(buf);
-#define DO4(buf)  DO2(buf); DO2(buf);
-#define DO8(buf)  DO4(buf); DO4(buf);
+
+/*
+ * The byte table above is extended into eight tables so that the portable
+ * kernel can consume eight bytes per step (slice-by-8). Where the compiler and
+ * processor allow it, a carry-less multiply kernel folds 64 bytes per step.
+ * The kernel is chosen once, on first use, and only if it agrees with the
+ * portable code on a reference buffer.
+ */
+
+typedef uint32_t (*CRC32Kernel)(uint32_t crc, const unsigned char* buf, size_t len);
+typedef void (*SHA1Kernel)(uint32_t state[5], const uint8_t* data, size_t blocks);
+
+static uint32_t crc_slice[8][256];
+
+void SHA1Transform(uint32_t state[5], const uint8_t buffer[64]);
+
+static uint32_t crc32Resolve(uint32_t crc, const unsigned char* buf, size_t len);
+static void sha1Resolve(uint32_t state[5], const uint8_t* data, size_t blocks);
+
+static CRC32Kernel crc32Kernel = crc32Resolve;
+static SHA1Kernel sha1Kernel = sha1Resolve;
+
+#define CRC_LOAD32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+static void buildSliceTables() {
+  int i;
+  int j;
+
+  for(i = 0; i < 256; i++)
+    crc_slice[0][i] = (uint32_t) crc_table[i];
+
+  for(i = 0; i < 256; i++) {
+    for(j = 1; j < 8; j++) {
+      crc_slice[j][i] = crc_slice[0][crc_slice[j - 1][i] & 0xff] ^ (crc_slice[j - 1][i] >> 8);
+    }
+  }
+}
+
+/* crc is the running value with the pre/post conditioning already applied */
+static uint32_t crc32Portable(uint32_t crc, const unsigned char* buf, size_t len) {
+  uint32_t lo;
+  uint32_t hi;
+
+  while(len >= 8) {
+    lo = crc ^ CRC_LOAD32(buf);
+    hi = CRC_LOAD32(buf + 4);
+    crc = crc_slice[7][lo & 0xff] ^ crc_slice[6][(lo >> 8) & 0xff]
+        ^ crc_slice[5][(lo >> 16) & 0xff] ^ crc_slice[4][lo >> 24]
+        ^ crc_slice[3][hi & 0xff] ^ crc_slice[2][(hi >> 8) & 0xff]
+        ^ crc_slice[1][(hi >> 16) & 0xff] ^ crc_slice[0][hi >> 24];
+    buf += 8;
+    len -= 8;
+  }
+
+  while(len > 0) {
+    DO1(buf);
+    len--;
+  }
+
+  return crc;
+}
+
+static void sha1Portable(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  while(blocks > 0) {
+    SHA1Transform(state, data);
+    data += 64;
+    blocks--;
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(WIN32)
+#define HAVE_CHECKSUM_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* Folding constants for the reflected CRC-32 polynomial (Intel, "Fast CRC Computation Using PCLMULQDQ") */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char* buf, size_t len) {
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  __m128i y5, y6, y7, y8;
+  size_t tail;
+
+  if(len < 64)
+    return crc32Portable(crc, buf, len);
+
+  tail = len & 15;
+  len -= tail;
+
+  x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+
+  x0 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+
+  buf += 64;
+  len -= 64;
+
+  while(len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+    y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+    y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+    y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+    y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+    buf += 64;
+    len -= 64;
+  }
+
+  /* fold the four lanes into one */
+  x0 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while(len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i*) buf);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  /* 128 -> 64 bits */
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+
+  x0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  crc = (uint32_t) _mm_extract_epi32(x1, 1);
+
+  return crc32Portable(crc, buf, tail);
+}
+
+#define SHA1_LOAD(msg, ofs) msg = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + ofs)), mask)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1ShaNI(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  __m128i abcd, abcdSave, e0, e0Save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+
+  abcd = _mm_loadu_si128((const __m128i*) state);
+  e0 = _mm_set_epi32((int) state[4], 0, 0, 0);
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+
+  while(blocks > 0) {
+    abcdSave = abcd;
+    e0Save = e0;
+
+    /* rounds 0-15 */
+    SHA1_LOAD(msg0, 0);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    SHA1_LOAD(msg1, 16);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    SHA1_LOAD(msg2, 32);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    SHA1_LOAD(msg3, 48);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    /* rounds 16-63 follow the same four-message rotation */
+#define SHA1_QUAD(ea, eb, m0, m1, m2, m3, f) \
+    ea = _mm_sha1nexte_epu32(ea, m0); \
+    eb = abcd; \
+    m1 = _mm_sha1msg2_epu32(m1, m0); \
+    abcd = _mm_sha1rnds4_epu32(abcd, ea, f); \
+    m3 = _mm_sha1msg1_epu32(m3, m0); \
+    m2 = _mm_xor_si128(m2, m0);
+
+    SHA1_QUAD(e0, e1, msg0, msg1, msg2, msg3, 0);
+    SHA1_QUAD(e1, e0, msg1, msg2, msg3, msg0, 1);
+    SHA1_QUAD(e0, e1, msg2, msg3, msg0, msg1, 1);
+    SHA1_QUAD(e1, e0, msg3, msg0, msg1, msg2, 1);
+    SHA1_QUAD(e0, e1, msg0, msg1, msg2, msg3, 1);
+    SHA1_QUAD(e1, e0, msg1, msg2, msg3, msg0, 1);
+    SHA1_QUAD(e0, e1, msg2, msg3, msg0, msg1, 2);
+    SHA1_QUAD(e1, e0, msg3, msg0, msg1, msg2, 2);
+    SHA1_QUAD(e0, e1, msg0, msg1, msg2, msg3, 2);
+    SHA1_QUAD(e1, e0, msg1, msg2, msg3, msg0, 2);
+    SHA1_QUAD(e0, e1, msg2, msg3, msg0, msg1, 2);
+    SHA1_QUAD(e1, e0, msg3, msg0, msg1, msg2, 3);
+
+#undef SHA1_QUAD
+
+    /* rounds 64-79 drain the schedule */
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0Save);
+    abcd = _mm_add_epi32(abcd, abcdSave);
+
+    data += 64;
+    blocks--;
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128((__m128i*) state, abcd);
+  state[4] = (uint32_t) _mm_extract_epi32(e0, 3);
+}
+
+#undef SHA1_LOAD
+
+static int cpuHas(unsigned int leaf, int reg, unsigned int bit) {
+  unsigned int regs[4];
+
+  if(__get_cpuid_max(0, NULL) < leaf)
+    return FALSE;
+
+  __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+  return (regs[reg] >> bit) & 1;
+}
+
+/* Run a candidate kernel against the portable one on an awkward-length buffer */
+static int crc32KernelAgrees(CRC32Kernel kernel) {
+  unsigned char buf[1031];
+  size_t i;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = (unsigned char)(i * 131 + (i >> 3));
+
+  for(i = 0; i < sizeof(buf); i += 97) {
+    if(kernel(0xffffffff, buf + (i & 7), sizeof(buf) - i - (i & 7)) != crc32Portable(0xffffffff, buf + (i & 7), sizeof(buf) - i - (i & 7)))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int sha1KernelAgrees(SHA1Kernel kernel) {
+  uint8_t buf[64 * 5 + 1];
+  uint32_t expected[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint32_t actual[5];
+  size_t i;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = (uint8_t)(i * 167 + 13);
+
+  memcpy(actual, expected, sizeof(actual));
+  sha1Portable(expected, buf + 1, 5);
+  kernel(actual, buf + 1, 5);
+
+  return memcmp(expected, actual, sizeof(expected)) == 0;
+}
+#endif
+
+static void selectChecksumKernels() {
+  CRC32Kernel crc32 = crc32Portable;
+  SHA1Kernel sha1 = sha1Portable;
+
+  buildSliceTables();
+
+#ifdef HAVE_CHECKSUM_X86
+  /* leaf 1: ECX.SSE4.1 (19), ECX.PCLMULQDQ (1), ECX.SSSE3 (9); leaf 7: EBX.SHA (29) */
+  if(cpuHas(1, 2, 1) && cpuHas(1, 2, 19) && crc32KernelAgrees(crc32Pclmul))
+    crc32 = crc32Pclmul;
+
+  if(cpuHas(7, 1, 29) && cpuHas(1, 2, 9) && cpuHas(1, 2, 19) && sha1KernelAgrees(sha1ShaNI))
+    sha1 = sha1ShaNI;
+#endif
+
+  crc32Kernel = crc32;
+  sha1Kernel = sha1;
+}
+
+#ifdef HAVE_PTHREAD
+static pthread_once_t checksumKernelsOnce = PTHREAD_ONCE_INIT;
+#define initChecksumKernels() pthread_once(&checksumKernelsOnce, selectChecksumKernels)
+#else
+#define initChecksumKernels() selectChecksumKernels()
+#endif
+
+static uint32_t crc32Resolve(uint32_t crc, const unsigned char* buf, size_t len) {
+  initChecksumKernels();
+  return crc32Kernel(crc, buf, len);
+}
+
+static void sha1Resolve(uint32_t state[5], const uint8_t* data, size_t blocks) {
+  initChecksumKernels();
+  sha1Kernel(state, data, blocks);
+}
 
 /* ========================================================================= */
 uint32_t CRC32Checksum(uint32_t* ckSum, const unsigned char *buf, size_t len)
@@ -136,18 +495,7 @@ uint32_t CRC32Checksum(uint32_t* ckSum, const unsigned char *buf, size_t len)
   if (buf == NULL) return crc;
   
   crc = crc ^ 0xffffffffL;
-  while (len >= 8)
-  {
-    DO8(buf);
-    len -= 8;
-  }
-  if (len)
-  {
-    do {
-DO1(buf);
-    } while (--len);
-  }
-  
+  crc = crc32Kernel(crc, buf, len);
   crc = crc ^ 0xffffffffL;
   
   *ckSum = crc;
@@ -200,7 +548,7 @@ void SHA1Transform(uint32_t state[5], const uint8_t buffer[64])
     CHAR64LONG16* block;
 
 #ifdef SHA1HANDSOFF
-    static uint8_t workspace[64];
+    uint8_t workspace[64];
     block = (CHAR64LONG16*)workspace;
     memcpy(block, buffer, 64);
 #else
@@ -272,8 +620,9 @@ void SHA1Update(SHA1_CTX* context, const uint8_t* data, const size_t len)
     if ((j + len) > 63) {
         memcpy(&context->buffer[j], data, (i = 64-j));
         SHA1Transform(context->state, context->buffer);
-        for ( ; i + 63 < len; i += 64) {
-            SHA1Transform(context->state, data + i);
+        if (i + 63 < len) {
+            sha1Kernel(context->state, data + i, (len - i) / 64);
+            i += ((len - i) / 64) * 64;
         }
         j = 0;
     }
@@ -308,8 +657,4 @@ void SHA1Final(uint8_t digest[SHA1_DIGEST_SIZE], SHA1_CTX* context)
     memset(context->state, 0, 20);
     memset(context->count, 0, 8);
     memset(finalcount, 0, 8);	/* SWR */
-
-#ifdef SHA1HANDSOFF  /* make SHA1Transform overwrite its own static vars */
-    SHA1Transform(context->state, context->buffer);
-#endif
 }
@@ -0,0 +1,247 @@
+/*
+ * Checks the PCLMULQDQ CRC-32 and SHA-NI SHA-1 kernels against the portable ones on random buffers of assorted
+ * lengths and alignments, and reports the throughput of each. checksum.c is compiled in directly so that the static
+ * kernels can be called without going through the dispatcher.
+ */
+
+#include "checksum.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_BUFFER_SIZE (1024 * 1024)
+#define TEST_RANDOM_RUNS 2000
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+char endianness;
+
+static void TestByteOrder()
+{
+  short int word = 0x0001;
+  char *byte = (char *) &word;
+  endianness = byte[0] ? IS_LITTLE_ENDIAN : IS_BIG_ENDIAN;
+}
+
+static uint32_t rngState = 0x12345678;
+
+static uint32_t nextRandom() {
+  rngState ^= rngState << 13;
+  rngState ^= rngState >> 17;
+  rngState ^= rngState << 5;
+  return rngState;
+}
+
+/* Bit at a time, shares nothing with the table driven kernels */
+static uint32_t crc32Reference(uint32_t crc, const unsigned char* buf, size_t len) {
+  int i;
+
+  while(len > 0) {
+    crc ^= *buf++;
+    for(i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    len--;
+  }
+
+  return crc;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int checkCRC(const char* name, CRC32Kernel kernel, const unsigned char* buf) {
+  static const size_t lengths[] = {0, 1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 255, 256, 1000,
+    4095, 4096, 4097, 65536 + 13, TEST_BUFFER_SIZE - 16};
+  size_t i;
+  size_t len;
+  size_t align;
+  size_t split;
+  uint32_t expected;
+  uint32_t actual;
+  int runs = sizeof(lengths) / sizeof(lengths[0]) + TEST_RANDOM_RUNS;
+  int r;
+
+  for(r = 0; r < runs; r++) {
+    if(r < (int)(sizeof(lengths) / sizeof(lengths[0]))) {
+      len = lengths[r];
+    } else {
+      len = nextRandom() % ((r & 1) ? 512 : (TEST_BUFFER_SIZE - 16));
+    }
+    align = nextRandom() % 16;
+    split = (len > 0) ? nextRandom() % len : 0;
+
+    expected = crc32Reference(0xffffffff, buf + align, len);
+
+    actual = kernel(0xffffffff, buf + align, len);
+    if(actual != expected) {
+      printf("FAIL: %s CRC-32 of %lu bytes at offset %lu: %08x, expected %08x\n", name, (unsigned long)len,
+        (unsigned long)align, actual, expected);
+      return FALSE;
+    }
+
+    /* the running value has to carry across calls */
+    actual = kernel(kernel(0xffffffff, buf + align, split), buf + align + split, len - split);
+    if(actual != expected) {
+      printf("FAIL: %s CRC-32 of %lu bytes at offset %lu split at %lu: %08x, expected %08x\n", name,
+        (unsigned long)len, (unsigned long)align, (unsigned long)split, actual, expected);
+      return FALSE;
+    }
+  }
+
+  for(i = 0; i < 64; i++) {
+    len = 1 + nextRandom() % 64;
+    if(kernel(0xffffffff, buf + i, len) != crc32Reference(0xffffffff, buf + i, len)) {
+      printf("FAIL: %s CRC-32 of %lu bytes at offset %lu\n", name, (unsigned long)len, (unsigned long)i);
+      return FALSE;
+    }
+  }
+
+  printf("%s CRC-32: ok\n", name);
+  return TRUE;
+}
+
+static int checkSHA1(const char* name, SHA1Kernel kernel, const uint8_t* buf) {
+  uint32_t expected[5];
+  uint32_t actual[5];
+  size_t blocks;
+  size_t align;
+  int r;
+
+  for(r = 0; r < TEST_RANDOM_RUNS; r++) {
+    blocks = (r < 64) ? (size_t)r : 1 + nextRandom() % ((r & 1) ? 16 : (TEST_BUFFER_SIZE / 64 - 1));
+    align = nextRandom() % 16;
+
+    expected[0] = actual[0] = nextRandom();
+    expected[1] = actual[1] = nextRandom();
+    expected[2] = actual[2] = nextRandom();
+    expected[3] = actual[3] = nextRandom();
+    expected[4] = actual[4] = nextRandom();
+
+    sha1Portable(expected, buf + align, blocks);
+    kernel(actual, buf + align, blocks);
+
+    if(memcmp(expected, actual, sizeof(expected)) != 0) {
+      printf("FAIL: %s SHA-1 of %lu blocks at offset %lu\n", name, (unsigned long)blocks, (unsigned long)align);
+      return FALSE;
+    }
+  }
+
+  printf("%s SHA-1: ok\n", name);
+  return TRUE;
+}
+
+static int checkSHA1Vectors() {
+  static const uint8_t abc[20] = {0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E,
+    0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D};
+  static const uint8_t million[20] = {0x34, 0xAA, 0x97, 0x3C, 0xD4, 0xC4, 0xDA, 0xA4, 0xF6, 0x1E,
+    0xEB, 0x2B, 0xDB, 0xAD, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6F};
+  uint8_t a[1000];
+  uint8_t digest[SHA1_DIGEST_SIZE];
+  SHA1_CTX context;
+  int i;
+
+  SHA1Init(&context);
+  SHA1Update(&context, (const uint8_t*) "abc", 3);
+  SHA1Final(digest, &context);
+  if(memcmp(digest, abc, sizeof(abc)) != 0) {
+    printf("FAIL: SHA-1 of \"abc\"\n");
+    return FALSE;
+  }
+
+  memset(a, 'a', sizeof(a));
+  SHA1Init(&context);
+  for(i = 0; i < 1000; i++)
+    SHA1Update(&context, a, sizeof(a));
+  SHA1Final(digest, &context);
+  if(memcmp(digest, million, sizeof(million)) != 0) {
+    printf("FAIL: SHA-1 of a million \"a\"\n");
+    return FALSE;
+  }
+
+  printf("SHA-1 test vectors: ok\n");
+  return TRUE;
+}
+
+static void benchCRC(const char* name, CRC32Kernel kernel, const unsigned char* buf) {
+  uint32_t crc = 0xffffffff;
+  double start;
+  double elapsed;
+  size_t done;
+
+  start = now();
+  for(done = 0; done < BENCH_BYTES; done += TEST_BUFFER_SIZE)
+    crc = kernel(crc, buf, TEST_BUFFER_SIZE);
+  elapsed = now() - start;
+
+  printf("%-10s CRC-32: %8.1f MB/s (%08x)\n", name, BENCH_BYTES / elapsed / (1024 * 1024), crc);
+}
+
+static void benchSHA1(const char* name, SHA1Kernel kernel, const uint8_t* buf) {
+  uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  double start;
+  double elapsed;
+  size_t done;
+
+  start = now();
+  for(done = 0; done < BENCH_BYTES / 4; done += TEST_BUFFER_SIZE)
+    kernel(state, buf, TEST_BUFFER_SIZE / 64);
+  elapsed = now() - start;
+
+  printf("%-10s SHA-1:  %8.1f MB/s (%08x)\n", name, (BENCH_BYTES / 4) / elapsed / (1024 * 1024), state[0]);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned char* buf;
+  int ok = TRUE;
+  int hasPclmul = FALSE;
+  int hasShaNI = FALSE;
+  size_t i;
+
+  TestByteOrder();
+
+  buf = (unsigned char*) malloc(TEST_BUFFER_SIZE + 16);
+  if(buf == NULL) {
+    printf("out of memory\n");
+    return 1;
+  }
+  for(i = 0; i < TEST_BUFFER_SIZE + 16; i++)
+    buf[i] = (unsigned char) nextRandom();
+
+  selectChecksumKernels();
+
+  ok &= checkSHA1Vectors();
+  ok &= checkCRC("portable", crc32Portable, buf);
+
+#ifdef HAVE_CHECKSUM_X86
+  hasPclmul = cpuHas(1, 2, 1) && cpuHas(1, 2, 19);
+  hasShaNI = cpuHas(7, 1, 29) && cpuHas(1, 2, 9) && cpuHas(1, 2, 19);
+
+  if(hasPclmul)
+    ok &= checkCRC("PCLMULQDQ", crc32Pclmul, buf);
+  if(hasShaNI)
+    ok &= checkSHA1("SHA-NI", sha1ShaNI, buf);
+#endif
+
+  if(!hasPclmul)
+    printf("PCLMULQDQ CRC-32: not supported on this CPU, skipped\n");
+  if(!hasShaNI)
+    printf("SHA-NI SHA-1: not supported on this CPU, skipped\n");
+
+  benchCRC("portable", crc32Portable, buf);
+#ifdef HAVE_CHECKSUM_X86
+  if(hasPclmul)
+    benchCRC("PCLMULQDQ", crc32Pclmul, buf);
+#endif
+  benchSHA1("portable", sha1Portable, buf);
+#ifdef HAVE_CHECKSUM_X86
+  if(hasShaNI)
+    benchSHA1("SHA-NI", sha1ShaNI, buf);
+#endif
+
+  free(buf);
+
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
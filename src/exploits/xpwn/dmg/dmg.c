@@ -5,6 +5,7 @@
 
 #include <dmg/dmg.h>
 #include <dmg/filevault.h>
+#include <dmg/parallel.h>
 
 char endianness;
 
@@ -39,9 +40,15 @@ int main(int argc, char* argv[]) {
 	int hasKey;
 	
 	TestByteOrder();
+
+	if(argc > 3 && strcmp(argv[2], "-j") == 0) {
+		setCompressionThreads(atoi(argv[3]));
+		memmove(&argv[2], &argv[4], sizeof(char*) * (argc - 4));
+		argc -= 2;
+	}
 	
 	if(argc < 4) {
-		printf("usage: %s [extract|build|build2048|res|iso|dmg] <in> <out> (-k <key>) (partition)\n", argv[0]);
+		printf("usage: %s [extract|build|build2048|res|iso|dmg] (-j <threads>) <in> <out> (-k <key>) (partition)\n", argv[0]);
 		return 0;
 	}
 
@@ -9,53 +9,182 @@
 
 #include <dmg/dmg.h>
 #include <dmg/dmgfile.h>
+#include <dmg/dmgcache.h>
 
-static void cacheRun(DMG* dmg, BLKXTable* blkx, int run) {
-	size_t bufferSize;
+#define DEFAULT_RUN_CACHE_SIZE 8
+
+static int runCacheSize = DEFAULT_RUN_CACHE_SIZE;
+
+/* One entry per run that covers at least one sector, sorted by start so a sector can be found by binary search. */
+typedef struct RunIndex {
+	uint64_t start;
+	uint64_t end;
+	BLKXTable* blkx;
+	int run;
+	int cached;
+} RunIndex;
+
+typedef struct RunCacheEntry {
+	void* data;
+	size_t size;
+	int index;
+	uint64_t lastUsed;
+} RunCacheEntry;
+
+/* DMG as handed out through io->data, plus the bookkeeping that only this file needs. DMG must stay the first member. */
+typedef struct DMGCache {
+	DMG dmg;
+
+	RunIndex* index;
+	int numRuns;
+
+	RunCacheEntry* entries;
+	int numEntries;
+	uint64_t clock;
+
+	void* compressed;
+	size_t compressedSize;
 	z_stream strm;
-	void* inBuffer;
-	int ret;
-	size_t have;
-	
-	if(dmg->runData) {
-		free(dmg->runData);
+
+	uint64_t hits;
+	uint64_t misses;
+} DMGCache;
+
+void setDmgRunCacheSize(int runs) {
+	if(runs < 1) {
+		runs = 1;
 	}
-	
+	runCacheSize = runs;
+}
+
+void getDmgRunCacheStats(io_func* io, uint64_t* hits, uint64_t* misses) {
+	DMGCache* cache;
+
+	cache = (DMGCache*) io->data;
+
+	if(hits)
+		*hits = cache->hits;
+
+	if(misses)
+		*misses = cache->misses;
+}
+
+static int compareRunIndex(const void* a, const void* b) {
+	const RunIndex* left = (const RunIndex*) a;
+	const RunIndex* right = (const RunIndex*) b;
+
+	if(left->start < right->start)
+		return -1;
+	else if(left->start > right->start)
+		return 1;
+	else
+		return 0;
+}
+
+static void buildRunIndex(DMGCache* cache) {
+	DMG* dmg;
+	int i;
+	int j;
+	int n;
+
+	dmg = &cache->dmg;
+
+	n = 0;
+	for(i = 0; i < dmg->numBLKX; i++) {
+		n += dmg->blkx[i]->blocksRunCount;
+	}
+
+	cache->index = (RunIndex*) malloc(sizeof(RunIndex) * (n > 0 ? n : 1));
+
+	n = 0;
+	for(i = 0; i < dmg->numBLKX; i++) {
+		for(j = 0; j < dmg->blkx[i]->blocksRunCount; j++) {
+			if(dmg->blkx[i]->runs[j].sectorCount == 0) {
+				continue;
+			}
+
+			cache->index[n].start = dmg->blkx[i]->firstSectorNumber + dmg->blkx[i]->runs[j].sectorStart;
+			cache->index[n].end = cache->index[n].start + dmg->blkx[i]->runs[j].sectorCount;
+			cache->index[n].blkx = dmg->blkx[i];
+			cache->index[n].run = j;
+			cache->index[n].cached = -1;
+			n++;
+		}
+	}
+
+	qsort(cache->index, n, sizeof(RunIndex), compareRunIndex);
+	cache->numRuns = n;
+}
+
+static int findRun(DMGCache* cache, uint64_t sector) {
+	int low;
+	int high;
+	int mid;
+
+	low = 0;
+	high = cache->numRuns - 1;
+
+	while(low <= high) {
+		mid = low + (high - low) / 2;
+		if(sector < cache->index[mid].start) {
+			high = mid - 1;
+		} else if(sector >= cache->index[mid].end) {
+			low = mid + 1;
+		} else {
+			return mid;
+		}
+	}
+
+	return -1;
+}
+
+static void cacheRun(DMGCache* cache, RunCacheEntry* entry, int index) {
+	DMG* dmg;
+	BLKXTable* blkx;
+	int run;
+	size_t bufferSize;
+	size_t have;
+	int ret;
+
+	dmg = &cache->dmg;
+	blkx = cache->index[index].blkx;
+	run = cache->index[index].run;
+
 	bufferSize = SECTOR_SIZE * blkx->runs[run].sectorCount;
-	
-	dmg->runData = (void*) malloc(bufferSize);
-	inBuffer = (void*) malloc(bufferSize);
-	memset(dmg->runData, 0, bufferSize);
-	
+
+	if(entry->size < bufferSize) {
+		free(entry->data);
+		entry->data = (void*) malloc(bufferSize);
+		entry->size = bufferSize;
+	}
+
+	have = 0;
+
 	ASSERT(dmg->dmg->seek(dmg->dmg, blkx->dataStart + blkx->runs[run].compOffset) == 0, "fseeko");
 	
     switch(blkx->runs[run].type) {
 		case BLOCK_ZLIB:
-			strm.zalloc = Z_NULL;
-			strm.zfree = Z_NULL;
-			strm.opaque = Z_NULL;
-			strm.avail_in = 0;
-			strm.next_in = Z_NULL;
-			
-			ASSERT(inflateInit(&strm) == Z_OK, "inflateInit");
-			
-			ASSERT((strm.avail_in = dmg->dmg->read(dmg->dmg, inBuffer, blkx->runs[run].compLength)) == blkx->runs[run].compLength, "fread");
-			strm.next_in = (unsigned char*) inBuffer;
-			
-			do {
-				strm.avail_out = bufferSize;
-				strm.next_out = (unsigned char*) dmg->runData;
-				ASSERT((ret = inflate(&strm, Z_NO_FLUSH)) != Z_STREAM_ERROR, "inflate/Z_STREAM_ERROR");
-				if(ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
-					ASSERT(FALSE, "inflate");
-				}
-				have = bufferSize - strm.avail_out;
-			} while (strm.avail_out == 0);
-			
-			ASSERT(inflateEnd(&strm) == Z_OK, "inflateEnd");
+			if(cache->compressedSize < blkx->runs[run].compLength) {
+				free(cache->compressed);
+				cache->compressedSize = blkx->runs[run].compLength;
+				cache->compressed = (void*) malloc(cache->compressedSize);
+			}
+
+			ASSERT(inflateReset(&cache->strm) == Z_OK, "inflateReset");
+
+			ASSERT((cache->strm.avail_in = dmg->dmg->read(dmg->dmg, cache->compressed, blkx->runs[run].compLength)) == blkx->runs[run].compLength, "fread");
+			cache->strm.next_in = (unsigned char*) cache->compressed;
+			cache->strm.avail_out = bufferSize;
+			cache->strm.next_out = (unsigned char*) entry->data;
+
+			ASSERT((ret = inflate(&cache->strm, Z_NO_FLUSH)) != Z_STREAM_ERROR, "inflate/Z_STREAM_ERROR");
+			if(ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+				ASSERT(FALSE, "inflate");
+			}
+			have = bufferSize - cache->strm.avail_out;
 			break;
 		case BLOCK_RAW:
-			ASSERT((have = dmg->dmg->read(dmg->dmg, dmg->runData, blkx->runs[run].compLength)) == blkx->runs[run].compLength, "fread");
+			ASSERT((have = dmg->dmg->read(dmg->dmg, entry->data, blkx->runs[run].compLength)) == blkx->runs[run].compLength, "fread");
 			break;
 		case BLOCK_IGNORE:
 			break;
@@ -66,28 +195,52 @@ static void cacheRun(DMG* dmg, BLKXTable* blkx, int run) {
 		default:
 			break;
     }
-	
-	dmg->runStart = (blkx->runs[run].sectorStart + blkx->firstSectorNumber) * SECTOR_SIZE;
-	dmg->runEnd = dmg->runStart + (blkx->runs[run].sectorCount * SECTOR_SIZE);
+
+	if(have < bufferSize) {
+		memset((uint8_t*)entry->data + have, 0, bufferSize - have);
+	}
+
+	entry->index = index;
+	cache->index[index].cached = entry - cache->entries;
 }
 
-static void cacheOffset(DMG* dmg, off_t location) {
+static void cacheOffset(DMGCache* cache, off_t location) {
+	DMG* dmg;
+	RunCacheEntry* entry;
+	int index;
 	int i;
-	int j;
-	uint64_t sector;
-	
-	sector = (uint64_t)(location / SECTOR_SIZE);
 
-	for(i = 0; i < dmg->numBLKX; i++) {
-		if(sector >= dmg->blkx[i]->firstSectorNumber && sector < (dmg->blkx[i]->firstSectorNumber + dmg->blkx[i]->sectorCount)) {
-			for(j = 0; j < dmg->blkx[i]->blocksRunCount; j++) {
-				if(sector >= (dmg->blkx[i]->firstSectorNumber + dmg->blkx[i]->runs[j].sectorStart) &&
-					sector < (dmg->blkx[i]->firstSectorNumber + dmg->blkx[i]->runs[j].sectorStart + dmg->blkx[i]->runs[j].sectorCount)) {
-					cacheRun(dmg, dmg->blkx[i], j);
-				}
+	dmg = &cache->dmg;
+
+	index = findRun(cache, (uint64_t)(location / SECTOR_SIZE));
+	if(index < 0) {
+		return;
+	}
+
+	if(cache->index[index].cached >= 0) {
+		entry = &cache->entries[cache->index[index].cached];
+		cache->hits++;
+	} else {
+		entry = &cache->entries[0];
+		for(i = 1; i < cache->numEntries; i++) {
+			if(cache->entries[i].lastUsed < entry->lastUsed) {
+				entry = &cache->entries[i];
 			}
 		}
+
+		if(entry->index >= 0) {
+			cache->index[entry->index].cached = -1;
+		}
+
+		cacheRun(cache, entry, index);
+		cache->misses++;
 	}
+
+	entry->lastUsed = ++cache->clock;
+
+	dmg->runData = entry->data;
+	dmg->runStart = cache->index[index].start * SECTOR_SIZE;
+	dmg->runEnd = cache->index[index].end * SECTOR_SIZE;
 }
 
 static int dmgFileRead(io_func* io, off_t location, size_t size, void *buffer) {
@@ -103,7 +256,10 @@ static int dmgFileRead(io_func* io, off_t location, size_t size, void *buffer) {
 	}
 
 	if(location < dmg->runStart || location >= dmg->runEnd) {
-		cacheOffset(dmg, location);
+		cacheOffset((DMGCache*) dmg, location);
+		if(location < dmg->runStart || location >= dmg->runEnd) {
+			return FALSE;
+		}
 	}
 	
 	if((location + size) > dmg->runEnd) {
@@ -131,24 +287,33 @@ static int dmgFileWrite(io_func* io, off_t location, size_t size, void *buffer)
 
 
 static void closeDmgFile(io_func* io) {
+	DMGCache* cache;
 	DMG* dmg;
+	int i;
 	
-	dmg = (DMG*) io->data;
+	cache = (DMGCache*) io->data;
+	dmg = &cache->dmg;
 	
-	if(dmg->runData) {
-		free(dmg->runData);
+	for(i = 0; i < cache->numEntries; i++) {
+		free(cache->entries[i].data);
 	}
+
+	inflateEnd(&cache->strm);
+	free(cache->compressed);
+	free(cache->entries);
+	free(cache->index);
 	
 	free(dmg->blkx);
 	releaseResources(dmg->resources);
 	dmg->dmg->close(dmg->dmg);
-	free(dmg);
+	free(cache);
 	free(io);
 }
 
 io_func* openDmgFile(AbstractFile* abstractIn) {
 	off_t fileLength;
 	UDIFResourceFile resourceFile;
+	DMGCache* cache;
 	DMG* dmg;	
 	ResourceData* blkx;
 	ResourceData* curData;
@@ -164,7 +329,9 @@ io_func* openDmgFile(AbstractFile* abstractIn) {
 	abstractIn->seek(abstractIn, fileLength - sizeof(UDIFResourceFile));
 	readUDIFResourceFile(abstractIn, &resourceFile);
 	
-	dmg = (DMG*) malloc(sizeof(DMG));
+	cache = (DMGCache*) malloc(sizeof(DMGCache));
+	memset(cache, 0, sizeof(DMGCache));
+	dmg = &cache->dmg;
 	dmg->dmg = abstractIn;
 	dmg->resources = readResources(abstractIn, &resourceFile);
 	dmg->numBLKX = 0;
@@ -189,7 +356,28 @@ io_func* openDmgFile(AbstractFile* abstractIn) {
 	dmg->offset = 0;
 	
 	dmg->runData = NULL;
-	cacheOffset(dmg, 0);
+	dmg->runStart = 0;
+	dmg->runEnd = 0;
+
+	buildRunIndex(cache);
+
+	cache->numEntries = runCacheSize;
+	cache->entries = (RunCacheEntry*) malloc(sizeof(RunCacheEntry) * cache->numEntries);
+	for(i = 0; i < cache->numEntries; i++) {
+		cache->entries[i].data = NULL;
+		cache->entries[i].size = 0;
+		cache->entries[i].index = -1;
+		cache->entries[i].lastUsed = 0;
+	}
+
+	cache->strm.zalloc = Z_NULL;
+	cache->strm.zfree = Z_NULL;
+	cache->strm.opaque = Z_NULL;
+	cache->strm.avail_in = 0;
+	cache->strm.next_in = Z_NULL;
+	ASSERT(inflateInit(&cache->strm) == Z_OK, "inflateInit");
+
+	cacheOffset(cache, 0);
 	
 	toReturn = (io_func*) malloc(sizeof(io_func));
 	
@@ -3,10 +3,16 @@
 #include <string.h>
 #include <zlib.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include <dmg/dmg.h>
+#include <dmg/parallel.h>
 #include <inttypes.h>
 
 #define SECTORS_AT_A_TIME 0x200
+#define COMPRESSION_LEVEL 1
 
 // Okay, this value sucks. You shouldn't touch it because it affects how many ignore sections get added to the blkx list
 // If the blkx list gets too fragmented with ignore sections, then the copy list in certain versions of the iPhone's
@@ -18,29 +24,431 @@
 // certainly nothing reasonable like "put in an ignore block if you encounter more than X blank sectors" (like mine)
 // There's always a large-ish one at the end, and a tiny 2 sector one at the end too, to take care of the space after
 // the backup volume header. No frakking clue how they go about determining how to do that.
+#define INITIAL_IGNORE_THRESHOLD 100000
+
+static int compressionThreads = 1;
+
+void setCompressionThreads(int threads) {
+	if(threads < 1) {
+		threads = 1;
+	}
+	compressionThreads = threads;
+}
+
+int getCompressionThreads() {
+	return compressionThreads;
+}
+
+typedef struct BLKXReader {
+	AbstractFile* in;
+	uint64_t startOff;
+	uint64_t totalSectors;
+	uint32_t numSectors;
+	uint64_t curSector;
+	uint32_t curRun;
+	size_t ignoreThreshold;
+	int addComment;
+} BLKXReader;
+
+typedef struct BLKXWriter {
+	AbstractFile* out;
+	BLKXTable* blkx;
+	uint32_t roomForRuns;
+	uint32_t curRun;
+	ChecksumFunc uncompressedChk;
+	void* uncompressedChkToken;
+	ChecksumFunc compressedChk;
+	void* compressedChkToken;
+} BLKXWriter;
+
+// Reads the next run to compress into inBuffer, or decides that the next stretch of the input is blank and describes it
+// with up to two ignore runs instead. Returns the number of runs placed in runs[], 0 once the input is exhausted. This is
+// the only place that decides where runs start and end, so the serial and threaded compressors produce the same table.
+static int readBLKXRuns(BLKXReader* reader, unsigned char* inBuffer, BLKXRun* runs, size_t* amountRead) {
+	AbstractFile* in;
+	BLKXRun* run;
+	size_t sectorsToSkip;
+	size_t processed;
+	int numRuns;
+
+	if(reader->numSectors == 0) {
+		return 0;
+	}
+
+	in = reader->in;
+	run = &runs[0];
+
+	run->type = BLOCK_ZLIB;
+	run->reserved = 0;
+	run->sectorStart = reader->curSector;
+	run->sectorCount = (reader->numSectors > SECTORS_AT_A_TIME) ? SECTORS_AT_A_TIME : reader->numSectors;
+	run->compOffset = 0;
+	run->compLength = 0;
+
+	sectorsToSkip = 0;
+	processed = 0;
+
+	while(processed < reader->numSectors)
+	{
+		run->sectorCount = ((reader->numSectors - processed) > SECTORS_AT_A_TIME) ? SECTORS_AT_A_TIME : (reader->numSectors - processed);
+
+		//printf("Currently at %" PRId64 "\n", curOff);
+		in->seek(in, reader->startOff + (reader->totalSectors - reader->numSectors + processed) * SECTOR_SIZE);
+		ASSERT((*amountRead = in->read(in, inBuffer, run->sectorCount * SECTOR_SIZE)) == (run->sectorCount * SECTOR_SIZE), "mRead");
+
+		if(!reader->addComment)
+			break;
+
+		processed += *amountRead / SECTOR_SIZE;
+
+		size_t* checkBuffer = (size_t*) inBuffer;
+		size_t counter;
+		size_t counter_max = *amountRead / sizeof(size_t);
+		for(counter = 0; counter < counter_max; counter++)
+		{
+			if(checkBuffer[counter] != 0) {
+				//printf("Not empty at %" PRId64 " / %" PRId64 "\n", (int64_t)(counter * sizeof(size_t)) + curOff, (int64_t)((counter * sizeof(size_t)) / SECTOR_SIZE + sectorsToSkip + run->sectorStart));
+				break;
+			}
+		}
+
+		size_t skipInBuffer = (counter * sizeof(size_t)) / SECTOR_SIZE;
+		sectorsToSkip += skipInBuffer;
+
+		//printf("sectorsToSkip: %d\n", sectorsToSkip);
+
+		if(counter < counter_max)
+		{
+			break;
+		}
+	}
+
+	if(sectorsToSkip > reader->ignoreThreshold)
+	{
+		int remainder = sectorsToSkip & 0xf;
+
+		numRuns = 0;
+
+		if(sectorsToSkip != remainder)
+		{
+			run = &runs[numRuns++];
+			run->type = BLOCK_IGNORE;
+			run->reserved = 0;
+			run->sectorStart = reader->curSector;
+			run->sectorCount = sectorsToSkip - remainder;
+			run->compOffset = 0;
+			run->compLength = 0;
+
+			printf("run %d: skipping sectors=%" PRId64 ", left=%d\n", reader->curRun, (int64_t) sectorsToSkip, reader->numSectors);
+
+			reader->curSector += run->sectorCount;
+			reader->numSectors -= run->sectorCount;
+			reader->curRun++;
+		}
+
+		if(remainder > 0)
+		{
+			run = &runs[numRuns++];
+			run->type = BLOCK_IGNORE;
+			run->reserved = 0;
+			run->sectorStart = reader->curSector;
+			run->sectorCount = remainder;
+			run->compOffset = 0;
+			run->compLength = 0;
+
+			printf("run %d: skipping sectors=%" PRId64 ", left=%d\n", reader->curRun, (int64_t) sectorsToSkip, reader->numSectors);
+
+			reader->curSector += run->sectorCount;
+			reader->numSectors -= run->sectorCount;
+			reader->curRun++;
+		}
+
+		reader->ignoreThreshold = 0;
+
+		return numRuns;
+	}
+
+	printf("run %d: sectors=%" PRId64 ", left=%d\n", reader->curRun, run->sectorCount, reader->numSectors);
+
+	reader->curSector += run->sectorCount;
+	reader->numSectors -= run->sectorCount;
+	reader->curRun++;
+
+	return 1;
+}
+
+// Deflates one run. strm must have been set up with deflateInit at COMPRESSION_LEVEL; it is reset afterwards so the
+// caller can keep reusing it, which produces exactly the same output as a fresh stream would. Runs that don't shrink by
+// at least 15 sectors are stored raw instead. Returns the number of bytes to write and points *data at them.
+static size_t compressRun(z_stream* strm, BLKXRun* run, unsigned char* inBuffer, size_t amountRead,
+			unsigned char* outBuffer, size_t bufferSize, unsigned char** data) {
+	size_t have;
+	int ret;
+
+	strm->avail_in = amountRead;
+	strm->next_in = inBuffer;
+	strm->avail_out = bufferSize;
+	strm->next_out = outBuffer;
+
+	ASSERT((ret = deflate(strm, Z_FINISH)) != Z_STREAM_ERROR, "deflate/Z_STREAM_ERROR");
+	if(ret != Z_STREAM_END) {
+		ASSERT(FALSE, "deflate");
+	}
+	have = bufferSize - strm->avail_out;
+
+	ASSERT(deflateReset(strm) == Z_OK, "deflateReset");
+
+	if((have / SECTOR_SIZE) >= (run->sectorCount - 15)) {
+		run->type = BLOCK_RAW;
+		*data = inBuffer;
+		return run->sectorCount * SECTOR_SIZE;
+	} else {
+		*data = outBuffer;
+		return have;
+	}
+}
+
+static BLKXRun* nextRun(BLKXWriter* writer) {
+	if(writer->curRun >= writer->roomForRuns) {
+		writer->roomForRuns <<= 1;
+		writer->blkx = (BLKXTable*) realloc(writer->blkx, sizeof(BLKXTable) + (writer->roomForRuns * sizeof(BLKXRun)));
+	}
+
+	return &(writer->blkx->runs[writer->curRun++]);
+}
+
+// Appends a run produced by readBLKXRuns/compressRun to the table, writes out its data and feeds the checksums. Must be
+// called in run order.
+static void writeRun(BLKXWriter* writer, BLKXRun* run, unsigned char* inBuffer, unsigned char* data, size_t length) {
+	BLKXRun* dest;
+
+	dest = nextRun(writer);
+	*dest = *run;
+	dest->compOffset = writer->out->tell(writer->out) - writer->blkx->dataStart;
+	dest->compLength = 0;
+
+	if(run->type == BLOCK_IGNORE) {
+		return;
+	}
+
+	if(writer->uncompressedChk)
+		(*writer->uncompressedChk)(writer->uncompressedChkToken, inBuffer, run->sectorCount * SECTOR_SIZE);
+
+	ASSERT(writer->out->write(writer->out, data, length) == length, "fwrite");
+	dest->compLength = length;
+
+	if(writer->compressedChk)
+		(*writer->compressedChk)(writer->compressedChkToken, data, length);
+}
+
+#ifdef HAVE_PTHREAD
+
+// The threaded compressor is a three stage pipeline over a ring of slots: a reader thread fills slots in order, the
+// deflate threads pick them up in whatever order they finish, and the calling thread writes them out in order again.
+
+enum {
+	SlotEmpty,
+	SlotRead,
+	SlotCompressed
+};
+
+typedef struct BLKXSlot {
+	unsigned char* inBuffer;
+	unsigned char* outBuffer;
+	BLKXRun runs[2];
+	int numRuns;
+	size_t amountRead;
+	unsigned char* data;
+	size_t length;
+	int state;
+} BLKXSlot;
+
+typedef struct BLKXPipeline {
+	BLKXReader* reader;
+	size_t bufferSize;
+	BLKXSlot* slots;
+	int numSlots;
+	uint64_t numRead;
+	uint64_t nextToCompress;
+	int readerDone;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} BLKXPipeline;
+
+static void* blkxReaderThread(void* arg) {
+	BLKXPipeline* pipeline;
+	BLKXSlot* slot;
+	uint64_t seq;
+	int numRuns;
+
+	pipeline = (BLKXPipeline*) arg;
+
+	for(seq = 0; ; seq++) {
+		slot = &(pipeline->slots[seq % pipeline->numSlots]);
+
+		pthread_mutex_lock(&pipeline->lock);
+		while(slot->state != SlotEmpty)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+		pthread_mutex_unlock(&pipeline->lock);
+
+		numRuns = readBLKXRuns(pipeline->reader, slot->inBuffer, slot->runs, &slot->amountRead);
+
+		pthread_mutex_lock(&pipeline->lock);
+		if(numRuns == 0) {
+			pipeline->readerDone = TRUE;
+		} else {
+			slot->numRuns = numRuns;
+			slot->state = SlotRead;
+			pipeline->numRead++;
+		}
+		pthread_cond_broadcast(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if(numRuns == 0)
+			break;
+	}
+
+	return NULL;
+}
+
+static void* blkxCompressThread(void* arg) {
+	BLKXPipeline* pipeline;
+	BLKXSlot* slot;
+	z_stream strm;
+
+	pipeline = (BLKXPipeline*) arg;
+
+	memset(&strm, 0, sizeof(strm));
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	ASSERT(deflateInit(&strm, COMPRESSION_LEVEL) == Z_OK, "deflateInit");
+
+	while(TRUE) {
+		pthread_mutex_lock(&pipeline->lock);
+		while(pipeline->nextToCompress == pipeline->numRead && !pipeline->readerDone)
+			pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+		if(pipeline->nextToCompress == pipeline->numRead) {
+			pthread_mutex_unlock(&pipeline->lock);
+			break;
+		}
+
+		slot = &(pipeline->slots[pipeline->nextToCompress % pipeline->numSlots]);
+		pipeline->nextToCompress++;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		if(slot->runs[0].type != BLOCK_IGNORE) {
+			slot->length = compressRun(&strm, &(slot->runs[0]), slot->inBuffer, slot->amountRead,
+						slot->outBuffer, pipeline->bufferSize, &slot->data);
+		}
+
+		pthread_mutex_lock(&pipeline->lock);
+		slot->state = SlotCompressed;
+		pthread_cond_broadcast(&pipeline->cond);
+		pthread_mutex_unlock(&pipeline->lock);
+	}
+
+	deflateEnd(&strm);
+
+	return NULL;
+}
+
+static void compressBLKXThreaded(BLKXReader* reader, BLKXWriter* writer, size_t bufferSize) {
+	BLKXPipeline pipeline;
+	pthread_t readerThread;
+	pthread_t* compressThreads;
+	BLKXSlot* slot;
+	uint64_t seq;
+	int i;
+
+	pipeline.reader = reader;
+	pipeline.bufferSize = bufferSize;
+	pipeline.numSlots = compressionThreads * 2;
+	pipeline.numRead = 0;
+	pipeline.nextToCompress = 0;
+	pipeline.readerDone = FALSE;
+	pthread_mutex_init(&pipeline.lock, NULL);
+	pthread_cond_init(&pipeline.cond, NULL);
+
+	ASSERT(pipeline.slots = (BLKXSlot*) malloc(sizeof(BLKXSlot) * pipeline.numSlots), "malloc");
+	for(i = 0; i < pipeline.numSlots; i++) {
+		memset(&(pipeline.slots[i]), 0, sizeof(BLKXSlot));
+		ASSERT(pipeline.slots[i].inBuffer = (unsigned char*) malloc(bufferSize), "malloc");
+		ASSERT(pipeline.slots[i].outBuffer = (unsigned char*) malloc(bufferSize), "malloc");
+		pipeline.slots[i].state = SlotEmpty;
+	}
+
+	ASSERT(compressThreads = (pthread_t*) malloc(sizeof(pthread_t) * compressionThreads), "malloc");
+
+	ASSERT(pthread_create(&readerThread, NULL, blkxReaderThread, &pipeline) == 0, "pthread_create");
+	for(i = 0; i < compressionThreads; i++) {
+		ASSERT(pthread_create(&compressThreads[i], NULL, blkxCompressThread, &pipeline) == 0, "pthread_create");
+	}
+
+	for(seq = 0; ; seq++) {
+		slot = &(pipeline.slots[seq % pipeline.numSlots]);
+
+		pthread_mutex_lock(&pipeline.lock);
+		while(slot->state != SlotCompressed && !(pipeline.readerDone && seq == pipeline.numRead))
+			pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+
+		if(slot->state != SlotCompressed) {
+			pthread_mutex_unlock(&pipeline.lock);
+			break;
+		}
+		pthread_mutex_unlock(&pipeline.lock);
+
+		for(i = 0; i < slot->numRuns; i++) {
+			writeRun(writer, &(slot->runs[i]), slot->inBuffer, slot->data, slot->length);
+		}
+
+		pthread_mutex_lock(&pipeline.lock);
+		slot->state = SlotEmpty;
+		pthread_cond_broadcast(&pipeline.cond);
+		pthread_mutex_unlock(&pipeline.lock);
+	}
+
+	pthread_join(readerThread, NULL);
+	for(i = 0; i < compressionThreads; i++) {
+		pthread_join(compressThreads[i], NULL);
+	}
+
+	for(i = 0; i < pipeline.numSlots; i++) {
+		free(pipeline.slots[i].inBuffer);
+		free(pipeline.slots[i].outBuffer);
+	}
+
+	free(pipeline.slots);
+	free(compressThreads);
+	pthread_cond_destroy(&pipeline.cond);
+	pthread_mutex_destroy(&pipeline.lock);
+}
+
+#endif
 
 BLKXTable* insertBLKX(AbstractFile* out, AbstractFile* in, uint32_t firstSectorNumber, uint32_t numSectors, uint32_t blocksDescriptor,
 			uint32_t checksumType, ChecksumFunc uncompressedChk, void* uncompressedChkToken, ChecksumFunc compressedChk,
 			void* compressedChkToken, Volume* volume, int addComment) {
 	BLKXTable* blkx;
-	
-	uint32_t roomForRuns;
-	uint32_t curRun;
-	uint64_t curSector;
+	BLKXReader reader;
+	BLKXWriter writer;
+	BLKXRun* run;
+	BLKXRun runs[2];
+	int numRuns;
+	int i;
 	
 	unsigned char* inBuffer;
 	unsigned char* outBuffer;
+	unsigned char* data;
 	size_t bufferSize;
-	size_t have;
-	int ret;
-	
-	int IGNORE_THRESHOLD = 100000;
+	size_t amountRead;
+	size_t length;
 
 	z_stream strm;	
 	
 	blkx = (BLKXTable*) malloc(sizeof(BLKXTable) + (2 * sizeof(BLKXRun)));
-	roomForRuns = 2;
-	memset(blkx, 0, sizeof(BLKXTable) + (roomForRuns * sizeof(BLKXRun)));
+	memset(blkx, 0, sizeof(BLKXTable) + (2 * sizeof(BLKXRun)));
 	
 	blkx->fUDIFBlocksSignature = UDIF_BLOCK_SIGNATURE;
 	blkx->infoVersion = 1;
@@ -61,215 +469,89 @@ BLKXTable* insertBLKX(AbstractFile* out, AbstractFile* in, uint32_t firstSectorN
 	blkx->blocksRunCount = 0;
 		
 	bufferSize = SECTOR_SIZE * blkx->decompressBufferRequested;
-	
-	ASSERT(inBuffer = (unsigned char*) malloc(bufferSize), "malloc");
-	ASSERT(outBuffer = (unsigned char*) malloc(bufferSize), "malloc");
-	 
-	curRun = 0;
-	curSector = 0;
-	
-	uint64_t startOff = in->tell(in);
+
+	writer.out = out;
+	writer.blkx = blkx;
+	writer.roomForRuns = 2;
+	writer.curRun = 0;
+	writer.uncompressedChk = uncompressedChk;
+	writer.uncompressedChkToken = uncompressedChkToken;
+	writer.compressedChk = compressedChk;
+	writer.compressedChkToken = compressedChkToken;
+
+	reader.in = in;
+	reader.startOff = in->tell(in);
+	reader.totalSectors = numSectors;
+	reader.numSectors = numSectors;
+	reader.curSector = 0;
+	reader.curRun = addComment ? 1 : 0;
+	reader.ignoreThreshold = INITIAL_IGNORE_THRESHOLD;
+	reader.addComment = addComment;
 
 	if(addComment)
 	{
-		blkx->runs[curRun].type = BLOCK_COMMENT;
-		blkx->runs[curRun].reserved = 0x2B626567;
-		blkx->runs[curRun].sectorStart = curSector;
-		blkx->runs[curRun].sectorCount = 0;
-		blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-		blkx->runs[curRun].compLength = 0;
-		curRun++;
-
-		if(curRun >= roomForRuns) {
-			roomForRuns <<= 1;
-			blkx = (BLKXTable*) realloc(blkx, sizeof(BLKXTable) + (roomForRuns * sizeof(BLKXRun)));
-		}
+		run = nextRun(&writer);
+		run->type = BLOCK_COMMENT;
+		run->reserved = 0x2B626567;
+		run->sectorStart = 0;
+		run->sectorCount = 0;
+		run->compOffset = out->tell(out) - writer.blkx->dataStart;
+		run->compLength = 0;
 	}
 
-	while(numSectors > 0) {
-		if(curRun >= roomForRuns) {
-			roomForRuns <<= 1;
-			blkx = (BLKXTable*) realloc(blkx, sizeof(BLKXTable) + (roomForRuns * sizeof(BLKXRun)));
-		}
-		
-		blkx->runs[curRun].type = BLOCK_ZLIB;
-		blkx->runs[curRun].reserved = 0;
-		blkx->runs[curRun].sectorStart = curSector;
-		blkx->runs[curRun].sectorCount = (numSectors > SECTORS_AT_A_TIME) ? SECTORS_AT_A_TIME : numSectors;
+#ifdef HAVE_PTHREAD
+	if(compressionThreads > 1) {
+		compressBLKXThreaded(&reader, &writer, bufferSize);
+	} else
+#endif
+	{
+		ASSERT(inBuffer = (unsigned char*) malloc(bufferSize), "malloc");
+		ASSERT(outBuffer = (unsigned char*) malloc(bufferSize), "malloc");
 
 		memset(&strm, 0, sizeof(strm));
 		strm.zalloc = Z_NULL;
 		strm.zfree = Z_NULL;
 		strm.opaque = Z_NULL;
-		
-		int amountRead;
-		{
-			size_t sectorsToSkip = 0;
-			size_t processed = 0;
-
-			while(processed < numSectors)
-			{
-				blkx->runs[curRun].sectorCount = ((numSectors - processed) > SECTORS_AT_A_TIME) ? SECTORS_AT_A_TIME : (numSectors - processed);
-
-				//printf("Currently at %" PRId64 "\n", curOff);
-				in->seek(in, startOff + (blkx->sectorCount - numSectors + processed) * SECTOR_SIZE);
-				ASSERT((amountRead = in->read(in, inBuffer, blkx->runs[curRun].sectorCount * SECTOR_SIZE)) == (blkx->runs[curRun].sectorCount * SECTOR_SIZE), "mRead");
-
-				if(!addComment)
-					break;
-
-				processed += amountRead / SECTOR_SIZE;
-
-				size_t* checkBuffer = (size_t*) inBuffer;
-				size_t counter;
-				size_t counter_max = amountRead / sizeof(size_t);
-				for(counter = 0; counter < counter_max; counter++)
-				{
-					if(checkBuffer[counter] != 0) {
-						//printf("Not empty at %" PRId64 " / %" PRId64 "\n", (int64_t)(counter * sizeof(size_t)) + curOff, (int64_t)((counter * sizeof(size_t)) / SECTOR_SIZE + sectorsToSkip + blkx->runs[curRun].sectorStart));
-						break;
-					}
-				}
-
-				size_t skipInBuffer = (counter * sizeof(size_t)) / SECTOR_SIZE;
-				sectorsToSkip += skipInBuffer;
-
-				//printf("sectorsToSkip: %d\n", sectorsToSkip);
-
-				if(counter < counter_max)
-				{
-					if(sectorsToSkip > IGNORE_THRESHOLD)
-					{
-						//printf("Seeking back to %" PRId64 "\n", curOff + (skipInBuffer * SECTOR_SIZE));
-						//in->seek(in, curOff + (skipInBuffer * SECTOR_SIZE));
-					} else {
-						//printf("Breaking out: %d / %d\n", (size_t) counter, (size_t) counter_max);
-					}
-					break;
-				}
-			}
-
-			if(sectorsToSkip > IGNORE_THRESHOLD)
-			{
-				int remainder = sectorsToSkip & 0xf;
-
-				if(sectorsToSkip != remainder)
-				{
-					blkx->runs[curRun].type = BLOCK_IGNORE;
-					blkx->runs[curRun].reserved = 0;
-					blkx->runs[curRun].sectorStart = curSector;
-					blkx->runs[curRun].sectorCount = sectorsToSkip - remainder;
-					blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-					blkx->runs[curRun].compLength = 0;
-
-					printf("run %d: skipping sectors=%" PRId64 ", left=%d\n", curRun, (int64_t) sectorsToSkip, numSectors);
-
-					curSector += blkx->runs[curRun].sectorCount;
-					numSectors -= blkx->runs[curRun].sectorCount;
-
-					curRun++;
-				}
-
-				if(remainder > 0)
-				{
-					blkx->runs[curRun].type = BLOCK_IGNORE;
-					blkx->runs[curRun].reserved = 0;
-					blkx->runs[curRun].sectorStart = curSector;
-					blkx->runs[curRun].sectorCount = remainder;
-					blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-					blkx->runs[curRun].compLength = 0;
-
-					printf("run %d: skipping sectors=%" PRId64 ", left=%d\n", curRun, (int64_t) sectorsToSkip, numSectors);
+		ASSERT(deflateInit(&strm, COMPRESSION_LEVEL) == Z_OK, "deflateInit");
 
-					curSector += blkx->runs[curRun].sectorCount;
-					numSectors -= blkx->runs[curRun].sectorCount;
-
-					curRun++;
+		while((numRuns = readBLKXRuns(&reader, inBuffer, runs, &amountRead)) > 0) {
+			for(i = 0; i < numRuns; i++) {
+				if(runs[i].type == BLOCK_IGNORE) {
+					writeRun(&writer, &runs[i], NULL, NULL, 0);
+				} else {
+					length = compressRun(&strm, &runs[i], inBuffer, amountRead, outBuffer, bufferSize, &data);
+					writeRun(&writer, &runs[i], inBuffer, data, length);
 				}
-
-				IGNORE_THRESHOLD = 0;
-				
-				continue;
 			}
 		}
 
-		printf("run %d: sectors=%" PRId64 ", left=%d\n", curRun, blkx->runs[curRun].sectorCount, numSectors);
-
-		ASSERT(deflateInit(&strm, 1) == Z_OK, "deflateInit");
-		
-		strm.avail_in = amountRead;
-		strm.next_in = inBuffer;
-		
-		if(uncompressedChk)
-			(*uncompressedChk)(uncompressedChkToken, inBuffer, blkx->runs[curRun].sectorCount * SECTOR_SIZE);
-	 
-		blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-		blkx->runs[curRun].compLength = 0;
-
-		strm.avail_out = bufferSize;
-		strm.next_out = outBuffer;
-	
-		ASSERT((ret = deflate(&strm, Z_FINISH)) != Z_STREAM_ERROR, "deflate/Z_STREAM_ERROR");
-		if(ret != Z_STREAM_END) {
-			ASSERT(FALSE, "deflate");
-		}
-		have = bufferSize - strm.avail_out;
-		
-		if((have / SECTOR_SIZE) >= (blkx->runs[curRun].sectorCount - 15)) {
-			blkx->runs[curRun].type = BLOCK_RAW;
-			ASSERT(out->write(out, inBuffer, blkx->runs[curRun].sectorCount * SECTOR_SIZE) == (blkx->runs[curRun].sectorCount * SECTOR_SIZE), "fwrite");
-			blkx->runs[curRun].compLength += blkx->runs[curRun].sectorCount * SECTOR_SIZE;
-
-			if(compressedChk)
-				(*compressedChk)(compressedChkToken, inBuffer, blkx->runs[curRun].sectorCount * SECTOR_SIZE);
-
-		} else {
-			ASSERT(out->write(out, outBuffer, have) == have, "fwrite");
-
-			if(compressedChk)
-				(*compressedChk)(compressedChkToken, outBuffer, have);
-
-			blkx->runs[curRun].compLength += have;
-		}
-							
 		deflateEnd(&strm);
 
-		curSector += blkx->runs[curRun].sectorCount;
-		numSectors -= blkx->runs[curRun].sectorCount;
-		curRun++;
-	}
-	
-	if(curRun >= roomForRuns) {
-		roomForRuns <<= 1;
-		blkx = (BLKXTable*) realloc(blkx, sizeof(BLKXTable) + (roomForRuns * sizeof(BLKXRun)));
+		free(inBuffer);
+		free(outBuffer);
 	}
 
 	if(addComment)
 	{	
-		blkx->runs[curRun].type = BLOCK_COMMENT;
-		blkx->runs[curRun].reserved = 0x2B656E64;
-		blkx->runs[curRun].sectorStart = curSector;
-		blkx->runs[curRun].sectorCount = 0;
-		blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-		blkx->runs[curRun].compLength = 0;
-		curRun++;
-
-		if(curRun >= roomForRuns) {
-			roomForRuns <<= 1;
-			blkx = (BLKXTable*) realloc(blkx, sizeof(BLKXTable) + (roomForRuns * sizeof(BLKXRun)));
-		}
+		run = nextRun(&writer);
+		run->type = BLOCK_COMMENT;
+		run->reserved = 0x2B656E64;
+		run->sectorStart = reader.curSector;
+		run->sectorCount = 0;
+		run->compOffset = out->tell(out) - writer.blkx->dataStart;
+		run->compLength = 0;
 	}
 
-	blkx->runs[curRun].type = BLOCK_TERMINATOR;
-	blkx->runs[curRun].reserved = 0;
-	blkx->runs[curRun].sectorStart = curSector;
-	blkx->runs[curRun].sectorCount = 0;
-	blkx->runs[curRun].compOffset = out->tell(out) - blkx->dataStart;
-	blkx->runs[curRun].compLength = 0;
-	blkx->blocksRunCount = curRun + 1;
-	
-	free(inBuffer);
-	free(outBuffer);
+	run = nextRun(&writer);
+	run->type = BLOCK_TERMINATOR;
+	run->reserved = 0;
+	run->sectorStart = reader.curSector;
+	run->sectorCount = 0;
+	run->compOffset = out->tell(out) - writer.blkx->dataStart;
+	run->compLength = 0;
+
+	blkx = writer.blkx;
+	blkx->blocksRunCount = writer.curRun;
 	
 	return blkx;
 }
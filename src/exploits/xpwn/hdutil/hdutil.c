@@ -6,6 +6,9 @@
 #include <unistd.h>
 #include <hfs/hfsplus.h>
 #include <dmg/dmgfile.h>
+#include <dmg/dmgcache.h>
+#include <hfs/hfsparallel.h>
+#include "mmapfile.h"
 #include <dmg/filevault.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -253,27 +256,57 @@ int main(int argc, const char *argv[]) {
 	Volume* volume;
 	AbstractFile* image;
 	int argOff;
+	int isDmg = FALSE;
+	int verbose = FALSE;
+	uint64_t hits;
+	uint64_t misses;
+	int i;
 	
 	TestByteOrder();
+
+	// options are only recognized in front of <image-file>, so that file arguments to the commands are left alone
+	while(argc > 2) {
+		if(strcmp(argv[1], "-j") == 0) {
+			hfs_setthreads(atoi(argv[2]));
+			i = 2;
+		} else if(strcmp(argv[1], "-v") == 0) {
+			verbose = TRUE;
+			i = 1;
+		} else {
+			break;
+		}
+
+		memmove(&argv[1], &argv[1 + i], sizeof(char*) * (argc - 1 - i));
+		argc -= i;
+	}
 	
 	if(argc < 3) {
-		printf("usage: %s <image-file> (-k <key>) <ls|cat|mv|mkdir|add|rm|chmod|extract|extractall|rmall|addall|grow|untar> <arguments>\n", argv[0]);
+		printf("usage: %s (-j <threads>) (-v) <image-file> (-k <key>) (-c <cached runs>) <ls|cat|mv|mkdir|add|rm|chmod|extract|extractall|rmall|addall|grow|untar> <arguments>\n", argv[0]);
 		return 0;
 	}
 
 	argOff = 2;
 	
 	if(strstr(argv[1], ".dmg")) {
-		image = createAbstractFileFromFile(fopen(argv[1], "rb"));
+		image = createAbstractFileFromMmap(argv[1]);
+		if(image == NULL)
+			image = createAbstractFileFromFile(fopen(argv[1], "rb"));
 		if(argc > 3) {
 			if(strcmp(argv[2], "-k") == 0) {
 				image = createAbstractFileFromFileVault(image, argv[3]);
 				argOff = 4;
 			}
 		}
+		if(argc > (argOff + 2) && strcmp(argv[argOff], "-c") == 0) {
+			setDmgRunCacheSize(atoi(argv[argOff + 1]));
+			argOff += 2;
+		}
 		io = openDmgFilePartition(image, -1);
+		isDmg = TRUE;
 	} else {
-		io = openFlatFile(argv[1]);
+		io = openMmapFile(argv[1], TRUE);
+		if(io == NULL)
+			io = openFlatFile(argv[1]);
 	}
 
 	if(io == NULL) {
@@ -321,6 +354,12 @@ int main(int argc, const char *argv[]) {
 	}
 	
 	closeVolume(volume);
+
+	if(verbose && isDmg) {
+		getDmgRunCacheStats(io, &hits, &misses);
+		fprintf(stderr, "run cache: %" PRIu64 " hits, %" PRIu64 " misses\n", hits, misses);
+	}
+
 	CLOSE(io);
 	
 	return 0;
@@ -1,21 +1,305 @@
 #include <stdlib.h>
+#include <string.h>
 #include <hfs/hfsplus.h>
 
+/*
+ * Node cache. Every B-tree's io_func is wrapped so that reads are served from whole nodes kept in memory; writes go
+ * straight through to the underlying file and update the cached copy. The pool is shared by all open trees (catalog,
+ * extents, attributes) and evicts the least recently used node. The descriptor of each cached node is kept flipped
+ * to host byte order and readBTNodeDescriptor hands out a pointer to it. Record keys are read and flipped the first
+ * time a search probes them and are kept with the node, so a search that passes through a node again compares
+ * against the same keys without reading or allocating. Both stay valid until the node is written or evicted.
+ */
+
+#define NODE_CACHE_ENTRIES 256
+#define NODE_CACHE_BUCKETS 509
+
+typedef struct NodeCache {
+  io_func* io;
+  uint32_t nodeSize;
+} NodeCache;
+
+typedef struct CachedNode {
+  NodeCache* owner;
+  uint32_t nodeNum;
+  uint8_t* data;
+  size_t size;
+  BTNodeDescriptor descriptor;
+  BTKey** keys;
+  uint16_t numKeys;
+  uint64_t lastUsed;
+  struct CachedNode* next;
+} CachedNode;
+
+static CachedNode nodeCache[NODE_CACHE_ENTRIES];
+static CachedNode* nodeCacheBuckets[NODE_CACHE_BUCKETS];
+static uint64_t nodeCacheClock = 0;
+
+static unsigned int nodeCacheHash(NodeCache* owner, uint32_t nodeNum) {
+  return (unsigned int)((((size_t)owner >> 4) ^ (nodeNum * 2654435761u)) % NODE_CACHE_BUCKETS);
+}
+
+static CachedNode* findCachedNode(NodeCache* owner, uint32_t nodeNum) {
+  CachedNode* node;
+
+  node = nodeCacheBuckets[nodeCacheHash(owner, nodeNum)];
+  while(node != NULL) {
+    if(node->owner == owner && node->nodeNum == nodeNum)
+      return node;
+    node = node->next;
+  }
+
+  return NULL;
+}
+
+static void dropCachedKeys(CachedNode* node) {
+  int i;
+
+  if(node->keys == NULL)
+    return;
+
+  for(i = 0; i < node->numKeys; i++)
+    free(node->keys[i]);
+
+  free(node->keys);
+  node->keys = NULL;
+  node->numKeys = 0;
+}
+
+static void unlinkCachedNode(CachedNode* node) {
+  CachedNode** link;
+
+  link = &nodeCacheBuckets[nodeCacheHash(node->owner, node->nodeNum)];
+  while(*link != NULL) {
+    if(*link == node) {
+      *link = node->next;
+      break;
+    }
+    link = &((*link)->next);
+  }
+
+  dropCachedKeys(node);
+  node->owner = NULL;
+  node->next = NULL;
+}
+
+static void flipCachedDescriptor(CachedNode* node) {
+  memcpy(&node->descriptor, node->data, sizeof(BTNodeDescriptor));
+  FLIPENDIAN(node->descriptor.fLink);
+  FLIPENDIAN(node->descriptor.bLink);
+  FLIPENDIAN(node->descriptor.numRecords);
+}
+
+static CachedNode* getCachedNode(NodeCache* cache, uint32_t nodeNum) {
+  CachedNode* node;
+  CachedNode** link;
+  int i;
+
+  node = findCachedNode(cache, nodeNum);
+  if(node != NULL) {
+    node->lastUsed = ++nodeCacheClock;
+    return node;
+  }
+
+  node = &nodeCache[0];
+  for(i = 0; i < NODE_CACHE_ENTRIES; i++) {
+    if(nodeCache[i].owner == NULL) {
+      node = &nodeCache[i];
+      break;
+    }
+    if(nodeCache[i].lastUsed < node->lastUsed)
+      node = &nodeCache[i];
+  }
+
+  if(node->owner != NULL)
+    unlinkCachedNode(node);
+
+  if(node->size < cache->nodeSize) {
+    free(node->data);
+    node->data = (uint8_t*) malloc(cache->nodeSize);
+    node->size = cache->nodeSize;
+  }
+
+  if(!READ(cache->io, (off_t)nodeNum * cache->nodeSize, cache->nodeSize, node->data))
+    return NULL;
+
+  node->owner = cache;
+  node->nodeNum = nodeNum;
+  node->lastUsed = ++nodeCacheClock;
+  flipCachedDescriptor(node);
+
+  link = &nodeCacheBuckets[nodeCacheHash(cache, nodeNum)];
+  node->next = *link;
+  *link = node;
+
+  return node;
+}
+
+static int nodeCacheRead(io_func* io, off_t location, size_t size, void *buffer) {
+  NodeCache* cache;
+  CachedNode* node;
+  off_t inNode;
+  size_t toRead;
+
+  cache = (NodeCache*) io->data;
+
+  while(size > 0) {
+    inNode = location % cache->nodeSize;
+    toRead = cache->nodeSize - inNode;
+    if(toRead > size)
+      toRead = size;
+
+    node = getCachedNode(cache, location / cache->nodeSize);
+    if(node != NULL) {
+      memcpy(buffer, node->data + inNode, toRead);
+    } else if(!READ(cache->io, location, toRead, buffer)) {
+      return FALSE;
+    }
+
+    size -= toRead;
+    location += toRead;
+    buffer = (void*)(((uint8_t*)buffer) + toRead);
+  }
+
+  return TRUE;
+}
+
+static int nodeCacheWrite(io_func* io, off_t location, size_t size, void *buffer) {
+  NodeCache* cache;
+  CachedNode* node;
+  off_t inNode;
+  size_t toWrite;
+
+  cache = (NodeCache*) io->data;
+
+  if(!WRITE(cache->io, location, size, buffer))
+    return FALSE;
+
+  while(size > 0) {
+    inNode = location % cache->nodeSize;
+    toWrite = cache->nodeSize - inNode;
+    if(toWrite > size)
+      toWrite = size;
+
+    node = findCachedNode(cache, location / cache->nodeSize);
+    if(node != NULL) {
+      memcpy(node->data + inNode, buffer, toWrite);
+      flipCachedDescriptor(node);
+      dropCachedKeys(node);
+    }
+
+    size -= toWrite;
+    location += toWrite;
+    buffer = (void*)(((uint8_t*)buffer) + toWrite);
+  }
+
+  return TRUE;
+}
+
+static void closeNodeCache(io_func* io) {
+  NodeCache* cache;
+  int i;
+
+  cache = (NodeCache*) io->data;
+
+  for(i = 0; i < NODE_CACHE_ENTRIES; i++) {
+    if(nodeCache[i].owner == cache)
+      unlinkCachedNode(&nodeCache[i]);
+  }
+
+  CLOSE(cache->io);
+  free(cache);
+  free(io);
+}
+
+static io_func* openNodeCache(io_func* io, uint32_t nodeSize) {
+  io_func* toReturn;
+  NodeCache* cache;
+
+  cache = (NodeCache*) malloc(sizeof(NodeCache));
+  cache->io = io;
+  cache->nodeSize = nodeSize;
+
+  toReturn = (io_func*) malloc(sizeof(io_func));
+  toReturn->data = cache;
+  toReturn->read = &nodeCacheRead;
+  toReturn->write = &nodeCacheWrite;
+  toReturn->close = &closeNodeCache;
+
+  return toReturn;
+}
+
+static RawFile* getTreeFile(BTree* tree) {
+  return (RawFile*)(((NodeCache*)tree->io->data)->io->data);
+}
+
+/*
+ * The returned descriptor belongs to the node cache and must not be freed. It only stays valid until the next access
+ * to the tree, so callers that do more I/O while they need it (or modify it) take a copy.
+ */
 BTNodeDescriptor* readBTNodeDescriptor(uint32_t num, BTree* tree) {
-  BTNodeDescriptor* descriptor;
-  
-  descriptor = (BTNodeDescriptor*) malloc(sizeof(BTNodeDescriptor));
-  
-  if(!READ(tree->io, num * tree->headerRec->nodeSize, sizeof(BTNodeDescriptor), descriptor))
+  CachedNode* node;
+
+  node = getCachedNode((NodeCache*) tree->io->data, num);
+  if(node == NULL)
     return NULL;
-    
-  FLIPENDIAN(descriptor->fLink);
-  FLIPENDIAN(descriptor->bLink);
-  FLIPENDIAN(descriptor->numRecords);
-  
+
+  return &node->descriptor;
+}
+
+/* For callers that hold on to a descriptor across other tree I/O or modify it */
+static BTNodeDescriptor* copyBTNodeDescriptor(uint32_t num, BTree* tree, BTNodeDescriptor* descriptor) {
+  BTNodeDescriptor* cached;
+
+  cached = readBTNodeDescriptor(num, tree);
+  if(cached == NULL)
+    return NULL;
+
+  *descriptor = *cached;
   return descriptor;
 }
 
+/*
+ * Key of record num of a node, from the node cache. The key belongs to the cache and must not be freed; it is only
+ * valid until the next access to the tree. *dataOffset is set to where the record's data starts.
+ */
+static BTKey* readCachedKey(BTree* tree, uint32_t nodeNum, int num, off_t* dataOffset) {
+  NodeCache* cache;
+  CachedNode* node;
+  uint16_t offset;
+  off_t recordOffset;
+  BTKey* key;
+
+  cache = (NodeCache*) tree->io->data;
+  node = getCachedNode(cache, nodeNum);
+  if(node == NULL || num >= node->descriptor.numRecords)
+    return NULL;
+
+  memcpy(&offset, node->data + cache->nodeSize - (sizeof(uint16_t) * (num + 1)), sizeof(uint16_t));
+  FLIPENDIAN(offset);
+  recordOffset = (off_t)nodeNum * cache->nodeSize + offset;
+
+  if(node->keys == NULL) {
+    node->keys = (BTKey**) calloc(node->descriptor.numRecords, sizeof(BTKey*));
+    node->numKeys = node->descriptor.numRecords;
+  }
+
+  key = node->keys[num];
+  if(key == NULL) {
+    key = READ_KEY(tree, recordOffset, tree->io);
+    if(key == NULL)
+      return NULL;
+
+    /* READ_KEY went through the cache too, but it only ever touches this node, which is the most recently used */
+    node->keys[num] = key;
+  }
+
+  if(dataOffset != NULL)
+    *dataOffset = recordOffset + key->keyLength + sizeof(key->keyLength);
+
+  return key;
+}
+
 static int writeBTNodeDescriptor(BTNodeDescriptor* descriptor, uint32_t num, BTree* tree) {
   BTNodeDescriptor myDescriptor;
   
@@ -107,6 +391,7 @@ BTree* openBTree(io_func* io, compareFunc compare, dataReadFunc keyRead, keyWrit
     return NULL;
   }
   
+  tree->io = openNodeCache(io, tree->headerRec->nodeSize);
   tree->compare = compare;
   tree->keyRead = keyRead;
   tree->keyWrite = keyWrite;
@@ -177,29 +462,51 @@ off_t getNodeNumberFromPointerRecord(off_t offset, io_func* io) {
 static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact, uint32_t *nodeNumber, int *recordNumber) {
   BTNodeDescriptor* descriptor;
   BTKey* key;
-  off_t recordOffset;
   off_t recordDataOffset;
   off_t lastRecordDataOffset;
+  uint16_t numRecords;
+  int8_t kind;
   
   int res;
   int i;
+  int low;
+  int high;
   
   descriptor = readBTNodeDescriptor(root, tree);
    
   if(descriptor == NULL)
     return NULL;
+
+  numRecords = descriptor->numRecords;
+  kind = descriptor->kind;
     
   lastRecordDataOffset = 0;
   
-  for(i = 0; i < descriptor->numRecords; i++) {
-    recordOffset = getRecordOffset(i, root, tree);
-    key = READ_KEY(tree, recordOffset, tree->io);
-    recordDataOffset = recordOffset + key->keyLength + sizeof(key->keyLength);
+  /* binary search for the first record whose key is not less than searchKey */
+  low = 0;
+  high = numRecords;
+  while(low < high) {
+    i = low + (high - low) / 2;
+    key = readCachedKey(tree, root, i, NULL);
+    if(key == NULL)
+      return NULL;
+    res = COMPARE(tree, key, searchKey);
+    if(res < 0)
+      low = i + 1;
+    else
+      high = i;
+  }
+  
+  i = low;
+  
+  if(i < numRecords) {
+    key = readCachedKey(tree, root, i, &recordDataOffset);
+    if(key == NULL)
+      return NULL;
     
     res = COMPARE(tree, key, searchKey);
-	free(key);
     if(res == 0) {
-      if(descriptor->kind == kBTLeafNode) {
+      if(kind == kBTLeafNode) {
         if(nodeNumber != NULL)
           *nodeNumber = root;
           
@@ -208,20 +515,17 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
         
         if(exact != NULL)
           *exact = TRUE;
-                 
-        free(descriptor);
 
         return READ_DATA(tree, recordDataOffset, tree->io);
       } else {
-      
-        free(descriptor);
         return searchNode(tree, getNodeNumberFromPointerRecord(recordDataOffset, tree->io), searchKey, exact, nodeNumber, recordNumber);
       }
-    } else if(res > 0) {
-      break;
     }
-
-    lastRecordDataOffset = recordDataOffset;
+  }
+  
+  if(i > 0) {
+    if(readCachedKey(tree, root, i - 1, &lastRecordDataOffset) == NULL)
+      return NULL;
   }
 
   if(lastRecordDataOffset == 0) {
@@ -229,7 +533,7 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
     return NULL;
   }
   
-  if(descriptor->kind == kBTLeafNode) {        
+  if(kind == kBTLeafNode) {        
     if(nodeNumber != NULL)
       *nodeNumber = root;
       
@@ -239,11 +543,8 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
     if(exact != NULL)
       *exact = FALSE;
       
-    free(descriptor);
     return READ_DATA(tree, lastRecordDataOffset, tree->io);
-  } else if(descriptor->kind == kBTIndexNode) {
-  
-    free(descriptor);
+  } else if(kind == kBTIndexNode) {
     return searchNode(tree, getNodeNumberFromPointerRecord(lastRecordDataOffset, tree->io), searchKey, exact, nodeNumber, recordNumber);
   } else {
     if(nodeNumber != NULL)
@@ -255,7 +556,6 @@ static void* searchNode(BTree* tree, uint32_t root, BTKey* searchKey, int *exact
     if(exact != NULL)
       *exact = FALSE;
 
-    free(descriptor);
     return NULL;
   }
 }
@@ -273,6 +573,7 @@ static uint32_t linearCheck(uint32_t* heightTable, unsigned char* map, BTree* tr
   uint32_t leafRecords;
   
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   
   uint32_t prevNode;
   
@@ -290,10 +591,8 @@ static uint32_t linearCheck(uint32_t* heightTable, unsigned char* map, BTree* tr
       descriptor = readBTNodeDescriptor(node, tree);
       while(descriptor->bLink != 0) {
         node = descriptor->bLink;
-        free(descriptor);
         descriptor = readBTNodeDescriptor(node, tree);
       }
-      free(descriptor);
       
       prevNode = 0;
       previousKey = NULL;
@@ -306,7 +605,7 @@ static uint32_t linearCheck(uint32_t* heightTable, unsigned char* map, BTree* tr
       }
       
       while(node != 0) {
-        descriptor = readBTNodeDescriptor(node, tree);
+        descriptor = copyBTNodeDescriptor(node, tree, &nodeDescriptor);
         if(descriptor->bLink != prevNode) {
           printf("BTREE CONSISTENCY ERROR: Node %d is not properly linked with previous node %d\n", node, prevNode);
           (*errCount)++;
@@ -352,7 +651,6 @@ static uint32_t linearCheck(uint32_t* heightTable, unsigned char* map, BTree* tr
         
         prevNode = node;
         node = descriptor->fLink;
-        free(descriptor);
       }
       
       if(i == 1) {
@@ -377,6 +675,7 @@ static uint32_t linearCheck(uint32_t* heightTable, unsigned char* map, BTree* tr
 static uint32_t traverseNode(uint32_t nodeNum, BTree* tree, unsigned char* map, int parentHeight, BTKey** firstKey, BTKey** lastKey,
                                   uint32_t* heightTable, uint32_t* errCount, int displayTree) {
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   BTKey* key;
   BTKey* previousKey;
   BTKey* retFirstKey;
@@ -392,7 +691,7 @@ static uint32_t traverseNode(uint32_t nodeNum, BTree* tree, unsigned char* map,
   
   off_t lastrecordDataOffset;
   
-  descriptor = readBTNodeDescriptor(nodeNum, tree);
+  descriptor = copyBTNodeDescriptor(nodeNum, tree, &nodeDescriptor);
   
   previousKey = NULL;
   
@@ -519,8 +818,6 @@ static uint32_t traverseNode(uint32_t nodeNum, BTree* tree, unsigned char* map,
   }
   
   if(previousKey != NULL) free(previousKey);
-
-  free(descriptor);
   
   return count;
   
@@ -578,7 +875,6 @@ static unsigned char* mapNodes(BTree* tree, uint32_t* numMapNodes, uint32_t* err
         
     descriptor = readBTNodeDescriptor(mapNode, tree);
     mapNode = descriptor->fLink;
-    free(descriptor);
     
     (*numMapNodes)++;
     
@@ -709,7 +1005,6 @@ static uint32_t findFree(BTree* tree) {
     
     descriptor = readBTNodeDescriptor(mapNode, tree);
     mapNode = descriptor->fLink;
-    free(descriptor);
     
     if(mapNode == 0) {
       return 0;
@@ -735,7 +1030,6 @@ static int markUsed(uint32_t node, BTree* tree) {
     while(TRUE) {
       descriptor = readBTNodeDescriptor(mapNode, tree);
       mapNode = descriptor->fLink;
-      free(descriptor);
       
       if(byteNumber > (tree->headerRec->nodeSize - 20)) {
         byteNumber -= tree->headerRec->nodeSize - 20;
@@ -765,10 +1059,11 @@ static int growBTree(BTree* tree) {
   uint32_t newNodesStart;
   
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   BTNodeDescriptor newDescriptor;
   
-  allocate((RawFile*)(tree->io->data), ((RawFile*)(tree->io->data))->forkData->logicalSize + ((RawFile*)(tree->io->data))->forkData->clumpSize);
-  increasedNodes = (((RawFile*)(tree->io->data))->forkData->logicalSize/tree->headerRec->nodeSize) - tree->headerRec->totalNodes;
+  allocate(getTreeFile(tree), getTreeFile(tree)->forkData->logicalSize + getTreeFile(tree)->forkData->clumpSize);
+  increasedNodes = (getTreeFile(tree)->forkData->logicalSize/tree->headerRec->nodeSize) - tree->headerRec->totalNodes;
   
   newNodesStart = tree->headerRec->totalNodes / tree->headerRec->nodeSize;
   
@@ -791,7 +1086,7 @@ static int growBTree(BTree* tree) {
     byteNumber -= tree->headerRec->nodeSize - 256;
     
     while(TRUE) {
-      descriptor = readBTNodeDescriptor(mapNode, tree);
+      descriptor = copyBTNodeDescriptor(mapNode, tree, &nodeDescriptor);
 
       if(descriptor->fLink == 0) {
         descriptor->fLink = newNodesStart;
@@ -851,6 +1146,8 @@ static uint32_t removeNode(BTree* tree, uint32_t node) {
   size_t mapRecordLength;
   BTNodeDescriptor *descriptor;
   BTNodeDescriptor *oDescriptor;
+  BTNodeDescriptor nodeDescriptor;
+  BTNodeDescriptor otherDescriptor;
   
   mapRecordStart = getRecordOffset(2, 0, tree);
   mapRecordLength = tree->headerRec->nodeSize - 256;
@@ -859,7 +1156,6 @@ static uint32_t removeNode(BTree* tree, uint32_t node) {
   while((node / 8) >= mapRecordLength) {
     descriptor = readBTNodeDescriptor(mapNode, tree);
     mapNode = descriptor->fLink;
-    free(descriptor);
     
     if(mapNode == 0) {
       hfs_panic("Cannot remove node because I can't map it!");
@@ -877,7 +1173,7 @@ static uint32_t removeNode(BTree* tree, uint32_t node) {
   
   tree->headerRec->freeNodes++;
   
-  descriptor = readBTNodeDescriptor(node, tree);
+  descriptor = copyBTNodeDescriptor(node, tree, &nodeDescriptor);
   
   if(tree->headerRec->firstLeafNode == node) {
     tree->headerRec->firstLeafNode = descriptor->fLink;
@@ -892,21 +1188,17 @@ static uint32_t removeNode(BTree* tree, uint32_t node) {
   }
   
   if(descriptor->bLink != 0) {
-    oDescriptor = readBTNodeDescriptor(descriptor->bLink, tree);
+    oDescriptor = copyBTNodeDescriptor(descriptor->bLink, tree, &otherDescriptor);
     oDescriptor->fLink = descriptor->fLink;
     ASSERT(writeBTNodeDescriptor(oDescriptor, descriptor->bLink, tree), "writeBTNodeDescriptor");
-	free(oDescriptor);
   }
   
   if(descriptor->fLink != 0) {
-    oDescriptor = readBTNodeDescriptor(descriptor->fLink, tree);
+    oDescriptor = copyBTNodeDescriptor(descriptor->fLink, tree, &otherDescriptor);
     oDescriptor->bLink = descriptor->bLink;
     ASSERT(writeBTNodeDescriptor(oDescriptor, descriptor->fLink, tree), "writeBTNodeDescriptor");
-	free(oDescriptor);
   }
   
-  free(descriptor);
-  
   ASSERT(WRITE(tree->io, mapRecordStart + (node / 8), 1, &byte), "WRITE");
   ASSERT(writeBTHeaderRec(tree), "writeBTHeaderRec");
   
@@ -920,6 +1212,7 @@ static uint32_t splitNode(uint32_t node, BTNodeDescriptor* descriptor, BTree* tr
   off_t internalOffset;
   
   BTNodeDescriptor* fDescriptor;
+  BTNodeDescriptor nextDescriptor;
   
   BTNodeDescriptor newDescriptor;
   uint32_t newNodeNum;
@@ -968,10 +1261,9 @@ static uint32_t splitNode(uint32_t node, BTNodeDescriptor* descriptor, BTree* tr
   ASSERT(writeBTNodeDescriptor(&newDescriptor, newNodeNum, tree), "writeBTNodeDescriptor");
   
   if(newDescriptor.fLink != 0) {    
-    fDescriptor = readBTNodeDescriptor(newDescriptor.fLink, tree);
+    fDescriptor = copyBTNodeDescriptor(newDescriptor.fLink, tree, &nextDescriptor);
     fDescriptor->bLink = newNodeNum;
     ASSERT(writeBTNodeDescriptor(fDescriptor, newDescriptor.fLink, tree), "writeBTNodeDescriptor");
-    free(fDescriptor);
   }
   
   descriptor->fLink = newNodeNum;
@@ -1042,6 +1334,7 @@ static int moveRecordsDown(BTree* tree, BTNodeDescriptor* descriptor, int record
 
 static int doAddRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length, unsigned char* content) {
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   BTKey* key;
   off_t recordOffset;
   off_t recordDataOffset;
@@ -1052,7 +1345,7 @@ static int doAddRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t leng
   int res;
   int i;
   
-  descriptor = readBTNodeDescriptor(root, tree);
+  descriptor = copyBTNodeDescriptor(root, tree, &nodeDescriptor);
    
   if(descriptor == NULL)
     return FALSE;
@@ -1067,7 +1360,6 @@ static int doAddRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t leng
     res = COMPARE(tree, key, searchKey);
     if(res == 0) {
       free(key);
-      free(descriptor);
       
       return FALSE;
     } else if(res > 0) {
@@ -1116,12 +1408,12 @@ static int doAddRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t leng
   ASSERT(writeBTNodeDescriptor(descriptor, root, tree), "writeBTNodeDescriptor");
   ASSERT(writeBTHeaderRec(tree), "writeBTHeaderRec");
   
-  free(descriptor);
   return TRUE;
 }
 
 static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length, unsigned char* content, int* callAgain) {
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   BTKey* key;
   off_t recordOffset;
   off_t recordDataOffset;
@@ -1137,7 +1429,7 @@ static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length
   
   uint32_t nodeBigEndian;
   
-  descriptor = readBTNodeDescriptor(root, tree);
+  descriptor = copyBTNodeDescriptor(root, tree, &nodeDescriptor);
    
   if(descriptor == NULL)
     return 0;
@@ -1154,7 +1446,6 @@ static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length
     res = COMPARE(tree, key, searchKey);
     if(res == 0) {
       free(key);
-      free(descriptor);
       
       return 0;
     } else if(res > 0) {
@@ -1177,12 +1468,10 @@ static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length
         doAddRecord(tree, newNode, searchKey, length, content);
       }
       
-      free(descriptor);
       return newNode;
     } else {
       doAddRecord(tree, root, searchKey, length, content);
       
-      free(descriptor);
       return 0;
     }
   } else {  
@@ -1226,7 +1515,6 @@ static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length
     }
     
     if(newNode == 0) {
-      free(descriptor);
       return 0;
     } else {
       newNodeBigEndian = newNode;
@@ -1243,13 +1531,11 @@ static int addRecord(BTree* tree, uint32_t root, BTKey* searchKey, size_t length
         }
         
         free(key);
-        free(descriptor);
         return newNode;
       } else {
         doAddRecord(tree, root, key, sizeof(newNodeBigEndian), (unsigned char*)(&newNodeBigEndian));
         
         free(key);
-        free(descriptor);
         return 0;
       }
     }
@@ -1373,6 +1659,7 @@ int addToBTree(BTree* tree, BTKey* searchKey, size_t length, unsigned char* cont
 
 static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int* callAgain, int* gone) {
   BTNodeDescriptor* descriptor;
+  BTNodeDescriptor nodeDescriptor;
   int length;
   int i;
   int res;
@@ -1391,7 +1678,7 @@ static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int*
   
   size_t freeSpace;
   
-  descriptor = readBTNodeDescriptor(root, tree);
+  descriptor = copyBTNodeDescriptor(root, tree, &nodeDescriptor);
   
   freeSpace = getFreeSpace(root, descriptor, tree);
   
@@ -1423,10 +1710,8 @@ static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int*
         ASSERT(writeBTHeaderRec(tree), "writeBTHeaderRec");
         
         if(descriptor->numRecords >= 1) {
-          free(descriptor);
           return 0;
         } else {
-          free(descriptor);
           removeNode(tree, root);
           (*gone) = TRUE;
           return 0;
@@ -1441,7 +1726,6 @@ static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int*
       
       if(lastRecordDataOffset == 0 || descriptor->kind == kBTLeafNode) {
         // not found;
-        free(descriptor);
         return 0;
       } else {
         nodeToTraverse = getNodeNumberFromPointerRecord(lastRecordDataOffset, tree->io);
@@ -1503,7 +1787,6 @@ static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int*
       (*gone) = TRUE;
     }
     
-    free(descriptor);
     return 0;
   } else {
     newNodeBigEndian = newNode;
@@ -1525,13 +1808,11 @@ static uint32_t removeRecord(BTree* tree, uint32_t root, BTKey* searchKey, int*
       }
       
       free(key);
-      free(descriptor);
       return newNode;
     } else {
       doAddRecord(tree, root, key, sizeof(newNodeBigEndian), (unsigned char*)(&newNodeBigEndian));
            
       free(key);
-      free(descriptor);
       return 0;
     }
   }
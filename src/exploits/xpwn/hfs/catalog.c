@@ -350,7 +350,7 @@ CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume) {
 	uint32_t nodeNumber;
 	int recordNumber;
 
-	BTNodeDescriptor* descriptor;
+	BTNodeDescriptor descriptor;
 	off_t recordOffset;
 	off_t recordDataOffset;
 	HFSPlusCatalogKey* currentKey;
@@ -382,9 +382,10 @@ CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume) {
 	++recordNumber;
 
 	while(nodeNumber != 0) {    
-		descriptor = readBTNodeDescriptor(nodeNumber, tree);
+		/* the hard link lookup below can evict this node from the cache, so keep a copy of its descriptor */
+		descriptor = *readBTNodeDescriptor(nodeNumber, tree);
 
-		while(recordNumber < descriptor->numRecords) {
+		while(recordNumber < descriptor.numRecords) {
 			recordOffset = getRecordOffset(recordNumber, nodeNumber, tree);
 			currentKey = (HFSPlusCatalogKey*) READ_KEY(tree, recordOffset, tree->io);
 			recordDataOffset = recordOffset + currentKey->keyLength + sizeof(currentKey->keyLength);
@@ -417,17 +418,14 @@ CatalogRecordList* getFolderContents(HFSCatalogNodeID CNID, Volume* volume) {
 				free(currentKey);
 			} else {
 				free(currentKey);
-				free(descriptor);
 				return list;
 			}
 
 			recordNumber++;
 		}
 
-		nodeNumber = descriptor->fLink;
+		nodeNumber = descriptor.fLink;
 		recordNumber = 0;
-
-		free(descriptor);
 	}
 
 	return list;
@@ -7,7 +7,9 @@
 #include <dirent.h>
 
 #include <hfs/hfslib.h>
+#include <hfs/hfsparallel.h>
 #include "abstractfile.h"
+#include "mmapfile.h"
 #include <inttypes.h>
 
 char endianness;
@@ -269,13 +271,21 @@ int main(int argc, const char *argv[]) {
 	Volume* volume;
 	
 	TestByteOrder();
+
+	if(argc > 2 && strcmp(argv[1], "-j") == 0) {
+		hfs_setthreads(atoi(argv[2]));
+		memmove(&argv[1], &argv[3], sizeof(char*) * (argc - 3));
+		argc -= 2;
+	}
 	
 	if(argc < 3) {
-		printf("usage: %s <image-file> <ls|cat|mv|mkdir|add|rm|chmod|extract|extractall|rmall|addall|debug> <arguments>\n", argv[0]);
+		printf("usage: %s (-j <threads>) <image-file> <ls|cat|mv|mkdir|add|rm|chmod|extract|extractall|rmall|addall|debug> <arguments>\n", argv[0]);
 		return 0;
 	}
 	
-	io = openFlatFile(argv[1]);
+	io = openMmapFile(argv[1], TRUE);
+	if(io == NULL)
+		io = openFlatFile(argv[1]);
 	if(io == NULL) {
 		fprintf(stderr, "error: Cannot open image-file.\n");
 		return 1;
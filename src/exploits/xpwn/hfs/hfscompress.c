@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 #include "common.h"
 #include <hfs/hfsplus.h>
@@ -36,9 +38,102 @@ void flipHFSPlusCmpfEnd(HFSPlusCmpfEnd* data) {
 	FLIPENDIANLE(data->unk4);
 }
 
+#define CMPF_BLOCK_SIZE 0x10000
+#define CMPF_READ_AHEAD 0x40000
+
+/*
+ * Per-file streaming state. Reads keep one inflate stream, one 64 KB block cache and a window of compressed bytes that
+ * is filled with one READ covering the wanted block and as many of the blocks physically following it as fit in
+ * CMPF_READ_AHEAD. Writes that start at 0 on an empty file and go forward are compressed one block at a time as they
+ * arrive, so only the compressed data is held until close; any other write falls back to caching the whole file.
+ */
+typedef struct HFSPlusCompressedStream {
+	HFSPlusCompressed compressed;
+
+	z_stream inflater;
+	int inflaterReady;
+	size_t cachedCapacity;
+	uint8_t* window;
+	size_t windowCapacity;
+	uint32_t windowStart;
+	uint32_t windowEnd;
+
+	z_stream deflater;
+	int deflaterReady;
+	int streaming;
+	uint8_t* pending;
+	size_t pendingSize;
+	uint8_t* spool;
+	size_t spoolSize;
+	size_t spoolCapacity;
+	HFSPlusCmpfRsrcBlock* spoolBlocks;
+	uint32_t numSpoolBlocks;
+	uint32_t spoolBlocksCapacity;
+} HFSPlusCompressedStream;
+
+static uint8_t* readCompressedBlock(HFSPlusCompressedStream* stream, uint32_t block) {
+	HFSPlusCompressed* data = &stream->compressed;
+	HFSPlusCmpfRsrcBlock* blocks = data->blocks->blocks;
+	uint32_t start;
+	uint32_t end;
+	uint32_t next;
+
+	start = blocks[block].offset;
+	end = start + blocks[block].size;
+
+	if(stream->window == NULL || start < stream->windowStart || end > stream->windowEnd) {
+		// read ahead into the blocks stored right after this one
+		for(next = block + 1; next < data->blocks->numBlocks; next++) {
+			if(blocks[next].offset != end || (end + blocks[next].size - start) > CMPF_READ_AHEAD)
+				break;
+			end += blocks[next].size;
+		}
+
+		if(stream->windowCapacity < (end - start)) {
+			stream->windowCapacity = end - start;
+			stream->window = (uint8_t*) realloc(stream->window, stream->windowCapacity);
+		}
+
+		if(!READ(data->io, data->rsrcHead.headerSize + sizeof(uint32_t) + start, end - start, stream->window)) {
+			hfs_panic("error reading");
+		}
+
+		stream->windowStart = start;
+		stream->windowEnd = end;
+	}
+
+	return stream->window + (start - stream->windowStart);
+}
+
+static size_t inflateBlock(HFSPlusCompressedStream* stream, uint32_t block, uint8_t* out, size_t outSize) {
+	HFSPlusCmpfRsrcBlock* blocks = stream->compressed.blocks->blocks;
+
+	if(!stream->inflaterReady) {
+		memset(&stream->inflater, 0, sizeof(stream->inflater));
+		if(inflateInit(&stream->inflater) != Z_OK) {
+			hfs_panic("error initializing inflate");
+		}
+		stream->inflaterReady = TRUE;
+	} else {
+		inflateReset(&stream->inflater);
+	}
+
+	stream->inflater.next_in = readCompressedBlock(stream, block);
+	stream->inflater.avail_in = blocks[block].size;
+	stream->inflater.next_out = out;
+	stream->inflater.avail_out = outSize;
+	inflate(&stream->inflater, Z_FINISH);
+
+	return outSize - stream->inflater.avail_out;
+}
+
 static int compressedRead(io_func* io, off_t location, size_t size, void *buffer) {
-	HFSPlusCompressed* data = (HFSPlusCompressed*) io->data;
+	HFSPlusCompressedStream* stream = (HFSPlusCompressedStream*) io->data;
+	HFSPlusCompressed* data = &stream->compressed;
 	size_t toRead;
+	size_t blockSize;
+	size_t actualSize;
+	uint32_t block;
 
 	while(size > 0) {
 		if(data->cached && location >= data->cachedStart && location < data->cachedEnd) {
@@ -57,30 +152,142 @@ static int compressedRead(io_func* io, off_t location, size_t size, void *buffer
 		if(size == 0)
 			break;
 
-		// Try to cache
-		uLongf actualSize;
-		uint32_t block = location / 0x10000;
-		uint8_t* compressed = (uint8_t*) malloc(data->blocks->blocks[block].size);
-		if(!READ(data->io, data->rsrcHead.headerSize + sizeof(uint32_t) + data->blocks->blocks[block].offset, data->blocks->blocks[block].size, compressed)) {
-			hfs_panic("error reading");
+		block = location / CMPF_BLOCK_SIZE;
+		if(data->blocks == NULL || block >= data->blocks->numBlocks)
+			return FALSE;
+
+		blockSize = data->decmpfs->size - ((off_t)block * CMPF_BLOCK_SIZE);
+		if(blockSize > CMPF_BLOCK_SIZE)
+			blockSize = CMPF_BLOCK_SIZE;
+
+		// whole blocks go straight into the caller's buffer
+		if((location % CMPF_BLOCK_SIZE) == 0 && size >= blockSize) {
+			actualSize = inflateBlock(stream, block, (uint8_t*) buffer, blockSize);
+			if(actualSize == blockSize) {
+				size -= actualSize;
+				location += actualSize;
+				buffer = ((uint8_t*) buffer) + actualSize;
+				continue;
+			}
 		}
 
-		if(data->cached)
+		if(data->cached == NULL || stream->cachedCapacity < CMPF_BLOCK_SIZE) {
 			free(data->cached);
+			data->cached = (uint8_t*) malloc(CMPF_BLOCK_SIZE);
+			stream->cachedCapacity = CMPF_BLOCK_SIZE;
+		}
 
-		data->cached = (uint8_t*) malloc(0x10000);
-		actualSize = 0x10000;
-		uncompress(data->cached, &actualSize, compressed, data->blocks->blocks[block].size);
-		data->cachedStart = block * 0x10000;
+		actualSize = inflateBlock(stream, block, data->cached, CMPF_BLOCK_SIZE);
+		data->cachedStart = block * CMPF_BLOCK_SIZE;
 		data->cachedEnd = data->cachedStart + actualSize;
-		free(compressed);
+
+		if(location >= data->cachedEnd)
+			return FALSE;
 	}
 
 	return TRUE;
 }
 
+static void spoolBlock(HFSPlusCompressedStream* stream, const uint8_t* block, size_t size) {
+	uLong bound;
+
+	if(!stream->deflaterReady) {
+		memset(&stream->deflater, 0, sizeof(stream->deflater));
+		if(deflateInit(&stream->deflater, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			hfs_panic("error initializing deflate");
+		}
+		stream->deflaterReady = TRUE;
+	} else {
+		deflateReset(&stream->deflater);
+	}
+
+	bound = deflateBound(&stream->deflater, size);
+	if((stream->spoolSize + bound) > stream->spoolCapacity) {
+		stream->spoolCapacity = (stream->spoolCapacity * 2) > (stream->spoolSize + bound) ? (stream->spoolCapacity * 2) : (stream->spoolSize + bound);
+		stream->spool = (uint8_t*) realloc(stream->spool, stream->spoolCapacity);
+	}
+
+	if(stream->numSpoolBlocks == stream->spoolBlocksCapacity) {
+		stream->spoolBlocksCapacity = stream->spoolBlocksCapacity ? (stream->spoolBlocksCapacity * 2) : 16;
+		stream->spoolBlocks = (HFSPlusCmpfRsrcBlock*) realloc(stream->spoolBlocks, sizeof(HFSPlusCmpfRsrcBlock) * stream->spoolBlocksCapacity);
+	}
+
+	stream->deflater.next_in = (Bytef*) block;
+	stream->deflater.avail_in = size;
+	stream->deflater.next_out = stream->spool + stream->spoolSize;
+	stream->deflater.avail_out = bound;
+	if(deflate(&stream->deflater, Z_FINISH) != Z_STREAM_END) {
+		hfs_panic("error compressing");
+	}
+
+	stream->spoolBlocks[stream->numSpoolBlocks].offset = stream->spoolSize;
+	stream->spoolBlocks[stream->numSpoolBlocks].size = bound - stream->deflater.avail_out;
+	stream->spoolSize += stream->spoolBlocks[stream->numSpoolBlocks].size;
+	stream->numSpoolBlocks++;
+}
+
+static void stopStreaming(HFSPlusCompressedStream* stream) {
+	HFSPlusCompressed* data = &stream->compressed;
+	uint8_t* newCache;
+	uint32_t i;
+
+	// give up on streaming: rebuild the whole file in memory from what has been compressed so far
+	newCache = (uint8_t*) malloc(data->decmpfs->size ? data->decmpfs->size : 1);
+	for(i = 0; i < stream->numSpoolBlocks; i++) {
+		uLongf actualSize = CMPF_BLOCK_SIZE;
+		uncompress(newCache + ((size_t)i * CMPF_BLOCK_SIZE), &actualSize, stream->spool + stream->spoolBlocks[i].offset, stream->spoolBlocks[i].size);
+	}
+	memcpy(newCache + ((size_t)stream->numSpoolBlocks * CMPF_BLOCK_SIZE), stream->pending, stream->pendingSize);
+
+	free(data->cached);
+	data->cached = newCache;
+	data->cachedStart = 0;
+	data->cachedEnd = data->decmpfs->size;
+	stream->cachedCapacity = data->decmpfs->size;
+
+	stream->spoolSize = 0;
+	stream->numSpoolBlocks = 0;
+	stream->pendingSize = 0;
+	stream->streaming = FALSE;
+}
+
 static int compressedWrite(io_func* io, off_t location, size_t size, void *buffer) {
-	HFSPlusCompressed* data = (HFSPlusCompressed*) io->data;
+	HFSPlusCompressedStream* stream = (HFSPlusCompressedStream*) io->data;
+	HFSPlusCompressed* data = &stream->compressed;
+	size_t toWrite;
+
+	if(!data->dirty && data->decmpfs->size == 0 && location == 0) {
+		stream->streaming = TRUE;
+		if(stream->pending == NULL)
+			stream->pending = (uint8_t*) malloc(CMPF_BLOCK_SIZE);
+		stream->pendingSize = 0;
+	}
+
+	if(stream->streaming) {
+		if(location == data->decmpfs->size) {
+			while(size > 0) {
+				toWrite = CMPF_BLOCK_SIZE - stream->pendingSize;
+				if(toWrite > size)
+					toWrite = size;
+
+				memcpy(stream->pending + stream->pendingSize, buffer, toWrite);
+				stream->pendingSize += toWrite;
+				data->decmpfs->size += toWrite;
+				size -= toWrite;
+				buffer = ((uint8_t*) buffer) + toWrite;
+
+				if(stream->pendingSize == CMPF_BLOCK_SIZE) {
+					spoolBlock(stream, stream->pending, stream->pendingSize);
+					stream->pendingSize = 0;
+				}
+			}
+
+			data->dirty = TRUE;
+			return TRUE;
+		}
+
+		stopStreaming(stream);
+	}
 
 	if(data->cachedStart != 0 || data->cachedEnd != data->decmpfs->size) {
 		// Cache entire file
@@ -92,12 +299,14 @@ static int compressedWrite(io_func* io, off_t location, size_t size, void *buffe
 		data->cached = newCache;
 		data->cachedStart = 0;
 		data->cachedEnd = data->decmpfs->size;
+		stream->cachedCapacity = data->decmpfs->size;
 	}
 
 	if((location + size) > data->decmpfs->size) {
 		data->decmpfs->size = location + size;
 		data->cached = (uint8_t*) realloc(data->cached, data->decmpfs->size);
 		data->cachedEnd = data->decmpfs->size;
+		stream->cachedCapacity = data->decmpfs->size;
 	}
 
 	memcpy(data->cached + location, buffer, size);
@@ -107,20 +316,37 @@ static int compressedWrite(io_func* io, off_t location, size_t size, void *buffe
 }
 
 static void closeHFSPlusCompressed(io_func* io) {
-	HFSPlusCompressed* data = (HFSPlusCompressed*) io->data;
+	HFSPlusCompressedStream* stream = (HFSPlusCompressedStream*) io->data;
+	HFSPlusCompressed* data = &stream->compressed;
 
 	if(data->io)
 		CLOSE(data->io);
+	data->io = NULL;
 
 	if(data->dirty) {
 		if(data->blocks)
 			free(data->blocks);
 
+		if(stream->streaming) {
+			if(stream->pendingSize > 0) {
+				spoolBlock(stream, stream->pending, stream->pendingSize);
+				stream->pendingSize = 0;
+			}
+		} else {
+			uint32_t i;
+			stream->spoolSize = 0;
+			stream->numSpoolBlocks = 0;
+			for(i = 0; ((off_t)i * CMPF_BLOCK_SIZE) < data->decmpfs->size; i++) {
+				spoolBlock(stream, data->cached + ((size_t)i * CMPF_BLOCK_SIZE),
+					(data->decmpfs->size - ((off_t)i * CMPF_BLOCK_SIZE)) > CMPF_BLOCK_SIZE ? CMPF_BLOCK_SIZE : (data->decmpfs->size - ((off_t)i * CMPF_BLOCK_SIZE)));
+			}
+		}
+
 		data->decmpfs->magic = CMPFS_MAGIC; 
 		data->decmpfs->flags = 0x4;
 		data->decmpfsSize = sizeof(HFSPlusDecmpfs);
 
-		uint32_t numBlocks = (data->decmpfs->size + 0xFFFF) / 0x10000;
+		uint32_t numBlocks = stream->numSpoolBlocks;
 		uint32_t blocksSize = sizeof(HFSPlusCmpfRsrcBlockHead) + (numBlocks * sizeof(HFSPlusCmpfRsrcBlock));
 		data->blocks = (HFSPlusCmpfRsrcBlockHead*) malloc(sizeof(HFSPlusCmpfRsrcBlockHead) + (numBlocks * sizeof(HFSPlusCmpfRsrcBlock)));
 		data->blocks->numBlocks = numBlocks;
@@ -131,44 +357,36 @@ static void closeHFSPlusCompressed(io_func* io) {
 		data->rsrcHead.totalSize = data->rsrcHead.headerSize + data->rsrcHead.dataSize;
 		data->rsrcHead.flags = 0x32;
 
-		uint8_t* buffer = (uint8_t*) malloc((0x10000 * 1.1) + 12);
-		uint32_t curFileOffset = data->blocks->dataSize;
-		uint32_t i;
-		for(i = 0; i < numBlocks; i++) {
-			data->blocks->blocks[i].offset = curFileOffset;
-			uLongf actualSize = (0x10000 * 1.1) + 12;
-			compress(buffer, &actualSize, data->cached + (0x10000 * i),
-					(data->decmpfs->size - (0x10000 * i)) > 0x10000 ? 0x10000 : (data->decmpfs->size - (0x10000 * i))); 
-			data->blocks->blocks[i].size = actualSize;
-
-			// check if we can fit the whole thing into an inline extended attribute
-			// a little fudge factor here since sizeof(HFSPlusAttrKey) is bigger than it ought to be, since only 127 characters are strictly allowed
-			if(numBlocks <= 1 && (actualSize + sizeof(HFSPlusDecmpfs) + sizeof(HFSPlusAttrKey)) <= 0x1000) {
-				data->decmpfs->flags = 0x3;
-				memcpy(data->decmpfs->data, buffer, actualSize);
-				data->decmpfsSize = sizeof(HFSPlusDecmpfs) + actualSize;
-				printf("inline data\n");
-				break;
-			} else {
-				if(i == 0) {
-					data->io = openRawFile(data->file->fileID, &data->file->resourceFork, (HFSPlusCatalogRecord*)data->file, data->volume);
-					if(!data->io) {
-						hfs_panic("error opening resource fork");
-					}
-				}
-
-				WRITE(data->io, data->rsrcHead.headerSize + sizeof(uint32_t) + data->blocks->blocks[i].offset, data->blocks->blocks[i].size, buffer);
+		// check if we can fit the whole thing into an inline extended attribute
+		// a little fudge factor here since sizeof(HFSPlusAttrKey) is bigger than it ought to be, since only 127 characters are strictly allowed
+		if(numBlocks == 1 && (stream->spoolBlocks[0].size + sizeof(HFSPlusDecmpfs) + sizeof(HFSPlusAttrKey)) <= 0x1000) {
+			data->decmpfs->flags = 0x3;
+			memcpy(data->decmpfs->data, stream->spool, stream->spoolBlocks[0].size);
+			data->decmpfsSize = sizeof(HFSPlusDecmpfs) + stream->spoolBlocks[0].size;
+			printf("inline data\n");
+		} else {
+			uint32_t curFileOffset = data->blocks->dataSize;
+			uint32_t i;
+			for(i = 0; i < numBlocks; i++) {
+				data->blocks->blocks[i].offset = curFileOffset;
+				data->blocks->blocks[i].size = stream->spoolBlocks[i].size;
 
 				curFileOffset += data->blocks->blocks[i].size;
 				data->blocks->dataSize += data->blocks->blocks[i].size;
 				data->rsrcHead.dataSize += data->blocks->blocks[i].size;
 				data->rsrcHead.totalSize += data->blocks->blocks[i].size;
 			}
-		}
 
-		free(buffer);
-		
-		if(data->decmpfs->flags == 0x4) {
+			data->io = openRawFile(data->file->fileID, &data->file->resourceFork, (HFSPlusCatalogRecord*)data->file, data->volume);
+			if(!data->io) {
+				hfs_panic("error opening resource fork");
+			}
+
+			// the compressed blocks are laid out back to back, so they all go out in one write
+			if(stream->spoolSize > 0) {
+				WRITE(data->io, data->rsrcHead.headerSize + sizeof(uint32_t) + data->blocks->blocks[0].offset, stream->spoolSize, stream->spool);
+			}
+
 			flipRsrcHead(&data->rsrcHead);
 			WRITE(data->io, 0, sizeof(HFSPlusCmpfRsrcHead), &data->rsrcHead);
 			flipRsrcHead(&data->rsrcHead);
@@ -205,24 +423,37 @@ static void closeHFSPlusCompressed(io_func* io) {
 		flipHFSPlusDecmpfs(data->decmpfs);
 	}
 
+	if(stream->inflaterReady)
+		inflateEnd(&stream->inflater);
+
+	if(stream->deflaterReady)
+		deflateEnd(&stream->deflater);
+
 	if(data->cached)
 		free(data->cached);
 
 	if(data->blocks)
 		free(data->blocks);
 
+	free(stream->window);
+	free(stream->pending);
+	free(stream->spool);
+	free(stream->spoolBlocks);
 	free(data->decmpfs);
-	free(data);
+	free(stream);
 	free(io);
 }
 
 io_func* openHFSPlusCompressed(Volume* volume, HFSPlusCatalogFile* file) {
 	io_func* io;
+	HFSPlusCompressedStream* stream;
 	HFSPlusCompressed* data;
 	uLongf actualSize;
 
 	io = (io_func*) malloc(sizeof(io_func));
-	data = (HFSPlusCompressed*) malloc(sizeof(HFSPlusCompressed));
+	stream = (HFSPlusCompressedStream*) malloc(sizeof(HFSPlusCompressedStream));
+	memset(stream, 0, sizeof(HFSPlusCompressedStream));
+	data = &stream->compressed;
 
 	data->volume = volume;
 	data->file = file;
@@ -257,6 +488,7 @@ io_func* openHFSPlusCompressed(Volume* volume, HFSPlusCatalogFile* file) {
 		}
 		data->cachedStart = 0;
 		data->cachedEnd = actualSize;
+		stream->cachedCapacity = data->decmpfs->size;
 	} else {
 		data->io = openRawFile(file->fileID, &file->resourceFork, (HFSPlusCatalogRecord*)file, volume);
 		if(!data->io) {
@@ -9,44 +9,49 @@
 #include "abstractfile.h"
 #include <sys/stat.h>
 #include <inttypes.h>
+#include <hfs/hfsparallel.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define BUFSIZE 1024*1024
 
 static int silence = 0;
+static int threads = 1;
 
 void hfs_setsilence(int s) {
 	silence = s;
 }
 
-void writeToFile(HFSPlusCatalogFile* file, AbstractFile* output, Volume* volume) {
-	unsigned char* buffer;
+void hfs_setthreads(int t) {
+	threads = (t < 1) ? 1 : t;
+}
+
+int hfs_getthreads() {
+	return threads;
+}
+
+static io_func* openFileForReading(HFSPlusCatalogFile* file, Volume* volume, size_t* size) {
 	io_func* io;
-	off_t curPosition;
-	size_t bytesLeft;
-	
-	buffer = (unsigned char*) malloc(BUFSIZE);
 
 	if(file->permissions.ownerFlags & UF_COMPRESSED) {
 		io = openHFSPlusCompressed(volume, file);
-		if(io == NULL) {
-			hfs_panic("error opening file");
-			free(buffer);
-			return;
-		}
-
-		curPosition = 0;
-		bytesLeft = ((HFSPlusCompressed*) io->data)->decmpfs->size;
+		if(io != NULL)
+			*size = ((HFSPlusCompressed*) io->data)->decmpfs->size;
 	} else {
 		io = openRawFile(file->fileID, &file->dataFork, (HFSPlusCatalogRecord*)file, volume);
-		if(io == NULL) {
-			hfs_panic("error opening file");
-			free(buffer);
-			return;
-		}
+		if(io != NULL)
+			*size = file->dataFork.logicalSize;
+	}
 
-		curPosition = 0;
-		bytesLeft = file->dataFork.logicalSize;
-	}	
+	return io;
+}
+
+static void copyToFile(io_func* io, size_t bytesLeft, AbstractFile* output, unsigned char* buffer) {
+	off_t curPosition;
+
+	curPosition = 0;
 	while(bytesLeft > 0) {
 		if(bytesLeft > BUFSIZE) {
 			if(!READ(io, curPosition, BUFSIZE, buffer)) {
@@ -68,6 +73,23 @@ void writeToFile(HFSPlusCatalogFile* file, AbstractFile* output, Volume* volume)
 			bytesLeft -= bytesLeft;
 		}
 	}
+}
+
+void writeToFile(HFSPlusCatalogFile* file, AbstractFile* output, Volume* volume) {
+	unsigned char* buffer;
+	io_func* io;
+	size_t bytesLeft;
+	
+	buffer = (unsigned char*) malloc(BUFSIZE);
+
+	io = openFileForReading(file, volume, &bytesLeft);
+	if(io == NULL) {
+		hfs_panic("error opening file");
+		free(buffer);
+		return;
+	}
+
+	copyToFile(io, bytesLeft, output, buffer);
 	CLOSE(io);
 
 	free(buffer);
@@ -287,12 +309,528 @@ void removeAllInFolder(HFSCatalogNodeID folderID, Volume* volume, const char* pa
 }
 
 
+static void setDefaultPermissions(const char* fullName, const char* name, Volume* volume) {
+	char testBuffer[1024];
+
+	if(strncmp(fullName, "/Applications/", sizeof("/Applications/") - 1) == 0) {
+		testBuffer[0] = '\0';
+		strcpy(testBuffer, "/Applications/");
+		strcat(testBuffer, name);
+		strcat(testBuffer, ".app/");
+		strcat(testBuffer, name);
+		if(strcmp(testBuffer, fullName) == 0) {
+			if(strcmp(name, "Installer") == 0
+			|| strcmp(name, "BootNeuter") == 0
+			) {
+				printf("Giving setuid permissions to %s...\n", fullName); fflush(stdout);
+				chmodFile(fullName, 04755, volume);
+			} else {
+				printf("Giving permissions to %s\n", fullName); fflush(stdout);
+				chmodFile(fullName, 0755, volume);
+			}
+		}
+	} else if(strncmp(fullName, "/bin/", sizeof("/bin/") - 1) == 0
+		|| strncmp(fullName, "/Applications/BootNeuter.app/bin/", sizeof("/Applications/BootNeuter.app/bin/") - 1) == 0
+		|| strncmp(fullName, "/sbin/", sizeof("/sbin/") - 1) == 0
+		|| strncmp(fullName, "/usr/sbin/", sizeof("/usr/sbin/") - 1) == 0
+		|| strncmp(fullName, "/usr/bin/", sizeof("/usr/bin/") - 1) == 0
+		|| strncmp(fullName, "/usr/libexec/", sizeof("/usr/libexec/") - 1) == 0
+		|| strncmp(fullName, "/usr/local/bin/", sizeof("/usr/local/bin/") - 1) == 0
+		|| strncmp(fullName, "/usr/local/sbin/", sizeof("/usr/local/sbin/") - 1) == 0
+		|| strncmp(fullName, "/usr/local/libexec/", sizeof("/usr/local/libexec/") - 1) == 0
+		) {
+		chmodFile(fullName, 0755, volume);
+		printf("Giving permissions to %s\n", fullName); fflush(stdout);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+
+#define ADDALL_PREFETCH_BYTES (64 * 1024 * 1024)
+#define ADDALL_PREFETCH_MAX_FILE (8 * 1024 * 1024)
+
+/*
+ * With more than one thread, extractall and addall keep every catalog and B-tree operation on the calling thread and
+ * hand the file contents to worker threads. Extraction workers still read fork data through volume->image, so for the
+ * duration the image is wrapped in an io_func that serializes its READs and WRITEs. Addall workers only read small
+ * host files ahead of the writer; larger ones, and any the workers fail to read, are streamed from disk by the writer.
+ */
+static pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int lockedImageRead(io_func* io, off_t location, size_t size, void *buffer) {
+	int ret;
+
+	pthread_mutex_lock(&imageLock);
+	ret = READ((io_func*) io->data, location, size, buffer);
+	pthread_mutex_unlock(&imageLock);
+
+	return ret;
+}
+
+static int lockedImageWrite(io_func* io, off_t location, size_t size, void *buffer) {
+	int ret;
+
+	pthread_mutex_lock(&imageLock);
+	ret = WRITE((io_func*) io->data, location, size, buffer);
+	pthread_mutex_unlock(&imageLock);
+
+	return ret;
+}
+
+static io_func* lockImage(Volume* volume) {
+	io_func* image;
+	io_func* locked;
+
+	image = volume->image;
+	locked = (io_func*) malloc(sizeof(io_func));
+	locked->data = image;
+	locked->read = &lockedImageRead;
+	locked->write = &lockedImageWrite;
+	locked->close = NULL;
+	volume->image = locked;
+
+	return image;
+}
+
+static void unlockImage(Volume* volume, io_func* image) {
+	free(volume->image);
+	volume->image = image;
+}
+
+typedef struct ExtractJob {
+	HFSPlusCatalogFile* file;
+	io_func* io;
+	size_t size;
+	char* path;
+} ExtractJob;
+
+typedef struct ExtractQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	ExtractJob* jobs;
+	int capacity;
+	int head;
+	int count;
+	int done;
+} ExtractQueue;
+
+static void* extractWorker(void* arg) {
+	ExtractQueue* queue = (ExtractQueue*) arg;
+	ExtractJob job;
+	AbstractFile* outFile;
+	unsigned char* buffer;
+
+	buffer = (unsigned char*) malloc(BUFSIZE);
+
+	while(TRUE) {
+		pthread_mutex_lock(&queue->lock);
+		while(queue->count == 0 && !queue->done)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+
+		if(queue->count == 0) {
+			pthread_mutex_unlock(&queue->lock);
+			break;
+		}
+
+		job = queue->jobs[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+
+		outFile = createAbstractFileFromFile(fopen(job.path, "wb"));
+		if(outFile != NULL) {
+			copyToFile(job.io, job.size, outFile, buffer);
+			outFile->close(outFile);
+		} else {
+			printf("WARNING: cannot fopen %s\n", job.path);
+		}
+
+		CLOSE(job.io);
+		free(job.file);
+		free(job.path);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static void queueExtraction(ExtractQueue* queue, ExtractJob* job) {
+	pthread_mutex_lock(&queue->lock);
+	while(queue->count == queue->capacity)
+		pthread_cond_wait(&queue->cond, &queue->lock);
+
+	queue->jobs[(queue->head + queue->count) % queue->capacity] = *job;
+	queue->count++;
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void queueFolderExtraction(HFSCatalogNodeID folderID, Volume* volume, const char* parentPath, ExtractQueue* queue) {
+	CatalogRecordList* list;
+	CatalogRecordList* theList;
+	char path[1024];
+	char* name;
+	HFSPlusCatalogFolder* folder;
+	ExtractJob job;
+	struct stat status;
+	
+	theList = list = getFolderContents(folderID, volume);
+	
+	while(list != NULL) {
+		name = unicodeToAscii(&list->name);
+		if(strncmp(name, ".HFS+ Private Directory Data", sizeof(".HFS+ Private Directory Data") - 1) == 0 || name[0] == '\0') {
+			free(name);
+			list = list->next;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", parentPath, name);
+		
+		if(list->record->recordType == kHFSPlusFolderRecord) {
+			folder = (HFSPlusCatalogFolder*)list->record;
+			printf("folder: %s\n", name);
+			if(stat(path, &status) != 0) {
+				ASSERT(mkdir(path, 0755) == 0, "mkdir");
+			}
+			queueFolderExtraction(folder->folderID, volume, path, queue);
+		} else if(list->record->recordType == kHFSPlusFileRecord) {
+			printf("file: %s\n", name);
+			job.file = (HFSPlusCatalogFile*) malloc(sizeof(HFSPlusCatalogFile));
+			memcpy(job.file, list->record, sizeof(HFSPlusCatalogFile));
+			job.io = openFileForReading(job.file, volume, &job.size);
+			if(job.io == NULL) {
+				hfs_panic("error opening file");
+			}
+			job.path = strdup(path);
+			queueExtraction(queue, &job);
+		}
+		
+		free(name);
+		list = list->next;
+	}
+	releaseCatalogRecordList(theList);
+}
+
+static void extractAllInFolderParallel(HFSCatalogNodeID folderID, Volume* volume) {
+	ExtractQueue queue;
+	pthread_t* workers;
+	io_func* image;
+	int i;
+
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.cond, NULL);
+	queue.capacity = threads * 4;
+	queue.jobs = (ExtractJob*) malloc(sizeof(ExtractJob) * queue.capacity);
+	queue.head = 0;
+	queue.count = 0;
+	queue.done = FALSE;
+
+	image = lockImage(volume);
+
+	workers = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+	for(i = 0; i < threads; i++) {
+		ASSERT(pthread_create(&workers[i], NULL, extractWorker, &queue) == 0, "pthread_create");
+	}
+
+	queueFolderExtraction(folderID, volume, ".", &queue);
+
+	pthread_mutex_lock(&queue.lock);
+	queue.done = TRUE;
+	pthread_cond_broadcast(&queue.cond);
+	pthread_mutex_unlock(&queue.lock);
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	unlockImage(volume, image);
+
+	free(workers);
+	free(queue.jobs);
+	pthread_cond_destroy(&queue.cond);
+	pthread_mutex_destroy(&queue.lock);
+}
+
+typedef struct AddEntry {
+	char* hostPath;
+	char* fullName;
+	char* name;
+	int isFolder;
+	int parent;
+	int lastChild;
+	off_t size;
+
+	int stream;
+	int loaded;
+	void* data;
+	size_t length;
+
+	HFSCatalogNodeID cnid;
+	CatalogRecordList* contents;
+} AddEntry;
+
+typedef struct AddList {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	AddEntry* entries;
+	int numEntries;
+	int nextToLoad;
+	off_t bytesLoaded;
+} AddList;
+
+static void scanHostFolder(AddList* addList, const char* hostDir, const char* parentName, int parent) {
+	DIR* dir;
+	DIR* tmp;
+	struct dirent* ent;
+	struct stat status;
+	AddEntry* entry;
+	char hostPath[1024];
+	char fullName[1024];
+	int index;
+
+	ASSERT((dir = opendir(hostDir)) != NULL, "opendir");
+
+	while((ent = readdir(dir)) != NULL) {
+		if(ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+			continue;
+		}
+
+		snprintf(hostPath, sizeof(hostPath), "%s/%s", hostDir, ent->d_name);
+		snprintf(fullName, sizeof(fullName), "%s%s", parentName, ent->d_name);
+
+		index = addList->numEntries++;
+		addList->entries = (AddEntry*) realloc(addList->entries, sizeof(AddEntry) * addList->numEntries);
+		entry = &addList->entries[index];
+		memset(entry, 0, sizeof(AddEntry));
+		entry->hostPath = strdup(hostPath);
+		entry->fullName = strdup(fullName);
+		entry->name = strdup(ent->d_name);
+		entry->parent = parent;
+		entry->lastChild = -1;
+
+		if(parent >= 0)
+			addList->entries[parent].lastChild = index;
+
+		if((tmp = opendir(hostPath)) != NULL) {
+			closedir(tmp);
+			entry->isFolder = TRUE;
+			entry->loaded = TRUE;
+
+			strcat(fullName, "/");
+			scanHostFolder(addList, hostPath, fullName, index);
+		} else if(stat(hostPath, &status) == 0) {
+			entry->size = status.st_size;
+			if(entry->size > ADDALL_PREFETCH_MAX_FILE) {
+				entry->stream = TRUE;
+				entry->loaded = TRUE;
+			}
+		}
+	}
+
+	closedir(dir);
+}
+
+static void* addWorker(void* arg) {
+	AddList* addList = (AddList*) arg;
+	AddEntry* entry;
+	FILE* file;
+	void* data;
+	void* newData;
+	size_t length;
+	size_t capacity;
+	size_t didRead;
+	int index;
+	int c;
+
+	while(TRUE) {
+		pthread_mutex_lock(&addList->lock);
+		while(TRUE) {
+			while(addList->nextToLoad < addList->numEntries
+				&& (addList->entries[addList->nextToLoad].isFolder || addList->entries[addList->nextToLoad].stream))
+				addList->nextToLoad++;
+
+			if(addList->nextToLoad >= addList->numEntries)
+				break;
+
+			// stay a bounded amount ahead of the writer, but always allow the file it is waiting for
+			if(addList->bytesLoaded == 0 || (addList->bytesLoaded + addList->entries[addList->nextToLoad].size) <= ADDALL_PREFETCH_BYTES)
+				break;
+
+			pthread_cond_wait(&addList->cond, &addList->lock);
+		}
+
+		if(addList->nextToLoad >= addList->numEntries) {
+			pthread_mutex_unlock(&addList->lock);
+			break;
+		}
+
+		index = addList->nextToLoad++;
+		entry = &addList->entries[index];
+		addList->bytesLoaded += entry->size;
+		pthread_mutex_unlock(&addList->lock);
+
+		data = NULL;
+		length = 0;
+		file = fopen(entry->hostPath, "rb");
+		if(file != NULL) {
+			// the size from the scan is exact unless the file changed since, so only grow if there is more
+			capacity = (entry->size > 0) ? (size_t) entry->size : 1;
+			data = malloc(capacity);
+			while(data != NULL) {
+				didRead = fread((uint8_t*) data + length, 1, capacity - length, file);
+				length += didRead;
+				if(length < capacity)
+					break;
+
+				if((c = fgetc(file)) == EOF)
+					break;
+
+				// it grew since the scan, leave it to the writer if it is no longer small
+				newData = (capacity * 2 <= ADDALL_PREFETCH_MAX_FILE) ? realloc(data, capacity * 2) : NULL;
+				if(newData == NULL) {
+					free(data);
+					data = NULL;
+					break;
+				}
+				data = newData;
+				capacity *= 2;
+				((uint8_t*) data)[length++] = (uint8_t) c;
+			}
+			if(data == NULL)
+				length = 0;
+			fclose(file);
+		}
+
+		pthread_mutex_lock(&addList->lock);
+		entry->data = data;
+		entry->length = length;
+		entry->loaded = TRUE;
+		pthread_cond_broadcast(&addList->cond);
+		pthread_mutex_unlock(&addList->lock);
+	}
+
+	return NULL;
+}
+
+static void addAllInFolderParallel(HFSCatalogNodeID folderID, Volume* volume, const char* parentName) {
+	AddList addList;
+	AddEntry* entry;
+	CatalogRecordList* theList;
+	CatalogRecordList* list;
+	pthread_t* workers;
+	AbstractFile* file;
+	HFSPlusCatalogFile* outFile;
+	char* name;
+	int i;
+
+	pthread_mutex_init(&addList.lock, NULL);
+	pthread_cond_init(&addList.cond, NULL);
+	addList.entries = NULL;
+	addList.numEntries = 0;
+	addList.nextToLoad = 0;
+	addList.bytesLoaded = 0;
+
+	scanHostFolder(&addList, ".", parentName, -1);
+
+	theList = getFolderContents(folderID, volume);
+
+	workers = (pthread_t*) malloc(sizeof(pthread_t) * threads);
+	for(i = 0; i < threads; i++) {
+		ASSERT(pthread_create(&workers[i], NULL, addWorker, &addList) == 0, "pthread_create");
+	}
+
+	for(i = 0; i < addList.numEntries; i++) {
+		entry = &addList.entries[i];
+
+		entry->cnid = 0;
+		list = (entry->parent >= 0) ? addList.entries[entry->parent].contents : theList;
+		while(list != NULL) {
+			name = unicodeToAscii(&list->name);
+			if(strcmp(name, entry->name) == 0) {
+				entry->cnid = (list->record->recordType == kHFSPlusFolderRecord) ? (((HFSPlusCatalogFolder*)list->record)->folderID)
+				: (((HFSPlusCatalogFile*)list->record)->fileID);
+				free(name);
+				break;
+			}
+			free(name);
+			list = list->next;
+		}
+
+		if(entry->isFolder) {
+			printf("folder: %s\n", entry->fullName); fflush(stdout);
+			
+			if(entry->cnid == 0) {
+				entry->cnid = newFolder(entry->fullName, volume);
+			}
+
+			if(entry->lastChild >= 0)
+				entry->contents = getFolderContents(entry->cnid, volume);
+		} else {
+			printf("file: %s\n", entry->fullName);	fflush(stdout);
+			if(entry->cnid == 0) {
+				entry->cnid = newFile(entry->fullName, volume);
+			}
+
+			pthread_mutex_lock(&addList.lock);
+			while(!entry->loaded)
+				pthread_cond_wait(&addList.cond, &addList.lock);
+			pthread_mutex_unlock(&addList.lock);
+
+			if(entry->data != NULL) {
+				file = createAbstractFileFromMemory(&entry->data, entry->length);
+			} else {
+				file = createAbstractFileFromFile(fopen(entry->hostPath, "rb"));
+				ASSERT(file != NULL, "fopen");
+			}
+			outFile = (HFSPlusCatalogFile*)getRecordByCNID(entry->cnid, volume);
+			writeToHFSFile(outFile, file, volume);
+			file->close(file);
+			free(outFile);
+
+			if(!entry->stream) {
+				pthread_mutex_lock(&addList.lock);
+				free(entry->data);
+				entry->data = NULL;
+				addList.bytesLoaded -= entry->size;
+				pthread_cond_broadcast(&addList.cond);
+				pthread_mutex_unlock(&addList.lock);
+			}
+			
+			setDefaultPermissions(entry->fullName, entry->name, volume);
+		}
+
+		if(entry->parent >= 0 && addList.entries[entry->parent].lastChild == i) {
+			releaseCatalogRecordList(addList.entries[entry->parent].contents);
+			addList.entries[entry->parent].contents = NULL;
+		}
+	}
+
+	for(i = 0; i < threads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	releaseCatalogRecordList(theList);
+
+	for(i = 0; i < addList.numEntries; i++) {
+		free(addList.entries[i].hostPath);
+		free(addList.entries[i].fullName);
+		free(addList.entries[i].name);
+	}
+
+	free(addList.entries);
+	free(workers);
+	pthread_cond_destroy(&addList.cond);
+	pthread_mutex_destroy(&addList.lock);
+}
+
+#endif
+
 void addAllInFolder(HFSCatalogNodeID folderID, Volume* volume, const char* parentName) {
 	CatalogRecordList* list;
 	CatalogRecordList* theList;
 	char cwd[1024];
 	char fullName[1024];
-	char testBuffer[1024];
 	char* pathComponent;
 	int pathLen;
 	
@@ -307,6 +845,13 @@ void addAllInFolder(HFSCatalogNodeID folderID, Volume* volume, const char* paren
 	
 	AbstractFile* file;
 	HFSPlusCatalogFile* outFile;
+
+#ifdef HAVE_PTHREAD
+	if(threads > 1) {
+		addAllInFolderParallel(folderID, volume, parentName);
+		return;
+	}
+#endif
 	
 	strcpy(fullName, parentName);
 	pathComponent = fullName + strlen(fullName);
@@ -364,36 +909,7 @@ void addAllInFolder(HFSCatalogNodeID folderID, Volume* volume, const char* paren
 			file->close(file);
 			free(outFile);
 			
-			if(strncmp(fullName, "/Applications/", sizeof("/Applications/") - 1) == 0) {
-				testBuffer[0] = '\0';
-				strcpy(testBuffer, "/Applications/");
-				strcat(testBuffer, ent->d_name);
-				strcat(testBuffer, ".app/");
-				strcat(testBuffer, ent->d_name);
-				if(strcmp(testBuffer, fullName) == 0) {
-					if(strcmp(ent->d_name, "Installer") == 0
-					|| strcmp(ent->d_name, "BootNeuter") == 0
-					) {
-						printf("Giving setuid permissions to %s...\n", fullName); fflush(stdout);
-						chmodFile(fullName, 04755, volume);
-					} else {
-						printf("Giving permissions to %s\n", fullName); fflush(stdout);
-						chmodFile(fullName, 0755, volume);
-					}
-				}
-			} else if(strncmp(fullName, "/bin/", sizeof("/bin/") - 1) == 0
-				|| strncmp(fullName, "/Applications/BootNeuter.app/bin/", sizeof("/Applications/BootNeuter.app/bin/") - 1) == 0
-				|| strncmp(fullName, "/sbin/", sizeof("/sbin/") - 1) == 0
-				|| strncmp(fullName, "/usr/sbin/", sizeof("/usr/sbin/") - 1) == 0
-				|| strncmp(fullName, "/usr/bin/", sizeof("/usr/bin/") - 1) == 0
-				|| strncmp(fullName, "/usr/libexec/", sizeof("/usr/libexec/") - 1) == 0
-				|| strncmp(fullName, "/usr/local/bin/", sizeof("/usr/local/bin/") - 1) == 0
-				|| strncmp(fullName, "/usr/local/sbin/", sizeof("/usr/local/sbin/") - 1) == 0
-				|| strncmp(fullName, "/usr/local/libexec/", sizeof("/usr/local/libexec/") - 1) == 0
-				) {
-				chmodFile(fullName, 0755, volume);
-				printf("Giving permissions to %s\n", fullName); fflush(stdout);
-			}
+			setDefaultPermissions(fullName, ent->d_name, volume);
 		}
 	}
 	
@@ -411,6 +927,13 @@ void extractAllInFolder(HFSCatalogNodeID folderID, Volume* volume) {
 	HFSPlusCatalogFile* file;
 	AbstractFile* outFile;
 	struct stat status;
+
+#ifdef HAVE_PTHREAD
+	if(threads > 1) {
+		extractAllInFolderParallel(folderID, volume);
+		return;
+	}
+#endif
 	
 	ASSERT(getcwd(cwd, 1024) != NULL, "cannot get current working directory");
 	
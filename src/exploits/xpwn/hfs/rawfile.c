@@ -4,34 +4,267 @@
 
 int writeExtents(RawFile* rawFile);
 
-int isBlockUsed(Volume* volume, uint32_t block)
-{
-	unsigned char byte;
+static int rawFileRead(io_func* io,off_t location, size_t size, void *buffer);
+static int rawFileWrite(io_func* io,off_t location, size_t size, void *buffer);
+
+#define ZERO_BUFFER_SIZE (1024 * 1024)
+
+/*
+ * Every RawFile keeps a flat copy of its extent list, with physically contiguous extents merged and each run tagged with
+ * the file block it starts at, so that an offset can be found by binary search. lastRun remembers where the previous
+ * access ended up so that sequential reads and writes don't have to search at all. The table is rebuilt lazily after
+ * allocate() changes the extents.
+ */
+typedef struct ExtentRun {
+	uint64_t fileBlock;
+	uint32_t startBlock;
+	uint32_t blockCount;
+} ExtentRun;
+
+typedef struct IndexedRawFile {
+	RawFile rawFile;
+	ExtentRun* runs;
+	int numRuns;
+	int lastRun;
+} IndexedRawFile;
+
+/*
+ * The allocation file keeps a copy of the whole bitmap in memory, loaded the first time it is needed. Writes through
+ * the allocation file's io_func update the copy; allocate() changes it directly and writes the touched bytes back in
+ * one go when it is done.
+ */
+typedef struct AllocationFile {
+	IndexedRawFile file;
+	unsigned char* bitmap;
+	size_t bitmapSize;
+	size_t dirtyStart;
+	size_t dirtyEnd;
+} AllocationFile;
+
+static void flushBitmap(Volume* volume) {
+	AllocationFile* allocationFile;
+
+	allocationFile = (AllocationFile*) volume->allocationFile->data;
+
+	if(allocationFile->dirtyEnd > allocationFile->dirtyStart) {
+		ASSERT(rawFileWrite(volume->allocationFile, allocationFile->dirtyStart, allocationFile->dirtyEnd - allocationFile->dirtyStart,
+			allocationFile->bitmap + allocationFile->dirtyStart), "WRITE");
+	}
 
-	READ(volume->allocationFile, block / 8, 1, &byte);
-	return (byte & (1 << (7 - (block % 8)))) != 0;
+	allocationFile->dirtyStart = 0;
+	allocationFile->dirtyEnd = 0;
 }
 
-int setBlockUsed(Volume* volume, uint32_t block, int used) {
-	unsigned char byte;
+static AllocationFile* loadBitmap(Volume* volume) {
+	AllocationFile* allocationFile;
+
+	allocationFile = (AllocationFile*) volume->allocationFile->data;
+
+	if(allocationFile->bitmap == NULL || allocationFile->bitmapSize != allocationFile->file.rawFile.forkData->logicalSize) {
+		flushBitmap(volume);
+
+		allocationFile->bitmapSize = allocationFile->file.rawFile.forkData->logicalSize;
+		free(allocationFile->bitmap);
+		allocationFile->bitmap = (unsigned char*) malloc(allocationFile->bitmapSize);
+		ASSERT(rawFileRead(volume->allocationFile, 0, allocationFile->bitmapSize, allocationFile->bitmap), "READ");
+	}
+
+	return allocationFile;
+}
+
+static uint32_t bitmapBlocks(AllocationFile* allocationFile, Volume* volume) {
+	if(((uint64_t)allocationFile->bitmapSize * 8) < volume->volumeHeader->totalBlocks)
+		return allocationFile->bitmapSize * 8;
+	else
+		return volume->volumeHeader->totalBlocks;
+}
+
+static int bitmapTest(AllocationFile* allocationFile, uint32_t block) {
+	return (allocationFile->bitmap[block / 8] & (1 << (7 - (block % 8)))) != 0;
+}
+
+static void bitmapMark(AllocationFile* allocationFile, uint32_t block, uint32_t count, int used) {
+	uint32_t end;
+	size_t firstByte;
+	size_t lastByte;
 
-	READ(volume->allocationFile, block / 8, 1, &byte);
-	if(used) {
-		byte |= (1 << (7 - (block % 8)));
+	if(count == 0)
+		return;
+
+	end = block + count;
+	firstByte = block / 8;
+	lastByte = (end - 1) / 8 + 1;
+
+	for(; block < end && (block % 8) != 0; block++) {
+		if(used)
+			allocationFile->bitmap[block / 8] |= (1 << (7 - (block % 8)));
+		else
+			allocationFile->bitmap[block / 8] &= ~(1 << (7 - (block % 8)));
+	}
+
+	if(block + 8 <= end) {
+		memset(allocationFile->bitmap + (block / 8), used ? 0xFF : 0x00, (end - block) / 8);
+		block += ((end - block) / 8) * 8;
+	}
+
+	for(; block < end; block++) {
+		if(used)
+			allocationFile->bitmap[block / 8] |= (1 << (7 - (block % 8)));
+		else
+			allocationFile->bitmap[block / 8] &= ~(1 << (7 - (block % 8)));
+	}
+
+	if(allocationFile->dirtyEnd == allocationFile->dirtyStart) {
+		allocationFile->dirtyStart = firstByte;
+		allocationFile->dirtyEnd = lastByte;
 	} else {
-		byte &= ~(1 << (7 - (block % 8)));
+		if(firstByte < allocationFile->dirtyStart)
+			allocationFile->dirtyStart = firstByte;
+		if(lastByte > allocationFile->dirtyEnd)
+			allocationFile->dirtyEnd = lastByte;
+	}
+}
+
+/* returns the first block in [block, end) whose bit equals used, or end if there is none */
+static uint32_t bitmapFind(AllocationFile* allocationFile, uint32_t block, uint32_t end, int used) {
+	uint64_t word;
+	uint64_t skip;
+
+	for(; block < end && (block % 64) != 0; block++) {
+		if(bitmapTest(allocationFile, block) == used)
+			return block;
+	}
+
+	/* skip whole words that can't contain a match */
+	skip = used ? 0 : ~((uint64_t)0);
+	while((block + 64) <= end) {
+		memcpy(&word, allocationFile->bitmap + (block / 8), sizeof(word));
+		if(word != skip)
+			break;
+		block += 64;
+	}
+
+	for(; block < end; block++) {
+		if(bitmapTest(allocationFile, block) == used)
+			return block;
 	}
-	ASSERT(WRITE(volume->allocationFile, block / 8, 1, &byte), "WRITE");
+
+	return end;
+}
+
+int isBlockUsed(Volume* volume, uint32_t block)
+{
+	return bitmapTest(loadBitmap(volume), block);
+}
+
+int setBlockUsed(Volume* volume, uint32_t block, int used) {
+	bitmapMark(loadBitmap(volume), block, 1, used);
+	flushBitmap(volume);
 
 	return TRUE;
 }
 
+static void invalidateExtentRuns(RawFile* rawFile) {
+	IndexedRawFile* indexed;
+
+	indexed = (IndexedRawFile*) rawFile;
+	free(indexed->runs);
+	indexed->runs = NULL;
+	indexed->numRuns = 0;
+	indexed->lastRun = 0;
+}
+
+static void buildExtentRuns(IndexedRawFile* indexed) {
+	Extent* extent;
+	ExtentRun* run;
+	uint64_t fileBlock;
+	int numExtents;
+
+	numExtents = 0;
+	for(extent = indexed->rawFile.extents; extent != NULL; extent = extent->next)
+		numExtents++;
+
+	indexed->runs = (ExtentRun*) malloc(sizeof(ExtentRun) * (numExtents + 1));
+	indexed->numRuns = 0;
+	indexed->lastRun = 0;
+
+	run = NULL;
+	fileBlock = 0;
+	for(extent = indexed->rawFile.extents; extent != NULL; extent = extent->next) {
+		if(extent->blockCount == 0)
+			continue;
+
+		if(run != NULL && (run->startBlock + run->blockCount) == extent->startBlock
+			&& ((uint64_t)run->blockCount + extent->blockCount) <= 0xFFFFFFFF) {
+			run->blockCount += extent->blockCount;
+		} else {
+			run = &indexed->runs[indexed->numRuns++];
+			run->fileBlock = fileBlock;
+			run->startBlock = extent->startBlock;
+			run->blockCount = extent->blockCount;
+		}
+
+		fileBlock += extent->blockCount;
+	}
+}
+
+/* returns the index of the run containing fileBlock, or -1 if it is past the end of the file */
+static int findExtentRun(IndexedRawFile* indexed, uint64_t fileBlock) {
+	ExtentRun* run;
+	int low;
+	int high;
+	int mid;
+
+	if(indexed->runs == NULL)
+		buildExtentRuns(indexed);
+
+	if(indexed->numRuns == 0)
+		return -1;
+
+	/* sequential access usually lands in the same run or the one right after it */
+	run = &indexed->runs[indexed->lastRun];
+	if(fileBlock >= run->fileBlock) {
+		if(fileBlock < (run->fileBlock + run->blockCount))
+			return indexed->lastRun;
+
+		if((indexed->lastRun + 1) < indexed->numRuns) {
+			run++;
+			if(fileBlock >= run->fileBlock && fileBlock < (run->fileBlock + run->blockCount))
+				return ++indexed->lastRun;
+		}
+	}
+
+	low = 0;
+	high = indexed->numRuns - 1;
+	while(low <= high) {
+		mid = low + (high - low) / 2;
+		run = &indexed->runs[mid];
+		if(fileBlock < run->fileBlock) {
+			high = mid - 1;
+		} else if(fileBlock >= (run->fileBlock + run->blockCount)) {
+			low = mid + 1;
+		} else {
+			indexed->lastRun = mid;
+			return mid;
+		}
+	}
+
+	return -1;
+}
+
 int allocate(RawFile* rawFile, off_t size) {
 	unsigned char* zeros;
+	size_t zerosSize;
 	Volume* volume;
+	AllocationFile* allocationFile;
 	HFSPlusForkData* forkData;
 	uint32_t blocksNeeded;
 	uint32_t blocksToAllocate;
+	uint32_t totalBlocks;
+	uint32_t runEnd;
+	uint32_t runLength;
+	off_t zeroOffset;
+	off_t zeroLeft;
 	Extent* extent;
 	Extent* lastExtent;
 
@@ -44,15 +277,21 @@ int allocate(RawFile* rawFile, off_t size) {
 	blocksNeeded = ((uint64_t)size / (uint64_t)volume->volumeHeader->blockSize) + (((size % volume->volumeHeader->blockSize) == 0) ? 0 : 1);
 
 	if(blocksNeeded > forkData->totalBlocks) {
-		zeros = (unsigned char*) malloc(volume->volumeHeader->blockSize);
-		memset(zeros, 0, volume->volumeHeader->blockSize);
-
 		blocksToAllocate = blocksNeeded - forkData->totalBlocks;
 
 		if(blocksToAllocate > volume->volumeHeader->freeBlocks) {
 			return FALSE;
 		}
 
+		allocationFile = loadBitmap(volume);
+		totalBlocks = bitmapBlocks(allocationFile, volume);
+
+		zerosSize = (size_t) blocksToAllocate * volume->volumeHeader->blockSize;
+		if(zerosSize > ZERO_BUFFER_SIZE)
+			zerosSize = ZERO_BUFFER_SIZE;
+		zeros = (unsigned char*) malloc(zerosSize);
+		memset(zeros, 0, zerosSize);
+
 		lastExtent = NULL;
 		while(extent != NULL) {
 			lastExtent = extent;
@@ -70,40 +309,67 @@ int allocate(RawFile* rawFile, off_t size) {
 		}
 
 		while(blocksToAllocate > 0) {
-			if(isBlockUsed(volume, curBlock)) {
+			if(curBlock >= totalBlocks || bitmapTest(allocationFile, curBlock)) {
 				if(lastExtent->blockCount > 0) {
 					lastExtent->next = (Extent*) malloc(sizeof(Extent));
 					lastExtent = lastExtent->next;
 					lastExtent->blockCount = 0;
 					lastExtent->next = NULL;
 				}
-				curBlock = volume->volumeHeader->nextAllocation;
-				volume->volumeHeader->nextAllocation++;
+
+				/* continue from the next free block at or after nextAllocation, wrapping around once */
+				curBlock = bitmapFind(allocationFile, volume->volumeHeader->nextAllocation, totalBlocks, FALSE);
+				if(curBlock >= totalBlocks) {
+					curBlock = bitmapFind(allocationFile, 0, totalBlocks, FALSE);
+					if(curBlock >= totalBlocks) {
+						free(zeros);
+						flushBitmap(volume);
+						hfs_panic("allocation bitmap is full!");
+						return FALSE;
+					}
+				}
+
+				volume->volumeHeader->nextAllocation = curBlock + 1;
 				if(volume->volumeHeader->nextAllocation >= volume->volumeHeader->totalBlocks) {
 					volume->volumeHeader->nextAllocation = 0;
 				}
-			} else {
-				if(lastExtent->blockCount == 0) {
-					lastExtent->startBlock = curBlock;
-				}
+			}
 
-				/* zero out allocated block */
-				ASSERT(WRITE(volume->image, curBlock * volume->volumeHeader->blockSize, volume->volumeHeader->blockSize, zeros), "WRITE");
+			runEnd = curBlock + blocksToAllocate;
+			if(runEnd > totalBlocks || runEnd < curBlock)
+				runEnd = totalBlocks;
+			runEnd = bitmapFind(allocationFile, curBlock, runEnd, TRUE);
+			runLength = runEnd - curBlock;
 
-				setBlockUsed(volume, curBlock, TRUE);
-				volume->volumeHeader->freeBlocks--;
-				blocksToAllocate--;
-				curBlock++;
-				lastExtent->blockCount++;
+			if(lastExtent->blockCount == 0) {
+				lastExtent->startBlock = curBlock;
+			}
 
-				if(curBlock >= volume->volumeHeader->totalBlocks) {
-					curBlock = volume->volumeHeader->nextAllocation;
-				}
+			/* zero out allocated blocks */
+			zeroOffset = (off_t)curBlock * volume->volumeHeader->blockSize;
+			zeroLeft = (off_t)runLength * volume->volumeHeader->blockSize;
+			while(zeroLeft > 0) {
+				size_t toWrite = (zeroLeft > zerosSize) ? zerosSize : (size_t) zeroLeft;
+				ASSERT(WRITE(volume->image, zeroOffset, toWrite, zeros), "WRITE");
+				zeroOffset += toWrite;
+				zeroLeft -= toWrite;
+			}
+
+			bitmapMark(allocationFile, curBlock, runLength, TRUE);
+			volume->volumeHeader->freeBlocks -= runLength;
+			blocksToAllocate -= runLength;
+			curBlock += runLength;
+			lastExtent->blockCount += runLength;
+
+			if(curBlock >= totalBlocks) {
+				curBlock = volume->volumeHeader->nextAllocation;
 			}
 		}
 
 		free(zeros);
+		flushBitmap(volume);
 	} else if(blocksNeeded < forkData->totalBlocks) {
+		allocationFile = loadBitmap(volume);
 		blocksToAllocate = blocksNeeded;
 
 		lastExtent = NULL;
@@ -127,10 +393,8 @@ int allocate(RawFile* rawFile, off_t size) {
 		}
 
 		do {
-			for(curBlock = (extent->startBlock + blocksToAllocate); curBlock < (extent->startBlock + extent->blockCount); curBlock++) {
-				setBlockUsed(volume, curBlock, FALSE);
-				volume->volumeHeader->freeBlocks++;
-			}
+			bitmapMark(allocationFile, extent->startBlock + blocksToAllocate, extent->blockCount - blocksToAllocate, FALSE);
+			volume->volumeHeader->freeBlocks += extent->blockCount - blocksToAllocate;
 			lastExtent = extent;
 			extent = extent->next;
 
@@ -144,8 +408,11 @@ int allocate(RawFile* rawFile, off_t size) {
 
 			blocksToAllocate = 0;
 		} while(extent != NULL);
+
+		flushBitmap(volume);
 	}
 
+	invalidateExtentRuns(rawFile);
 	writeExtents(rawFile);
 
 	forkData->logicalSize = size;
@@ -161,111 +428,136 @@ int allocate(RawFile* rawFile, off_t size) {
 }
 
 static int rawFileRead(io_func* io,off_t location, size_t size, void *buffer) {
-	RawFile* rawFile;
+	IndexedRawFile* indexed;
 	Volume* volume;
-	Extent* extent;
+	ExtentRun* run;
+	int curRun;
 
 	size_t blockSize;
-	off_t fileLoc;
-	off_t locationInBlock;
+	off_t locationInRun;
 	size_t possible;
 
-	rawFile = (RawFile*) io->data;
-	volume = rawFile->volume;
+	indexed = (IndexedRawFile*) io->data;
+	volume = indexed->rawFile.volume;
 	blockSize = volume->volumeHeader->blockSize;
 
-	if(!rawFile->extents)
+	if(!indexed->rawFile.extents)
 		return FALSE;
 
-	extent = rawFile->extents;
-	fileLoc = 0;
+	if(size == 0)
+		return TRUE;
 
-	locationInBlock = location;
-	while(TRUE) {
-		fileLoc += extent->blockCount * blockSize;
-		if(fileLoc <= location) {
-			locationInBlock -= extent->blockCount * blockSize;
-			extent = extent->next;
-			if(extent == NULL)
-				break;
-		} else {
-			break;
-		}
-	}
+	curRun = findExtentRun(indexed, location / blockSize);
+	if(curRun < 0)
+		return FALSE;
+
+	run = &indexed->runs[curRun];
+	locationInRun = location - (off_t)(run->fileBlock * blockSize);
 
 	while(size > 0) {
-		if(extent == NULL)
+		if(curRun >= indexed->numRuns)
 			return FALSE;
 
-		possible = extent->blockCount * blockSize - locationInBlock;
+		run = &indexed->runs[curRun];
+		possible = (size_t)run->blockCount * blockSize - locationInRun;
 
 		if(size > possible) {
-			ASSERT(READ(volume->image, extent->startBlock * blockSize + locationInBlock, possible, buffer), "READ");
+			ASSERT(READ(volume->image, (off_t)run->startBlock * blockSize + locationInRun, possible, buffer), "READ");
 			size -= possible;
 			buffer = (void*)(((size_t)buffer) + possible);
-			extent = extent->next;
+			curRun++;
 		} else {
-			ASSERT(READ(volume->image, extent->startBlock * blockSize + locationInBlock, size, buffer), "READ");
+			ASSERT(READ(volume->image, (off_t)run->startBlock * blockSize + locationInRun, size, buffer), "READ");
 			break;
 		}
 
-		locationInBlock = 0;
+		locationInRun = 0;
 	}
 
+	if(curRun < indexed->numRuns)
+		indexed->lastRun = curRun;
+
 	return TRUE;
 }
 
 static int rawFileWrite(io_func* io,off_t location, size_t size, void *buffer) {
-	RawFile* rawFile;
+	IndexedRawFile* indexed;
 	Volume* volume;
-	Extent* extent;
+	ExtentRun* run;
+	int curRun;
 
 	size_t blockSize;
-	off_t fileLoc;
-	off_t locationInBlock;
+	off_t locationInRun;
 	size_t possible;
 
-	rawFile = (RawFile*) io->data;
-	volume = rawFile->volume;
+	indexed = (IndexedRawFile*) io->data;
+	volume = indexed->rawFile.volume;
 	blockSize = volume->volumeHeader->blockSize;
 
-	if(rawFile->forkData->logicalSize < (location + size)) {
-		ASSERT(allocate(rawFile, location + size), "allocate");
+	if(indexed->rawFile.forkData->logicalSize < (location + size)) {
+		ASSERT(allocate(&indexed->rawFile, location + size), "allocate");
 	}
 
-	extent = rawFile->extents;
-	fileLoc = 0;
+	if(size == 0)
+		return TRUE;
 
-	locationInBlock = location;
-	while(TRUE) {
-		fileLoc += extent->blockCount * blockSize;
-		if(fileLoc <= location) {
-			locationInBlock -= extent->blockCount * blockSize;
-			extent = extent->next;
-			if(extent == NULL)
-				break;
-		} else {
-			break;
-		}
-	}
+	curRun = findExtentRun(indexed, location / blockSize);
+	if(curRun < 0)
+		return FALSE;
+
+	run = &indexed->runs[curRun];
+	locationInRun = location - (off_t)(run->fileBlock * blockSize);
 
 	while(size > 0) {
-		if(extent == NULL)
+		if(curRun >= indexed->numRuns)
 			return FALSE;
 
-		possible = extent->blockCount * blockSize - locationInBlock;
+		run = &indexed->runs[curRun];
+		possible = (size_t)run->blockCount * blockSize - locationInRun;
 
 		if(size > possible) {
-			ASSERT(WRITE(volume->image, extent->startBlock * blockSize + locationInBlock, possible, buffer), "WRITE");
+			ASSERT(WRITE(volume->image, (off_t)run->startBlock * blockSize + locationInRun, possible, buffer), "WRITE");
 			size -= possible;
 			buffer = (void*)(((size_t)buffer) + possible);
-			extent = extent->next;
+			curRun++;
 		} else {
-			ASSERT(WRITE(volume->image, extent->startBlock * blockSize + locationInBlock, size, buffer), "WRITE");
+			ASSERT(WRITE(volume->image, (off_t)run->startBlock * blockSize + locationInRun, size, buffer), "WRITE");
 			break;
 		}
 
-		locationInBlock = 0;
+		locationInRun = 0;
+	}
+
+	if(curRun < indexed->numRuns)
+		indexed->lastRun = curRun;
+
+	return TRUE;
+}
+
+static int allocationFileRead(io_func* io, off_t location, size_t size, void *buffer) {
+	AllocationFile* allocationFile;
+
+	allocationFile = (AllocationFile*) io->data;
+
+	if(allocationFile->bitmap != NULL && allocationFile->bitmapSize == allocationFile->file.rawFile.forkData->logicalSize
+		&& (location + size) <= allocationFile->bitmapSize) {
+		memcpy(buffer, allocationFile->bitmap + location, size);
+		return TRUE;
+	}
+
+	return rawFileRead(io, location, size, buffer);
+}
+
+static int allocationFileWrite(io_func* io, off_t location, size_t size, void *buffer) {
+	AllocationFile* allocationFile;
+
+	allocationFile = (AllocationFile*) io->data;
+
+	if(!rawFileWrite(io, location, size, buffer))
+		return FALSE;
+
+	if(allocationFile->bitmap != NULL && (location + size) <= allocationFile->bitmapSize) {
+		memcpy(allocationFile->bitmap + location, buffer, size);
 	}
 
 	return TRUE;
@@ -285,10 +577,25 @@ static void closeRawFile(io_func* io) {
 		free(toRemove);
 	}
 
+	free(((IndexedRawFile*) rawFile)->runs);
+
 	free(rawFile);
 	free(io);
 }
 
+static void closeAllocationFile(io_func* io) {
+	AllocationFile* allocationFile;
+
+	allocationFile = (AllocationFile*) io->data;
+	if(allocationFile->dirtyEnd > allocationFile->dirtyStart) {
+		ASSERT(rawFileWrite(io, allocationFile->dirtyStart, allocationFile->dirtyEnd - allocationFile->dirtyStart,
+			allocationFile->bitmap + allocationFile->dirtyStart), "WRITE");
+	}
+	free(allocationFile->bitmap);
+
+	closeRawFile(io);
+}
+
 int removeExtents(RawFile* rawFile) {
 	uint32_t blocksLeft;
 	HFSPlusForkData* forkData;
@@ -478,10 +785,25 @@ int readExtents(RawFile* rawFile) {
 
 io_func* openRawFile(HFSCatalogNodeID id, HFSPlusForkData* forkData, HFSPlusCatalogRecord* catalogRecord, Volume* volume) {
 	io_func* io;
+	IndexedRawFile* indexed;
 	RawFile* rawFile;
 
 	io = (io_func*) malloc(sizeof(io_func));
-	rawFile = (RawFile*) malloc(sizeof(RawFile));
+	if(id == kHFSAllocationFileID) {
+		AllocationFile* allocationFile = (AllocationFile*) malloc(sizeof(AllocationFile));
+		allocationFile->bitmap = NULL;
+		allocationFile->bitmapSize = 0;
+		allocationFile->dirtyStart = 0;
+		allocationFile->dirtyEnd = 0;
+		indexed = &allocationFile->file;
+	} else {
+		indexed = (IndexedRawFile*) malloc(sizeof(IndexedRawFile));
+	}
+
+	indexed->runs = NULL;
+	indexed->numRuns = 0;
+	indexed->lastRun = 0;
+	rawFile = &indexed->rawFile;
 
 	rawFile->id = id;
 	rawFile->volume = volume;
@@ -490,9 +812,15 @@ io_func* openRawFile(HFSCatalogNodeID id, HFSPlusForkData* forkData, HFSPlusCata
 	rawFile->extents = NULL;
 
 	io->data = rawFile;
-	io->read = &rawFileRead;
-	io->write = &rawFileWrite;
-	io->close = &closeRawFile;
+	if(id == kHFSAllocationFileID) {
+		io->read = &allocationFileRead;
+		io->write = &allocationFileWrite;
+		io->close = &closeAllocationFile;
+	} else {
+		io->read = &rawFileRead;
+		io->write = &rawFileWrite;
+		io->close = &closeRawFile;
+	}
 
 	if(!readExtents(rawFile)) {
 		return NULL;
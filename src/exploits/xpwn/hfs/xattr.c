@@ -295,7 +295,7 @@ XAttrList* getAllExtendedAttributes(HFSCatalogNodeID CNID, Volume* volume) {
 	HFSPlusAttrRecord* record;
 	uint32_t nodeNumber;
 	int recordNumber;
-	BTNodeDescriptor* descriptor;
+	BTNodeDescriptor descriptor;
 	HFSPlusAttrKey* currentKey;
 	off_t recordOffset;
 	XAttrList* list = NULL;
@@ -319,9 +319,9 @@ XAttrList* getAllExtendedAttributes(HFSCatalogNodeID CNID, Volume* volume) {
 	free(record);
 	
 	while(nodeNumber != 0) {    
-		descriptor = readBTNodeDescriptor(nodeNumber, tree);
+		descriptor = *readBTNodeDescriptor(nodeNumber, tree);
 
-		while(recordNumber < descriptor->numRecords) {
+		while(recordNumber < descriptor.numRecords) {
 			recordOffset = getRecordOffset(recordNumber, nodeNumber, tree);
 			currentKey = (HFSPlusAttrKey*) READ_KEY(tree, recordOffset, tree->io);
 
@@ -346,17 +346,14 @@ XAttrList* getAllExtendedAttributes(HFSCatalogNodeID CNID, Volume* volume) {
 				free(currentKey);
 			} else {
 				free(currentKey);
-				free(descriptor);
 				return list;
 			}
 
 			recordNumber++;
 		}
 
-		nodeNumber = descriptor->fLink;
+		nodeNumber = descriptor.fLink;
 		recordNumber = 0;
-
-		free(descriptor);
 	}
 	return list;
 }
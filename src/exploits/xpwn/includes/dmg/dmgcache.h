@@ -0,0 +1,17 @@
+#ifndef DMGCACHE_H
+#define DMGCACHE_H
+
+#include <stdint.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	/* Number of decompressed runs each DMG opened afterwards with openDmgFile keeps around (default 8). */
+	void setDmgRunCacheSize(int runs);
+	void getDmgRunCacheStats(io_func* io, uint64_t* hits, uint64_t* misses);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	/* Number of deflate threads insertBLKX uses. 1 (the default) compresses on the calling thread; the output is the
+	 * same either way. Ignored when built without pthreads. */
+	void setCompressionThreads(int threads);
+	int getCompressionThreads();
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef HFSPARALLEL_H
+#define HFSPARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	/* Number of threads extractAllInFolder and addAllInFolder use for file contents. 1 (the default) does everything on
+	 * the calling thread. Catalog and B-tree work always stays on the calling thread. Ignored when built without
+	 * pthreads. */
+	void hfs_setthreads(int threads);
+	int hfs_getthreads();
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef MMAPFILE_H
+#define MMAPFILE_H
+
+#include "common.h"
+#include "abstractfile.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	/* Read-only AbstractFile over a memory mapping of a regular file, advised for random access since disk images are
+	 * read by walking their B-trees and block runs. Returns NULL if the file can't be mapped (not a regular file, empty,
+	 * or no mmap on this platform) so callers can fall back to createAbstractFileFromFile. */
+	AbstractFile* createAbstractFileFromMmap(const char* fileName);
+
+	/* io_func over a memory mapping of a regular file, advised for random access. A writable mapping is shared with the
+	 * file and grows it when written past the end. Returns NULL under the same conditions as above. */
+	io_func* openMmapFile(const char* fileName, int writable);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
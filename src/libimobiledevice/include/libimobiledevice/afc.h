@@ -92,6 +92,27 @@ typedef enum {
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+/**
+ * Completion callback for asynchronous requests.
+ *
+ * @param client The client the request was sent on.
+ * @param request_id The id returned when the request was submitted.
+ * @param status AFC_E_SUCCESS or the error the request failed with.
+ * @param data The data returned by a read request, NULL otherwise. Only valid
+ *        until the callback returns.
+ * @param length Number of bytes in data for a read request, or the number of
+ *        bytes written for a write request.
+ * @param user_data The user data passed when the request was submitted.
+ */
+typedef void (*afc_request_cb_t)(afc_client_t client, uint64_t request_id, afc_error_t status, const char *data, uint32_t length, void *user_data);
+
+/** Receives file data in afc_file_read_pipelined(). Return < 0 to abort. */
+typedef ssize_t (*afc_file_sink_cb_t)(const void *data, size_t length, void *user_data);
+
+/** Supplies file data for afc_file_write_pipelined(). Return the number of
+ *  bytes placed in buffer, 0 at the end of the data, or < 0 to abort. */
+typedef ssize_t (*afc_file_source_cb_t)(void *buffer, size_t length, void *user_data);
+
 /* Interface */
 
 /**
@@ -344,8 +365,96 @@ afc_error_t afc_set_file_time(afc_client_t client, const char *path, uint64_t mt
  */
 afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
 
+/* Asynchronous interface */
+
+/**
+ * Sends a read request for the given file without waiting for the response.
+ * Several requests can be in flight at the same time; the device answers
+ * them in the order they were sent.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param length The number of bytes to read
+ * @param callback Function called with the data once the response arrived.
+ *        It is invoked from afc_complete_requests() or any other AFC function
+ *        called on this client and must not call AFC functions itself.
+ * @param user_data Pointer passed to the callback.
+ * @param request_id Set to the id of the request. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_read_async(afc_client_t client, uint64_t handle, uint32_t length, afc_request_cb_t callback, void *user_data, uint64_t *request_id);
+
+/**
+ * Sends a write request for the given file without waiting for the response.
+ * The data is sent before the function returns and can be reused right away.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param data The data to write to the file.
+ * @param length How much data to write.
+ * @param callback Function called with the result once the response arrived.
+ *        The same restrictions as for afc_file_read_async() apply.
+ * @param user_data Pointer passed to the callback.
+ * @param request_id Set to the id of the request. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+afc_error_t afc_file_write_async(afc_client_t client, uint64_t handle, const char *data, uint32_t length, afc_request_cb_t callback, void *user_data, uint64_t *request_id);
+
+/**
+ * Receives responses for requests in flight and invokes their callbacks until
+ * at most max_pending requests are left. Pass 0 to wait for all of them.
+ *
+ * @param client The client to use.
+ * @param max_pending Number of requests that may still be in flight when
+ *        this function returns.
+ * @param pending Set to the number of requests still in flight. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value if the
+ *         connection failed. In that case the callbacks of all requests in
+ *         flight are invoked with the error.
+ */
+afc_error_t afc_complete_requests(afc_client_t client, uint32_t max_pending, uint32_t *pending);
+
 /* Helper functions */
 
+/**
+ * Reads a file from its current position to the end, keeping up to window
+ * read requests in flight.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param chunk_size Bytes to request with each read, or 0 for the default.
+ * @param window Number of requests in flight, or 0 for the default.
+ * @param callback Called with the file data in order. It must not call
+ *        AFC functions on this client.
+ * @param user_data Pointer passed to the callback.
+ * @param bytes_read Set to the number of bytes read. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         aborted the transfer, or another AFC_E_* error value.
+ */
+afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_file_sink_cb_t callback, void *user_data, uint64_t *bytes_read);
+
+/**
+ * Writes data to a file until the callback reports the end of the data,
+ * keeping up to window write requests in flight.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param chunk_size Bytes to send with each write, or 0 for the default.
+ * @param window Number of requests in flight, or 0 for the default.
+ * @param callback Called to fill the next chunk. It must not call AFC
+ *        functions on this client.
+ * @param user_data Pointer passed to the callback.
+ * @param bytes_written Set to the number of bytes written. Can be NULL.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *         aborted the transfer, or another AFC_E_* error value.
+ */
+afc_error_t afc_file_write_pipelined(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_file_source_cb_t callback, void *user_data, uint64_t *bytes_written);
+
 /**
  * Get a specific key of the device info list for a client connection.
  * Known key values are: Model, FSTotalBytes, FSFreeBytes and FSBlockSize.
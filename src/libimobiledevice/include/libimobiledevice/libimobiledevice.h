@@ -70,6 +70,12 @@ typedef struct {
 /** Callback to notifiy if a device was added or removed. */
 typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_data);
 
+/** A buffer to send with idevice_connection_sendv(). */
+typedef struct {
+	const char *data; /**< The data to send. */
+	uint32_t length; /**< Number of bytes in data. */
+} idevice_iovec_t;
+
 /* functions */
 
 /**
@@ -185,6 +191,21 @@ idevice_error_t idevice_disconnect(idevice_connection_t connection);
  */
 idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
 
+/**
+ * Send data from several buffers to a device via the given connection as if
+ * it was one contiguous buffer. Plain connections pass all buffers to a single
+ * system call, SSL connections send them as a single record.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send.
+ * @param iovcnt Number of buffers in iov.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes);
+
 /**
  * Receive data from a device via the given connection.
  * This function will return after the given timeout even if no data has been
@@ -105,6 +105,22 @@ service_error_t service_client_free(service_client_t client);
  */
 service_error_t service_send(service_client_t client, const char *data, uint32_t size, uint32_t *sent);
 
+/**
+ * Sends data from several buffers using the given service client, with a
+ * single write to the underlying connection where possible.
+ *
+ * @param client The service client to use for sending.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of buffers in iov
+ * @param sent Number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent);
+
 /**
  * Receives data using the given service client with specified timeout.
  *
@@ -90,6 +90,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
 	client_loc->file_handle = 0;
 	client_loc->lock = 0;
+	client_loc->requests = NULL;
+	client_loc->requests_size = 0;
+	client_loc->requests_head = 0;
+	client_loc->requests_count = 0;
+	client_loc->scratch = NULL;
+	client_loc->scratch_size = 0;
 	mutex_init(&client_loc->mutex);
 
 	*client = client_loc;
@@ -132,13 +138,15 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 		client->parent = NULL;
 	}
 	free(client->afc_packet);
+	free(client->requests);
+	free(client->scratch);
 	mutex_destroy(&client->mutex);
 	free(client);
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Dispatches an AFC packet over a client.
+ * Sends an AFC packet over a client without waiting for requests in flight.
  *
  * @param client The client to send data through.
  * @param operation The operation to perform.
@@ -150,8 +158,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, const char *data, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+static afc_error_t afc_send_packet(afc_client_t client, uint64_t operation, const char *data, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
 {
+	idevice_iovec_t iov[3];
 	uint32_t sent = 0;
 
 	if (!client || !client->parent || !client->afc_packet)
@@ -173,52 +182,81 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 
 	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket));
 
-	/* send AFC packet header */
-	AFCPacket_to_LE(client->afc_packet);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket), &sent);
-	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket)) {
-		return AFC_E_SUCCESS;
-	}
-
-	/* send AFC packet data (if there's data to send) */
-	sent = 0;
 	if (data_length > 0) {
 		debug_info("packet data follows");
 		debug_buffer(data, data_length);
-		service_send(client->parent, data, data_length, &sent);
-	}
-	*bytes_sent += sent;
-	if (sent < data_length) {
-		return AFC_E_SUCCESS;
 	}
-
-	sent = 0;
 	if (payload_length > 0) {
 		debug_info("packet payload follows");
 		debug_buffer(payload, payload_length);
-		service_send(client->parent, payload, payload_length, &sent);
 	}
-	*bytes_sent += sent;
-	if (sent < payload_length) {
+
+	/* send header, data and payload with a single write */
+	iov[0].data = (const char*)client->afc_packet;
+	iov[0].length = sizeof(AFCPacket);
+	iov[1].data = data;
+	iov[1].length = data_length;
+	iov[2].data = payload;
+	iov[2].length = payload_length;
+
+	AFCPacket_to_LE(client->afc_packet);
+	service_sendv(client->parent, iov, 3, &sent);
+	AFCPacket_from_LE(client->afc_packet);
+	*bytes_sent = sent;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Makes sure the scratch buffer of an AFC client can hold size bytes.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_NO_MEM.
+ */
+static afc_error_t afc_scratch_reserve(afc_client_t client, uint32_t size)
+{
+	uint32_t newsize;
+	char *newbuf;
+
+	if (size <= client->scratch_size)
 		return AFC_E_SUCCESS;
+
+	newsize = (client->scratch_size) ? client->scratch_size : 4096;
+	while (newsize < size && newsize < 0x80000000)
+		newsize *= 2;
+	if (newsize < size)
+		newsize = size;
+
+	newbuf = (char*)realloc(client->scratch, newsize);
+	if (!newbuf) {
+		debug_info("ERROR: Could not allocate %u bytes", newsize);
+		return AFC_E_NO_MEM;
 	}
+	client->scratch = newbuf;
+	client->scratch_size = newsize;
 
 	return AFC_E_SUCCESS;
 }
 
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives the next AFC packet through an AFC client, whichever request it
+ * belongs to.
+ *
+ * The payload of an AFC_OP_DATA response is received straight into dest if
+ * it fits, everything else goes to the scratch buffer of the client. Either
+ * way no memory is allocated for the response and the data returned in bytes
+ * is only valid until the next packet is received on this client.
  *
  * @param client The client to receive data on.
- * @param bytes The char* to point to the newly-received data.
+ * @param packet_num Set to the packet number of the response, or 0 if no
+ *     valid header could be received.
+ * @param dest Buffer for the payload of a data response. Can be NULL.
+ * @param dest_size Size of dest.
+ * @param bytes Set to the received data, either dest or the scratch buffer.
  * @param bytes_recv How much data was received.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_receive_packet(afc_client_t client, uint64_t *packet_num, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -233,6 +271,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	if (bytes) {
 		*bytes = NULL;
 	}
+	*packet_num = 0;
 
 	/* first, read the AFC header */
 	service_receive(client->parent, (char*)&header, sizeof(AFCPacket), bytes_recv);
@@ -250,12 +289,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 		debug_info("Invalid AFC packet received (magic != " AFC_MAGIC ")!");
 	}
 
-	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
-		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
-		return AFC_E_OP_HEADER_INVALID;
-	}
+	*packet_num = header.packet_num;
 
 	/* then, read the attached packet */
 	if (header.this_length < sizeof(AFCPacket)) {
@@ -276,35 +310,35 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
 	this_len = (uint32_t)header.this_length - sizeof(AFCPacket);
+	if (this_len > entire_len) {
+		debug_info("Invalid AFCPacket header received!");
+		return AFC_E_OP_HEADER_INVALID;
+	}
 
-	dump_here = (char*)malloc(entire_len);
-	if (this_len > 0) {
-		service_receive(client->parent, dump_here, this_len, bytes_recv);
-		if (*bytes_recv <= 0) {
-			free(dump_here);
-			debug_info("Did not get packet contents!");
-			return AFC_E_NOT_ENOUGH_DATA;
-		} else if (*bytes_recv < this_len) {
-			free(dump_here);
-			debug_info("Could not receive this_len=%d bytes", this_len);
-			return AFC_E_NOT_ENOUGH_DATA;
+	if (header.operation == AFC_OP_DATA && dest && entire_len <= dest_size) {
+		dump_here = dest;
+	} else {
+		if (afc_scratch_reserve(client, entire_len) != AFC_E_SUCCESS) {
+			return AFC_E_NO_MEM;
 		}
+		dump_here = client->scratch;
 	}
 
-	current_count = this_len;
-
-	if (entire_len > this_len) {
-		while (current_count < entire_len) {
-			service_receive(client->parent, dump_here+current_count, entire_len - current_count, bytes_recv);
-			if (*bytes_recv <= 0) {
-				debug_info("Error receiving data (recv returned %d)", *bytes_recv);
-				break;
-			}
-			current_count += *bytes_recv;
-		}
-		if (current_count < entire_len) {
-			debug_info("WARNING: could not receive full packet (read %s, size %d)", current_count, entire_len);
+	/* the header told us the full size, so receive all of it in one go */
+	while (current_count < entire_len) {
+		service_receive(client->parent, dump_here+current_count, entire_len - current_count, bytes_recv);
+		if (*bytes_recv <= 0) {
+			debug_info("Error receiving data (recv returned %d)", *bytes_recv);
+			break;
 		}
+		current_count += *bytes_recv;
+	}
+	if (current_count < this_len) {
+		debug_info("Could not receive this_len=%d bytes", this_len);
+		*bytes_recv = 0;
+		return AFC_E_NOT_ENOUGH_DATA;
+	} else if (current_count < entire_len) {
+		debug_info("WARNING: could not receive full packet (read %d, size %d)", current_count, entire_len);
 	}
 
 	if (current_count >= sizeof(uint64_t)) {
@@ -322,8 +356,7 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 		if (param1 != AFC_E_SUCCESS) {
 			/* error status */
-			/* free buffer */
-			free(dump_here);
+			*bytes_recv = 0;
 			return (afc_error_t)param1;
 		}
 	} else if (header.operation == AFC_OP_DATA) {
@@ -337,7 +370,6 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 		debug_info("got a tell response, position=%lld", param1);
 	} else {
 		/* unknown operation code received */
-		free(dump_here);
 		*bytes_recv = 0;
 
 		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
@@ -350,14 +382,215 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 	if (bytes) {
 		*bytes = dump_here;
-	} else {
-		free(dump_here);
 	}
 
 	*bytes_recv = current_count;
 	return AFC_E_SUCCESS;
 }
 
+/**
+ * Receives the response to the last request sent through an AFC client,
+ * placing the payload of a data response into dest if it fits.
+ *
+ * @param client The client to receive data on.
+ * @param dest Buffer for the payload of a data response. Can be NULL.
+ * @param dest_size Size of dest.
+ * @param bytes Set to the received data, either dest or the scratch buffer
+ *     of the client. Must not be freed. Can be NULL.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data_into(afc_client_t client, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
+{
+	uint64_t packet_num = 0;
+	afc_error_t ret;
+
+	ret = afc_receive_packet(client, &packet_num, dest, dest_size, bytes, bytes_recv);
+
+	/* check if it has the correct packet number */
+	if (packet_num != 0 && packet_num != client->afc_packet->packet_num) {
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", packet_num, client->afc_packet->packet_num);
+		if (bytes) {
+			*bytes = NULL;
+		}
+		*bytes_recv = 0;
+		return AFC_E_OP_HEADER_INVALID;
+	}
+
+	return ret;
+}
+
+/**
+ * Receives the response to the last request sent through an AFC client and
+ * sets a variable to the received data.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the received data. It points into the
+ *     scratch buffer of the client and must not be freed.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_data_into(client, NULL, 0, bytes, bytes_recv);
+}
+
+/**
+ * Queues an asynchronous request for the packet that was just sent.
+ *
+ * @return AFC_E_SUCCESS on success or AFC_E_NO_MEM.
+ */
+static afc_error_t afc_request_add(afc_client_t client, uint32_t length, afc_request_cb_t callback, void *user_data)
+{
+	struct afc_request *req;
+
+	if (client->requests_count == client->requests_size) {
+		uint32_t newsize = (client->requests_size) ? client->requests_size * 2 : 16;
+		struct afc_request *newreqs = (struct afc_request*)malloc(sizeof(struct afc_request) * newsize);
+		uint32_t i;
+		if (!newreqs) {
+			return AFC_E_NO_MEM;
+		}
+		for (i = 0; i < client->requests_count; i++) {
+			newreqs[i] = client->requests[(client->requests_head + i) % client->requests_size];
+		}
+		free(client->requests);
+		client->requests = newreqs;
+		client->requests_size = newsize;
+		client->requests_head = 0;
+	}
+
+	req = &client->requests[(client->requests_head + client->requests_count) % client->requests_size];
+	req->packet_num = client->afc_packet->packet_num;
+	req->operation = client->afc_packet->operation;
+	req->length = length;
+	req->callback = callback;
+	req->user_data = user_data;
+	client->requests_count++;
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Fails all requests in flight with the given error.
+ */
+static void afc_requests_fail(afc_client_t client, afc_error_t error)
+{
+	struct afc_request req;
+
+	while (client->requests_count > 0) {
+		req = client->requests[client->requests_head];
+		client->requests_head = (client->requests_head + 1) % client->requests_size;
+		client->requests_count--;
+		if (req.callback) {
+			req.callback(client, req.packet_num, error, NULL, 0, req.user_data);
+		}
+	}
+}
+
+/**
+ * Receives one response and completes the request it belongs to.
+ *
+ * @return AFC_E_SUCCESS if a request was completed (successfully or not), or
+ *     an AFC_E_* error value if the connection failed.
+ */
+static afc_error_t afc_request_complete_next(afc_client_t client)
+{
+	struct afc_request req;
+	uint64_t packet_num = 0;
+	char *data = NULL;
+	uint32_t bytes = 0;
+	uint32_t i;
+	uint32_t idx = 0;
+	afc_error_t ret;
+
+	ret = afc_receive_packet(client, &packet_num, NULL, 0, &data, &bytes);
+	if (packet_num == 0) {
+		afc_requests_fail(client, ret);
+		return ret;
+	}
+
+	/* responses arrive in order, so this is usually the oldest request */
+	for (i = 0; i < client->requests_count; i++) {
+		idx = (client->requests_head + i) % client->requests_size;
+		if (client->requests[idx].packet_num == packet_num)
+			break;
+	}
+	if (i == client->requests_count) {
+		debug_info("ERROR: Response for unknown packet number %lld", packet_num);
+		afc_requests_fail(client, AFC_E_OP_HEADER_INVALID);
+		return AFC_E_OP_HEADER_INVALID;
+	}
+
+	req = client->requests[idx];
+	/* close the gap, keeping the older requests in order */
+	while (idx != client->requests_head) {
+		uint32_t prev = (idx + client->requests_size - 1) % client->requests_size;
+		client->requests[idx] = client->requests[prev];
+		idx = prev;
+	}
+	client->requests_head = (client->requests_head + 1) % client->requests_size;
+	client->requests_count--;
+
+	if (req.callback) {
+		if (req.operation == AFC_OP_FILE_WRITE) {
+			req.callback(client, packet_num, ret, NULL, (ret == AFC_E_SUCCESS) ? req.length : 0, req.user_data);
+		} else {
+			req.callback(client, packet_num, ret, data, (ret == AFC_E_SUCCESS) ? bytes : 0, req.user_data);
+		}
+	}
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Completes requests in flight until at most max_pending are left.
+ */
+static afc_error_t afc_requests_wait(afc_client_t client, uint32_t max_pending)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	while (client->requests_count > max_pending && ret == AFC_E_SUCCESS) {
+		ret = afc_request_complete_next(client);
+	}
+
+	return ret;
+}
+
+/**
+ * Dispatches an AFC packet over a client. Requests still in flight are
+ * completed first so the next response belongs to this packet.
+ *
+ * @param client The client to send data through.
+ * @param operation The operation to perform.
+ * @param data The data to send together with the header.
+ * @param data_length The length of the data to send with the header.
+ * @param payload The data to send after the header has been sent.
+ * @param payload_length The length of data to send after the header.
+ * @param bytes_sent The total number of bytes actually sent.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, const char *data, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+{
+	afc_error_t ret;
+
+	if (!client || !client->parent || !client->afc_packet)
+		return AFC_E_INVALID_ARG;
+
+	*bytes_sent = 0;
+
+	if (client->requests_count > 0) {
+		ret = afc_requests_wait(client, 0);
+		if (ret != AFC_E_SUCCESS)
+			return ret;
+	}
+
+	return afc_send_packet(client, operation, data, data_length, payload, payload_length, bytes_sent);
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -422,15 +655,11 @@ LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const c
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
 	/* Parse the data */
 	list_loc = make_strings_list(data, bytes);
-	if (data)
-		free(data);
 
 	afc_unlock(client);
 	*directory_information = list_loc;
@@ -458,15 +687,11 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char *
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
 	/* Parse the data */
 	list = make_strings_list(data, bytes);
-	if (data)
-		free(data);
 
 	afc_unlock(client);
 
@@ -605,7 +830,6 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 	ret = afc_receive_data(client, &received, &bytes);
 	if (received) {
 		*file_information = make_strings_list(received, bytes);
-		free(received);
 	}
 
 	afc_unlock(client);
@@ -643,16 +867,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	/* Receive the data */
 	data = NULL;
 	ret = afc_receive_data(client, &data, &bytes);
-	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
-
+	if ((ret == AFC_E_SUCCESS) && (bytes >= sizeof(uint64_t)) && data) {
 		/* Get the file handle */
 		memcpy(handle, data, sizeof(uint64_t));
-		free(data);
+		afc_unlock(client);
 		return ret;
 	}
-	/* in case memory was allocated but no data received or an error occurred */
-	free(data);
 
 	debug_info("Didn't get any further data");
 
@@ -686,16 +906,14 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
-	/* Receive the data */
-	ret = afc_receive_data(client, &input, &bytes_loc);
+	/* Receive the data, straight into the buffer of the caller */
+	ret = afc_receive_data_into(client, data, length, &input, &bytes_loc);
 	debug_info("afc_receive_data returned error: %d", ret);
 	debug_info("bytes returned: %i", bytes_loc);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return ret;
 	} else if (bytes_loc == 0) {
-		if (input)
-			free(input);
 		afc_unlock(client);
 		*bytes_read = current_count;
 		/* FIXME: check that's actually a success */
@@ -703,9 +921,10 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 	} else {
 		if (input) {
 			debug_info("%d", bytes_loc);
-			memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
-			free(input);
-			input = NULL;
+			/* only copy if the response did not fit into data */
+			if (input != data) {
+				memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
+			}
 			current_count += (bytes_loc > length) ? length : bytes_loc;
 		}
 	}
@@ -862,12 +1081,11 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t han
 
 	/* Receive the data */
 	ret = afc_receive_data(client, &buffer, &bytes);
-	if (bytes > 0 && buffer) {
+	if (bytes >= sizeof(uint64_t) && buffer) {
 		/* Get the position */
 		memcpy(position, buffer, sizeof(uint64_t));
 		*position = le64toh(*position);
 	}
-	free(buffer);
 
 	afc_unlock(client);
 
@@ -1022,6 +1240,250 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t clien
 	return ret;
 }
 
+/**
+ * Sends a read request and queues it as asynchronous request.
+ * The client must be locked.
+ */
+static afc_error_t afc_file_read_submit(afc_client_t client, uint64_t handle, uint32_t length, afc_request_cb_t callback, void *user_data)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret;
+	struct {
+		uint64_t handle;
+		uint64_t size;
+	} readinfo;
+
+	readinfo.handle = handle;
+	readinfo.size = htole64(length);
+	ret = afc_send_packet(client, AFC_OP_FILE_READ, (const char*)&readinfo, sizeof(readinfo), NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + sizeof(readinfo)) {
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	return afc_request_add(client, length, callback, user_data);
+}
+
+/**
+ * Sends a write request and queues it as asynchronous request.
+ * The client must be locked.
+ */
+static afc_error_t afc_file_write_submit(afc_client_t client, uint64_t handle, const char *data, uint32_t length, afc_request_cb_t callback, void *user_data)
+{
+	uint32_t bytes = 0;
+	afc_error_t ret;
+
+	ret = afc_send_packet(client, AFC_OP_FILE_WRITE, (const char*)&handle, 8, data, length, &bytes);
+	if (ret != AFC_E_SUCCESS || bytes < sizeof(AFCPacket) + 8 + length) {
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	return afc_request_add(client, length, callback, user_data);
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_async(afc_client_t client, uint64_t handle, uint32_t length, afc_request_cb_t callback, void *user_data, uint64_t *request_id)
+{
+	afc_error_t ret;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	ret = afc_file_read_submit(client, handle, length, callback, user_data);
+	if (ret == AFC_E_SUCCESS && request_id) {
+		*request_id = client->afc_packet->packet_num;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_write_async(afc_client_t client, uint64_t handle, const char *data, uint32_t length, afc_request_cb_t callback, void *user_data, uint64_t *request_id)
+{
+	afc_error_t ret;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	ret = afc_file_write_submit(client, handle, data, length, callback, user_data);
+	if (ret == AFC_E_SUCCESS && request_id) {
+		*request_id = client->afc_packet->packet_num;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_complete_requests(afc_client_t client, uint32_t max_pending, uint32_t *pending)
+{
+	afc_error_t ret;
+
+	if (!client || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	ret = afc_requests_wait(client, max_pending);
+	if (pending) {
+		*pending = client->requests_count;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+#define AFC_PIPELINE_CHUNK_SIZE 65536
+#define AFC_PIPELINE_WINDOW 8
+
+struct afc_pipeline {
+	afc_file_sink_cb_t sink;
+	afc_file_source_cb_t source;
+	void *user_data;
+	uint32_t chunk_size;
+	uint64_t bytes;
+	int eof;
+	afc_error_t error;
+};
+
+static void afc_pipeline_read_cb(afc_client_t client, uint64_t request_id, afc_error_t status, const char *data, uint32_t length, void *user_data)
+{
+	struct afc_pipeline *pipeline = (struct afc_pipeline*)user_data;
+
+	/* reads sent past the end of the file only return empty responses */
+	if (pipeline->eof || pipeline->error != AFC_E_SUCCESS)
+		return;
+
+	if (status != AFC_E_SUCCESS) {
+		pipeline->error = status;
+		return;
+	}
+	if (length > 0 && pipeline->sink(data, length, pipeline->user_data) < 0) {
+		pipeline->error = AFC_E_OP_INTERRUPTED;
+		return;
+	}
+	pipeline->bytes += length;
+	/* the device may serve less than was asked for without being at the
+	 * end, and the reads in flight go on from where this one stopped */
+	if (length == 0) {
+		pipeline->eof = 1;
+	}
+}
+
+static void afc_pipeline_write_cb(afc_client_t client, uint64_t request_id, afc_error_t status, const char *data, uint32_t length, void *user_data)
+{
+	struct afc_pipeline *pipeline = (struct afc_pipeline*)user_data;
+
+	if (status != AFC_E_SUCCESS) {
+		if (pipeline->error == AFC_E_SUCCESS)
+			pipeline->error = status;
+		return;
+	}
+	pipeline->bytes += length;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_file_sink_cb_t callback, void *user_data, uint64_t *bytes_read)
+{
+	struct afc_pipeline pipeline;
+	afc_error_t ret;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0 || !callback)
+		return AFC_E_INVALID_ARG;
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.sink = callback;
+	pipeline.user_data = user_data;
+	pipeline.chunk_size = (chunk_size) ? chunk_size : AFC_PIPELINE_CHUNK_SIZE;
+	if (!window)
+		window = AFC_PIPELINE_WINDOW;
+
+	afc_lock(client);
+
+	ret = afc_requests_wait(client, 0);
+	while (ret == AFC_E_SUCCESS && !pipeline.eof && pipeline.error == AFC_E_SUCCESS) {
+		while (ret == AFC_E_SUCCESS && client->requests_count < window) {
+			ret = afc_file_read_submit(client, handle, pipeline.chunk_size, afc_pipeline_read_cb, &pipeline);
+		}
+		if (ret == AFC_E_SUCCESS) {
+			ret = afc_requests_wait(client, window - 1);
+		}
+	}
+	/* collect the responses to reads sent past the end of the file */
+	if (ret == AFC_E_SUCCESS) {
+		ret = afc_requests_wait(client, 0);
+	} else {
+		afc_requests_fail(client, ret);
+	}
+
+	afc_unlock(client);
+
+	if (bytes_read)
+		*bytes_read = pipeline.bytes;
+
+	return (ret != AFC_E_SUCCESS) ? ret : pipeline.error;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_write_pipelined(afc_client_t client, uint64_t handle, uint32_t chunk_size, uint32_t window, afc_file_source_cb_t callback, void *user_data, uint64_t *bytes_written)
+{
+	struct afc_pipeline pipeline;
+	afc_error_t ret;
+	char *buffer;
+	ssize_t amount;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0 || !callback)
+		return AFC_E_INVALID_ARG;
+
+	memset(&pipeline, 0, sizeof(pipeline));
+	pipeline.source = callback;
+	pipeline.user_data = user_data;
+	pipeline.chunk_size = (chunk_size) ? chunk_size : AFC_PIPELINE_CHUNK_SIZE;
+	if (!window)
+		window = AFC_PIPELINE_WINDOW;
+
+	/* the data is sent before a request is queued, so one buffer will do */
+	buffer = (char*)malloc(pipeline.chunk_size);
+	if (!buffer)
+		return AFC_E_NO_MEM;
+
+	afc_lock(client);
+
+	ret = afc_requests_wait(client, 0);
+	while (ret == AFC_E_SUCCESS && !pipeline.eof && pipeline.error == AFC_E_SUCCESS) {
+		while (ret == AFC_E_SUCCESS && client->requests_count < window) {
+			amount = pipeline.source(buffer, pipeline.chunk_size, pipeline.user_data);
+			if (amount < 0) {
+				pipeline.error = AFC_E_OP_INTERRUPTED;
+				break;
+			} else if (amount == 0) {
+				pipeline.eof = 1;
+				break;
+			}
+			ret = afc_file_write_submit(client, handle, buffer, (uint32_t)amount, afc_pipeline_write_cb, &pipeline);
+		}
+		if (ret == AFC_E_SUCCESS) {
+			ret = afc_requests_wait(client, window - 1);
+		}
+	}
+	if (ret == AFC_E_SUCCESS) {
+		ret = afc_requests_wait(client, 0);
+	} else {
+		afc_requests_fail(client, ret);
+	}
+
+	afc_unlock(client);
+
+	free(buffer);
+
+	if (bytes_written)
+		*bytes_written = pipeline.bytes;
+
+	return (ret != AFC_E_SUCCESS) ? ret : pipeline.error;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 {
 	int i = 0;
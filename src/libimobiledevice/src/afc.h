@@ -50,6 +50,15 @@ typedef struct {
 	(x)->packet_num    = le64toh((x)->packet_num); \
 	(x)->operation     = le64toh((x)->operation);
 
+/* An asynchronous request waiting for its response */
+struct afc_request {
+	uint64_t packet_num;
+	uint64_t operation;
+	uint32_t length;
+	afc_request_cb_t callback;
+	void *user_data;
+};
+
 struct afc_client_private {
 	service_client_t parent;
 	AFCPacket *afc_packet;
@@ -57,6 +66,14 @@ struct afc_client_private {
 	int lock;
 	mutex_t mutex;
 	int free_parent;
+	/* ring buffer of requests in flight, oldest first */
+	struct afc_request *requests;
+	uint32_t requests_size;
+	uint32_t requests_head;
+	uint32_t requests_count;
+	/* reused for received responses, only grows */
+	char *scratch;
+	uint32_t scratch_size;
 };
 
 /* AFC Operations */
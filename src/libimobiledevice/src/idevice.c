@@ -31,6 +31,10 @@
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include <usbmuxd.h>
@@ -363,6 +367,144 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_
 	return internal_connection_send(connection, data, len, sent_bytes);
 }
 
+/* buffers that are coalesced on the stack instead of the heap */
+#define IDEVICE_SENDV_STACK_SIZE 4096
+/* more buffers than this are coalesced before sending */
+#define IDEVICE_SENDV_MAX_IOV 16
+
+/**
+ * Internally used function to copy several buffers into one.
+ */
+static char *internal_coalesce(const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t total, char *stackbuf)
+{
+	char *buf = (total <= IDEVICE_SENDV_STACK_SIZE) ? stackbuf : (char*)malloc(total);
+	uint32_t offset = 0;
+	uint32_t i;
+
+	if (!buf) {
+		return NULL;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].length > 0) {
+			memcpy(buf + offset, iov[i].data, iov[i].length);
+			offset += iov[i].length;
+		}
+	}
+	return buf;
+}
+
+/**
+ * Internally used function to send raw data from several buffers over the
+ * given connection with as few system calls as possible.
+ */
+static idevice_error_t internal_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t total, uint32_t *sent_bytes)
+{
+	char stackbuf[IDEVICE_SENDV_STACK_SIZE];
+	idevice_error_t res;
+	char *buf;
+
+#ifndef WIN32
+	if (connection->type == CONNECTION_USBMUXD && iovcnt <= IDEVICE_SENDV_MAX_IOV) {
+		struct iovec vec[IDEVICE_SENDV_MAX_IOV];
+		struct msghdr msg;
+		int fd = (int)(long)connection->data;
+		int flags = 0;
+		uint32_t done = 0;
+		uint32_t i;
+		ssize_t sent;
+
+#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+#endif
+		for (i = 0; i < iovcnt; i++) {
+			vec[i].iov_base = (void*)iov[i].data;
+			vec[i].iov_len = iov[i].length;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = iovcnt;
+
+		while (done < total) {
+			sent = sendmsg(fd, &msg, flags);
+			if (sent < 0) {
+				if (errno == EINTR)
+					continue;
+				debug_info("ERROR: sendmsg returned %d (%s)", errno, strerror(errno));
+				*sent_bytes = done;
+				return (done > 0) ? IDEVICE_E_SUCCESS : IDEVICE_E_UNKNOWN_ERROR;
+			}
+			done += sent;
+			/* skip what went out already */
+			while (sent > 0 && msg.msg_iovlen > 0) {
+				if ((size_t)sent >= msg.msg_iov->iov_len) {
+					sent -= msg.msg_iov->iov_len;
+					msg.msg_iov++;
+					msg.msg_iovlen--;
+				} else {
+					msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + sent;
+					msg.msg_iov->iov_len -= sent;
+					sent = 0;
+				}
+			}
+		}
+		*sent_bytes = done;
+		return IDEVICE_E_SUCCESS;
+	}
+#endif
+
+	buf = internal_coalesce(iov, iovcnt, total, stackbuf);
+	if (!buf) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	res = internal_connection_send(connection, buf, total, sent_bytes);
+	if (buf != stackbuf) {
+		free(buf);
+	}
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes)
+{
+	char stackbuf[IDEVICE_SENDV_STACK_SIZE];
+	idevice_error_t res;
+	uint32_t total = 0;
+	uint32_t i;
+	char *buf;
+
+	if (!connection || !iov || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].length > 0 && !iov[i].data) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		if (iov[i].length > UINT32_MAX - total) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		total += iov[i].length;
+	}
+	if (total == 0) {
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (connection->ssl_data) {
+		/* one SSL_write() produces one record instead of one per buffer */
+		buf = internal_coalesce(iov, iovcnt, total, stackbuf);
+		if (!buf) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		res = idevice_connection_send(connection, buf, total, sent_bytes);
+		if (buf != stackbuf) {
+			free(buf);
+		}
+		return res;
+	}
+
+	return internal_connection_sendv(connection, iov, iovcnt, total, sent_bytes);
+}
+
 /**
  * Internally used function for receiving raw data over the given connection
  * using a timeout.
@@ -104,10 +104,11 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 static property_list_service_error_t internal_plist_send(property_list_service_client_t client, plist_t plist, int binary)
 {
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	idevice_iovec_t iov[2];
 	char *content = NULL;
 	uint32_t length = 0;
 	uint32_t nlen = 0;
-	int bytes = 0;
+	uint32_t bytes = 0;
 
 	if (!client || (client && !client->parent) || !plist) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
@@ -125,20 +126,22 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 
 	nlen = htobe32(length);
 	debug_info("sending %d bytes", length);
-	service_send(client->parent, (const char*)&nlen, sizeof(nlen), (uint32_t*)&bytes);
-	if (bytes == sizeof(nlen)) {
-		service_send(client->parent, content, length, (uint32_t*)&bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if ((uint32_t)bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
-			}
+	/* length prefix and plist go out in a single write */
+	iov[0].data = (const char*)&nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = content;
+	iov[1].length = length;
+	service_sendv(client->parent, iov, 2, &bytes);
+	if (bytes > 0) {
+		debug_info("sent %d bytes", bytes);
+		debug_plist(plist);
+		if (bytes == sizeof(nlen) + length) {
+			res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+		} else {
+			debug_info("ERROR: Could not send all data (%d of %d)!", bytes, (uint32_t)(sizeof(nlen) + length));
 		}
 	}
-	if (bytes <= 0) {
+	if (bytes == 0) {
 		debug_info("ERROR: sending to device failed.");
 	}
 
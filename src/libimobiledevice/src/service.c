@@ -149,6 +149,27 @@ LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const
 	return res;
 }
 
+LIBIMOBILEDEVICE_API service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !iov || (iovcnt == 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	res = idevice_to_service_error(idevice_connection_sendv(client->connection, iov, iovcnt, &bytes));
+	debug_info("sent %d bytes", bytes);
+	if (bytes == 0) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client_t client, char* data, uint32_t size, uint32_t *received, unsigned int timeout)
 {
 	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
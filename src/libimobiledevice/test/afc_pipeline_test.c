@@ -0,0 +1,589 @@
+/*
+ * afc_pipeline_test.c
+ * Runs the asynchronous and pipelined AFC requests against a mock device
+ * on a socket pair, checking the data and the order of completion.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "idevice.h"
+#include "afc.h"
+
+#define TEST_CHUNK_SIZE 65536
+#define TEST_WINDOW 8
+#define TEST_ASYNC_READS 4
+#define TEST_ASYNC_LENGTH 10
+
+#define CHECK(cond) \
+	if (!(cond)) { \
+		printf("  %s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		goto leave; \
+	}
+
+/* The device end of the connection. Reads and writes go to one file. */
+struct mock_device {
+	int fd;
+	pthread_t thread;
+	const char *content;
+	size_t content_length;
+	size_t position;
+	/* the most a read returns, 0 for no limit */
+	uint32_t max_read;
+	/* answer the n-th read or write with fail_status, 0 for never */
+	int fail_at;
+	uint64_t fail_status;
+	int requests;
+	/* with batch set, collect that many requests, answer the ones listed
+	 * in answer_order (up to a -1) and hang up */
+	int batch;
+	int answer_order[TEST_ASYNC_READS + 1];
+	char *written;
+	size_t written_length;
+};
+
+struct mock_connection {
+	struct idevice_connection_private connection;
+	struct service_client_private service;
+	afc_client_t client;
+};
+
+static int mock_recv_all(int fd, void *buf, size_t length)
+{
+	size_t done = 0;
+	ssize_t res;
+
+	while (done < length) {
+		res = recv(fd, (char*)buf + done, length - done, 0);
+		if (res <= 0)
+			return -1;
+		done += res;
+	}
+	return 0;
+}
+
+static char *mock_packet(uint64_t packet_num, uint64_t operation, const void *data, uint32_t length, uint32_t *packet_length)
+{
+	AFCPacket header;
+	char *packet = (char*)malloc(sizeof(AFCPacket) + length);
+
+	memcpy(header.magic, AFC_MAGIC, AFC_MAGIC_LEN);
+	header.entire_length = sizeof(AFCPacket) + length;
+	header.this_length = (operation == AFC_OP_DATA) ? sizeof(AFCPacket) : header.entire_length;
+	header.packet_num = packet_num;
+	header.operation = operation;
+	AFCPacket_to_LE(&header);
+	memcpy(packet, &header, sizeof(AFCPacket));
+	if (length)
+		memcpy(packet + sizeof(AFCPacket), data, length);
+	*packet_length = sizeof(AFCPacket) + length;
+	return packet;
+}
+
+static char *mock_status(uint64_t packet_num, uint64_t status, uint32_t *packet_length)
+{
+	status = htole64(status);
+	return mock_packet(packet_num, AFC_OP_STATUS, &status, sizeof(status), packet_length);
+}
+
+/**
+ * Plays the device for one request and returns the response packet.
+ */
+static char *mock_answer(struct mock_device *dev, AFCPacket *header, const char *body, uint32_t *packet_length)
+{
+	uint64_t size;
+	uint64_t position;
+	int64_t offset;
+
+	switch (header->operation) {
+	case AFC_OP_FILE_READ:
+	case AFC_OP_FILE_WRITE:
+		if (++dev->requests == dev->fail_at)
+			return mock_status(header->packet_num, dev->fail_status, packet_length);
+		if (header->operation == AFC_OP_FILE_WRITE) {
+			size = header->entire_length - header->this_length;
+			dev->written = (char*)realloc(dev->written, dev->written_length + size);
+			memcpy(dev->written + dev->written_length, body + 8, size);
+			dev->written_length += size;
+			return mock_status(header->packet_num, AFC_E_SUCCESS, packet_length);
+		}
+		memcpy(&size, body + 8, sizeof(size));
+		size = le64toh(size);
+		if (dev->max_read && size > dev->max_read)
+			size = dev->max_read;
+		if (size > dev->content_length - dev->position)
+			size = dev->content_length - dev->position;
+		dev->position += size;
+		return mock_packet(header->packet_num, AFC_OP_DATA, dev->content + dev->position - size, (uint32_t)size, packet_length);
+	case AFC_OP_FILE_TELL:
+		position = htole64(dev->position);
+		return mock_packet(header->packet_num, AFC_OP_FILE_TELL_RES, &position, sizeof(position), packet_length);
+	case AFC_OP_FILE_SEEK:
+		memcpy(&offset, body + 16, sizeof(offset));
+		dev->position = (size_t)le64toh(offset);
+		return mock_status(header->packet_num, AFC_E_SUCCESS, packet_length);
+	default:
+		return mock_status(header->packet_num, AFC_E_OP_NOT_SUPPORTED, packet_length);
+	}
+}
+
+static void *mock_thread(void *arg)
+{
+	struct mock_device *dev = (struct mock_device*)arg;
+	char *held[TEST_ASYNC_READS];
+	uint32_t held_length[TEST_ASYNC_READS];
+	int num_held = 0;
+	AFCPacket header;
+	char *body;
+	char *packet;
+	uint32_t packet_length;
+	int i;
+
+	while (mock_recv_all(dev->fd, &header, sizeof(header)) == 0) {
+		AFCPacket_from_LE(&header);
+		body = (char*)malloc(header.entire_length - sizeof(AFCPacket) + 1);
+		if (mock_recv_all(dev->fd, body, header.entire_length - sizeof(AFCPacket)) < 0) {
+			free(body);
+			break;
+		}
+		packet = mock_answer(dev, &header, body, &packet_length);
+		free(body);
+
+		if (!dev->batch) {
+			send(dev->fd, packet, packet_length, 0);
+			free(packet);
+			continue;
+		}
+
+		held[num_held] = packet;
+		held_length[num_held++] = packet_length;
+		if (num_held < dev->batch)
+			continue;
+		for (i = 0; dev->answer_order[i] >= 0; i++) {
+			send(dev->fd, held[dev->answer_order[i]], held_length[dev->answer_order[i]], 0);
+		}
+		for (i = 0; i < num_held; i++) {
+			free(held[i]);
+		}
+		shutdown(dev->fd, SHUT_RDWR);
+		break;
+	}
+
+	return NULL;
+}
+
+static int mock_start(struct mock_device *dev, struct mock_connection *conn)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		return -1;
+
+	dev->fd = fds[1];
+	memset(conn, 0, sizeof(struct mock_connection));
+	conn->connection.type = CONNECTION_USBMUXD;
+	conn->connection.data = (void*)(intptr_t)fds[0];
+	conn->service.connection = &conn->connection;
+	if (afc_client_new_with_service_client(&conn->service, &conn->client) != AFC_E_SUCCESS ||
+		pthread_create(&dev->thread, NULL, mock_thread, dev) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	return 0;
+}
+
+static void mock_stop(struct mock_device *dev, struct mock_connection *conn)
+{
+	afc_client_free(conn->client);
+	close((int)(intptr_t)conn->connection.data);
+	pthread_join(dev->thread, NULL);
+	close(dev->fd);
+}
+
+static char *make_content(size_t length)
+{
+	char *content = (char*)malloc(length + 1);
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		content[i] = (char)((i * 7 + 3) % 251);
+	return content;
+}
+
+struct sink_state {
+	char *data;
+	size_t length;
+	int calls;
+	int abort_at;
+};
+
+static ssize_t test_sink(const void *data, size_t length, void *user_data)
+{
+	struct sink_state *sink = (struct sink_state*)user_data;
+
+	if (++sink->calls == sink->abort_at)
+		return -1;
+	sink->data = (char*)realloc(sink->data, sink->length + length);
+	memcpy(sink->data + sink->length, data, length);
+	sink->length += length;
+	return length;
+}
+
+struct source_state {
+	const char *data;
+	size_t length;
+	size_t position;
+};
+
+static ssize_t test_source(void *buffer, size_t length, void *user_data)
+{
+	struct source_state *source = (struct source_state*)user_data;
+
+	if (length > source->length - source->position)
+		length = source->length - source->position;
+	memcpy(buffer, source->data + source->position, length);
+	source->position += length;
+	return length;
+}
+
+/**
+ * Reads the whole file, which the device hands out max_read bytes at a
+ * time at most.
+ */
+static int test_read(size_t length, uint32_t max_read)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct sink_state sink;
+	uint64_t bytes = 0;
+	int res = -1;
+
+	memset(&dev, 0, sizeof(dev));
+	memset(&sink, 0, sizeof(sink));
+	dev.content = make_content(length);
+	dev.content_length = length;
+	dev.max_read = max_read;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)dev.content);
+		return -1;
+	}
+
+	CHECK(afc_file_read_pipelined(conn.client, 1, TEST_CHUNK_SIZE, TEST_WINDOW, test_sink, &sink, &bytes) == AFC_E_SUCCESS);
+	CHECK(bytes == length);
+	CHECK(sink.length == length);
+	CHECK(memcmp(sink.data, dev.content, length) == 0);
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	free((char*)dev.content);
+	free(sink.data);
+	return res;
+}
+
+static int test_read_in_order(void)
+{
+	return test_read(1024 * 1024 + 123, 0);
+}
+
+static int test_read_eof(void)
+{
+	/* ends on a chunk boundary, so only an empty response tells */
+	return test_read(16 * TEST_CHUNK_SIZE, 0);
+}
+
+static int test_read_short(void)
+{
+	return test_read(300000, 1000);
+}
+
+static int test_read_error(void)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct sink_state sink;
+	uint64_t bytes = 0;
+	uint64_t position = 0;
+	int res = -1;
+
+	memset(&dev, 0, sizeof(dev));
+	memset(&sink, 0, sizeof(sink));
+	dev.content = make_content(1024 * 1024);
+	dev.content_length = 1024 * 1024;
+	dev.fail_at = 5;
+	dev.fail_status = AFC_E_IO_ERROR;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)dev.content);
+		return -1;
+	}
+
+	CHECK(afc_file_read_pipelined(conn.client, 1, TEST_CHUNK_SIZE, TEST_WINDOW, test_sink, &sink, &bytes) == AFC_E_IO_ERROR);
+	CHECK(bytes == 4 * TEST_CHUNK_SIZE);
+	CHECK(memcmp(sink.data, dev.content, sink.length) == 0);
+	/* the responses to the other reads in flight must not be taken for this one */
+	CHECK(afc_file_tell(conn.client, 1, &position) == AFC_E_SUCCESS);
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	free((char*)dev.content);
+	free(sink.data);
+	return res;
+}
+
+static int test_sink_abort(void)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct sink_state sink;
+	uint64_t bytes = 0;
+	uint64_t position = 0;
+	int res = -1;
+
+	memset(&dev, 0, sizeof(dev));
+	memset(&sink, 0, sizeof(sink));
+	dev.content = make_content(1024 * 1024);
+	dev.content_length = 1024 * 1024;
+	sink.abort_at = 3;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)dev.content);
+		return -1;
+	}
+
+	CHECK(afc_file_read_pipelined(conn.client, 1, TEST_CHUNK_SIZE, TEST_WINDOW, test_sink, &sink, &bytes) == AFC_E_OP_INTERRUPTED);
+	CHECK(bytes == 2 * TEST_CHUNK_SIZE);
+	CHECK(sink.calls == 3);
+	CHECK(afc_file_tell(conn.client, 1, &position) == AFC_E_SUCCESS);
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	free((char*)dev.content);
+	free(sink.data);
+	return res;
+}
+
+static int test_write(void)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct source_state source;
+	uint64_t bytes = 0;
+	int res = -1;
+
+	memset(&dev, 0, sizeof(dev));
+	source.length = 1024 * 1024 + 77;
+	source.data = make_content(source.length);
+	source.position = 0;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)source.data);
+		return -1;
+	}
+
+	CHECK(afc_file_write_pipelined(conn.client, 1, TEST_CHUNK_SIZE, TEST_WINDOW, test_source, &source, &bytes) == AFC_E_SUCCESS);
+	CHECK(bytes == source.length);
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	if (res == 0 && (dev.written_length != source.length || memcmp(dev.written, source.data, source.length) != 0)) {
+		printf("  device got different data\n");
+		res = -1;
+	}
+	free((char*)source.data);
+	free(dev.written);
+	return res;
+}
+
+static int test_write_error(void)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct source_state source;
+	uint64_t bytes = 0;
+	uint64_t position = 0;
+	int res = -1;
+
+	memset(&dev, 0, sizeof(dev));
+	dev.fail_at = 3;
+	dev.fail_status = AFC_E_NO_SPACE_LEFT;
+	source.length = 1024 * 1024;
+	source.data = make_content(source.length);
+	source.position = 0;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)source.data);
+		return -1;
+	}
+
+	CHECK(afc_file_write_pipelined(conn.client, 1, TEST_CHUNK_SIZE, TEST_WINDOW, test_source, &source, &bytes) == AFC_E_NO_SPACE_LEFT);
+	CHECK(bytes < source.length);
+	CHECK(afc_file_tell(conn.client, 1, &position) == AFC_E_SUCCESS);
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	free((char*)source.data);
+	free(dev.written);
+	return res;
+}
+
+struct completion {
+	uint64_t request_id;
+	afc_error_t status;
+	char data[TEST_ASYNC_LENGTH];
+	uint32_t length;
+};
+
+struct completions {
+	struct completion list[TEST_ASYNC_READS];
+	int count;
+};
+
+static void test_read_cb(afc_client_t client, uint64_t request_id, afc_error_t status, const char *data, uint32_t length, void *user_data)
+{
+	struct completions *done = (struct completions*)user_data;
+	struct completion *c;
+
+	if (done->count == TEST_ASYNC_READS)
+		return;
+	c = &done->list[done->count++];
+	c->request_id = request_id;
+	c->status = status;
+	c->length = (length < TEST_ASYNC_LENGTH) ? length : TEST_ASYNC_LENGTH;
+	if (data)
+		memcpy(c->data, data, c->length);
+}
+
+/**
+ * Has the device answer TEST_ASYNC_READS reads in the given order and
+ * hang up, then checks that each answer reached its own request and that
+ * the unanswered ones failed oldest first.
+ */
+static int test_out_of_order(const int *answer_order, int answered)
+{
+	struct mock_device dev;
+	struct mock_connection conn;
+	struct completions done;
+	uint64_t ids[TEST_ASYNC_READS];
+	uint32_t pending = 0;
+	int res = -1;
+	int failed;
+	int i;
+	int j;
+
+	memset(&dev, 0, sizeof(dev));
+	memset(&done, 0, sizeof(done));
+	dev.content = make_content(TEST_ASYNC_READS * TEST_ASYNC_LENGTH);
+	dev.content_length = TEST_ASYNC_READS * TEST_ASYNC_LENGTH;
+	dev.batch = TEST_ASYNC_READS;
+	for (i = 0; i < answered; i++)
+		dev.answer_order[i] = answer_order[i];
+	dev.answer_order[answered] = -1;
+	if (mock_start(&dev, &conn) < 0) {
+		free((char*)dev.content);
+		return -1;
+	}
+
+	for (i = 0; i < TEST_ASYNC_READS; i++) {
+		CHECK(afc_file_read_async(conn.client, 1, TEST_ASYNC_LENGTH, test_read_cb, &done, &ids[i]) == AFC_E_SUCCESS);
+	}
+	afc_complete_requests(conn.client, 0, &pending);
+	CHECK(pending == 0);
+	CHECK(done.count == TEST_ASYNC_READS);
+
+	for (i = 0; i < answered; i++) {
+		j = answer_order[i];
+		CHECK(done.list[i].request_id == ids[j]);
+		CHECK(done.list[i].status == AFC_E_SUCCESS);
+		CHECK(done.list[i].length == TEST_ASYNC_LENGTH);
+		CHECK(memcmp(done.list[i].data, dev.content + j * TEST_ASYNC_LENGTH, TEST_ASYNC_LENGTH) == 0);
+	}
+
+	/* the rest fail in the order they were sent */
+	failed = answered;
+	for (j = 0; j < TEST_ASYNC_READS; j++) {
+		for (i = 0; i < answered && answer_order[i] != j; i++);
+		if (i < answered)
+			continue;
+		CHECK(done.list[failed].request_id == ids[j]);
+		CHECK(done.list[failed].status != AFC_E_SUCCESS);
+		failed++;
+	}
+	res = 0;
+
+leave:
+	mock_stop(&dev, &conn);
+	free((char*)dev.content);
+	return res;
+}
+
+static int test_out_of_order_all(void)
+{
+	static const int order[] = { 3, 0, 2, 1 };
+	return test_out_of_order(order, 4);
+}
+
+static int test_out_of_order_hangup(void)
+{
+	static const int order[] = { 2 };
+	return test_out_of_order(order, 1);
+}
+
+struct test {
+	const char *name;
+	int (*run)(void);
+};
+
+static const struct test tests[] = {
+	{ "pipelined read", test_read_in_order },
+	{ "pipelined read ending on a chunk boundary", test_read_eof },
+	{ "pipelined read with short responses", test_read_short },
+	{ "pipelined read with an error status", test_read_error },
+	{ "pipelined read aborted by the sink", test_sink_abort },
+	{ "pipelined write", test_write },
+	{ "pipelined write with an error status", test_write_error },
+	{ "asynchronous reads answered out of order", test_out_of_order_all },
+	{ "asynchronous reads partly answered before hangup", test_out_of_order_hangup },
+	{ NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+	int failures = 0;
+	int i;
+
+	for (i = 0; tests[i].name; i++) {
+		if (tests[i].run() == 0) {
+			printf("%s: ok\n", tests[i].name);
+		} else {
+			printf("%s: FAILED\n", tests[i].name);
+			failures++;
+		}
+	}
+
+	return (failures) ? 1 : 0;
+}
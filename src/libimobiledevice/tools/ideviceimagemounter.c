@@ -335,31 +335,14 @@ int main(int argc, char **argv)
 					goto leave;
 				}
 
-				char buf[8192];
-				size_t amount = 0;
-				do {
-					amount = fread(buf, 1, sizeof(buf), f);
-					if (amount > 0) {
-						uint32_t written, total = 0;
-						while (total < amount) {
-							written = 0;
-							if (afc_file_write(afc, af, buf, amount, &written) !=
-								AFC_E_SUCCESS) {
-								fprintf(stderr, "AFC Write error!\n");
-								break;
-							}
-							total += written;
-						}
-						if (total != amount) {
-							fprintf(stderr, "Error: wrote only %d of %d\n", total,
-									(unsigned int)amount);
-							afc_file_close(afc, af);
-							fclose(f);
-							goto leave;
-						}
-					}
+				uint64_t written = 0;
+				if (afc_file_write_pipelined(afc, af, 0, 0, mim_upload_cb, f, &written) != AFC_E_SUCCESS
+				    || written != (uint64_t)image_size) {
+					fprintf(stderr, "Error: wrote only %" PRIu64 " of %" PRIu64 "\n", written, (uint64_t)image_size);
+					afc_file_close(afc, af);
+					fclose(f);
+					goto leave;
 				}
-				while (amount > 0);
 
 				afc_file_close(afc, af);
 				break;
@@ -37,6 +37,7 @@ static int wsa_init = 0;
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #endif
 #include "socket.h"
 
@@ -291,11 +292,17 @@ int socket_connect(const char *addr, uint16_t port)
 
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 {
+#ifdef WIN32
 	fd_set fds;
-	int sret;
-	int eagain;
 	struct timeval to;
 	struct timeval *pto;
+#else
+	// poll() instead of select() so descriptors >= FD_SETSIZE work too
+	struct pollfd pfd;
+	int pto;
+#endif
+	int sret;
+	int eagain;
 
 	if (fd < 0) {
 		if (verbose >= 2)
@@ -303,6 +310,7 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		return -1;
 	}
 
+#ifdef WIN32
 	FD_ZERO(&fds);
 	FD_SET(fd, &fds);
 
@@ -313,11 +321,31 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 	} else {
 		pto = NULL;
 	}
+#else
+	pfd.fd = fd;
+	pfd.revents = 0;
+	switch (fdm) {
+	case FDM_READ:
+		pfd.events = POLLIN;
+		break;
+	case FDM_WRITE:
+		pfd.events = POLLOUT;
+		break;
+	case FDM_EXCEPT:
+		pfd.events = POLLPRI;
+		break;
+	default:
+		return -1;
+	}
+
+	pto = (timeout > 0) ? (int)timeout : -1;
+#endif
 
 	sret = -1;
 
 	do {
 		eagain = 0;
+#ifdef WIN32
 		switch (fdm) {
 		case FDM_READ:
 			sret = select(fd + 1, &fds, NULL, NULL, pto);
@@ -331,6 +359,9 @@ int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout)
 		default:
 			return -1;
 		}
+#else
+		sret = poll(&pfd, 1, pto);
+#endif
 
 		if (sret < 0) {
 			switch (errno) {
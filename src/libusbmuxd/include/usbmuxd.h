@@ -225,6 +225,15 @@ int usbmuxd_delete_pair_record(const char* record_id);
  */
 void libusbmuxd_set_use_inotify(int set);
 
+/**
+ * Enable or disable persistent mode. When enabled, a background thread stays
+ * connected to usbmuxd and keeps track of the attached devices, so the device
+ * list and lookups by UDID are answered from memory. Pair records and the
+ * SystemBUID that were read are cached as well. Disabled by default; setting
+ * the environment variable LIBUSBMUXD_PERSISTENT=1 enables it too.
+ */
+void libusbmuxd_set_persistent(int set);
+
 void libusbmuxd_set_debug_level(int level);
 
 #ifdef __cplusplus
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -99,6 +100,64 @@ static volatile int use_tag = 0;
 static volatile int proto_version = 1;
 static volatile int try_list_devices = 1;
 
+/*
+ * In persistent mode the device monitor thread stays connected to usbmuxd
+ * even without a subscriber. Device lookups are answered from the table it
+ * keeps, and pair records and the BUID are cached, instead of opening a new
+ * socket for every request.
+ */
+#define DEVICE_SYNC_TIMEOUT 100	/* ms without events after Listen until the table is complete */
+#define PAIR_RECORD_TTL 10	/* seconds a cached pair record is trusted */
+
+struct pair_record_entry {
+	char *record_id;
+	char *data;
+	uint32_t size;
+	time_t time;
+};
+
+static int persistent_mode = 0;
+static int persistent_env_checked = 0;
+static volatile int monitor_running = 0;
+static int devices_synced = 0;
+static void *event_user_data = NULL;
+static struct collection pair_records;
+static char *cached_buid = NULL;
+
+#ifdef WIN32
+static CRITICAL_SECTION cache_mutex;
+static volatile LONG cache_mutex_state = 0;
+
+static void cache_lock()
+{
+	if (InterlockedCompareExchange(&cache_mutex_state, 1, 0) == 0) {
+		InitializeCriticalSection(&cache_mutex);
+		cache_mutex_state = 2;
+	}
+	while (cache_mutex_state != 2) {
+		Sleep(0);
+	}
+	EnterCriticalSection(&cache_mutex);
+}
+
+static void cache_unlock()
+{
+	LeaveCriticalSection(&cache_mutex);
+}
+#else
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void cache_lock()
+{
+	pthread_mutex_lock(&cache_mutex);
+}
+
+static void cache_unlock()
+{
+	pthread_mutex_unlock(&cache_mutex);
+}
+#endif
+
 /**
  * Finds a device info record by its handle.
  * if the record is not found, NULL is returned.
@@ -527,7 +586,7 @@ static int usbmuxd_listen_poll()
 
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
-		while (event_cb) {
+		while (monitor_running) {
 			if ((sfd = connect_usbmuxd_socket()) >= 0) {
 				break;
 			}
@@ -650,28 +709,76 @@ retry:
 	return sfd;
 }
 
+/**
+ * Drops the cached pair record with the given id, or all of them if
+ * record_id is NULL. Must be called with the cache locked.
+ */
+static void pair_records_drop(const char *record_id)
+{
+	if (!pair_records.list) {
+		return;
+	}
+	FOREACH(struct pair_record_entry *entry, &pair_records) {
+		if (!record_id || !strcmp(entry->record_id, record_id)) {
+			collection_remove(&pair_records, entry);
+			free(entry->record_id);
+			free(entry->data);
+			free(entry);
+		}
+	} ENDFOREACH
+}
+
+/**
+ * Forgets everything learned from usbmuxd, e.g. when the connection to it
+ * went away and it might have been restarted.
+ */
+static void cache_flush()
+{
+	cache_lock();
+	pair_records_drop(NULL);
+	free(cached_buid);
+	cached_buid = NULL;
+	cache_unlock();
+}
+
 /**
  * Waits for an event to occur, i.e. a packet coming from usbmuxd.
  * Calls generate_event to pass the event via callback to the client program.
+ *
+ * @return 1 if a packet was handled, 0 if nothing arrived within timeout
+ *     milliseconds (0 waits forever), or a negative errno value.
  */
-static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
+static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data, int timeout)
 {
 	struct usbmuxd_header hdr;
 	void *payload = NULL;
+	int res;
+
+	res = receive_packet(sfd, &hdr, &payload, timeout);
+	if (res < 0) {
+		struct collection removed;
 
-	/* block until we receive something */
-	if (receive_packet(sfd, &hdr, &payload, 0) < 0) {
 		DEBUG(1, "%s: Error in usbmuxd connection, disconnecting all devices!\n", __func__);
 		// when then usbmuxd connection fails,
 		// generate remove events for every device that
 		// is still present so applications know about it
-		FOREACH(usbmuxd_device_info_t *dev, &devices) {
+		cache_lock();
+		devices_synced = 0;
+		removed = devices;
+		collection_init(&devices);
+		cache_unlock();
+		cache_flush();
+
+		FOREACH(usbmuxd_device_info_t *dev, &removed) {
 			generate_event(callback, dev, UE_DEVICE_REMOVE, user_data);
-			collection_remove(&devices, dev);
 			free(dev);
 		} ENDFOREACH
+		collection_free(&removed);
 		return -EIO;
 	}
+	if (res == 0) {
+		return 0;
+	}
 
 	if ((hdr.length > sizeof(hdr)) && !payload) {
 		DEBUG(1, "%s: Invalid packet received, payload is missing!\n", __func__);
@@ -696,7 +803,9 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 			sprintf(devinfo->udid + 32, "%08x", devinfo->handle);
 		}
 
+		cache_lock();
 		collection_add(&devices, devinfo);
+		cache_unlock();
 		generate_event(callback, devinfo, UE_DEVICE_ADD, user_data);
 	} else if (hdr.message == MESSAGE_DEVICE_REMOVE) {
 		uint32_t handle;
@@ -704,12 +813,17 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 
 		memcpy(&handle, payload, sizeof(uint32_t));
 
+		cache_lock();
 		devinfo = devices_find(handle);
+		if (devinfo) {
+			collection_remove(&devices, devinfo);
+			pair_records_drop(devinfo->udid);
+		}
+		cache_unlock();
 		if (!devinfo) {
 			DEBUG(1, "%s: WARNING: got device remove message for handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
 			generate_event(callback, devinfo, UE_DEVICE_REMOVE, user_data);
-			collection_remove(&devices, devinfo);
 			free(devinfo);
 		}
 	} else if (hdr.message == MESSAGE_DEVICE_PAIRED) {
@@ -718,7 +832,12 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 
 		memcpy(&handle, payload, sizeof(uint32_t));
 
+		cache_lock();
 		devinfo = devices_find(handle);
+		if (devinfo) {
+			pair_records_drop(devinfo->udid);
+		}
+		cache_unlock();
 		if (!devinfo) {
 			DEBUG(1, "%s: WARNING: got paired message for device handle %d, but couldn't find the corresponding handle in the device list. This event will be ignored.\n", __func__, handle);
 		} else {
@@ -730,16 +849,20 @@ static int get_next_event(int sfd, usbmuxd_event_cb_t callback, void *user_data)
 	if (payload) {
 		free(payload);
 	}
-	return 0;
+	return 1;
 }
 
 static void device_monitor_cleanup(void* data)
 {
+	cache_lock();
+	devices_synced = 0;
 	FOREACH(usbmuxd_device_info_t *dev, &devices) {
 		collection_remove(&devices, dev);
 		free(dev);
 	} ENDFOREACH
 	collection_free(&devices);
+	cache_unlock();
+	cache_flush();
 
 	socket_close(listenfd);
 	listenfd = -1;
@@ -752,23 +875,42 @@ static void device_monitor_cleanup(void* data)
  */
 static void *device_monitor(void *data)
 {
+	cache_lock();
 	collection_init(&devices);
+	cache_unlock();
 
 #ifndef WIN32
 	pthread_cleanup_push(device_monitor_cleanup, NULL);
 #endif
-	while (event_cb) {
+	while (monitor_running) {
 
 		listenfd = usbmuxd_listen();
 		if (listenfd < 0) {
 			continue;
 		}
 
-		while (event_cb) {
-			int res = get_next_event(listenfd, event_cb, data);
+		while (monitor_running) {
+			usbmuxd_event_cb_t callback;
+			void *user_data;
+			int synced;
+
+			cache_lock();
+			callback = event_cb;
+			user_data = event_user_data;
+			synced = devices_synced;
+			cache_unlock();
+
+			// usbmuxd sends all present devices right after Listen,
+			// the table is complete once that burst is over
+			int res = get_next_event(listenfd, callback, user_data, synced ? 0 : DEVICE_SYNC_TIMEOUT);
 			if (res < 0) {
 			    break;
 			}
+			if (res == 0) {
+				cache_lock();
+				devices_synced = 1;
+				cache_unlock();
+			}
 		}
 	}
 
@@ -780,35 +922,40 @@ static void *device_monitor(void *data)
 	return NULL;
 }
 
-USBMUXD_API int usbmuxd_subscribe(usbmuxd_event_cb_t callback, void *user_data)
+static int device_monitor_start()
 {
 	int res;
 
-	if (!callback) {
-		return -EINVAL;
+	if (monitor_running) {
+		return 0;
 	}
-	event_cb = callback;
+	monitor_running = 1;
 
 #ifdef WIN32
 	res = 0;
-	devmon = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)device_monitor, user_data, 0, NULL);
+	devmon = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)device_monitor, NULL, 0, NULL);
 	if (devmon == NULL) {
 		res = GetLastError();
 	}
 #else
-	res = pthread_create(&devmon, NULL, device_monitor, user_data);
+	res = pthread_create(&devmon, NULL, device_monitor, NULL);
 #endif
 	if (res != 0) {
+		monitor_running = 0;
 		DEBUG(1, "%s: ERROR: Could not start device watcher thread!\n", __func__);
 		return res;
 	}
 	return 0;
 }
 
-USBMUXD_API int usbmuxd_unsubscribe()
+static int device_monitor_stop()
 {
 	int res;
-	event_cb = NULL;
+
+	if (!monitor_running) {
+		return 0;
+	}
+	monitor_running = 0;
 
 	socket_shutdown(listenfd, SHUT_RDWR);
 
@@ -833,6 +980,84 @@ USBMUXD_API int usbmuxd_unsubscribe()
 	return 0;
 }
 
+/**
+ * Enables persistent mode if requested through the environment, so tools
+ * can use it without being changed.
+ */
+static void persistent_mode_check_env()
+{
+	if (persistent_env_checked) {
+		return;
+	}
+	persistent_env_checked = 1;
+	const char *env = getenv("LIBUSBMUXD_PERSISTENT");
+	if (env && atoi(env) > 0) {
+		libusbmuxd_set_persistent(1);
+	}
+}
+
+USBMUXD_API int usbmuxd_subscribe(usbmuxd_event_cb_t callback, void *user_data)
+{
+	struct collection present;
+
+	if (!callback) {
+		return -EINVAL;
+	}
+	cache_lock();
+	event_user_data = user_data;
+	event_cb = callback;
+	cache_unlock();
+
+	if (!monitor_running) {
+		return device_monitor_start();
+	}
+
+	// the monitor already runs for persistent mode, tell the new
+	// subscriber about the devices it knows of
+	collection_init(&present);
+	cache_lock();
+	FOREACH(usbmuxd_device_info_t *dev, &devices) {
+		usbmuxd_device_info_t *copy = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t));
+		memcpy(copy, dev, sizeof(usbmuxd_device_info_t));
+		collection_add(&present, copy);
+	} ENDFOREACH
+	cache_unlock();
+	FOREACH(usbmuxd_device_info_t *dev, &present) {
+		generate_event(callback, dev, UE_DEVICE_ADD, user_data);
+		free(dev);
+	} ENDFOREACH
+	collection_free(&present);
+
+	return 0;
+}
+
+USBMUXD_API int usbmuxd_unsubscribe()
+{
+	cache_lock();
+	event_cb = NULL;
+	cache_unlock();
+
+	if (persistent_mode) {
+		return 0;
+	}
+	return device_monitor_stop();
+}
+
+USBMUXD_API void libusbmuxd_set_persistent(int set)
+{
+	persistent_env_checked = 1;
+	if (set) {
+		persistent_mode = 1;
+		device_monitor_start();
+	} else {
+		persistent_mode = 0;
+		if (!event_cb) {
+			device_monitor_stop();
+		}
+		cache_flush();
+	}
+}
+
 static usbmuxd_device_info_t *device_info_from_device_record(struct usbmuxd_device_record *dev)
 {
 	if (!dev) {
@@ -856,6 +1081,34 @@ static usbmuxd_device_info_t *device_info_from_device_record(struct usbmuxd_devi
 	return devinfo;
 }
 
+/**
+ * Copies the device table kept by the monitor thread in persistent mode.
+ *
+ * @return the number of devices, or -1 if the table is not complete (yet).
+ */
+static int device_list_from_table(usbmuxd_device_info_t **device_list)
+{
+	usbmuxd_device_info_t *newlist;
+	int dev_cnt = 0;
+
+	cache_lock();
+	if (!devices_synced) {
+		cache_unlock();
+		return -1;
+	}
+	newlist = (usbmuxd_device_info_t*)malloc(sizeof(usbmuxd_device_info_t) * (collection_count(&devices) + 1));
+	FOREACH(usbmuxd_device_info_t *di, &devices) {
+		memcpy(&newlist[dev_cnt], di, sizeof(usbmuxd_device_info_t));
+		dev_cnt++;
+	} ENDFOREACH
+	cache_unlock();
+
+	memset(&newlist[dev_cnt], 0, sizeof(usbmuxd_device_info_t));
+	*device_list = newlist;
+
+	return dev_cnt;
+}
+
 USBMUXD_API int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
 {
 	int sfd;
@@ -871,6 +1124,15 @@ USBMUXD_API int usbmuxd_get_device_list(usbmuxd_device_info_t **device_list)
 
 	*device_list = NULL;
 
+	persistent_mode_check_env();
+	if (persistent_mode) {
+		dev_cnt = device_list_from_table(device_list);
+		if (dev_cnt >= 0) {
+			return dev_cnt;
+		}
+		dev_cnt = 0;
+	}
+
 retry:
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
@@ -1024,6 +1286,27 @@ USBMUXD_API int usbmuxd_get_device_by_udid(const char *udid, usbmuxd_device_info
 	if (!device) {
 		return -EINVAL;
 	}
+
+	persistent_mode_check_env();
+	if (persistent_mode) {
+		int found = -1;
+		cache_lock();
+		if (devices_synced) {
+			found = 0;
+			FOREACH(usbmuxd_device_info_t *di, &devices) {
+				if (!udid || !strcmp(udid, di->udid)) {
+					memcpy(device, di, sizeof(usbmuxd_device_info_t));
+					found = 1;
+					break;
+				}
+			} ENDFOREACH
+		}
+		cache_unlock();
+		if (found >= 0) {
+			return found;
+		}
+	}
+
 	if (usbmuxd_get_device_list(&dev_list) < 0) {
 		return -ENODEV;
 	}
@@ -1154,6 +1437,18 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 	}
 	*buid = NULL;
 
+	persistent_mode_check_env();
+	if (persistent_mode) {
+		cache_lock();
+		if (cached_buid) {
+			*buid = strdup(cached_buid);
+		}
+		cache_unlock();
+		if (*buid) {
+			return 0;
+		}
+	}
+
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n", __func__, strerror(errno));
@@ -1173,6 +1468,12 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 			if (node && plist_get_node_type(node) == PLIST_STRING) {
 				plist_get_string_val(node, buid);
 			}
+			if (persistent_mode && *buid) {
+				cache_lock();
+				free(cached_buid);
+				cached_buid = strdup(*buid);
+				cache_unlock();
+			}
 			ret = 0;
 		} else if (ret == 1) {
 			ret = -(int)rc;
@@ -1184,6 +1485,56 @@ USBMUXD_API int usbmuxd_read_buid(char **buid)
 	return ret;
 }
 
+/**
+ * Gets a copy of a pair record cached in persistent mode.
+ *
+ * @return 1 if a record that is not too old was found, 0 otherwise.
+ */
+static int pair_record_from_cache(const char *record_id, char **record_data, uint32_t *record_size)
+{
+	int found = 0;
+
+	cache_lock();
+	if (pair_records.list) {
+		FOREACH(struct pair_record_entry *entry, &pair_records) {
+			if (strcmp(entry->record_id, record_id)) {
+				continue;
+			}
+			if (time(NULL) - entry->time < PAIR_RECORD_TTL) {
+				*record_data = (char*)malloc(entry->size);
+				memcpy(*record_data, entry->data, entry->size);
+				*record_size = entry->size;
+				found = 1;
+			}
+			break;
+		} ENDFOREACH
+	}
+	cache_unlock();
+
+	return found;
+}
+
+static void pair_record_to_cache(const char *record_id, const char *record_data, uint32_t record_size)
+{
+	struct pair_record_entry *entry = (struct pair_record_entry*)malloc(sizeof(struct pair_record_entry));
+	if (!entry) {
+		return;
+	}
+	entry->record_id = strdup(record_id);
+	entry->data = (char*)malloc(record_size);
+	memcpy(entry->data, record_data, record_size);
+	entry->size = record_size;
+	entry->time = time(NULL);
+
+	cache_lock();
+	if (!pair_records.list) {
+		collection_init(&pair_records);
+	}
+	pair_records_drop(record_id);
+	collection_add(&pair_records, entry);
+	cache_unlock();
+}
+
 USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_data, uint32_t *record_size)
 {
 	int sfd;
@@ -1196,6 +1547,11 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 	*record_data = NULL;
 	*record_size = 0;
 
+	persistent_mode_check_env();
+	if (persistent_mode && pair_record_from_cache(record_id, record_data, record_size)) {
+		return 0;
+	}
+
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
@@ -1219,6 +1575,9 @@ USBMUXD_API int usbmuxd_read_pair_record(const char* record_id, char **record_da
 				plist_get_data_val(node, record_data, &int64val);
 				if (*record_data && int64val > 0) {
 					*record_size = (uint32_t)int64val;
+					if (persistent_mode) {
+						pair_record_to_cache(record_id, *record_data, *record_size);
+					}
 					ret = 0;
 				}
 			}
@@ -1242,6 +1601,10 @@ USBMUXD_API int usbmuxd_save_pair_record(const char* record_id, const char *reco
 		return -EINVAL;
 	}
 
+	cache_lock();
+	pair_records_drop(record_id);
+	cache_unlock();
+
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
@@ -1281,6 +1644,10 @@ USBMUXD_API int usbmuxd_delete_pair_record(const char* record_id)
 		return -EINVAL;
 	}
 
+	cache_lock();
+	pair_records_drop(record_id);
+	cache_unlock();
+
 	sfd = connect_usbmuxd_socket();
 	if (sfd < 0) {
 		DEBUG(1, "%s: Error: Connection to usbmuxd failed: %s\n",
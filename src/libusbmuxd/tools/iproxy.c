@@ -23,6 +23,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SPLICE) && defined(HAVE_ACCEPT4) && defined(HAVE_PIPE2)
+#define HAVE_EPOLL_PROXY 1
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,19 +51,34 @@ typedef unsigned int socklen_t;
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <signal.h>
+#endif
+#ifdef HAVE_EPOLL_PROXY
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #endif
 #include "socket.h"
 #include "usbmuxd.h"
 
-static uint16_t listen_port = 0;
-static uint16_t device_port = 0;
-static char* device_udid = NULL;
+struct port_mapping {
+	uint16_t listen_port;
+	uint16_t device_port;
+	const char *udid;
+	int lfd;
+};
+
+static struct port_mapping *mappings = NULL;
+static int num_mappings = 0;
 
 struct client_data {
 	int fd;
 	int sfd;
+	struct port_mapping *map;
 	volatile int stop_ctos;
 	volatile int stop_stoc;
+	uint64_t bytes_ctos;
+	uint64_t bytes_stoc;
 };
 
 static void *run_stoc_loop(void *arg)
@@ -77,6 +103,9 @@ static void *run_stoc_loop(void *arg)
 		} else {
 			// send to socket
 			sent = socket_send(cdata->fd, buffer, recv_len);
+			if (sent > 0) {
+				cdata->bytes_stoc += sent;
+			}
 			if (sent < recv_len) {
 				if (sent <= 0) {
 					fprintf(stderr, "send failed: %s\n", strerror(errno));
@@ -130,6 +159,9 @@ static void *run_ctos_loop(void *arg)
 		} else {
 			// send to local socket
 			sent = socket_send(cdata->sfd, buffer, recv_len);
+			if (sent > 0) {
+				cdata->bytes_ctos += sent;
+			}
 			if (sent < recv_len) {
 				if (sent <= 0) {
 					fprintf(stderr, "send failed: %s\n", strerror(errno));
@@ -196,10 +228,10 @@ static void *acceptor_thread(void *arg)
 	}
 
 	usbmuxd_device_info_t *dev = NULL;
-	if (device_udid) {
+	if (cdata->map->udid) {
 		int i;
 		for (i = 0; i < count; i++) {
-			if (strncmp(dev_list[i].udid, device_udid, sizeof(dev_list[0].udid)) == 0) {
+			if (strncmp(dev_list[i].udid, cdata->map->udid, sizeof(dev_list[0].udid)) == 0) {
 				dev = &(dev_list[i]);
 				break;
 			}
@@ -218,9 +250,9 @@ static void *acceptor_thread(void *arg)
 		return NULL;
 	}
 
-	fprintf(stdout, "Requesting connecion to device handle == %d (serial: %s), port %d\n", dev->handle, dev->udid, device_port);
+	fprintf(stdout, "Requesting connecion to device handle == %d (serial: %s), port %d\n", dev->handle, dev->udid, cdata->map->device_port);
 
-	cdata->sfd = usbmuxd_connect(dev->handle, device_port);
+	cdata->sfd = usbmuxd_connect(dev->handle, cdata->map->device_port);
 	free(dev_list);
 	if (cdata->sfd < 0) {
 		fprintf(stderr, "Error connecting to device!\n");
@@ -234,6 +266,7 @@ static void *acceptor_thread(void *arg)
 		pthread_create(&ctos, NULL, run_ctos_loop, cdata);
 		pthread_join(ctos, NULL);
 #endif
+		printf("closed connection %d -> %d: %llu bytes to device, %llu bytes from device\n", cdata->map->listen_port, cdata->map->device_port, (unsigned long long)cdata->bytes_ctos, (unsigned long long)cdata->bytes_stoc);
 	}
 
 	if (cdata->fd > 0) {
@@ -247,22 +280,647 @@ static void *acceptor_thread(void *arg)
 	return NULL;
 }
 
-int main(int argc, char **argv)
+
+static void *listener_thread(void *arg)
 {
-	int mysock = -1;
+	struct port_mapping *map = (struct port_mapping*)arg;
+#ifdef WIN32
+	HANDLE acceptor = NULL;
+#else
+	pthread_t acceptor;
+#endif
+	struct client_data *cdata;
+	int c_sock;
 
-	if (argc < 3) {
-		printf("usage: %s LOCAL_TCP_PORT DEVICE_TCP_PORT [UDID]\n", argv[0]);
-		return 0;
+	while (1) {
+		printf("waiting for connection on port %d\n", map->listen_port);
+		c_sock = socket_accept(map->lfd, map->listen_port);
+		if (c_sock) {
+			printf("accepted connection, fd = %d\n", c_sock);
+			cdata = (struct client_data*)calloc(1, sizeof(struct client_data));
+			if (!cdata) {
+				socket_close(c_sock);
+				fprintf(stderr, "ERROR: Out of memory\n");
+				exit(-1);
+			}
+			cdata->fd = c_sock;
+			cdata->map = map;
+#ifdef WIN32
+			acceptor = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)acceptor_thread, cdata, 0, NULL);
+			CloseHandle(acceptor);
+#else
+			pthread_create(&acceptor, NULL, acceptor_thread, cdata);
+			pthread_detach(acceptor);
+#endif
+		} else {
+			break;
+		}
+	}
+	socket_close(c_sock);
+
+	return NULL;
+}
+
+static int run_threaded(void)
+{
+	int i;
+#ifdef WIN32
+	HANDLE *listeners = (HANDLE*)calloc(num_mappings, sizeof(HANDLE));
+#else
+	pthread_t *listeners = (pthread_t*)calloc(num_mappings, sizeof(pthread_t));
+#endif
+
+	if (!listeners) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < num_mappings; i++) {
+#ifdef WIN32
+		listeners[i] = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)listener_thread, &mappings[i], 0, NULL);
+#else
+		pthread_create(&listeners[i], NULL, listener_thread, &mappings[i]);
+#endif
+	}
+	for (i = 0; i < num_mappings; i++) {
+#ifdef WIN32
+		WaitForSingleObject(listeners[i], INFINITE);
+		CloseHandle(listeners[i]);
+#else
+		pthread_join(listeners[i], NULL);
+#endif
+	}
+	free(listeners);
+
+	return 0;
+}
+
+#ifdef HAVE_EPOLL_PROXY
+/*
+ * Event driven proxy mode. Each worker thread runs its own epoll loop and
+ * owns the connections it accepted; the listening sockets are shared by all
+ * workers. Data is moved between the client socket and the usbmuxd socket
+ * with splice() through a pipe per direction, so it never gets copied to
+ * user space.
+ */
+
+#define PROXY_PIPE_SIZE 262144
+#define PROXY_MAX_EVENTS 64
+#define PROXY_ACCEPT_BATCH 16
+#define PROXY_PUMP_ROUNDS 16
+
+enum proxy_endpoint_type {
+	PROXY_EP_LISTENER,
+	PROXY_EP_WAKEUP,
+	PROXY_EP_CLIENT,
+	PROXY_EP_DEVICE
+};
+
+struct proxy_conn;
+
+struct proxy_endpoint {
+	enum proxy_endpoint_type type;
+	int fd;
+	uint32_t events;
+	int registered;
+	int hup;
+	struct port_mapping *map;
+	struct proxy_conn *conn;
+};
+
+struct proxy_direction {
+	int src;
+	int dst;
+	int pipe[2];
+	size_t capacity;
+	size_t pending;
+	int eof;
+	int full;
+	int shut;
+	uint64_t bytes;
+};
+
+struct proxy_conn {
+	struct proxy_endpoint client;
+	struct proxy_endpoint device;
+	struct proxy_direction ctos;
+	struct proxy_direction stoc;
+	struct port_mapping *map;
+	uint32_t handle;
+	time_t started;
+	int closed;
+	struct proxy_conn *next;
+	struct proxy_conn *prev;
+};
+
+struct proxy_worker {
+	int index;
+	int efd;
+	int wakeup[2];
+	struct proxy_endpoint wakeup_ep;
+	struct proxy_endpoint *listeners;
+	struct proxy_conn *conns;
+	struct proxy_conn *dead;
+	pthread_t thread;
+};
+
+static struct proxy_worker *workers = NULL;
+static int num_workers = 1;
+
+static int proxy_set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int proxy_direction_init(struct proxy_direction *dir, int src, int dst)
+{
+	int size;
+
+	dir->src = src;
+	dir->dst = dst;
+	if (pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		dir->pipe[0] = dir->pipe[1] = -1;
+		return -1;
+	}
+	dir->capacity = 65536;
+#ifdef F_SETPIPE_SZ
+	// a bigger pipe lets a single splice() move more data per wakeup
+	fcntl(dir->pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+#endif
+#ifdef F_GETPIPE_SZ
+	size = fcntl(dir->pipe[1], F_GETPIPE_SZ);
+	if (size > 0) {
+		dir->capacity = size;
+	}
+#else
+	(void)size;
+#endif
+	return 0;
+}
+
+/*
+ * Gives up on a direction whose destination went away; nothing queued for it
+ * can be delivered anymore.
+ */
+static void proxy_direction_drop(struct proxy_direction *dir)
+{
+	dir->eof = 1;
+	dir->full = 0;
+	dir->pending = 0;
+	dir->shut = 1;
+}
+
+/*
+ * Moves as much data as possible from dir->src through the pipe to dir->dst.
+ * Returns -1 if the connection failed, 0 otherwise.
+ */
+static int proxy_pump(struct proxy_direction *dir)
+{
+	int rounds = PROXY_PUMP_ROUNDS;
+	int progress;
+	ssize_t res;
+
+	do {
+		progress = 0;
+		if (!dir->eof && !dir->full) {
+			res = splice(dir->src, NULL, dir->pipe[1], NULL, dir->capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (res > 0) {
+				dir->pending += res;
+				progress = 1;
+			} else if (res == 0) {
+				dir->eof = 1;
+			} else if (errno == EAGAIN) {
+				// with data in the pipe this can also mean the pipe is
+				// out of buffers; wait until the other side drained it
+				if (dir->pending > 0) {
+					dir->full = 1;
+				}
+			} else if (errno != EINTR) {
+				return -1;
+			}
+		}
+		if (dir->pending > 0) {
+			res = splice(dir->pipe[0], NULL, dir->dst, NULL, dir->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (res > 0) {
+				dir->pending -= res;
+				dir->bytes += res;
+				dir->full = 0;
+				progress = 1;
+			} else if (res < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+				// the receiver is gone, the other direction may still have
+				// data to deliver
+				proxy_direction_drop(dir);
+				break;
+			} else if (res < 0 && errno != EAGAIN && errno != EINTR) {
+				return -1;
+			}
+		}
+	} while (progress && --rounds > 0);
+
+	if (dir->eof && dir->pending == 0 && !dir->shut) {
+		shutdown(dir->dst, SHUT_WR);
+		dir->shut = 1;
+	}
+
+	return 0;
+}
+
+static void proxy_update_endpoint(struct proxy_worker *w, struct proxy_endpoint *ep, struct proxy_direction *in, struct proxy_direction *out)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+
+	if (!in->eof && !in->full) {
+		events |= EPOLLIN;
+	}
+	if (out->pending > 0) {
+		events |= EPOLLOUT;
+	}
+	if (ep->hup && events == 0) {
+		// EPOLLHUP is reported regardless of the requested events, so a
+		// hung up endpoint that has to wait for its peer must not stay in
+		// the set or the worker would spin on it
+		if (ep->registered && epoll_ctl(w->efd, EPOLL_CTL_DEL, ep->fd, NULL) == 0) {
+			ep->registered = 0;
+			ep->events = 0;
+		}
+		return;
+	}
+	if (ep->registered && events == ep->events) {
+		return;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ep;
+	if (epoll_ctl(w->efd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ep->fd, &ev) == 0) {
+		ep->registered = 1;
+		ep->events = events;
+	}
+}
+
+static void proxy_print_conn(struct proxy_conn *conn, const char *what)
+{
+	printf("%s connection %d -> %d (handle %d, fd %d): %lds, %llu bytes to device, %llu bytes from device\n",
+		what, conn->map->listen_port, conn->map->device_port, conn->handle, conn->client.fd,
+		(long)(time(NULL) - conn->started),
+		(unsigned long long)conn->ctos.bytes, (unsigned long long)conn->stoc.bytes);
+	fflush(stdout);
+}
+
+static void proxy_conn_close(struct proxy_worker *w, struct proxy_conn *conn)
+{
+	if (conn->closed) {
+		return;
+	}
+	proxy_print_conn(conn, "closed");
+	conn->closed = 1;
+
+	close(conn->ctos.pipe[0]);
+	close(conn->ctos.pipe[1]);
+	close(conn->stoc.pipe[0]);
+	close(conn->stoc.pipe[1]);
+	socket_close(conn->client.fd);
+	socket_close(conn->device.fd);
+
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		w->conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+	// events for the other endpoint might still be queued in this batch
+	conn->next = w->dead;
+	w->dead = conn;
+}
+
+static void proxy_conn_handle(struct proxy_worker *w, struct proxy_endpoint *ep, uint32_t events)
+{
+	struct proxy_conn *conn = ep->conn;
+	struct proxy_direction *in;
+	struct proxy_direction *out;
+	int res = 0;
+
+	if (conn->closed) {
+		return;
+	}
+	if (events & EPOLLERR) {
+		proxy_conn_close(w, conn);
+		return;
+	}
+
+	in = (ep->type == PROXY_EP_CLIENT) ? &conn->ctos : &conn->stoc;
+	out = (ep->type == PROXY_EP_CLIENT) ? &conn->stoc : &conn->ctos;
+
+	// EPOLLHUP means the peer closed, but data it sent before might still be
+	// unread; keep reading until EOF, only the way towards it is dead
+	if (events & EPOLLHUP) {
+		ep->hup = 1;
+		if (!out->shut) {
+			proxy_direction_drop(out);
+		}
+	}
+
+	if (events & (EPOLLIN | EPOLLHUP)) {
+		res |= proxy_pump(in);
+	}
+	if ((events & EPOLLOUT) && !ep->hup) {
+		res |= proxy_pump(out);
+	}
+
+	if (res < 0 || (conn->ctos.shut && conn->stoc.shut
+	    && conn->ctos.pending == 0 && conn->stoc.pending == 0)) {
+		proxy_conn_close(w, conn);
+		return;
+	}
+
+	proxy_update_endpoint(w, &conn->client, &conn->ctos, &conn->stoc);
+	proxy_update_endpoint(w, &conn->device, &conn->stoc, &conn->ctos);
+}
+
+static int proxy_add_endpoint(struct proxy_worker *w, struct proxy_endpoint *ep, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = ep;
+	ep->events = events;
+	ep->registered = 1;
+
+	return epoll_ctl(w->efd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/*
+ * Connecting to the device is a blocking request/reply with usbmuxd; a device
+ * that is slow to answer only stalls the worker that accepted the connection.
+ */
+static void proxy_conn_start(struct proxy_worker *w, struct port_mapping *map, int fd)
+{
+	usbmuxd_device_info_t dev;
+	struct proxy_conn *conn;
+	int sfd;
+
+	if (usbmuxd_get_device_by_udid(map->udid, &dev) <= 0) {
+		printf("No connected/matching device found, disconnecting client.\n");
+		socket_close(fd);
+		return;
+	}
+
+	sfd = usbmuxd_connect(dev.handle, map->device_port);
+	if (sfd < 0) {
+		fprintf(stderr, "Error connecting to device %s port %d!\n", dev.udid, map->device_port);
+		socket_close(fd);
+		return;
+	}
+
+	conn = (struct proxy_conn*)calloc(1, sizeof(struct proxy_conn));
+	if (!conn) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		socket_close(sfd);
+		socket_close(fd);
+		return;
+	}
+	conn->ctos.pipe[0] = conn->ctos.pipe[1] = -1;
+	conn->stoc.pipe[0] = conn->stoc.pipe[1] = -1;
+	conn->map = map;
+	conn->handle = dev.handle;
+	conn->started = time(NULL);
+	conn->client.type = PROXY_EP_CLIENT;
+	conn->client.fd = fd;
+	conn->client.conn = conn;
+	conn->device.type = PROXY_EP_DEVICE;
+	conn->device.fd = sfd;
+	conn->device.conn = conn;
+
+	if (proxy_set_nonblocking(sfd) < 0
+	    || proxy_direction_init(&conn->ctos, fd, sfd) < 0
+	    || proxy_direction_init(&conn->stoc, sfd, fd) < 0) {
+		fprintf(stderr, "Error setting up connection: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if (proxy_add_endpoint(w, &conn->client, EPOLLIN) < 0
+	    || proxy_add_endpoint(w, &conn->device, EPOLLIN) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	conn->next = w->conns;
+	if (w->conns) {
+		w->conns->prev = conn;
+	}
+	w->conns = conn;
+
+	printf("accepted connection %d -> %d (handle %d, serial: %s), fd = %d\n", map->listen_port, map->device_port, dev.handle, dev.udid, fd);
+	return;
+
+fail:
+	if (conn->ctos.pipe[0] >= 0) {
+		close(conn->ctos.pipe[0]);
+		close(conn->ctos.pipe[1]);
+	}
+	if (conn->stoc.pipe[0] >= 0) {
+		close(conn->stoc.pipe[0]);
+		close(conn->stoc.pipe[1]);
+	}
+	socket_close(sfd);
+	socket_close(fd);
+	free(conn);
+}
+
+static void proxy_accept(struct proxy_worker *w, struct port_mapping *map)
+{
+	int i;
+	int fd;
+
+	for (i = 0; i < PROXY_ACCEPT_BATCH; i++) {
+		fd = accept4(map->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, "accept: %s\n", strerror(errno));
+			}
+			break;
+		}
+		proxy_conn_start(w, map, fd);
 	}
+}
+
+static void proxy_print_stats(struct proxy_worker *w)
+{
+	struct proxy_conn *conn;
+	char buf[64];
+
+	while (read(w->wakeup[0], buf, sizeof(buf)) > 0);
+
+	for (conn = w->conns; conn; conn = conn->next) {
+		proxy_print_conn(conn, "active");
+	}
+}
 
-	listen_port = atoi(argv[1]);
-	device_port = atoi(argv[2]);
+static void *proxy_worker_thread(void *arg)
+{
+	struct proxy_worker *w = (struct proxy_worker*)arg;
+	struct epoll_event events[PROXY_MAX_EVENTS];
+	struct proxy_endpoint *ep;
+	struct proxy_conn *conn;
+	int i;
+	int n;
+
+	while (1) {
+		n = epoll_wait(w->efd, events, PROXY_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			ep = (struct proxy_endpoint*)events[i].data.ptr;
+			switch (ep->type) {
+			case PROXY_EP_LISTENER:
+				proxy_accept(w, ep->map);
+				break;
+			case PROXY_EP_WAKEUP:
+				proxy_print_stats(w);
+				break;
+			default:
+				proxy_conn_handle(w, ep, events[i].events);
+				break;
+			}
+		}
+		while (w->dead) {
+			conn = w->dead;
+			w->dead = conn->next;
+			free(conn);
+		}
+	}
+
+	return NULL;
+}
+
+static int proxy_worker_init(struct proxy_worker *w, int index)
+{
+	uint32_t listen_events = EPOLLIN;
+	int i;
+
+#ifdef EPOLLEXCLUSIVE
+	// only wake up one of the workers for each incoming connection
+	if (num_workers > 1) {
+		listen_events |= EPOLLEXCLUSIVE;
+	}
+#endif
+
+	w->index = index;
+	w->efd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->efd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		return -1;
+	}
+	if (pipe2(w->wakeup, O_NONBLOCK | O_CLOEXEC) < 0) {
+		fprintf(stderr, "pipe2: %s\n", strerror(errno));
+		return -1;
+	}
+	w->wakeup_ep.type = PROXY_EP_WAKEUP;
+	w->wakeup_ep.fd = w->wakeup[0];
+	if (proxy_add_endpoint(w, &w->wakeup_ep, EPOLLIN) < 0) {
+		fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+		return -1;
+	}
+
+	w->listeners = (struct proxy_endpoint*)calloc(num_mappings, sizeof(struct proxy_endpoint));
+	if (!w->listeners) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < num_mappings; i++) {
+		w->listeners[i].type = PROXY_EP_LISTENER;
+		w->listeners[i].fd = mappings[i].lfd;
+		w->listeners[i].map = &mappings[i];
+		if (proxy_add_endpoint(w, &w->listeners[i], listen_events) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_epoll(void)
+{
+	struct rlimit rl;
+	sigset_t sigs;
+	int sig = 0;
+	int i;
+
+	// every connection needs two sockets and two pipes
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
 
-	if (argc > 3) {
-		device_udid = argv[3];
+	// the shared socket helper only uses a backlog of 1
+	for (i = 0; i < num_mappings; i++) {
+		listen(mappings[i].lfd, SOMAXCONN);
+		proxy_set_nonblocking(mappings[i].lfd);
 	}
 
+	// the device lookup on each accepted connection is served from the
+	// device list libusbmuxd keeps in persistent mode
+	libusbmuxd_set_persistent(1);
+
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	workers = (struct proxy_worker*)calloc(num_workers, sizeof(struct proxy_worker));
+	if (!workers) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -1;
+	}
+	for (i = 0; i < num_workers; i++) {
+		if (proxy_worker_init(&workers[i], i) < 0) {
+			return -1;
+		}
+		if (pthread_create(&workers[i].thread, NULL, proxy_worker_thread, &workers[i]) != 0) {
+			fprintf(stderr, "Could not start worker thread\n");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < num_mappings; i++) {
+		printf("waiting for connections on port %d\n", mappings[i].listen_port);
+	}
+	fflush(stdout);
+
+	while (sigwait(&sigs, &sig) == 0) {
+		if (sig != SIGUSR1) {
+			break;
+		}
+		for (i = 0; i < num_workers; i++) {
+			if (write(workers[i].wakeup[1], "", 1) < 0) {
+				fprintf(stderr, "Could not wake up worker %d\n", i);
+			}
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static int add_mapping(uint16_t listen_port, uint16_t device_port, const char *udid)
+{
+	struct port_mapping *newmaps;
+
 	if (!listen_port) {
 		fprintf(stderr, "Invalid listen_port specified!\n");
 		return -EINVAL;
@@ -273,45 +931,139 @@ int main(int argc, char **argv)
 		return -EINVAL;
 	}
 
-	// first create the listening socket endpoint waiting for connections.
-	mysock = socket_create(listen_port);
-	if (mysock < 0) {
-		fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
-		return -errno;
-	} else {
-#ifdef WIN32
-		HANDLE acceptor = NULL;
-#else
-		pthread_t acceptor;
+	newmaps = (struct port_mapping*)realloc(mappings, sizeof(struct port_mapping) * (num_mappings + 1));
+	if (!newmaps) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return -ENOMEM;
+	}
+	mappings = newmaps;
+	mappings[num_mappings].listen_port = listen_port;
+	mappings[num_mappings].device_port = device_port;
+	mappings[num_mappings].udid = udid;
+	mappings[num_mappings].lfd = -1;
+	num_mappings++;
+
+	return 0;
+}
+
+static int parse_mapping(const char *arg)
+{
+	const char *device_port;
+	const char *udid;
+
+	device_port = strchr(arg, ':');
+	if (!device_port) {
+		fprintf(stderr, "Invalid mapping '%s', expected LOCAL_TCP_PORT:DEVICE_TCP_PORT[:UDID]\n", arg);
+		return -EINVAL;
+	}
+	device_port++;
+	udid = strchr(device_port, ':');
+	if (udid) {
+		udid++;
+	}
+
+	return add_mapping(atoi(arg), atoi(device_port), (udid && *udid) ? udid : NULL);
+}
+
+static void print_usage(const char *name)
+{
+	printf("usage: %s [OPTIONS] LOCAL_TCP_PORT DEVICE_TCP_PORT [UDID]\n", name);
+	printf("       %s [OPTIONS] -m LOCAL_TCP_PORT:DEVICE_TCP_PORT[:UDID] [-m ...]\n", name);
+	printf("\n");
+	printf("  -m, --map MAPPING\tforward LOCAL_TCP_PORT to DEVICE_TCP_PORT on the device\n");
+	printf("\t\t\twith the given UDID, or the first device if omitted.\n");
+	printf("\t\t\tCan be given more than once.\n");
+#ifdef HAVE_EPOLL_PROXY
+	printf("  -e, --epoll\t\tserve all connections from an event loop and forward\n");
+	printf("\t\t\tdata with splice() instead of two threads per connection.\n");
+	printf("\t\t\tSend SIGUSR1 to print the byte counters of all active\n");
+	printf("\t\t\tconnections.\n");
+	printf("  -w, --workers N\tuse N event loop threads (implies --epoll)\n");
 #endif
-		struct client_data *cdata;
-		int c_sock;
-		while (1) {
-			printf("waiting for connection\n");
-			c_sock = socket_accept(mysock, listen_port);
-			if (c_sock) {
-				printf("accepted connection, fd = %d\n", c_sock);
-				cdata = (struct client_data*)malloc(sizeof(struct client_data));
-				if (!cdata) {
-					socket_close(c_sock);
-					fprintf(stderr, "ERROR: Out of memory\n");
-					return -1;
-				}
-				cdata->fd = c_sock;
-#ifdef WIN32
-				acceptor = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)acceptor_thread, cdata, 0, NULL);
-				CloseHandle(acceptor);
-#else
-				pthread_create(&acceptor, NULL, acceptor_thread, cdata);
-				pthread_detach(acceptor);
+	printf("  -h, --help\t\tprints usage information\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *args[3];
+	int num_args = 0;
+#ifdef HAVE_EPOLL_PROXY
+	int use_epoll = 0;
 #endif
-			} else {
-				break;
+	int res;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--map")) {
+			i++;
+			if (!argv[i]) {
+				print_usage(argv[0]);
+				return 0;
+			}
+			res = parse_mapping(argv[i]);
+			if (res < 0) {
+				return res;
 			}
 		}
-		socket_close(c_sock);
-		socket_close(mysock);
+#ifdef HAVE_EPOLL_PROXY
+		else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--epoll")) {
+			use_epoll = 1;
+		}
+		else if (!strcmp(argv[i], "-w") || !strcmp(argv[i], "--workers")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) < 1) {
+				print_usage(argv[0]);
+				return 0;
+			}
+			num_workers = atoi(argv[i]);
+			use_epoll = 1;
+		}
+#endif
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argv[0]);
+			return 0;
+		}
+		else if (num_args < 3) {
+			args[num_args++] = argv[i];
+		}
+		else {
+			print_usage(argv[0]);
+			return 0;
+		}
 	}
 
-	return 0;
+	if (num_args == 1 || (num_args == 0 && num_mappings == 0)) {
+		print_usage(argv[0]);
+		return 0;
+	}
+
+	if (num_args > 0) {
+		res = add_mapping(atoi(args[0]), atoi(args[1]), (num_args > 2) ? args[2] : NULL);
+		if (res < 0) {
+			return res;
+		}
+	}
+
+	// first create the listening socket endpoints waiting for connections.
+	for (i = 0; i < num_mappings; i++) {
+		mappings[i].lfd = socket_create(mappings[i].listen_port);
+		if (mappings[i].lfd < 0) {
+			fprintf(stderr, "Error creating socket for port %d: %s\n", mappings[i].listen_port, strerror(errno));
+			return -errno;
+		}
+	}
+
+#ifdef HAVE_EPOLL_PROXY
+	if (use_epoll) {
+		res = run_epoll();
+	} else
+#endif
+	res = run_threaded();
+
+	for (i = 0; i < num_mappings; i++) {
+		socket_close(mappings[i].lfd);
+	}
+	free(mappings);
+
+	return res;
 }
@@ -42,6 +42,7 @@
 #include "client.h"
 #include "device.h"
 #include "conf.h"
+#include "event.h"
 
 #define CMD_BUF_SIZE	0x10000
 #define REPLY_BUF_SIZE	0x10000
@@ -57,9 +58,7 @@ enum client_state {
 
 struct mux_client {
 	int fd;
-	unsigned char *ob_buf;
-	uint32_t ob_size;
-	uint32_t ob_capacity;
+	struct ringbuf ob;
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
@@ -68,11 +67,25 @@ struct mux_client {
 	int connect_device;
 	enum client_state state;
 	uint32_t proto_version;
+	struct event_watch watch;
+	struct mux_connection *connection;
 };
 
 static struct collection client_list;
 pthread_mutex_t client_list_mutex;
 
+static void client_event_cb(struct event_watch *watch, short events);
+
+/**
+ * Push the client's current event mask to the event loop.
+ * The descriptor stays registered for the client's lifetime,
+ * so this is all that is needed when the mask changes.
+ */
+static void update_client_events(struct mux_client *client)
+{
+	event_modify(&client->watch, client->events);
+}
+
 /**
  * Receive raw data from the client socket.
  *
@@ -121,7 +134,40 @@ int client_write(struct mux_client *client, void *buffer, uint32_t len)
 }
 
 /**
- * Set event mask to use for ppoll()ing the client socket.
+ * Send raw data gathered from several buffers to the client socket.
+ *
+ * @param client Client to send to.
+ * @param iov The buffers to send, in order.
+ * @param iovcnt Number of entries in iov.
+ * @return Same as system call sendmsg(). Number of bytes written; when < 0 errno will be set.
+ */
+int client_writev(struct mux_client *client, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	int sret = -1;
+
+	usbmuxd_log(LL_SPEW, "client_writev fd %d iovcnt %d", client->fd, iovcnt);
+	if(client->state != CLIENT_CONNECTED) {
+		usbmuxd_log(LL_ERROR, "Attempted to write to client %d not in CONNECTED state", client->fd);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	sret = sendmsg(client->fd, &msg, 0);
+	if (sret < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			usbmuxd_log(LL_ERROR, "ERROR: client_writev: fd %d not ready for writing", client->fd);
+		} else {
+			usbmuxd_log(LL_ERROR, "ERROR: client_writev: sending to fd %d failed: %s", client->fd, strerror(errno));
+		}
+	}
+	return sret;
+}
+
+/**
+ * Set event mask to use for polling the client socket.
  * Typically POLLOUT and/or POLLIN. Note that this overrides
  * the current mask, that is, it is not ORing the argument
  * into the current mask.
@@ -137,8 +183,10 @@ int client_set_events(struct mux_client *client, short events)
 		return -1;
 	}
 	client->devents = events;
-	if(client->state == CLIENT_CONNECTED)
+	if(client->state == CLIENT_CONNECTED) {
 		client->events = events;
+		update_client_events(client);
+	}
 	return 0;
 }
 
@@ -176,15 +224,22 @@ int client_accept(int listenfd)
 	memset(client, 0, sizeof(struct mux_client));
 
 	client->fd = cfd;
-	client->ob_buf = malloc(REPLY_BUF_SIZE);
-	client->ob_size = 0;
-	client->ob_capacity = REPLY_BUF_SIZE;
+	ringbuf_init(&client->ob, REPLY_BUF_SIZE);
 	client->ib_buf = malloc(CMD_BUF_SIZE);
 	client->ib_size = 0;
 	client->ib_capacity = CMD_BUF_SIZE;
 	client->state = CLIENT_COMMAND;
 	client->events = POLLIN;
 
+	if(event_add(&client->watch, cfd, client->events, client_event_cb, client) < 0) {
+		usbmuxd_log(LL_ERROR, "Could not watch client fd %d", cfd);
+		close(cfd);
+		ringbuf_free(&client->ob);
+		free(client->ib_buf);
+		free(client);
+		return -1;
+	}
+
 	pthread_mutex_lock(&client_list_mutex);
 	collection_add(&client_list, client);
 	pthread_mutex_unlock(&client_list_mutex);
@@ -215,26 +270,18 @@ void client_close(struct mux_client *client)
 		client->state = CLIENT_DEAD;
 		device_abort_connect(client->connect_device, client);
 	}
-	close(client->fd);
-	if(client->ob_buf)
-		free(client->ob_buf);
-	if(client->ib_buf)
-		free(client->ib_buf);
+	// unlist it first, device notifications may come from other threads
 	pthread_mutex_lock(&client_list_mutex);
 	collection_remove(&client_list, client);
 	pthread_mutex_unlock(&client_list_mutex);
+	event_remove(&client->watch);
+	close(client->fd);
+	ringbuf_free(&client->ob);
+	if(client->ib_buf)
+		free(client->ib_buf);
 	free(client);
 }
 
-void client_get_fds(struct fdlist *list)
-{
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *client, &client_list) {
-		fdlist_add(list, FD_CLIENT, client->fd, client->events);
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
-}
-
 static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
 {
 	struct usbmuxd_header hdr;
@@ -244,25 +291,21 @@ static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtyp
 	hdr.tag = tag;
 	usbmuxd_log(LL_DEBUG, "send_pkt fd %d tag %d msg %d payload_length %d", client->fd, tag, msg, payload_length);
 
-	uint32_t available = client->ob_capacity - client->ob_size;
+	uint32_t available = client->ob.capacity - client->ob.size;
 	/* the output buffer _should_ be large enough, but just in case */
 	if(available < hdr.length) {
-		unsigned char* new_buf;
-		uint32_t new_size = ((client->ob_capacity + hdr.length + 4096) / 4096) * 4096;
-		usbmuxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob_capacity, new_size);
-		new_buf = realloc(client->ob_buf, new_size);
-		if (!new_buf) {
+		uint32_t new_size = ((client->ob.capacity + hdr.length + 4096) / 4096) * 4096;
+		usbmuxd_log(LL_DEBUG, "%s: Enlarging client %d output buffer %d -> %d", __func__, client->fd, client->ob.capacity, new_size);
+		if (ringbuf_grow(&client->ob, new_size) < 0) {
 			usbmuxd_log(LL_FATAL, "%s: Failed to realloc.", __func__);
 			return -1;
 		}
-		client->ob_buf = new_buf;
-		client->ob_capacity = new_size;
 	}
-	memcpy(client->ob_buf + client->ob_size, &hdr, sizeof(hdr));
+	ringbuf_write(&client->ob, &hdr, sizeof(hdr));
 	if(payload && payload_length)
-		memcpy(client->ob_buf + client->ob_size + sizeof(hdr), payload, payload_length);
-	client->ob_size += hdr.length;
+		ringbuf_write(&client->ob, payload, payload_length);
 	client->events |= POLLOUT;
+	update_client_events(client);
 	return hdr.length;
 }
 
@@ -312,6 +355,7 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 	if(result == RESULT_OK) {
 		client->state = CLIENT_CONNECTING2;
 		client->events = POLLOUT; // wait for the result packet to go through
+		update_client_events(client);
 		// no longer need this
 		free(client->ib_buf);
 		client->ib_buf = NULL;
@@ -321,6 +365,38 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 	return 0;
 }
 
+/**
+ * Stop watching the client socket on the calling thread's event loop,
+ * so it can be handed to another thread.
+ */
+void client_detach(struct mux_client *client)
+{
+	event_remove(&client->watch);
+}
+
+/**
+ * Start watching the client socket on the calling thread's event loop,
+ * taking it over from the thread that called client_detach().
+ */
+int client_attach(struct mux_client *client)
+{
+	return event_add(&client->watch, client->fd, client->events, client_event_cb, client);
+}
+
+/**
+ * The device connection this client is attached to, if any. Kept
+ * by device.c so client events need no search to find it.
+ */
+struct mux_connection *client_get_connection(struct mux_client *client)
+{
+	return client->connection;
+}
+
+void client_set_connection(struct mux_client *client, struct mux_connection *conn)
+{
+	client->connection = conn;
+}
+
 static plist_t create_device_attached_plist(struct device_info *dev)
 {
 	plist_t dict = plist_new_dict();
@@ -364,6 +440,98 @@ static int send_device_list(struct mux_client *client, uint32_t tag)
 	return res;
 }
 
+static plist_t create_histogram_plist(const uint64_t *hist)
+{
+	plist_t array = plist_new_array();
+	int i;
+	for (i = 0; i < EVENT_HIST_BUCKETS; i++) {
+		plist_array_append_item(array, plist_new_uint(hist[i]));
+	}
+	return array;
+}
+
+static plist_t create_connection_stats_plist(struct connection_stats *conn)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "SourcePort", plist_new_uint(conn->sport));
+	plist_dict_set_item(dict, "DestinationPort", plist_new_uint(conn->dport));
+	plist_dict_set_item(dict, "State", plist_new_string(conn->state));
+	plist_dict_set_item(dict, "TXWindow", plist_new_uint(conn->tx_win));
+	plist_dict_set_item(dict, "RXWindow", plist_new_uint(conn->rx_win));
+	plist_dict_set_item(dict, "BufferedBytes", plist_new_uint(conn->buffered));
+	plist_dict_set_item(dict, "UnackedBytes", plist_new_uint(conn->unacked));
+	plist_dict_set_item(dict, "RXBytes", plist_new_uint(conn->rx_bytes));
+	plist_dict_set_item(dict, "TXBytes", plist_new_uint(conn->tx_bytes));
+	plist_dict_set_item(dict, "ACKsSent", plist_new_uint(conn->acks_sent));
+	plist_dict_set_item(dict, "Age", plist_new_uint(conn->age));
+	return dict;
+}
+
+static plist_t create_device_stats_plist(struct device_stats *dev)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "DeviceID", plist_new_uint(dev->id));
+	plist_dict_set_item(dict, "SerialNumber", plist_new_string(dev->serial));
+	plist_dict_set_item(dict, "Thread", plist_new_uint(dev->thread));
+	plist_dict_set_item(dict, "RXBytes", plist_new_uint(dev->rx_bytes));
+	plist_dict_set_item(dict, "TXBytes", plist_new_uint(dev->tx_bytes));
+	plist_dict_set_item(dict, "RXPackets", plist_new_uint(dev->rx_packets));
+	plist_dict_set_item(dict, "TXPackets", plist_new_uint(dev->tx_packets));
+	plist_dict_set_item(dict, "TXTransfers", plist_new_uint(dev->tx_transfers));
+	plist_dict_set_item(dict, "RXTransfersInFlight", plist_new_uint(dev->rx_in_flight));
+	plist_dict_set_item(dict, "TXTransfersInFlight", plist_new_uint(dev->tx_in_flight));
+	plist_dict_set_item(dict, "Reassemblies", plist_new_uint(dev->reassemblies));
+	plist_dict_set_item(dict, "Errors", plist_new_uint(dev->errors));
+	plist_t conns = plist_new_array();
+	int i;
+	for (i = 0; i < dev->num_connections; i++) {
+		plist_array_append_item(conns, create_connection_stats_plist(&dev->connections[i]));
+	}
+	plist_dict_set_item(dict, "Connections", conns);
+	return dict;
+}
+
+/**
+ * Reply to GetStatistics with the counters of every device, its
+ * connections and the event loops. Times are in milliseconds (connection
+ * age) and microseconds (loop busy time); histogram bucket i counts
+ * waits or dispatch batches that took less than 2^(i+1) microseconds.
+ */
+static int send_statistics(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+	plist_t dict = plist_new_dict();
+	plist_t devices = plist_new_array();
+	plist_t loops = plist_new_array();
+
+	struct device_stats *devs = NULL;
+	struct event_stats *ev = NULL;
+	int num_loops = 0;
+	int i;
+
+	int count = device_get_stats(&devs, &ev, &num_loops);
+	for (i = 0; i < count; i++) {
+		plist_array_append_item(devices, create_device_stats_plist(&devs[i]));
+	}
+	for (i = 0; i < num_loops; i++) {
+		plist_t loop = plist_new_dict();
+		plist_dict_set_item(loop, "Thread", plist_new_uint(i));
+		plist_dict_set_item(loop, "Iterations", plist_new_uint(ev[i].iterations));
+		plist_dict_set_item(loop, "Dispatched", plist_new_uint(ev[i].dispatched));
+		plist_dict_set_item(loop, "BusyTime", plist_new_uint(ev[i].busy_usec));
+		plist_dict_set_item(loop, "WaitHistogram", create_histogram_plist(ev[i].wait_hist));
+		plist_dict_set_item(loop, "DispatchHistogram", create_histogram_plist(ev[i].dispatch_hist));
+		plist_array_append_item(loops, loop);
+	}
+	device_free_stats(devs, count, ev);
+
+	plist_dict_set_item(dict, "Devices", devices);
+	plist_dict_set_item(dict, "EventLoops", loops);
+	res = send_plist_pkt(client, tag, dict);
+	plist_free(dict);
+	return res;
+}
+
 static int send_system_buid(struct mux_client *client, uint32_t tag)
 {
 	int res = -1;
@@ -563,14 +731,15 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 					plist_free(dict);
 
 					usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, device_id, ntohs(portnum));
+					// set up before the call, the client may be handed over to a device worker
+					client->connect_tag = hdr->tag;
+					client->connect_device = device_id;
+					client->state = CLIENT_CONNECTING1;
 					res = device_start_connect(device_id, ntohs(portnum), client);
 					if(res < 0) {
+						client->state = CLIENT_COMMAND;
 						if (send_result(client, hdr->tag, -res) < 0)
 							return -1;
-					} else {
-						client->connect_tag = hdr->tag;
-						client->connect_device = device_id;
-						client->state = CLIENT_CONNECTING1;
 					}
 					return 0;
 				} else if (!strcmp(message, "ListDevices")) {
@@ -579,6 +748,12 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 					if (send_device_list(client, hdr->tag) < 0)
 						return -1;
 					return 0;
+				} else if (!strcmp(message, "GetStatistics")) {
+					free(message);
+					plist_free(dict);
+					if (send_statistics(client, hdr->tag) < 0)
+						return -1;
+					return 0;
 				} else if (!strcmp(message, "ReadBUID")) {
 					free(message);
 					plist_free(dict);
@@ -656,14 +831,14 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 		case MESSAGE_CONNECT:
 			ch = (void*)hdr;
 			usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, ch->device_id, ntohs(ch->port));
+			client->connect_tag = hdr->tag;
+			client->connect_device = ch->device_id;
+			client->state = CLIENT_CONNECTING1;
 			res = device_start_connect(ch->device_id, ntohs(ch->port), client);
 			if(res < 0) {
+				client->state = CLIENT_COMMAND;
 				if(send_result(client, hdr->tag, -res) < 0)
 					return -1;
-			} else {
-				client->connect_tag = hdr->tag;
-				client->connect_device = ch->device_id;
-				client->state = CLIENT_CONNECTING1;
 			}
 			return 0;
 		default:
@@ -678,31 +853,34 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 static void process_send(struct mux_client *client)
 {
 	int res;
-	if(!client->ob_size) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	if(!client->ob.size) {
 		usbmuxd_log(LL_WARNING, "Client %d OUT process but nothing to send?", client->fd);
 		client->events &= ~POLLOUT;
+		update_client_events(client);
 		return;
 	}
-	res = send(client->fd, client->ob_buf, client->ob_size, 0);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = ringbuf_peek(&client->ob, iov);
+	res = sendmsg(client->fd, &msg, 0);
 	if(res <= 0) {
 		usbmuxd_log(LL_ERROR, "Send to client fd %d failed: %d %s", client->fd, res, strerror(errno));
 		client_close(client);
 		return;
 	}
-	if((uint32_t)res == client->ob_size) {
-		client->ob_size = 0;
+	ringbuf_consume(&client->ob, res);
+	if(!client->ob.size) {
 		client->events &= ~POLLOUT;
 		if(client->state == CLIENT_CONNECTING2) {
 			usbmuxd_log(LL_DEBUG, "Client %d switching to CONNECTED state", client->fd);
 			client->state = CLIENT_CONNECTED;
 			client->events = client->devents;
 			// no longer need this
-			free(client->ob_buf);
-			client->ob_buf = NULL;
+			ringbuf_free(&client->ob);
 		}
-	} else {
-		client->ob_size -= res;
-		memmove(client->ob_buf, client->ob_buf + res, client->ob_size);
+		update_client_events(client);
 	}
 }
 static void process_recv(struct mux_client *client)
@@ -752,26 +930,14 @@ static void process_recv(struct mux_client *client)
 		if(client->ib_size < hdr->length)
 			return;
 	}
-	client_command(client, hdr);
+	// reset first, a Connect may hand the client over to a device worker
 	client->ib_size = 0;
+	client_command(client, hdr);
 }
 
-void client_process(int fd, short events)
+static void client_event_cb(struct event_watch *watch, short events)
 {
-	struct mux_client *client = NULL;
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *lc, &client_list) {
-		if(lc->fd == fd) {
-			client = lc;
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
-
-	if(!client) {
-		usbmuxd_log(LL_INFO, "client_process: fd %d not found in client list", fd);
-		return;
-	}
+	struct mux_client *client = watch->data;
 
 	if(client->state == CLIENT_CONNECTED) {
 		usbmuxd_log(LL_SPEW, "client_process in CONNECTED state");
@@ -22,23 +22,28 @@
 #define CLIENT_H
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include "usbmuxd-proto.h"
 
 struct device_info;
 struct mux_client;
+struct mux_connection;
 
 int client_read(struct mux_client *client, void *buffer, uint32_t len);
 int client_write(struct mux_client *client, void *buffer, uint32_t len);
+int client_writev(struct mux_client *client, struct iovec *iov, int iovcnt);
 int client_set_events(struct mux_client *client, short events);
 void client_close(struct mux_client *client);
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result);
+struct mux_connection *client_get_connection(struct mux_client *client);
+void client_set_connection(struct mux_client *client, struct mux_connection *conn);
+void client_detach(struct mux_client *client);
+int client_attach(struct mux_client *client);
 
 void client_device_add(struct device_info *dev);
 void client_device_remove(int device_id);
 
 int client_accept(int fd);
-void client_get_fds(struct fdlist *list);
-void client_process(int fd, short events);
 
 void client_init(void);
 void client_shutdown(void);
@@ -34,6 +34,11 @@
 #include <libgen.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #ifdef WIN32
 #include <shlobj.h>
@@ -42,6 +47,7 @@
 #include "conf.h"
 #include "utils.h"
 #include "log.h"
+#include "event.h"
 
 #ifdef WIN32
 #define DIR_SEP '\\'
@@ -55,6 +61,7 @@
 #define CONFIG_HOST_ID_KEY "HostID"
 
 #define CONFIG_EXT ".plist"
+#define CONFIG_TMP_EXT ".tmp"
 
 #ifdef WIN32
 #define CONFIG_DIR "Apple"DIR_SEP_S"Lockdown"
@@ -222,95 +229,333 @@ static char *config_generate_system_buid()
 	return config_generate_uuid(1);
 }
 
-static int internal_set_value(const char *config_file, const char *key, plist_t value)
+/*
+ * Pairing records and the system configuration are kept in memory, so
+ * ReadPairRecord and friends do not touch the disk on the main loop.
+ * With inotify, changes made to the directory by others drop the affected
+ * entry and it is read again on next use, while the events caused by our
+ * own writes are recognized and skipped; without it, only entries with
+ * writes still in flight are used and everything else is read from disk
+ * as before. Writes go to a temporary file that a background thread
+ * renames over the old one.
+ */
+struct config_entry {
+	char *name;	// file name in the config directory
+	char *data;	// NULL if there is no such file
+	uint64_t size;
+	int pending;	// writes queued for this file
+	int written;	// our writes whose inotify event is still to come
+};
+
+struct config_job {
+	struct config_job *next;
+	char *name;
+	char *data;	// NULL to remove the file
+	uint64_t size;
+	int to_xml;	// convert a binary plist before writing
+};
+
+static struct collection config_cache;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int config_cache_valid;	// inotify is watching the directory
+static uint32_t config_generation;	// bumped on every invalidation
+static int config_inotify_fd = -1;
+static struct event_watch config_inotify_watch;
+
+static pthread_t config_writer;
+static int config_writer_running;
+static int config_writer_stop;
+static struct config_job *config_jobs;
+static struct config_job **config_jobs_tail = &config_jobs;
+static pthread_cond_t config_jobs_cond = PTHREAD_COND_INITIALIZER;
+
+static struct config_entry *config_cache_find(const char *name)
 {
-	if (!config_file)
-		return 0;
+	FOREACH(struct config_entry *entry, &config_cache) {
+		if (!strcmp(entry->name, name))
+			return entry;
+	} ENDFOREACH
+	return NULL;
+}
 
-	/* read file into plist */
-	plist_t config = NULL;
+static void config_cache_drop(struct config_entry *entry)
+{
+	collection_remove(&config_cache, entry);
+	free(entry->name);
+	free(entry->data);
+	free(entry);
+}
 
-	plist_read_from_filename(&config, config_file);
-	if (!config) {
-		config = plist_new_dict();
-		plist_dict_set_item(config, key, value);
-	} else {
-		plist_t n = plist_dict_get_item(config, key);
-		if (n) {
-			plist_dict_remove_item(config, key);
-		}
-		plist_dict_set_item(config, key, value);
-		remove(config_file);
+static struct config_entry *config_cache_set(const char *name, char *data, uint64_t size)
+{
+	struct config_entry *entry = config_cache_find(name);
+	if (!entry) {
+		entry = malloc(sizeof(struct config_entry));
+		memset(entry, 0, sizeof(struct config_entry));
+		entry->name = strdup(name);
+		collection_add(&config_cache, entry);
 	}
+	free(entry->data);
+	entry->data = data;
+	entry->size = size;
+	return entry;
+}
 
-	/* store in config file */
-	char *value_string = NULL;
-	if (plist_get_node_type(value) == PLIST_STRING) {
-		plist_get_string_val(value, &value_string);
-		usbmuxd_log(LL_DEBUG, "setting key %s to %s in config_file %s", key, value_string, config_file);
-		if (value_string)
-			free(value_string);
-	} else {
-		usbmuxd_log(LL_DEBUG, "setting key %s in config_file %s", key, config_file);
-	}
+/**
+ * Drop cached files that are not waiting for a write of ours, so they
+ * are read again. name NULL means all of them, which also forgets about
+ * the events still expected for our writes.
+ */
+static void config_cache_invalidate(const char *name)
+{
+	pthread_mutex_lock(&config_mutex);
+	config_generation++;
+	FOREACH(struct config_entry *entry, &config_cache) {
+		if (!name)
+			entry->written = 0;
+		if (entry->pending || (name && strcmp(entry->name, name)))
+			continue;
+		config_cache_drop(entry);
+	} ENDFOREACH
+	pthread_mutex_unlock(&config_mutex);
+}
 
-	plist_write_to_filename(config, config_file, PLIST_FORMAT_XML);
+static char *config_file_path(const char *name)
+{
+	return string_concat(config_get_config_dir(), DIR_SEP_S, name, NULL);
+}
 
-	plist_free(config);
+/**
+ * Get a copy of a file in the config directory, from the cache if
+ * possible.
+ *
+ * @return 0 on success or -ENOENT if there is no such file.
+ */
+static int config_read_file(const char *name, char **data, uint64_t *size)
+{
+	struct config_entry *entry;
+	uint32_t generation;
+	char *file_data = NULL;
+	uint64_t file_size = 0;
+
+	*data = NULL;
+	*size = 0;
+
+	pthread_mutex_lock(&config_mutex);
+	entry = config_cache_find(name);
+	if (entry && (config_cache_valid || entry->pending)) {
+		if (entry->data) {
+			*data = malloc(entry->size + 1);
+			memcpy(*data, entry->data, entry->size);
+			(*data)[entry->size] = '\0';
+			*size = entry->size;
+		}
+		pthread_mutex_unlock(&config_mutex);
+		return *data ? 0 : -ENOENT;
+	}
+	generation = config_generation;
+	pthread_mutex_unlock(&config_mutex);
+
+	char *path = config_file_path(name);
+	buffer_read_from_filename(path, &file_data, &file_size);
+	free(path);
+
+	if (file_data) {
+		*data = malloc(file_size + 1);
+		memcpy(*data, file_data, file_size);
+		(*data)[file_size] = '\0';
+		*size = file_size;
+	}
 
-	return 1;
+	pthread_mutex_lock(&config_mutex);
+	// only keep what was read if nothing changed on disk in the meantime
+	if (config_cache_valid && generation == config_generation && !config_cache_find(name)) {
+		config_cache_set(name, file_data, file_size);
+		file_data = NULL;
+	}
+	pthread_mutex_unlock(&config_mutex);
+	free(file_data);
+
+	return *data ? 0 : -ENOENT;
 }
 
-static int config_set_value(const char *key, plist_t value)
+static void config_job_run(struct config_job *job)
 {
-	const char *config_path = NULL;
-	char *config_file = NULL;
+	char *path = config_file_path(job->name);
+	char *tmp = string_concat(path, CONFIG_TMP_EXT, NULL);
+	int done = 0;	// path was replaced or removed
+
+	if (!job->data) {
+		if (remove(path) == 0)
+			done = 1;
+		else if (errno != ENOENT)
+			usbmuxd_log(LL_ERROR, "%s: could not remove %s: %s", __func__, path, strerror(errno));
+	} else {
+		char *data = job->data;
+		uint64_t size = job->size;
+		char *xml = NULL;
+
+		if (job->to_xml && size > 8 && !memcmp(data, "bplist00", 8)) {
+			plist_t plist = NULL;
+			uint32_t xml_size = 0;
+			plist_from_bin(data, size, &plist);
+			if (plist) {
+				plist_to_xml(plist, &xml, &xml_size);
+				plist_free(plist);
+			}
+			if (xml) {
+				data = xml;
+				size = xml_size;
+			}
+		}
 
-	/* Make sure config directory exists */
-	config_create_config_dir();
+		config_create_config_dir();
+		FILE *f = fopen(tmp, "wb");
+		if (!f) {
+			usbmuxd_log(LL_ERROR, "%s: could not open '%s' for writing: %s", __func__, tmp, strerror(errno));
+		} else {
+			int ok = (fwrite(data, 1, size, f) == size);
+			if (fflush(f) != 0 || fsync(fileno(f)) != 0)
+				ok = 0;
+			fclose(f);
+			if (!ok || rename(tmp, path) != 0) {
+				usbmuxd_log(LL_ERROR, "%s: could not write '%s': %s", __func__, path, strerror(errno));
+				remove(tmp);
+			} else {
+				done = 1;
+			}
+		}
+		free(xml);
+	}
+	free(tmp);
+	free(path);
+
+	pthread_mutex_lock(&config_mutex);
+	struct config_entry *entry = config_cache_find(job->name);
+	if (entry) {
+		// the cache already has what we wrote, skip the IN_MOVED_TO or IN_DELETE this causes
+		if (done && config_cache_valid)
+			entry->written++;
+		if (--entry->pending == 0 && !config_cache_valid)
+			config_cache_drop(entry);
+	}
+	pthread_mutex_unlock(&config_mutex);
+
+	free(job->name);
+	free(job->data);
+	free(job);
+}
 
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, CONFIG_FILE, NULL);
+static void *config_writer_thread(void *arg)
+{
+	pthread_mutex_lock(&config_mutex);
+	while (1) {
+		struct config_job *job = config_jobs;
+		if (!job) {
+			if (config_writer_stop)
+				break;
+			pthread_cond_wait(&config_jobs_cond, &config_mutex);
+			continue;
+		}
+		config_jobs = job->next;
+		if (!config_jobs)
+			config_jobs_tail = &config_jobs;
+		pthread_mutex_unlock(&config_mutex);
+		config_job_run(job);
+		pthread_mutex_lock(&config_mutex);
+	}
+	pthread_mutex_unlock(&config_mutex);
+	return NULL;
+}
 
-	int result = internal_set_value(config_file, key, value);
+/**
+ * Replace a file in the config directory, or remove it if data is NULL.
+ * The cache is updated right away, the disk in the background.
+ * Takes ownership of data.
+ */
+static void config_write_file(const char *name, char *data, uint64_t size, int to_xml)
+{
+	struct config_job *job = malloc(sizeof(struct config_job));
+	memset(job, 0, sizeof(struct config_job));
+	job->name = strdup(name);
+	job->size = size;
+	job->to_xml = to_xml;
+	if (data) {
+		job->data = malloc(size);
+		memcpy(job->data, data, size);
+	}
 
-	free(config_file);
+	pthread_mutex_lock(&config_mutex);
+	config_cache_set(name, data, size)->pending++;
+	if (config_writer_running) {
+		*config_jobs_tail = job;
+		config_jobs_tail = &job->next;
+		pthread_cond_signal(&config_jobs_cond);
+		job = NULL;
+	}
+	pthread_mutex_unlock(&config_mutex);
 
-	return result;
+	// no writer thread (yet), do it here
+	if (job)
+		config_job_run(job);
 }
 
-static int internal_get_value(const char* config_file, const char *key, plist_t *value)
+static int config_get_value(const char *key, plist_t *value)
 {
+	char *data = NULL;
+	uint64_t size = 0;
+	plist_t config = NULL;
+
 	*value = NULL;
 
-	/* now parse file to get the SystemBUID */
-	plist_t config = NULL;
-	if (plist_read_from_filename(&config, config_file)) {
-		usbmuxd_log(LL_DEBUG, "reading key %s from config_file %s", key, config_file);
+	if (config_read_file(CONFIG_FILE, &data, &size) == 0) {
+		usbmuxd_log(LL_DEBUG, "reading key %s from config_file %s", key, CONFIG_FILE);
+		if (size > 8 && !memcmp(data, "bplist00", 8))
+			plist_from_bin(data, size, &config);
+		else
+			plist_from_xml(data, size, &config);
+		free(data);
+	}
+	if (config) {
 		plist_t n = plist_dict_get_item(config, key);
-		if (n) {
+		if (n)
 			*value = plist_copy(n);
-			n = NULL;
-		}
+		plist_free(config);
 	}
-	plist_free(config);
 
 	return 1;
 }
 
-static int config_get_value(const char *key, plist_t *value)
+static int config_set_value(const char *key, plist_t value)
 {
-	const char *config_path = NULL;
-	char *config_file = NULL;
-
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, CONFIG_FILE, NULL);
+	char *data = NULL;
+	uint64_t size = 0;
+	plist_t config = NULL;
+	char *xml = NULL;
+	uint32_t xml_size = 0;
+
+	if (config_read_file(CONFIG_FILE, &data, &size) == 0) {
+		if (size > 8 && !memcmp(data, "bplist00", 8))
+			plist_from_bin(data, size, &config);
+		else
+			plist_from_xml(data, size, &config);
+		free(data);
+	}
+	if (!config)
+		config = plist_new_dict();
+	if (plist_dict_get_item(config, key))
+		plist_dict_remove_item(config, key);
+	plist_dict_set_item(config, key, value);
 
-	int result = internal_get_value(config_file, key, value);
+	usbmuxd_log(LL_DEBUG, "setting key %s in config_file %s", key, CONFIG_FILE);
 
-	free(config_file);
+	plist_to_xml(config, &xml, &xml_size);
+	plist_free(config);
+	if (!xml)
+		return 0;
+	config_write_file(CONFIG_FILE, xml, xml_size, 0);
 
-	return result;
+	return 1;
 }
 
 /**
@@ -332,22 +577,14 @@ static int config_set_system_buid(const char *system_buid)
  */
 int config_has_device_record(const char *udid)
 {
-	int res = 0;
+	char *data = NULL;
+	uint64_t size = 0;
 	if (!udid) return 0;
 
-	/* ensure config directory exists */
-	config_create_config_dir();
-
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	struct stat st;
-
-	if ((stat(device_record_file, &st) == 0) && S_ISREG(st.st_mode))
-		res = 1;
-
-	free(device_record_file);
+	char *name = string_concat(udid, CONFIG_EXT, NULL);
+	int res = (config_read_file(name, &data, &size) == 0);
+	free(name);
+	free(data);
 
 	return res;
 }
@@ -391,12 +628,11 @@ void config_get_system_buid(char **system_buid)
  * @param record_data buffer containing a pairing record
  * @param record_size size of buffer passed in record_data
  *
- * @return 0 on success or a negative errno otherwise.
+ * @return 0 on success or a negative errno otherwise. The record is
+ *     written to disk in the background.
  */
 int config_set_device_record(const char *udid, char* record_data, uint64_t record_size)
 {
-	int res = 0;
-
 	if (!udid || !record_data || record_size < 8)
 		return -EINVAL;
 
@@ -412,26 +648,15 @@ int config_set_device_record(const char *udid, char* record_data, uint64_t recor
 			plist_free(plist);
 		return -EINVAL;
 	}
+	plist_free(plist);
 
-	/* ensure config directory exists */
-	config_create_config_dir();
-
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	remove(device_record_file);
+	char *data = malloc(record_size);
+	memcpy(data, record_data, record_size);
+	char *name = string_concat(udid, CONFIG_EXT, NULL);
+	config_write_file(name, data, record_size, 1);
+	free(name);
 
-	/* store file */
-	if (!plist_write_to_filename(plist, device_record_file, PLIST_FORMAT_XML)) {
-		usbmuxd_log(LL_DEBUG, "could not open '%s' for writing: %s", device_record_file, strerror(errno));
-		res = -ENOENT;
-	}
-	free(device_record_file);
-	if (plist)
-		plist_free(plist);
-
-	return res;
+	return 0;
 }
 
 /**
@@ -447,22 +672,12 @@ int config_set_device_record(const char *udid, char* record_data, uint64_t recor
  */
 int config_get_device_record(const char *udid, char **record_data, uint64_t *record_size)
 {
-	int res = 0;
-
-	/* ensure config directory exists */
-	config_create_config_dir();
-
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	/* read file */
-	buffer_read_from_filename(device_record_file, record_data, record_size);
-	if (!*record_data) {
-		usbmuxd_log(LL_ERROR, "%s: failed to read '%s': %s", __func__, device_record_file, strerror(errno));
-		res = -ENOENT;
+	char *name = string_concat(udid, CONFIG_EXT, NULL);
+	int res = config_read_file(name, record_data, record_size);
+	if (res < 0) {
+		usbmuxd_log(LL_ERROR, "%s: no pairing record for '%s'", __func__, udid);
 	}
-	free(device_record_file);
+	free(name);
 
 	return res;
 }
@@ -476,38 +691,43 @@ int config_get_device_record(const char *udid, char **record_data, uint64_t *rec
  */
 int config_remove_device_record(const char *udid)
 {
-	int res = 0;
-
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
+	char *name = string_concat(udid, CONFIG_EXT, NULL);
 
-	/* remove file */
-	if (remove(device_record_file) != 0) {
-		res = -errno;
-		usbmuxd_log(LL_DEBUG, "could not remove %s: %s", device_record_file, strerror(errno));
+	if (!config_has_device_record(udid)) {
+		usbmuxd_log(LL_DEBUG, "could not remove %s: %s", name, strerror(ENOENT));
+		free(name);
+		return -ENOENT;
 	}
+	config_write_file(name, NULL, 0, 0);
+	free(name);
 
-	free(device_record_file);
-
-	return res;
+	return 0;
 }
 
 static int config_device_record_get_value(const char *udid, const char *key, plist_t *value)
 {
-	const char *config_path = NULL;
-	char *config_file = NULL;
+	char *data = NULL;
+	uint64_t size = 0;
+	plist_t record = NULL;
 
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	int result = internal_get_value(config_file, key, value);
+	*value = NULL;
 
-	free(config_file);
+	if (config_get_device_record(udid, &data, &size) == 0) {
+		if (size > 8 && !memcmp(data, "bplist00", 8))
+			plist_from_bin(data, size, &record);
+		else
+			plist_from_xml(data, size, &record);
+		free(data);
+	}
+	if (record) {
+		plist_t n = plist_dict_get_item(record, key);
+		if (n)
+			*value = plist_copy(n);
+		plist_free(record);
+	}
 
-	return result;
+	return 1;
 }
-
 void config_device_record_get_host_id(const char *udid, char **host_id)
 {
 	plist_t value = NULL;
@@ -525,3 +745,150 @@ void config_device_record_get_host_id(const char *udid, char **host_id)
 		usbmuxd_log(LL_ERROR, "%s: ERROR couldn't get HostID from pairing record for udid %s", __func__, udid);
 	}
 }
+
+#ifdef HAVE_SYS_INOTIFY_H
+/**
+ * Handle an inotify event for a file in the config directory. Our own
+ * temporary files, files with a write of ours still queued and the
+ * events caused by writes we just completed leave the cache alone.
+ */
+static void config_file_changed(const char *name)
+{
+	size_t len = strlen(name);
+	struct config_entry *entry;
+	int ours = 0;
+
+	if (len >= strlen(CONFIG_TMP_EXT) && !strcmp(name + len - strlen(CONFIG_TMP_EXT), CONFIG_TMP_EXT))
+		return;
+
+	pthread_mutex_lock(&config_mutex);
+	entry = config_cache_find(name);
+	if (entry && entry->written > 0) {
+		entry->written--;
+		ours = 1;
+	} else if (entry && entry->pending) {
+		ours = 1;
+	}
+	pthread_mutex_unlock(&config_mutex);
+
+	if (!ours)
+		config_cache_invalidate(name);
+}
+
+static void config_inotify_cb(struct event_watch *watch, short events)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read(config_inotify_fd, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + len) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				config_cache_invalidate(NULL);
+			} else if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+				// the directory itself went away, nothing to watch anymore
+				usbmuxd_log(LL_WARNING, "Config directory %s disappeared, not caching pairing records", config_get_config_dir());
+				pthread_mutex_lock(&config_mutex);
+				config_cache_valid = 0;
+				pthread_mutex_unlock(&config_mutex);
+				config_cache_invalidate(NULL);
+			} else if (ev->len) {
+				config_file_changed(ev->name);
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+/**
+ * Read all pairing records and the system configuration into memory.
+ */
+static void config_preload(void)
+{
+	const char *config_path = config_get_config_dir();
+	DIR *dir = opendir(config_path);
+	struct dirent *ent;
+	int count = 0;
+
+	if (!dir)
+		return;
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(ent->d_name);
+		char *data = NULL;
+		uint64_t size = 0;
+
+		if (len <= strlen(CONFIG_EXT) || strcmp(ent->d_name + len - strlen(CONFIG_EXT), CONFIG_EXT))
+			continue;
+		// goes through the cache, which keeps a copy
+		if (config_read_file(ent->d_name, &data, &size) == 0)
+			count++;
+		free(data);
+	}
+	closedir(dir);
+	usbmuxd_log(LL_INFO, "Cached %d files from %s", count, config_path);
+}
+#endif
+
+/**
+ * Start caching the contents of the config directory and writing changes
+ * from a background thread. Must be called from the main thread, after
+ * event_init().
+ */
+void config_init(void)
+{
+	collection_init(&config_cache);
+	config_create_config_dir();
+
+#ifdef HAVE_SYS_INOTIFY_H
+	config_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (config_inotify_fd < 0) {
+		usbmuxd_log(LL_WARNING, "inotify_init1 failed, not caching pairing records: %s", strerror(errno));
+	} else if (inotify_add_watch(config_inotify_fd, config_get_config_dir(),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+		usbmuxd_log(LL_WARNING, "Could not watch %s, not caching pairing records: %s", config_get_config_dir(), strerror(errno));
+		close(config_inotify_fd);
+		config_inotify_fd = -1;
+	} else if (event_add(&config_inotify_watch, config_inotify_fd, POLLIN, config_inotify_cb, NULL) < 0) {
+		close(config_inotify_fd);
+		config_inotify_fd = -1;
+	} else {
+		config_cache_valid = 1;
+		config_preload();
+	}
+#endif
+
+	config_writer_stop = 0;
+	if (pthread_create(&config_writer, NULL, config_writer_thread, NULL) != 0) {
+		usbmuxd_log(LL_WARNING, "Could not start config writer thread, writing directly");
+	} else {
+		config_writer_running = 1;
+	}
+}
+
+/**
+ * Write out what is still queued and stop caching.
+ */
+void config_shutdown(void)
+{
+	if (config_writer_running) {
+		pthread_mutex_lock(&config_mutex);
+		config_writer_stop = 1;
+		pthread_cond_signal(&config_jobs_cond);
+		pthread_mutex_unlock(&config_mutex);
+		pthread_join(config_writer, NULL);
+		config_writer_running = 0;
+	}
+	if (config_inotify_fd >= 0) {
+		event_remove(&config_inotify_watch);
+		close(config_inotify_fd);
+		config_inotify_fd = -1;
+	}
+	pthread_mutex_lock(&config_mutex);
+	config_cache_valid = 0;
+	FOREACH(struct config_entry *entry, &config_cache) {
+		config_cache_drop(entry);
+	} ENDFOREACH
+	collection_free(&config_cache);
+	pthread_mutex_unlock(&config_mutex);
+}
@@ -28,6 +28,9 @@
 
 const char *config_get_config_dir();
 
+void config_init(void);
+void config_shutdown(void);
+
 void config_get_system_buid(char **system_buid);
 
 int config_has_device_record(const char *udid);
@@ -31,22 +31,37 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "device.h"
 #include "client.h"
 #include "preflight.h"
 #include "usb.h"
 #include "log.h"
+#include "event.h"
 
 int next_device_id;
 
 #define DEV_MRU 65536
 
 #define CONN_INBUF_SIZE		262144
-#define CONN_OUTBUF_SIZE	65536
 
 #define ACK_TIMEOUT 30
 
+// with the delayed ACK policy, ACK at once when the device has less than
+// this much window left, instead of waiting for the end of the loop turn
+#define DEFAULT_ACK_WINDOW 32768
+
+// connections are indexed by source port through a two-level table,
+// pages of CONN_PAGE_SIZE entries are only allocated for ports in use
+#define CONN_PAGE_SIZE 256
+#define CONN_PAGES (65536 / CONN_PAGE_SIZE)
+
+#define MAX_THREADS 64
+
 enum mux_protocol {
 	MUX_PROTO_VERSION = 0,
 	MUX_PROTO_CONTROL = 1,
@@ -86,7 +101,78 @@ struct version_header
 
 struct mux_device;
 
+// Devices are spread over worker threads ("shards") when device_set_threads()
+// asks for them. A shard only ever touches its own devices, their connections
+// and the clients connected through them; other threads reach it by posting
+// to its inbox. The main thread keeps libusb, new clients and the device list,
+// and is a shard itself in single-threaded mode.
+struct device_shard
+{
+	int index;
+	pthread_t thread;
+	int running;
+	int dead;	// its event loop failed, see shard_run_dead()
+	struct shard_sync *startup;	// reports the thread's setup to device_init()
+	struct collection devices;	// owned by the shard's thread
+	int device_count;	// for balancing, main thread only
+	// fires when the oldest pending ACK is due, instead of the loop
+	// scanning all connections for the shortest timeout every iteration
+	struct event_timer ack_timer;
+	struct mpsc_queue inbox;
+	int wake_pending;	// a wakeup byte is already in the pipe
+	int wake_fds[2];
+	struct event_watch wake_watch;
+	// outgoing mux packets vs. the bulk transfers they were coalesced into
+	uint64_t tx_packets;
+	uint64_t tx_transfers;
+	uint64_t tx_stats_time;
+	// pure ACKs sent vs. data segments received from the devices
+	uint64_t acks_sent;
+	uint64_t data_segments;
+};
+
+enum shard_msg_type {
+	SHARD_DEVICE_ADD,	// take over a new device and send it the version packet
+	SHARD_DEVICE_REMOVE,	// tear down a device that went away (synchronous)
+	SHARD_DATA,	// a copy of USB data received for a device
+	SHARD_CONNECT,	// take over a client and start its connection
+	SHARD_CLIENT,	// take back a client (main thread only)
+	SHARD_KILL,	// tear down all connections (synchronous)
+	SHARD_STATS,	// report device and event loop counters (synchronous)
+	SHARD_STOP	// leave the thread's loop
+};
+
+struct shard_sync
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+	int result;
+};
+
+struct shard_msg
+{
+	struct mpsc_node node;	// first, so a popped node is the message
+	enum shard_msg_type type;
+	struct mux_device *dev;
+	struct mux_client *client;
+	uint16_t dport;
+	uint32_t length;
+	struct shard_stats *stats;
+	struct shard_sync *sync;	// set when the poster waits for the result
+	unsigned char data[];
+};
+
+// what a shard reports for GetStatistics
+struct shard_stats
+{
+	struct device_stats *devices;
+	int count;
+	struct event_stats loop;
+};
+
 #define CONN_ACK_PENDING 1
+#define CONN_ACK_DEFERRED 2	// ACK goes out at the end of this event loop turn
 
 struct mux_connection
 {
@@ -99,34 +185,52 @@ struct mux_connection
 	uint32_t max_payload;
 	uint32_t sendable;
 	int flags;
-	unsigned char *ib_buf;
-	uint32_t ib_size;
-	uint32_t ib_capacity;
-	unsigned char *ob_buf;
-	uint32_t ob_capacity;
+	struct ringbuf ib;	// device data waiting to be written to the client
 	short events;
 	uint64_t last_ack_time;
+	uint64_t created;
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t acks_sent;
 };
 
 struct mux_device
 {
 	struct usb_device *usbdev;
+	struct device_shard *shard;
 	int id;
 	enum mux_dev_state state;
 	int visible;
 	struct collection connections;
+	struct mux_connection **conn_pages[CONN_PAGES];
+	uint32_t sport_map[65536 / 32];	// bit set for every source port in use
 	uint16_t next_sport;
 	unsigned char *pktbuf;
 	uint32_t pktlen;
+	unsigned char *txbuf;	// pooled USB_MTU buffer collecting outgoing packets
+	int txlen;
 	void *preflight_cb_data;
 	int version;
 	uint16_t rx_seq;
 	uint16_t tx_seq;
+	int acks_deferred;	// some connection has CONN_ACK_DEFERRED set
+	// lifetime counters, only touched by the shard's thread
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t rx_packets, tx_packets;
+	uint64_t tx_transfers;
+	uint64_t reassemblies;
+	uint64_t errors;
 };
 
 static struct collection device_list;
 pthread_mutex_t device_list_mutex;
 
+static struct device_shard main_shard;
+static struct device_shard *shards;	// worker threads, if any
+static int num_shards;
+
+static enum ack_policy ack_policy = ACK_DELAYED;
+static uint32_t ack_window = DEFAULT_ACK_WINDOW;
+
 static struct mux_device* get_mux_device_for_id(int device_id)
 {
   struct mux_device *dev = NULL;
@@ -144,24 +248,135 @@ static struct mux_device* get_mux_device_for_id(int device_id)
 
 static struct mux_connection* get_mux_connection(int device_id, struct mux_client *client)
 {
-	struct mux_connection *conn = NULL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->id == device_id) {
-			FOREACH(struct mux_connection *lconn, &dev->connections) {
-				if(lconn->client == client) {
-					conn = lconn;
-					break;
-				}
-			} ENDFOREACH
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-
+	struct mux_connection *conn = client_get_connection(client);
+	if(conn && conn->dev->id != device_id)
+		return NULL;
 	return conn;
 }
 
+static struct mux_connection* get_connection_for_sport(struct mux_device *dev, uint16_t sport)
+{
+	struct mux_connection **page = dev->conn_pages[sport / CONN_PAGE_SIZE];
+	if(!page)
+		return NULL;
+	return page[sport % CONN_PAGE_SIZE];
+}
+
+static void set_connection_for_sport(struct mux_device *dev, uint16_t sport, struct mux_connection *conn)
+{
+	struct mux_connection ***page = &dev->conn_pages[sport / CONN_PAGE_SIZE];
+	if(!*page) {
+		if(!conn)
+			return;
+		*page = malloc(sizeof(struct mux_connection *) * CONN_PAGE_SIZE);
+		memset(*page, 0, sizeof(struct mux_connection *) * CONN_PAGE_SIZE);
+	}
+	(*page)[sport % CONN_PAGE_SIZE] = conn;
+	if(conn)
+		dev->sport_map[sport / 32] |= 1U << (sport % 32);
+	else
+		dev->sport_map[sport / 32] &= ~(1U << (sport % 32));
+}
+
+static void free_mux_device(struct mux_device *dev)
+{
+	int i;
+	for(i = 0; i < CONN_PAGES; i++)
+		free(dev->conn_pages[i]);
+	free(dev->pktbuf);
+	free(dev->txbuf);
+	free(dev);
+}
+
+static struct shard_msg *shard_msg_new(enum shard_msg_type type, struct mux_device *dev, uint32_t length)
+{
+	struct shard_msg *msg = malloc(sizeof(struct shard_msg) + length);
+	memset(msg, 0, sizeof(struct shard_msg));
+	msg->type = type;
+	msg->dev = dev;
+	msg->length = length;
+	return msg;
+}
+
+/**
+ * Queue a message for a shard and wake its thread up, unless a wakeup
+ * is already pending.
+ */
+static void shard_post(struct device_shard *shard, struct shard_msg *msg)
+{
+	char c = 0;
+
+	mpsc_push(&shard->inbox, &msg->node);
+	if(!__atomic_exchange_n(&shard->wake_pending, 1, __ATOMIC_SEQ_CST)) {
+		if(write(shard->wake_fds[1], &c, 1) < 0)
+			usbmuxd_log(LL_ERROR, "Could not wake up device thread %d: %s", shard->index, strerror(errno));
+	}
+}
+
+/**
+ * Post a message and wait until the shard has handled it.
+ *
+ * @return the result reported with shard_msg_done().
+ */
+static void shard_sync_init(struct shard_sync *sync)
+{
+	pthread_mutex_init(&sync->mutex, NULL);
+	pthread_cond_init(&sync->cond, NULL);
+	sync->done = 0;
+	sync->result = 0;
+}
+
+static int shard_sync_wait(struct shard_sync *sync)
+{
+	pthread_mutex_lock(&sync->mutex);
+	while(!sync->done)
+		pthread_cond_wait(&sync->cond, &sync->mutex);
+	pthread_mutex_unlock(&sync->mutex);
+	pthread_cond_destroy(&sync->cond);
+	pthread_mutex_destroy(&sync->mutex);
+	return sync->result;
+}
+
+static void shard_sync_signal(struct shard_sync *sync, int result)
+{
+	pthread_mutex_lock(&sync->mutex);
+	sync->result = result;
+	sync->done = 1;
+	pthread_cond_signal(&sync->cond);
+	pthread_mutex_unlock(&sync->mutex);
+}
+
+static int shard_call(struct device_shard *shard, struct shard_msg *msg)
+{
+	struct shard_sync sync;
+
+	shard_sync_init(&sync);
+	msg->sync = &sync;
+	shard_post(shard, msg);
+	return shard_sync_wait(&sync);
+}
+
+static void shard_msg_done(struct shard_msg *msg, int result)
+{
+	struct shard_sync *sync = msg->sync;
+
+	free(msg);
+	if(sync)
+		shard_sync_signal(sync, result);
+}
+
+/**
+ * Hand a client that is done with a worker's device back to the main
+ * thread, where it goes on processing commands.
+ */
+static void shard_return_client(struct mux_client *client)
+{
+	struct shard_msg *msg = shard_msg_new(SHARD_CLIENT, NULL, 0);
+	msg->client = client;
+	client_detach(client);
+	shard_post(&main_shard, msg);
+}
+
 static int get_next_device_id(void)
 {
 	while(1) {
@@ -180,11 +395,67 @@ static int get_next_device_id(void)
 	}
 }
 
+static int get_mux_header_size(struct mux_device *dev)
+{
+	return (dev->version < 2) ? 8 : sizeof(struct mux_header);
+}
+
+/**
+ * Hand the packets collected in the device's TX buffer to the USB layer
+ * as a single bulk transfer.
+ */
+static void flush_tx(struct mux_device *dev)
+{
+	unsigned char *buffer = dev->txbuf;
+	int length = dev->txlen;
+	int res;
+
+	dev->txbuf = NULL;
+	dev->txlen = 0;
+	if(!buffer)
+		return;
+	if(!length) {
+		usb_put_tx_buffer(dev->usbdev, buffer);
+		return;
+	}
+	if((res = usb_send(dev->usbdev, buffer, length)) < 0) {
+		usbmuxd_log(LL_ERROR, "usb_send failed while sending %d bytes to device %d: %d", length, dev->id, res);
+		dev->errors++;
+		return;
+	}
+	dev->tx_transfers++;
+	dev->shard->tx_transfers++;
+}
+
+/**
+ * Make room for a packet of up to total bytes in the device's TX buffer,
+ * flushing what is already queued if it would not fit.
+ *
+ * @return where the packet has to be placed.
+ */
+static unsigned char *tx_reserve(struct mux_device *dev, int total)
+{
+	if(dev->txbuf && (dev->txlen + total) > USB_MTU)
+		flush_tx(dev);
+	if(!dev->txbuf) {
+		dev->txbuf = usb_get_tx_buffer(dev->usbdev);
+		dev->txlen = 0;
+	}
+	return dev->txbuf + dev->txlen;
+}
+
+/**
+ * Queue a mux packet for the device. Packets are collected in a pooled
+ * buffer and go out together when device_flush_tx() runs at the end of
+ * the event loop iteration.
+ *
+ * data may already point into the TX buffer, at the payload position
+ * returned by reserve_tcp_payload(); it is not copied in that case.
+ */
 static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *header, const void *data, int length)
 {
 	unsigned char *buffer;
 	int hdrlen;
-	int res;
 
 	switch(proto) {
 		case MUX_PROTO_VERSION:
@@ -198,20 +469,22 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 			break;
 		default:
 			usbmuxd_log(LL_ERROR, "Invalid protocol %d for outgoing packet (dev %d hdr %p data %p len %d)", proto, dev->id, header, data, length);
+			dev->errors++;
 			return -1;
 	}
 	usbmuxd_log(LL_SPEW, "send_packet(%d, 0x%x, %p, %p, %d)", dev->id, proto, header, data, length);
 
-	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
+	int mux_header_size = get_mux_header_size(dev);
 
 	int total = mux_header_size + hdrlen + length;
 
 	if(total > USB_MTU) {
 		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (hdr %d data %d total %d) to device %d", hdrlen, length, total, dev->id);
+		dev->errors++;
 		return -1;
 	}
 
-	buffer = malloc(total);
+	buffer = tx_reserve(dev, total);
 	struct mux_header *mhdr = (struct mux_header *)buffer;
 	mhdr->protocol = htonl(proto);
 	mhdr->length = htonl(total);
@@ -225,35 +498,56 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 		mhdr->rx_seq = htons(dev->rx_seq);
 		dev->tx_seq++;
 	}	
-	memcpy(buffer + mux_header_size, header, hdrlen);
-	if(data && length)
+	if(hdrlen)
+		memcpy(buffer + mux_header_size, header, hdrlen);
+	if(data && length && data != buffer + mux_header_size + hdrlen)
 		memcpy(buffer + mux_header_size + hdrlen, data, length);
 
-	if((res = usb_send(dev->usbdev, buffer, total)) < 0) {
-		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", total, dev->id, res);
-		free(buffer);
-		return res;
-	}
+	dev->txlen += total;
+	dev->tx_packets++;
+	dev->tx_bytes += total;
+	dev->shard->tx_packets++;
 	return total;
 }
 
-static uint16_t find_sport(struct mux_device *dev)
+/**
+ * Reserve space for a TCP segment of up to length bytes in the device's
+ * TX buffer, so client data can be read straight into place and sent
+ * with send_tcp() without another copy.
+ *
+ * @return the payload area of the reserved segment.
+ */
+static unsigned char *reserve_tcp_payload(struct mux_device *dev, int length)
 {
-	if(collection_count(&dev->connections) >= 65535)
-		return 0; //insanity
+	int hdrlen = get_mux_header_size(dev) + sizeof(struct tcphdr);
+	return tx_reserve(dev, hdrlen + length) + hdrlen;
+}
 
-	while(1) {
-		int ok = 1;
-		FOREACH(struct mux_connection *conn, &dev->connections) {
-			if(dev->next_sport == conn->sport) {
-				dev->next_sport++;
-				ok = 0;
-				break;
-			}
-		} ENDFOREACH
-		if(ok)
-			return dev->next_sport++;
+/**
+ * Pick the next free source port at or after dev->next_sport, wrapping
+ * around. Port 0 is reserved in the map so it is never handed out.
+ *
+ * @return the port, or 0 if all of them are in use.
+ */
+static uint16_t find_sport(struct mux_device *dev)
+{
+	uint32_t start = dev->next_sport / 32;
+	uint32_t i;
+
+	for(i = 0; i <= 65536 / 32; i++) {
+		uint32_t word = (start + i) % (65536 / 32);
+		uint32_t used = dev->sport_map[word];
+		uint32_t bit;
+
+		if(i == 0)
+			used |= (1U << (dev->next_sport % 32)) - 1; // ports below next_sport come last
+		if(used == 0xFFFFFFFF)
+			continue;
+		for(bit = 0; used & (1U << bit); bit++);
+		dev->next_sport = (uint16_t)(word * 32 + bit + 1);
+		return (uint16_t)(word * 32 + bit);
 	}
+	return 0; //insanity
 }
 
 static int send_anon_rst(struct mux_device *dev, uint16_t sport, uint16_t dport, uint32_t ack)
@@ -291,7 +585,11 @@ static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned c
 	if(res >= 0) {
 		conn->tx_acked = conn->tx_ack;
 		conn->last_ack_time = mstime64();
-		conn->flags &= ~CONN_ACK_PENDING;
+		conn->flags &= ~(CONN_ACK_PENDING | CONN_ACK_DEFERRED);
+		if(flags == TH_ACK && !length) {
+			conn->acks_sent++;
+			conn->dev->shard->acks_sent++;
+		}
 	}
 	return res;
 }
@@ -309,47 +607,41 @@ static void connection_teardown(struct mux_connection *conn)
 			usbmuxd_log(LL_ERROR, "Error sending TCP RST to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
 	}
 	if(conn->client) {
+		client_set_connection(conn->client, NULL);
 		if(conn->state == CONN_REFUSED || conn->state == CONN_CONNECTING) {
-			client_notify_connect(conn->client, RESULT_CONNREFUSED);
+			if(client_notify_connect(conn->client, RESULT_CONNREFUSED) == 0 && conn->dev->shard != &main_shard)
+				shard_return_client(conn->client);
 		} else {
 			conn->state = CONN_DEAD;
-			if((conn->events & POLLOUT) && conn->ib_size > 0){
-				while(1){
-					size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+			if((conn->events & POLLOUT) && conn->ib.size > 0){
+				struct iovec iov[2];
+				while(conn->ib.size > 0){
+					size = client_writev(conn->client, iov, ringbuf_peek(&conn->ib, iov));
 					if(size <= 0) {
 						break;
 					}
-					if(size == (int)conn->ib_size) {
-						conn->ib_size = 0;
-						break;
-					} else {
-						conn->ib_size -= size;
-						memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-					}
+					ringbuf_consume(&conn->ib, size);
 				}
 			}
 			client_close(conn->client);
 		}
 	}
-	if(conn->ib_buf)
-		free(conn->ib_buf);
-	if(conn->ob_buf)
-		free(conn->ob_buf);
+	ringbuf_free(&conn->ib);
+	set_connection_for_sport(conn->dev, conn->sport, NULL);
 	collection_remove(&conn->dev->connections, conn);
 	free(conn);
 }
 
-int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+static int connection_start(struct mux_device *dev, uint16_t dport, struct mux_client *client)
 {
-	struct mux_device *dev = get_mux_device_for_id(device_id);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
+	if(dev->state == MUXDEV_DEAD) {
+		usbmuxd_log(LL_WARNING, "Attempted to connect to dead device %d", dev->id);
 		return -RESULT_BADDEV;
 	}
 
 	uint16_t sport = find_sport(dev);
 	if(!sport) {
-		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", device_id);
+		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", dev->id);
 		return -RESULT_BADDEV;
 	}
 
@@ -369,25 +661,49 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 	conn->rx_recvd = 0;
 	conn->flags = 0;
 	conn->max_payload = USB_MTU - sizeof(struct mux_header) - sizeof(struct tcphdr);
+	conn->created = mstime64();
 
-	conn->ob_buf = malloc(CONN_OUTBUF_SIZE);
-	conn->ob_capacity = CONN_OUTBUF_SIZE;
-	conn->ib_buf = malloc(CONN_INBUF_SIZE);
-	conn->ib_capacity = CONN_INBUF_SIZE;
-	conn->ib_size = 0;
+	ringbuf_init(&conn->ib, CONN_INBUF_SIZE);
 
 	int res;
 
 	res = send_tcp(conn, TH_SYN, NULL, 0);
 	if(res < 0) {
 		usbmuxd_log(LL_ERROR, "Error sending TCP SYN to device %d (%d->%d)", dev->id, sport, dport);
+		ringbuf_free(&conn->ib);
 		free(conn);
 		return -RESULT_CONNREFUSED; //bleh
 	}
 	collection_add(&dev->connections, conn);
+	set_connection_for_sport(dev, sport, conn);
+	client_set_connection(client, conn);
 	return 0;
 }
 
+int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+{
+	struct mux_device *dev = get_mux_device_for_id(device_id);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
+		return -RESULT_BADDEV;
+	}
+
+	if(dev->shard != &main_shard) {
+		if(__atomic_load_n(&dev->shard->dead, __ATOMIC_ACQUIRE)) {
+			usbmuxd_log(LL_WARNING, "Attempted to connect to device %d on failed device thread %d", device_id, dev->shard->index);
+			return -RESULT_BADDEV;
+		}
+		// the device's thread takes the client over and reports the result
+		struct shard_msg *msg = shard_msg_new(SHARD_CONNECT, dev, 0);
+		msg->client = client;
+		msg->dport = dport;
+		client_detach(client);
+		shard_post(dev->shard, msg);
+		return 0;
+	}
+	return connection_start(dev, dport, client);
+}
+
 /**
  * Examine the state of a connection's buffers and
  * update all connection flags and masks accordingly.
@@ -404,8 +720,6 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->sendable = 0;
 
-	if(conn->sendable > conn->ob_capacity)
-		conn->sendable = conn->ob_capacity;
 	if(conn->sendable > conn->max_payload)
 		conn->sendable = conn->max_payload;
 
@@ -414,20 +728,41 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->events &= ~POLLIN;
 
-	if(conn->ib_size)
+	if(conn->ib.size)
 		conn->events |= POLLOUT;
 	else
 		conn->events &= ~POLLOUT;
 
-	if(conn->tx_acked != conn->tx_ack)
+	if(conn->tx_acked != conn->tx_ack) {
 		conn->flags |= CONN_ACK_PENDING;
-	else
-		conn->flags &= ~CONN_ACK_PENDING;
+		if(conn->state == CONN_CONNECTED) {
+			event_timer_arm(&conn->dev->shard->ack_timer, ACK_TIMEOUT + 1);
+			if(ack_policy == ACK_DELAYED) {
+				conn->flags |= CONN_ACK_DEFERRED;
+				conn->dev->acks_deferred = 1;
+			}
+		}
+	} else {
+		conn->flags &= ~(CONN_ACK_PENDING | CONN_ACK_DEFERRED);
+	}
 
 	usbmuxd_log(LL_SPEW, "update_connection: sendable %d, events %d, flags %d", conn->sendable, conn->events, conn->flags);
 	client_set_events(conn->client, conn->events);
 }
 
+/**
+ * Whether the delayed ACK policy wants an ACK sent right away because the
+ * device is about to run out of window.
+ */
+static int ack_urgent(struct mux_connection *conn)
+{
+	uint32_t unacked = conn->rx_recvd - conn->tx_acked;
+
+	if(ack_policy != ACK_DELAYED || conn->tx_ack == conn->tx_acked)
+		return 0;
+	return (unacked >= conn->tx_win) || (conn->tx_win - unacked < ack_window);
+}
+
 static int send_tcp_ack(struct mux_connection *conn)
 {
 	if(send_tcp(conn, TH_ACK, NULL, 0) < 0) {
@@ -462,28 +797,26 @@ void device_client_process(int device_id, struct mux_client *client, short event
 
 	int res;
 	int size;
-	if((events & POLLOUT) && conn->ib_size > 0) {
+	if((events & POLLOUT) && conn->ib.size > 0) {
 		// Client is ready to receive data, send what we have
 		// in the client's connection buffer (if there is any)
-		size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+		struct iovec iov[2];
+		size = client_writev(conn->client, iov, ringbuf_peek(&conn->ib, iov));
 		if(size <= 0) {
 			usbmuxd_log(LL_DEBUG, "error writing to client (%d)", size);
 			connection_teardown(conn);
 			return;
 		}
 		conn->tx_ack += size;
-		if(size == (int)conn->ib_size) {
-			conn->ib_size = 0;
-		} else {
-			conn->ib_size -= size;
-			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-		}
+		conn->rx_bytes += size;
+		ringbuf_consume(&conn->ib, size);
 	}
 	if((events & POLLIN) && conn->sendable > 0) {
 		// There is inbound trafic on the client socket,
 		// convert it to tcp and send to the device
 		// (if the device's input buffer is not full)
-		size = client_read(conn->client, conn->ob_buf, conn->sendable);
+		unsigned char *payload = reserve_tcp_payload(conn->dev, conn->sendable);
+		size = client_read(conn->client, payload, conn->sendable);
 		if(size <= 0) {
 			if (size < 0) {
 				usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
@@ -491,14 +824,19 @@ void device_client_process(int device_id, struct mux_client *client, short event
 			connection_teardown(conn);
 			return;
 		}
-		res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
+		res = send_tcp(conn, TH_ACK, payload, size);
 		if(res < 0) {
 			connection_teardown(conn);
 			return;
 		}
 		conn->tx_seq += size;
+		conn->tx_bytes += size;
 	}
 
+	if(ack_urgent(conn)) {
+		send_tcp_ack(conn);
+		return;
+	}
 	update_connection(conn);
 }
 
@@ -521,13 +859,12 @@ void device_client_process(int device_id, struct mux_client *client, short event
  */
 static void connection_device_input(struct mux_connection *conn, unsigned char *payload, uint32_t payload_length)
 {
-	if((conn->ib_size + payload_length) > conn->ib_capacity) {
-		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, conn->ib_capacity-conn->ib_size, payload_length);
+	if((conn->ib.size + payload_length) > conn->ib.capacity) {
+		usbmuxd_log(LL_ERROR, "Input buffer overflow on device %d connection %d->%d (space=%d, payload=%d)", conn->dev->id, conn->sport, conn->dport, conn->ib.capacity-conn->ib.size, payload_length);
 		connection_teardown(conn);
 		return;
 	}
-	memcpy(conn->ib_buf + conn->ib_size, payload, payload_length);
-	conn->ib_size += payload_length;
+	ringbuf_write(&conn->ib, payload, payload_length);
 	conn->rx_recvd += payload_length;
 	update_connection(conn);
 }
@@ -552,10 +889,8 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	vh->minor = ntohl(vh->minor);
 	if(vh->major != 2 && vh->major != 1) {
 		usbmuxd_log(LL_ERROR, "Device %d has unknown version %d.%d", dev->id, vh->major, vh->minor);
-		pthread_mutex_lock(&device_list_mutex);
-		collection_remove(&device_list, dev);
-		pthread_mutex_unlock(&device_list_mutex);
-		free(dev);
+		// ignored from now on, the entry goes away with the USB device
+		dev->state = MUXDEV_DEAD;
 		return;
 	}
 	dev->version = vh->major;
@@ -565,7 +900,7 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	}
 
 	usbmuxd_log(LL_NOTICE, "Connected to v%d.%d device %d on location 0x%x with serial number %s", dev->version, vh->minor, dev->id, usb_get_location(dev->usbdev), usb_get_serial(dev->usbdev));
-	dev->state = MUXDEV_ACTIVE;
+	__atomic_store_n(&dev->state, MUXDEV_ACTIVE, __ATOMIC_RELEASE); // read by device_get_list() on other threads
 	collection_init(&dev->connections);
 	struct device_info info;
 	info.id = dev->id;
@@ -631,12 +966,9 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 	}
 
 	// Find the connection on this device that has the right sport and dport
-	FOREACH(struct mux_connection *lconn, &dev->connections) {
-		if(lconn->sport == sport && lconn->dport == dport) {
-			conn = lconn;
-			break;
-		}
-	} ENDFOREACH
+	conn = get_connection_for_sport(dev, sport);
+	if(conn && conn->dport != dport)
+		conn = NULL;
 
 	if(!conn) {
 		if(!(th->th_flags & TH_RST)) {
@@ -678,6 +1010,7 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 			}
 			conn->state = CONN_CONNECTED;
 			if(client_notify_connect(conn->client, RESULT_OK) < 0) {
+				client_set_connection(conn->client, NULL);
 				conn->client = NULL;
 				connection_teardown(conn);
 			}
@@ -690,10 +1023,15 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 				conn->state = CONN_DYING;
 			connection_teardown(conn);
 		} else {
+			if(payload_length)
+				dev->shard->data_segments++;
 			connection_device_input(conn, payload, payload_length);
 
-			// Device likes it best when we are prompty ACKing data
-			send_tcp_ack(conn);
+			// Device likes it best when we are prompty ACKing data.
+			// With delayed ACKs, they ride along with outgoing data
+			// or go out once per loop turn unless the window runs low.
+			if(ack_policy == ACK_IMMEDIATE || ack_urgent(conn))
+				send_tcp_ack(conn);
 		}
 	}
 }
@@ -706,38 +1044,20 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
  * @param buffer
  * @param length
  */
-void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+static void device_input(struct mux_device *dev, unsigned char *buffer, uint32_t length)
 {
-	struct mux_device *dev = NULL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *tdev, &device_list) {
-		if(tdev->usbdev == usbdev) {
-			dev = tdev;
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
-		return;
-	}
-
-	if(!length)
-		return;
-
-	// sanity check (should never happen with current USB implementation)
-	if((length > USB_MRU) || (length > DEV_MRU)) {
-		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
+	if(dev->state == MUXDEV_DEAD)
 		return;
-	}
 
 	usbmuxd_log(LL_SPEW, "Mux data input for device %p: %p len %d", dev, buffer, length);
+	dev->rx_bytes += length;
 
 	// handle broken up transfers
 	if(dev->pktlen) {
 		if((length + dev->pktlen) > DEV_MRU) {
 			usbmuxd_log(LL_ERROR, "Incoming split packet is too large (%d so far), dropping!", length + dev->pktlen);
 			dev->pktlen = 0;
+			dev->errors++;
 			return;
 		}
         memcpy(dev->pktbuf + dev->pktlen, buffer, length);
@@ -746,6 +1066,7 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 			buffer = dev->pktbuf;
 			length += dev->pktlen;
 			dev->pktlen = 0;
+			dev->reassemblies++;
 			usbmuxd_log(LL_SPEW, "Gathered mux data from buffer (total size: %d)", length);
 		} else {
 			dev->pktlen += length;
@@ -766,8 +1087,10 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
 	if(ntohl(mhdr->length) != length) {
 		usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, ntohl(mhdr->length), length);
+		dev->errors++;
 		return;
 	}
+	dev->rx_packets++;
 
 	struct tcphdr *th;
 	unsigned char *payload;
@@ -781,6 +1104,7 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 		case MUX_PROTO_VERSION:
 			if(length < (mux_header_size + sizeof(struct version_header))) {
 				usbmuxd_log(LL_ERROR, "Incoming version packet is too small (%d)", length);
+				dev->errors++;
 				return;
 			}
 			device_version_input(dev, (struct version_header *)((char*)mhdr+mux_header_size));
@@ -793,6 +1117,7 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 		case MUX_PROTO_TCP:
 			if(length < (mux_header_size + sizeof(struct tcphdr))) {
 				usbmuxd_log(LL_ERROR, "Incoming TCP packet is too small (%d)", length);
+				dev->errors++;
 				return;
 			}
 			th = (struct tcphdr *)((char*)mhdr+mux_header_size);
@@ -802,11 +1127,90 @@ void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_
 			break;
 		default:
 			usbmuxd_log(LL_ERROR, "Incoming packet for device %d has unknown protocol 0x%x)", dev->id, ntohl(mhdr->protocol));
+			dev->errors++;
 			break;
 	}
 
 }
 
+void device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
+{
+	struct mux_device *dev = usb_get_mux_device(usbdev);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return;
+	}
+
+	if(!length)
+		return;
+
+	// sanity check (should never happen with current USB implementation)
+	if((length > USB_MRU) || (length > DEV_MRU)) {
+		usbmuxd_log(LL_ERROR, "Too much data received from USB (%d), file a bug", length);
+		return;
+	}
+
+	if(dev->shard != &main_shard) {
+		// the RX buffer goes back to libusb as soon as we return
+		struct shard_msg *msg = shard_msg_new(SHARD_DATA, dev, length);
+		memcpy(msg->data, buffer, length);
+		shard_post(dev->shard, msg);
+		return;
+	}
+	device_input(dev, buffer, length);
+}
+
+/**
+ * Take a new device over in the thread of its shard and ask it for its
+ * protocol version.
+ */
+static int shard_device_add(struct mux_device *dev)
+{
+	int res;
+	struct version_header vh;
+	vh.major = htonl(2);
+	vh.minor = htonl(0);
+	vh.padding = 0;
+	collection_add(&dev->shard->devices, dev);
+	if((res = send_packet(dev, MUX_PROTO_VERSION, &vh, NULL, 0)) < 0) {
+		usbmuxd_log(LL_ERROR, "Error sending version request packet to device %d", dev->id);
+		return res;
+	}
+	return 0;
+}
+
+/**
+ * Tear down a device that went away, in the thread of its shard.
+ *
+ * @return 1 if it was active, so clients have to be told.
+ */
+static int shard_device_remove(struct mux_device *dev)
+{
+	int was_active = (dev->state == MUXDEV_ACTIVE);
+	dev->state = MUXDEV_DEAD;
+	if(was_active) {
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			connection_teardown(conn);
+		} ENDFOREACH
+		collection_free(&dev->connections);
+	}
+	collection_remove(&dev->shard->devices, dev);
+	return was_active;
+}
+
+static struct device_shard *pick_shard(void)
+{
+	struct device_shard *shard = &main_shard;
+	int i;
+	for(i = 0; i < num_shards; i++) {
+		if(__atomic_load_n(&shards[i].dead, __ATOMIC_ACQUIRE))
+			continue;
+		if(shard == &main_shard || shards[i].device_count < shard->device_count)
+			shard = &shards[i];
+	}
+	return shard;
+}
+
 int device_add(struct usb_device *usbdev)
 {
 	int res;
@@ -814,58 +1218,63 @@ int device_add(struct usb_device *usbdev)
 	struct mux_device *dev;
 	usbmuxd_log(LL_NOTICE, "Connecting to new device on location 0x%x as ID %d", usb_get_location(usbdev), id);
 	dev = malloc(sizeof(struct mux_device));
+	memset(dev, 0, sizeof(struct mux_device));
 	dev->id = id;
 	dev->usbdev = usbdev;
+	dev->shard = pick_shard();
 	dev->state = MUXDEV_INIT;
 	dev->visible = 0;
 	dev->next_sport = 1;
+	dev->sport_map[0] = 1; // port 0 means "no port"
 	dev->pktbuf = malloc(DEV_MRU);
 	dev->pktlen = 0;
 	dev->preflight_cb_data = NULL;
 	dev->version = 0;
-	struct version_header vh;
-	vh.major = htonl(2);
-	vh.minor = htonl(0);
-	vh.padding = 0;
-	if((res = send_packet(dev, MUX_PROTO_VERSION, &vh, NULL, 0)) < 0) {
-		usbmuxd_log(LL_ERROR, "Error sending version request packet to device %d", id);
-		free(dev->pktbuf);
-		free(dev);
+	if(dev->shard == &main_shard && (res = shard_device_add(dev)) < 0) {
+		collection_remove(&main_shard.devices, dev);
+		free_mux_device(dev);
 		return res;
 	}
+	dev->shard->device_count++;
 	pthread_mutex_lock(&device_list_mutex);
 	collection_add(&device_list, dev);
 	pthread_mutex_unlock(&device_list_mutex);
+	usb_set_mux_device(usbdev, dev);
+	if(dev->shard != &main_shard) {
+		usbmuxd_log(LL_INFO, "Device %d is handled by device thread %d", id, dev->shard->index);
+		shard_post(dev->shard, shard_msg_new(SHARD_DEVICE_ADD, dev, 0));
+	}
 	return 0;
 }
 
 void device_remove(struct usb_device *usbdev)
 {
+	struct mux_device *dev = usb_get_mux_device(usbdev);
+	int was_active;
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return;
+	}
+
+	usbmuxd_log(LL_NOTICE, "Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
+	usb_set_mux_device(usbdev, NULL);
 	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->usbdev == usbdev) {
-			usbmuxd_log(LL_NOTICE, "Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
-			if(dev->state == MUXDEV_ACTIVE) {
-				dev->state = MUXDEV_DEAD;
-				FOREACH(struct mux_connection *conn, &dev->connections) {
-					connection_teardown(conn);
-				} ENDFOREACH
-				client_device_remove(dev->id);
-				collection_free(&dev->connections);
-			}
-			if (dev->preflight_cb_data) {
-				preflight_device_remove_cb(dev->preflight_cb_data);
-			}
-			collection_remove(&device_list, dev);
-			pthread_mutex_unlock(&device_list_mutex);
-			free(dev->pktbuf);
-			free(dev);
-			return;
-		}
-	} ENDFOREACH
+	collection_remove(&device_list, dev);
 	pthread_mutex_unlock(&device_list_mutex);
 
-	usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+	// no new messages can reach it now, the ones queued before are handled first
+	if(dev->shard != &main_shard)
+		was_active = shard_call(dev->shard, shard_msg_new(SHARD_DEVICE_REMOVE, dev, 0));
+	else
+		was_active = shard_device_remove(dev);
+	dev->shard->device_count--;
+
+	if(was_active)
+		client_device_remove(dev->id);
+	if (dev->preflight_cb_data) {
+		preflight_device_remove_cb(dev->preflight_cb_data);
+	}
+	free_mux_device(dev);
 }
 
 void device_set_visible(int device_id)
@@ -901,7 +1310,7 @@ int device_get_count(int include_hidden)
 	pthread_mutex_unlock(&device_list_mutex);
 
 	FOREACH(struct mux_device *dev, &dev_list) {
-		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible))
+		if((__atomic_load_n(&dev->state, __ATOMIC_ACQUIRE) == MUXDEV_ACTIVE) && (include_hidden || dev->visible))
 			count++;
 	} ENDFOREACH
 
@@ -920,8 +1329,8 @@ int device_get_list(int include_hidden, struct device_info **devices)
 	*devices = malloc(sizeof(struct device_info) * dev_list.capacity);
 	struct device_info *p = *devices;
 
-	FOREACH(struct mux_device *dev, &device_list) {
-		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
+	FOREACH(struct mux_device *dev, &dev_list) {
+		if((__atomic_load_n(&dev->state, __ATOMIC_ACQUIRE) == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
 			p->id = dev->id;
 			p->serial = usb_get_serial(dev->usbdev);
 			p->location = usb_get_location(dev->usbdev);
@@ -937,64 +1346,535 @@ int device_get_list(int include_hidden, struct device_info **devices)
 	return count;
 }
 
-int device_get_timeout(void)
+static void device_check_timeouts(struct event_timer *timer)
 {
+	struct device_shard *shard = timer->data;
+	uint64_t ct = mstime64();
 	uint64_t oldest = (uint64_t)-1LL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
+	FOREACH(struct mux_device *dev, &shard->devices) {
 		if(dev->state == MUXDEV_ACTIVE) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
-				if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && conn->last_ack_time < oldest)
+				if((conn->state != CONN_CONNECTED) || !(conn->flags & CONN_ACK_PENDING))
+					continue;
+				if((ct - conn->last_ack_time) > ACK_TIMEOUT) {
+					usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
+					send_tcp_ack(conn);
+				} else if(conn->last_ack_time < oldest) {
 					oldest = conn->last_ack_time;
+				}
 			} ENDFOREACH
 		}
 	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-	uint64_t ct = mstime64();
-	if((int64_t)oldest == -1LL)
-		return 100000; //meh
-	if((ct - oldest) > ACK_TIMEOUT)
-		return 0;
-	return ACK_TIMEOUT - (ct - oldest);
+
+	// ACKs that are pending but not yet due re-arm the timer for the oldest one
+	if((int64_t)oldest != -1LL)
+		event_timer_arm(&shard->ack_timer, ACK_TIMEOUT - (ct - oldest) + 1);
 }
 
-void device_check_timeouts(void)
+/**
+ * Submit the packets queued for the shard's devices during this event
+ * loop iteration, one bulk transfer per device where they fit.
+ */
+static void shard_flush_tx(struct device_shard *shard)
 {
-	uint64_t ct = mstime64();
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list) {
-		if(dev->state == MUXDEV_ACTIVE) {
+	uint64_t now;
+
+	FOREACH(struct mux_device *dev, &shard->devices) {
+		if(dev->acks_deferred) {
+			// ACKs that did not ride along with data in this turn
+			dev->acks_deferred = 0;
 			FOREACH(struct mux_connection *conn, &dev->connections) {
-				if((conn->state == CONN_CONNECTED) && 
-						(conn->flags & CONN_ACK_PENDING) && 
-						(ct - conn->last_ack_time) > ACK_TIMEOUT) {
-					usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
+				if(!(conn->flags & CONN_ACK_DEFERRED))
+					continue;
+				conn->flags &= ~CONN_ACK_DEFERRED;
+				if(conn->state == CONN_CONNECTED && conn->tx_ack != conn->tx_acked)
 					send_tcp_ack(conn);
-				}
 			} ENDFOREACH
 		}
+		if(dev->txbuf)
+			flush_tx(dev);
 	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
+
+	now = mstime64();
+	if(now - shard->tx_stats_time >= 1000) {
+		uint64_t elapsed = now - shard->tx_stats_time;
+		if(shard->tx_packets)
+			usbmuxd_log(LL_DEBUG, "TX[%d]: %" PRIu64 " packets/s in %" PRIu64 " transfers/s", shard->index, shard->tx_packets * 1000 / elapsed, shard->tx_transfers * 1000 / elapsed);
+		if(shard->data_segments)
+			usbmuxd_log(LL_DEBUG, "RX[%d]: %" PRIu64 " data segments/s, %" PRIu64 " ACKs/s", shard->index, shard->data_segments * 1000 / elapsed, shard->acks_sent * 1000 / elapsed);
+		shard->tx_packets = 0;
+		shard->tx_transfers = 0;
+		shard->acks_sent = 0;
+		shard->data_segments = 0;
+		shard->tx_stats_time = now;
+	}
 }
 
-void device_init(void)
+/**
+ * Submit the packets queued for the devices of the main thread.
+ * Worker threads flush their own devices on every loop turn.
+ */
+void device_flush_tx(void)
 {
-	usbmuxd_log(LL_DEBUG, "device_init");
-	collection_init(&device_list);
-	pthread_mutex_init(&device_list_mutex, NULL);
-	next_device_id = 1;
+	shard_flush_tx(&main_shard);
 }
 
-void device_kill_connections(void)
+static void shard_kill_connections(struct device_shard *shard)
 {
-	usbmuxd_log(LL_DEBUG, "device_kill_connections");
-	FOREACH(struct mux_device *dev, &device_list) {
+	FOREACH(struct mux_device *dev, &shard->devices) {
 		if(dev->state != MUXDEV_INIT) {
 			FOREACH(struct mux_connection *conn, &dev->connections) {
 				connection_teardown(conn);
 			} ENDFOREACH
 		}
 	} ENDFOREACH
+}
+
+static const char *conn_state_name(enum mux_conn_state state)
+{
+	switch(state) {
+		case CONN_CONNECTING:
+			return "Connecting";
+		case CONN_CONNECTED:
+			return "Connected";
+		case CONN_REFUSED:
+			return "Refused";
+		case CONN_DYING:
+			return "Dying";
+		case CONN_DEAD:
+			return "Dead";
+		default:
+			return "UNKNOWN";
+	}
+}
+
+/**
+ * Snapshot the counters of a shard's devices and their connections.
+ * Runs in the shard's thread, so nothing changes underneath it.
+ */
+static void shard_collect_stats(struct device_shard *shard, struct shard_stats *stats)
+{
+	uint64_t now = mstime64();
+	struct device_stats *ds;
+
+	stats->count = collection_count(&shard->devices);
+	stats->devices = malloc(sizeof(struct device_stats) * (stats->count + 1));
+	ds = stats->devices;
+	FOREACH(struct mux_device *dev, &shard->devices) {
+		struct connection_stats *cs;
+
+		memset(ds, 0, sizeof(struct device_stats));
+		ds->id = dev->id;
+		ds->thread = shard->index;
+		ds->serial = usb_get_serial(dev->usbdev);
+		ds->rx_bytes = dev->rx_bytes;
+		ds->tx_bytes = dev->tx_bytes;
+		ds->rx_packets = dev->rx_packets;
+		ds->tx_packets = dev->tx_packets;
+		ds->tx_transfers = dev->tx_transfers;
+		ds->reassemblies = dev->reassemblies;
+		ds->errors = dev->errors;
+		ds->num_connections = collection_count(&dev->connections);
+		ds->connections = malloc(sizeof(struct connection_stats) * (ds->num_connections + 1));
+		cs = ds->connections;
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			cs->sport = conn->sport;
+			cs->dport = conn->dport;
+			cs->state = conn_state_name(conn->state);
+			cs->tx_win = conn->tx_win;
+			cs->rx_win = conn->rx_win;
+			cs->buffered = conn->ib.size;
+			cs->unacked = conn->tx_seq - conn->rx_ack;
+			cs->rx_bytes = conn->rx_bytes;
+			cs->tx_bytes = conn->tx_bytes;
+			cs->acks_sent = conn->acks_sent;
+			cs->age = now - conn->created;
+			cs++;
+		} ENDFOREACH
+		ds++;
+	} ENDFOREACH
+}
+
+/**
+ * Collect the counters of all devices, their connections and the event
+ * loops of the main and worker threads. Must be called from the main
+ * thread; the workers are asked for their part and answer in between
+ * two turns of their loops.
+ *
+ * @param devices Set to an array with the stats of every device.
+ * @param loops Set to an array with the stats of every event loop,
+ *   starting with the main thread's.
+ * @param num_loops Set to the number of entries in loops.
+ *
+ * @return the number of devices. Free the result with device_free_stats().
+ */
+int device_get_stats(struct device_stats **devices, struct event_stats **loops, int *num_loops)
+{
+	struct shard_stats *stats;
+	int count = 0;
+	int i;
+
+	stats = malloc(sizeof(struct shard_stats) * (num_shards + 1));
+	shard_collect_stats(&main_shard, &stats[0]);
+	event_get_stats(&stats[0].loop);
+	for(i = 0; i < num_shards; i++) {
+		struct shard_msg *msg = shard_msg_new(SHARD_STATS, NULL, 0);
+		msg->stats = &stats[i + 1];
+		if(shard_call(&shards[i], msg) < 0)
+			memset(&stats[i + 1], 0, sizeof(struct shard_stats));
+	}
+
+	for(i = 0; i <= num_shards; i++)
+		count += stats[i].count;
+	*devices = malloc(sizeof(struct device_stats) * (count + 1));
+	*loops = malloc(sizeof(struct event_stats) * (num_shards + 1));
+	*num_loops = num_shards + 1;
+	count = 0;
+	for(i = 0; i <= num_shards; i++) {
+		memcpy(*devices + count, stats[i].devices, sizeof(struct device_stats) * stats[i].count);
+		count += stats[i].count;
+		(*loops)[i] = stats[i].loop;
+		free(stats[i].devices);
+	}
+	free(stats);
+
+	// the USB transfers belong to the main thread
+	for(i = 0; i < count; i++) {
+		struct mux_device *dev = get_mux_device_for_id((*devices)[i].id);
+		if(dev)
+			usb_get_transfer_counts(dev->usbdev, &(*devices)[i].rx_in_flight, &(*devices)[i].tx_in_flight);
+	}
+	return count;
+}
+
+void device_free_stats(struct device_stats *devices, int count, struct event_stats *loops)
+{
+	int i;
+	for(i = 0; i < count; i++)
+		free(devices[i].connections);
+	free(devices);
+	free(loops);
+}
+
+static void shard_handle_msg(struct device_shard *shard, struct shard_msg *msg)
+{
+	int res = 0;
+
+	switch(msg->type) {
+		case SHARD_DEVICE_ADD:
+			if(shard_device_add(msg->dev) < 0)
+				msg->dev->state = MUXDEV_DEAD;
+			break;
+		case SHARD_DEVICE_REMOVE:
+			res = shard_device_remove(msg->dev);
+			break;
+		case SHARD_DATA:
+			device_input(msg->dev, msg->data, msg->length);
+			break;
+		case SHARD_CONNECT:
+			client_attach(msg->client);
+			res = connection_start(msg->dev, msg->dport, msg->client);
+			if(res < 0) {
+				client_notify_connect(msg->client, -res);
+				shard_return_client(msg->client);
+			}
+			break;
+		case SHARD_CLIENT:
+			client_attach(msg->client);
+			break;
+		case SHARD_KILL:
+			shard_kill_connections(shard);
+			shard_flush_tx(shard);
+			break;
+		case SHARD_STATS:
+			shard_collect_stats(shard, msg->stats);
+			event_get_stats(&msg->stats->loop);
+			break;
+		case SHARD_STOP:
+			shard->running = 0;
+			break;
+		default:
+			usbmuxd_log(LL_ERROR, "Device thread %d got unknown message type %d", shard->index, msg->type);
+			res = -1;
+			break;
+	}
+	shard_msg_done(msg, res);
+}
+
+static void shard_process_inbox(struct device_shard *shard)
+{
+	struct mpsc_node *node;
+	while((node = mpsc_pop(&shard->inbox)))
+		shard_handle_msg(shard, (struct shard_msg *)node);
+}
+
+static void shard_wake_cb(struct event_watch *watch, short events)
+{
+	struct device_shard *shard = watch->data;
+	char buf[64];
+
+	while(read(shard->wake_fds[0], buf, sizeof(buf)) > 0);
+	// clear before draining, so messages posted from now on wake us again
+	__atomic_store_n(&shard->wake_pending, 0, __ATOMIC_SEQ_CST);
+	shard_process_inbox(shard);
+}
+
+static void shard_init(struct device_shard *shard, int index)
+{
+	memset(shard, 0, sizeof(struct device_shard));
+	shard->index = index;
+	shard->running = 1;
+	collection_init(&shard->devices);
+	mpsc_init(&shard->inbox);
+	shard->wake_fds[0] = shard->wake_fds[1] = -1;
+	shard->tx_stats_time = mstime64();
+}
+
+static int shard_open_inbox(struct device_shard *shard)
+{
+	if(pipe(shard->wake_fds) < 0) {
+		usbmuxd_log(LL_FATAL, "Could not create wakeup pipe: %s", strerror(errno));
+		return -1;
+	}
+	fcntl(shard->wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(shard->wake_fds[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+static void shard_free(struct device_shard *shard)
+{
+	struct mpsc_node *node;
+	while((node = mpsc_pop(&shard->inbox)))
+		free(node);
+	if(shard->wake_fds[0] >= 0) {
+		close(shard->wake_fds[0]);
+		close(shard->wake_fds[1]);
+	}
+	collection_free(&shard->devices);
+}
+
+/**
+ * Finish a message for a shard whose event loop failed: nothing is
+ * handled any more, but callers must not block forever.
+ */
+static void shard_fail_msg(struct device_shard *shard, struct shard_msg *msg)
+{
+	int res = -1;
+
+	switch(msg->type) {
+		case SHARD_DEVICE_ADD:
+			// keep it, so its removal still finds it
+			msg->dev->state = MUXDEV_DEAD;
+			collection_add(&shard->devices, msg->dev);
+			break;
+		case SHARD_DEVICE_REMOVE:
+			res = shard_device_remove(msg->dev);
+			break;
+		case SHARD_CONNECT:
+			client_notify_connect(msg->client, RESULT_BADDEV);
+			shard_return_client(msg->client);
+			break;
+		case SHARD_STOP:
+			shard->running = 0;
+			res = 0;
+			break;
+		default:
+			break;
+	}
+	shard_msg_done(msg, res);
+}
+
+/**
+ * What is left of a shard's thread after event_wait() failed. The shard
+ * is skipped for new devices from now on; until device_shutdown() stops
+ * it, anything posted to it still gets an answer.
+ */
+static void shard_run_dead(struct device_shard *shard)
+{
+	struct pollfd pfd;
+	struct mpsc_node *node;
+	char buf[64];
+
+	__atomic_store_n(&shard->dead, 1, __ATOMIC_RELEASE);
+	pfd.fd = shard->wake_fds[0];
+	pfd.events = POLLIN;
+	while(shard->running) {
+		while(read(shard->wake_fds[0], buf, sizeof(buf)) > 0);
+		__atomic_store_n(&shard->wake_pending, 0, __ATOMIC_SEQ_CST);
+		while(shard->running && (node = mpsc_pop(&shard->inbox)))
+			shard_fail_msg(shard, (struct shard_msg *)node);
+		if(shard->running)
+			poll(&pfd, 1, 1000);
+	}
+}
+
+static int shard_thread_setup(struct device_shard *shard)
+{
+	if(event_init() < 0) {
+		usbmuxd_log(LL_FATAL, "Could not set up event loop for device thread %d", shard->index);
+		return -1;
+	}
+	event_timer_init(&shard->ack_timer, device_check_timeouts, shard);
+	if(event_add(&shard->wake_watch, shard->wake_fds[0], POLLIN, shard_wake_cb, shard) < 0) {
+		usbmuxd_log(LL_FATAL, "Could not watch the inbox of device thread %d", shard->index);
+		event_timer_free(&shard->ack_timer);
+		event_shutdown();
+		return -1;
+	}
+	return 0;
+}
+
+static void *shard_thread(void *arg)
+{
+	struct device_shard *shard = arg;
+	int res;
+
+	res = shard_thread_setup(shard);
+	// device_init() is waiting for this, and forgets the shard on failure
+	shard_sync_signal(shard->startup, res);
+	if(res < 0)
+		return NULL;
+
+	while(shard->running) {
+		// everything queued for the devices since the last wait goes out now
+		shard_flush_tx(shard);
+		if(event_wait(1000, NULL) < 0 && errno != EINTR) {
+			usbmuxd_log(LL_FATAL, "event_wait failed in device thread %d: %s", shard->index, strerror(errno));
+			break;
+		}
+	}
+
+	FOREACH(struct mux_device *dev, &shard->devices) {
+		FOREACH(struct mux_connection *conn, &dev->connections) {
+			connection_teardown(conn);
+		} ENDFOREACH
+		collection_free(&dev->connections);
+	} ENDFOREACH
+	shard_flush_tx(shard);
+	if(shard->running)
+		shard_run_dead(shard);
+	event_remove(&shard->wake_watch);
+	event_timer_free(&shard->ack_timer);
+	event_shutdown();
+	return NULL;
+}
+
+/**
+ * Choose when ACKs for data from the devices are sent.
+ *
+ * @param policy ACK_IMMEDIATE to ACK every segment, ACK_DELAYED to
+ *   piggy-back and coalesce them within one event loop turn.
+ * @param window With ACK_DELAYED, ACK at once when the device has less
+ *   than this many bytes of window left. 0 keeps the default.
+ */
+void device_set_ack_policy(enum ack_policy policy, uint32_t window)
+{
+	ack_policy = policy;
+	ack_window = window ? window : DEFAULT_ACK_WINDOW;
+}
+
+/**
+ * Spread devices over worker threads, each with its own event loop.
+ * Has to be called before device_init().
+ *
+ * @param threads Number of worker threads, 0 handles everything in the
+ *   main thread.
+ */
+void device_set_threads(int threads)
+{
+	if(threads < 0)
+		threads = 0;
+	if(threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	num_shards = threads;
+}
+
+static void shards_stop(void)
+{
+	int i;
+	for(i = 0; i < num_shards; i++) {
+		shard_post(&shards[i], shard_msg_new(SHARD_STOP, NULL, 0));
+		pthread_join(shards[i].thread, NULL);
+		shard_free(&shards[i]);
+	}
+	free(shards);
+	shards = NULL;
+}
+
+int device_init(void)
+{
+	int i;
+	usbmuxd_log(LL_DEBUG, "device_init");
+	collection_init(&device_list);
+	pthread_mutex_init(&device_list_mutex, NULL);
+	shard_init(&main_shard, 0);
+	event_timer_init(&main_shard.ack_timer, device_check_timeouts, &main_shard);
+	next_device_id = 1;
+
+	if(!num_shards)
+		return 0;
+
+	// clients come back to the main thread through its inbox
+	if(shard_open_inbox(&main_shard) < 0) {
+		num_shards = 0;
+		return -1;
+	}
+	if(event_add(&main_shard.wake_watch, main_shard.wake_fds[0], POLLIN, shard_wake_cb, &main_shard) < 0) {
+		usbmuxd_log(LL_FATAL, "Could not watch the inbox of the main thread");
+		num_shards = 0;
+		return -1;
+	}
+
+	shards = malloc(sizeof(struct device_shard) * num_shards);
+	for(i = 0; i < num_shards; i++) {
+		struct shard_sync startup;
+		sigset_t set, oldset;
+		int res;
+		shard_init(&shards[i], i + 1);
+		if(shard_open_inbox(&shards[i]) < 0) {
+			shard_free(&shards[i]);
+			break;
+		}
+		shard_sync_init(&startup);
+		shards[i].startup = &startup;
+		// signals are for the main thread's event_wait()
+		sigfillset(&set);
+		pthread_sigmask(SIG_BLOCK, &set, &oldset);
+		res = pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i]);
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+		if(res != 0) {
+			usbmuxd_log(LL_ERROR, "Could not start device thread %d", i + 1);
+			shard_sync_signal(&startup, -1);
+		}
+		// the thread is not used before its event loop is up
+		if(shard_sync_wait(&startup) < 0) {
+			if(res == 0)
+				pthread_join(shards[i].thread, NULL);
+			shard_free(&shards[i]);
+			break;
+		}
+		shards[i].startup = NULL;
+	}
+	if(i < num_shards) {
+		usbmuxd_log(LL_FATAL, "Could not start %d device threads", num_shards);
+		num_shards = i;
+		shards_stop();
+		event_remove(&main_shard.wake_watch);
+		num_shards = 0;
+		return -1;
+	}
+	usbmuxd_log(LL_INFO, "Started %d device thread%s", num_shards, (num_shards == 1) ? "" : "s");
+	return 0;
+}
+
+void device_kill_connections(void)
+{
+	int i;
+	usbmuxd_log(LL_DEBUG, "device_kill_connections");
+	for(i = 0; i < num_shards; i++)
+		shard_call(&shards[i], shard_msg_new(SHARD_KILL, NULL, 0));
+	shard_kill_connections(&main_shard);
+	device_flush_tx();
 	// give USB a while to send the final connection RSTs and the like
 	usb_process_timeout(100);
 }
@@ -1002,16 +1882,29 @@ void device_kill_connections(void)
 void device_shutdown(void)
 {
 	usbmuxd_log(LL_DEBUG, "device_shutdown");
+	shards_stop();
+	if(num_shards) {
+		// clients handed back at the very end
+		shard_process_inbox(&main_shard);
+		event_remove(&main_shard.wake_watch);
+		num_shards = 0;
+	}
+	shard_free(&main_shard);
+
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *dev, &device_list) {
-		FOREACH(struct mux_connection *conn, &dev->connections) {
-			connection_teardown(conn);
-		} ENDFOREACH
-		collection_free(&dev->connections);
+		if(dev->shard == &main_shard) {
+			FOREACH(struct mux_connection *conn, &dev->connections) {
+				connection_teardown(conn);
+			} ENDFOREACH
+			collection_free(&dev->connections);
+		}
 		collection_remove(&device_list, dev);
-		free(dev);
+		usb_set_mux_device(dev->usbdev, NULL);
+		free_mux_device(dev);
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
 	pthread_mutex_destroy(&device_list_mutex);
 	collection_free(&device_list);
+	event_timer_free(&main_shard.ack_timer);
 }
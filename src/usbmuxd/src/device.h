@@ -23,6 +23,11 @@
 #include "usb.h"
 #include "client.h"
 
+enum ack_policy {
+	ACK_IMMEDIATE,	// ACK every data segment as it arrives
+	ACK_DELAYED	// piggy-back on data, coalesce within one loop turn
+};
+
 struct device_info {
 	int id;
 	const char *serial;
@@ -31,6 +36,33 @@ struct device_info {
 	uint64_t speed;
 };
 
+struct connection_stats {
+	uint16_t sport, dport;
+	const char *state;
+	uint32_t tx_win, rx_win;
+	uint32_t buffered;	// device data not yet written to the client
+	uint32_t unacked;	// client data the device has not ACKed yet
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t acks_sent;
+	uint64_t age;	// milliseconds
+};
+
+struct device_stats {
+	int id;
+	int thread;	// 0 is the main thread
+	const char *serial;
+	uint64_t rx_bytes, tx_bytes;
+	uint64_t rx_packets, tx_packets;
+	uint64_t tx_transfers;
+	uint64_t reassemblies;	// packets gathered from split transfers
+	uint64_t errors;
+	int rx_in_flight, tx_in_flight;
+	int num_connections;
+	struct connection_stats *connections;
+};
+
+struct event_stats;
+
 void device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length);
 
 int device_add(struct usb_device *dev);
@@ -39,17 +71,19 @@ void device_remove(struct usb_device *dev);
 int device_start_connect(int device_id, uint16_t port, struct mux_client *client);
 void device_client_process(int device_id, struct mux_client *client, short events);
 void device_abort_connect(int device_id, struct mux_client *client);
+void device_flush_tx(void);
+void device_set_ack_policy(enum ack_policy policy, uint32_t window);
+void device_set_threads(int threads);
 
 void device_set_visible(int device_id);
 void device_set_preflight_cb_data(int device_id, void* data);
 
 int device_get_count(int include_hidden);
 int device_get_list(int include_hidden, struct device_info **devices);
+int device_get_stats(struct device_stats **devices, struct event_stats **loops, int *num_loops);
+void device_free_stats(struct device_stats *devices, int count, struct event_stats *loops);
 
-int device_get_timeout(void);
-void device_check_timeouts(void);
-
-void device_init(void);
+int device_init(void);
 void device_kill_connections(void);
 void device_shutdown(void);
 
@@ -0,0 +1,472 @@
+/*
+ * event.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE 1
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define USE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+#include "event.h"
+#include "log.h"
+#include "utils.h"
+
+// Maximum number of ready descriptors dispatched per event_wait() call
+#define EVENT_BATCH 64
+
+/*
+ * Descriptors are registered once and stay registered until removed, the
+ * watch pointer itself travels with each event so dispatch needs no lookup.
+ * A callback may remove any watch, including ones that are still pending in
+ * the current batch; those entries are cleared so they are never dispatched.
+ *
+ * Every thread that calls event_init() gets a loop of its own. Watches and
+ * timers are added to the calling thread's loop and remember it, so they
+ * are modified and removed there even when that happens from elsewhere.
+ */
+
+struct event_loop {
+#ifdef USE_EPOLL
+	int epfd;
+	struct epoll_event pending[EVENT_BATCH];
+#else
+	struct collection watches;
+	struct collection timers;
+	struct pollfd *pollfds;
+	struct event_watch **pollwatches;
+	int poll_capacity;
+#endif
+	int pending_count;
+	int pending_pos;
+	struct event_stats stats;
+};
+
+static __thread struct event_loop *loop;
+
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hist_add(uint64_t *hist, uint64_t usec)
+{
+	int bucket = 0;
+	while(bucket < EVENT_HIST_BUCKETS - 1 && usec >= (2ULL << bucket))
+		bucket++;
+	hist[bucket]++;
+}
+
+/**
+ * Account one event_wait() call: start is when it entered poll, ready
+ * when poll returned and now when the callbacks are done.
+ */
+static void account_wait(uint64_t start, uint64_t ready, int dispatched)
+{
+	uint64_t done = usec_now();
+	loop->stats.iterations++;
+	loop->stats.dispatched += dispatched;
+	loop->stats.busy_usec += done - ready;
+	hist_add(loop->stats.wait_hist, ready - start);
+	if(dispatched)
+		hist_add(loop->stats.dispatch_hist, done - ready);
+}
+
+/**
+ * Copy the counters of the calling thread's loop.
+ */
+void event_get_stats(struct event_stats *stats)
+{
+	*stats = loop->stats;
+}
+
+#ifdef USE_EPOLL
+
+static uint32_t poll_to_epoll(short events)
+{
+	uint32_t res = 0;
+	if(events & POLLIN)
+		res |= EPOLLIN;
+	if(events & POLLOUT)
+		res |= EPOLLOUT;
+	return res;
+}
+
+static short epoll_to_poll(uint32_t events)
+{
+	short res = 0;
+	if(events & EPOLLIN)
+		res |= POLLIN;
+	if(events & EPOLLOUT)
+		res |= POLLOUT;
+	if(events & EPOLLERR)
+		res |= POLLERR;
+	if(events & EPOLLHUP)
+		res |= POLLHUP;
+	return res;
+}
+
+int event_init(void)
+{
+	loop = malloc(sizeof(struct event_loop));
+	memset(loop, 0, sizeof(struct event_loop));
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epfd < 0) {
+		usbmuxd_log(LL_FATAL, "epoll_create1() failed: %s", strerror(errno));
+		free(loop);
+		loop = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void event_shutdown(void)
+{
+	if(!loop)
+		return;
+	close(loop->epfd);
+	free(loop);
+	loop = NULL;
+}
+
+int event_add(struct event_watch *watch, int fd, short events, event_cb cb, void *data)
+{
+	struct epoll_event ev;
+
+	watch->fd = fd;
+	watch->events = events;
+	watch->cb = cb;
+	watch->data = data;
+	watch->loop = loop;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = poll_to_epoll(events);
+	ev.data.ptr = watch;
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		usbmuxd_log(LL_ERROR, "epoll_ctl(ADD) for fd %d failed: %s", fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int event_modify(struct event_watch *watch, short events)
+{
+	struct epoll_event ev;
+
+	if(watch->events == events)
+		return 0;
+	watch->events = events;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = poll_to_epoll(events);
+	ev.data.ptr = watch;
+	if(epoll_ctl(watch->loop->epfd, EPOLL_CTL_MOD, watch->fd, &ev) < 0) {
+		usbmuxd_log(LL_ERROR, "epoll_ctl(MOD) for fd %d failed: %s", watch->fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+void event_remove(struct event_watch *watch)
+{
+	struct event_loop *wloop = watch->loop;
+	int i;
+
+	if(epoll_ctl(wloop->epfd, EPOLL_CTL_DEL, watch->fd, NULL) < 0)
+		usbmuxd_log(LL_WARNING, "epoll_ctl(DEL) for fd %d failed: %s", watch->fd, strerror(errno));
+
+	for(i = wloop->pending_pos + 1; i < wloop->pending_count; i++) {
+		if(wloop->pending[i].data.ptr == watch)
+			wloop->pending[i].data.ptr = NULL;
+	}
+}
+
+static void timer_fd_cb(struct event_watch *watch, short revents)
+{
+	struct event_timer *timer = watch->data;
+	uint64_t expirations;
+
+	// EAGAIN means the timer was rearmed after it had already fired
+	if(read(watch->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	timer->deadline = 0;
+	timer->cb(timer);
+}
+
+int event_timer_init(struct event_timer *timer, event_timer_cb cb, void *data)
+{
+	int fd;
+
+	timer->cb = cb;
+	timer->data = data;
+	timer->deadline = 0;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0) {
+		usbmuxd_log(LL_FATAL, "timerfd_create() failed: %s", strerror(errno));
+		return -1;
+	}
+	if(event_add(&timer->watch, fd, POLLIN, timer_fd_cb, timer) < 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+void event_timer_arm(struct event_timer *timer, int msec)
+{
+	struct itimerspec its;
+	uint64_t deadline = mstime64() + msec;
+
+	if(timer->deadline && timer->deadline <= deadline)
+		return;
+	timer->deadline = deadline;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = msec / 1000;
+	its.it_value.tv_nsec = (msec % 1000) * 1000000;
+	if(msec <= 0) {
+		// an all-zero it_value would disarm the timer instead
+		its.it_value.tv_sec = 0;
+		its.it_value.tv_nsec = 1;
+	}
+	if(timerfd_settime(timer->watch.fd, 0, &its, NULL) < 0)
+		usbmuxd_log(LL_ERROR, "timerfd_settime() failed: %s", strerror(errno));
+}
+
+void event_timer_disarm(struct event_timer *timer)
+{
+	struct itimerspec its;
+
+	if(!timer->deadline)
+		return;
+	timer->deadline = 0;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(timer->watch.fd, 0, &its, NULL);
+}
+
+void event_timer_free(struct event_timer *timer)
+{
+	event_remove(&timer->watch);
+	close(timer->watch.fd);
+	timer->deadline = 0;
+}
+
+int event_wait(int timeout, const sigset_t *sigmask)
+{
+	uint64_t start, ready;
+	int cnt;
+
+	start = usec_now();
+	cnt = epoll_pwait(loop->epfd, loop->pending, EVENT_BATCH, timeout, sigmask);
+	ready = usec_now();
+	usbmuxd_log(LL_FLOOD, "epoll_pwait() returned %d", cnt);
+	if(cnt <= 0) {
+		account_wait(start, ready, 0);
+		return cnt;
+	}
+
+	loop->pending_count = cnt;
+	for(loop->pending_pos = 0; loop->pending_pos < loop->pending_count; loop->pending_pos++) {
+		struct event_watch *watch = loop->pending[loop->pending_pos].data.ptr;
+		if(!watch)
+			continue;
+		watch->cb(watch, epoll_to_poll(loop->pending[loop->pending_pos].events));
+	}
+	loop->pending_count = 0;
+	loop->pending_pos = 0;
+
+	account_wait(start, ready, cnt);
+	return cnt;
+}
+
+#else
+
+#ifndef HAVE_PPOLL
+static int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
+{
+	int ready;
+	sigset_t origmask;
+	int to = timeout->tv_sec*1000 + timeout->tv_nsec/1000000;
+
+	sigprocmask(SIG_SETMASK, sigmask, &origmask);
+	ready = poll(fds, nfds, to);
+	sigprocmask(SIG_SETMASK, &origmask, NULL);
+
+	return ready;
+}
+#endif
+
+int event_init(void)
+{
+	loop = malloc(sizeof(struct event_loop));
+	memset(loop, 0, sizeof(struct event_loop));
+	collection_init(&loop->watches);
+	collection_init(&loop->timers);
+	return 0;
+}
+
+void event_shutdown(void)
+{
+	if(!loop)
+		return;
+	free(loop->pollfds);
+	free(loop->pollwatches);
+	collection_free(&loop->watches);
+	collection_free(&loop->timers);
+	free(loop);
+	loop = NULL;
+}
+
+int event_add(struct event_watch *watch, int fd, short events, event_cb cb, void *data)
+{
+	watch->fd = fd;
+	watch->events = events;
+	watch->cb = cb;
+	watch->data = data;
+	watch->loop = loop;
+	collection_add(&loop->watches, watch);
+	return 0;
+}
+
+int event_modify(struct event_watch *watch, short events)
+{
+	watch->events = events;
+	return 0;
+}
+
+void event_remove(struct event_watch *watch)
+{
+	struct event_loop *wloop = watch->loop;
+	int i;
+
+	collection_remove(&wloop->watches, watch);
+	for(i = wloop->pending_pos + 1; i < wloop->pending_count; i++) {
+		if(wloop->pollwatches[i] == watch)
+			wloop->pollwatches[i] = NULL;
+	}
+}
+
+int event_timer_init(struct event_timer *timer, event_timer_cb cb, void *data)
+{
+	timer->cb = cb;
+	timer->data = data;
+	timer->deadline = 0;
+	timer->watch.fd = -1;
+	timer->watch.loop = loop;
+	collection_add(&loop->timers, timer);
+	return 0;
+}
+
+void event_timer_arm(struct event_timer *timer, int msec)
+{
+	uint64_t deadline = mstime64() + msec;
+
+	if(timer->deadline && timer->deadline <= deadline)
+		return;
+	timer->deadline = deadline;
+}
+
+void event_timer_disarm(struct event_timer *timer)
+{
+	timer->deadline = 0;
+}
+
+void event_timer_free(struct event_timer *timer)
+{
+	collection_remove(&timer->watch.loop->timers, timer);
+	timer->deadline = 0;
+}
+
+int event_wait(int timeout, const sigset_t *sigmask)
+{
+	struct timespec tspec;
+	uint64_t now, start, ready;
+	int count = 0;
+	int cnt;
+
+	FOREACH(struct event_watch *watch, &loop->watches) {
+		if(count == loop->poll_capacity) {
+			loop->poll_capacity = loop->poll_capacity ? loop->poll_capacity * 2 : 16;
+			loop->pollfds = realloc(loop->pollfds, sizeof(*loop->pollfds) * loop->poll_capacity);
+			loop->pollwatches = realloc(loop->pollwatches, sizeof(*loop->pollwatches) * loop->poll_capacity);
+		}
+		loop->pollfds[count].fd = watch->fd;
+		loop->pollfds[count].events = watch->events;
+		loop->pollfds[count].revents = 0;
+		loop->pollwatches[count] = watch;
+		count++;
+	} ENDFOREACH
+
+	now = mstime64();
+	FOREACH(struct event_timer *timer, &loop->timers) {
+		if(timer->deadline) {
+			int remain = (timer->deadline > now) ? (int)(timer->deadline - now) : 0;
+			if(remain < timeout)
+				timeout = remain;
+		}
+	} ENDFOREACH
+
+	tspec.tv_sec = timeout / 1000;
+	tspec.tv_nsec = (timeout % 1000) * 1000000;
+	start = usec_now();
+	cnt = ppoll(loop->pollfds, count, &tspec, sigmask);
+	ready = usec_now();
+	usbmuxd_log(LL_FLOOD, "poll() returned %d", cnt);
+	if(cnt < 0) {
+		account_wait(start, ready, 0);
+		return cnt;
+	}
+
+	loop->pending_count = count;
+	for(loop->pending_pos = 0; loop->pending_pos < loop->pending_count; loop->pending_pos++) {
+		struct event_watch *watch = loop->pollwatches[loop->pending_pos];
+		if(!watch || !loop->pollfds[loop->pending_pos].revents)
+			continue;
+		watch->cb(watch, loop->pollfds[loop->pending_pos].revents);
+	}
+	loop->pending_count = 0;
+	loop->pending_pos = 0;
+
+	now = mstime64();
+	FOREACH(struct event_timer *timer, &loop->timers) {
+		if(timer->deadline && timer->deadline <= now) {
+			timer->deadline = 0;
+			timer->cb(timer);
+		}
+	} ENDFOREACH
+
+	account_wait(start, ready, cnt);
+	return cnt;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * event.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+
+struct event_loop;
+struct event_watch;
+struct event_timer;
+
+typedef void (*event_cb)(struct event_watch *watch, short revents);
+typedef void (*event_timer_cb)(struct event_timer *timer);
+
+// A file descriptor registered with the event loop. The structure is owned
+// by the caller and must stay valid until event_remove() has been called.
+struct event_watch {
+	int fd;
+	short events;	// POLLIN/POLLOUT mask currently registered
+	event_cb cb;
+	void *data;
+	struct event_loop *loop;	// the loop it was added to
+};
+
+// A one-shot timer. Arming an armed timer only ever moves its deadline
+// closer, so several users can share one timer for "check again soon".
+struct event_timer {
+	event_timer_cb cb;
+	void *data;
+	uint64_t deadline;	// mstime64() value it fires at, 0 when disarmed
+	struct event_watch watch;	// timerfd, when the backend has one
+};
+
+// Counters kept by every loop. Bucket i of the histograms counts calls that
+// took less than 2^(i+1) microseconds, the last one everything longer.
+#define EVENT_HIST_BUCKETS 24
+
+struct event_stats {
+	uint64_t iterations;	// event_wait() calls
+	uint64_t dispatched;	// callbacks run
+	uint64_t busy_usec;	// time spent in callbacks
+	uint64_t wait_hist[EVENT_HIST_BUCKETS];	// time blocked in poll
+	uint64_t dispatch_hist[EVENT_HIST_BUCKETS];	// time to run one batch
+};
+
+// set up / tear down the calling thread's event loop
+int event_init(void);
+void event_shutdown(void);
+
+int event_add(struct event_watch *watch, int fd, short events, event_cb cb, void *data);
+int event_modify(struct event_watch *watch, short events);
+void event_remove(struct event_watch *watch);
+
+int event_timer_init(struct event_timer *timer, event_timer_cb cb, void *data);
+void event_timer_arm(struct event_timer *timer, int msec);
+void event_timer_disarm(struct event_timer *timer);
+void event_timer_free(struct event_timer *timer);
+
+int event_wait(int timeout, const sigset_t *sigmask);
+void event_get_stats(struct event_stats *stats);
+
+#endif
@@ -26,17 +26,56 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
-#include <sys/time.h>
+#include <pthread.h>
 #include <syslog.h>
 
 #include "log.h"
 #include "utils.h"
 
+#define LOG_RING_SLOTS 256	// power of two
+#define LOG_SLOT_TEXT 240
+#define LOG_MAX_RINGS 128
+
 unsigned int log_level = LL_WARNING;
 
 int log_syslog = 0;
 
+// Once the writer thread runs, every thread formats its messages into a
+// ring of its own and the writer puts them out. Nothing on the logging
+// side blocks: when a ring is full the message is dropped and counted.
+struct log_slot {
+	uint64_t time;	// usec since the epoch
+	int level;
+	char text[LOG_SLOT_TEXT];
+};
+
+struct log_ring {
+	uint32_t head;	// next slot the writer reads
+	uint32_t tail;	// next slot the owner writes
+	uint32_t dropped;
+	int in_use;	// cleared when the owning thread exits
+	struct log_slot slots[LOG_RING_SLOTS];
+};
+
+static struct log_ring *rings[LOG_MAX_RINGS];
+static int num_rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static __thread struct log_ring *thread_ring;
+
+static pthread_t writer_thread;
+static int writer_running;
+static int writer_stop;
+// The writer sleeps on writer_cond when there is nothing to do. It sets
+// writer_idle and checks the rings once more before it does, and loggers
+// check writer_idle after publishing, so one of the two always notices.
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_idle;
+static int writer_wakeup;
+
 void log_enable_syslog()
 {
 	if (!log_syslog) {
@@ -61,35 +100,232 @@ static int level_to_syslog_level(int level)
 	return result;
 }
 
-void usbmuxd_log(enum loglevel level, const char *fmt, ...)
+static uint64_t log_time(void)
 {
-	va_list ap;
-	char *fs;
-	struct timeval ts;
-	struct tm *tp;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	if(level > log_level)
+static void log_output(int level, uint64_t time, const char *text)
+{
+	char ts[16];
+	time_t sec;
+	struct tm tm;
+
+	if (log_syslog) {
+		syslog(level_to_syslog_level(level), "[%d] %s", level, text);
 		return;
+	}
+	sec = time / 1000000;
+	localtime_r(&sec, &tm);
+	strftime(ts, sizeof(ts), "%H:%M:%S", &tm);
+	fprintf(stderr, "[%s.%03d][%d] %s\n", ts, (int)((time % 1000000) / 1000), level, text);
+}
+
+static void ring_release(void *arg)
+{
+	struct log_ring *ring = arg;
+	__atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
 
-	get_tick_count(&ts);
-	tp = localtime(&ts.tv_sec);
+/**
+ * Get the calling thread's ring, taking over a drained one left behind by
+ * a thread that exited, or setting up a new one.
+ */
+static struct log_ring *get_thread_ring(void)
+{
+	struct log_ring *ring = NULL;
+	int i;
 
-	fs = malloc(20 + strlen(fmt));
+	if (thread_ring)
+		return thread_ring;
 
-	if(log_syslog) {
-		sprintf(fs, "[%d] %s\n", level, fmt);
-	} else {
-		strftime(fs, 10, "[%H:%M:%S", tp);
-		sprintf(fs+9, ".%03d][%d] %s\n", (int)(ts.tv_usec / 1000), level, fmt);
+	pthread_mutex_lock(&rings_mutex);
+	for (i = 0; i < num_rings; i++) {
+		struct log_ring *r = rings[i];
+		if (!__atomic_load_n(&r->in_use, __ATOMIC_ACQUIRE)
+		    && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+			ring = r;
+			break;
+		}
+	}
+	if (!ring && num_rings < LOG_MAX_RINGS) {
+		ring = malloc(sizeof(struct log_ring));
+		if (ring) {
+			memset(ring, 0, sizeof(struct log_ring));
+			rings[num_rings] = ring;
+			__atomic_store_n(&num_rings, num_rings + 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (ring) {
+		ring->in_use = 1;
+		pthread_setspecific(ring_key, ring);
 	}
+	pthread_mutex_unlock(&rings_mutex);
 
-	va_start(ap, fmt);
-	if (log_syslog) {
-		vsyslog(level_to_syslog_level(level), fs, ap);
-	} else {
-		vfprintf(stderr, fs, ap);
+	thread_ring = ring;
+	return ring;
+}
+
+/**
+ * Write out everything queued in the rings, oldest message first.
+ *
+ * @return the number of messages written.
+ */
+static int log_drain(void)
+{
+	int count = 0;
+	int n = __atomic_load_n(&num_rings, __ATOMIC_ACQUIRE);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t dropped = __atomic_exchange_n(&rings[i]->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			char text[64];
+			snprintf(text, sizeof(text), "Log buffer full, %u messages dropped", dropped);
+			log_output(LL_WARNING, log_time(), text);
+		}
 	}
-	va_end(ap);
 
-	free(fs);
+	while (1) {
+		struct log_ring *next = NULL;
+		uint64_t oldest = 0;
+
+		for (i = 0; i < n; i++) {
+			struct log_ring *ring = rings[i];
+			uint32_t head = ring->head;
+			if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+				continue;
+			if (!next || ring->slots[head % LOG_RING_SLOTS].time < oldest) {
+				next = ring;
+				oldest = ring->slots[head % LOG_RING_SLOTS].time;
+			}
+		}
+		if (!next)
+			break;
+		struct log_slot *slot = &next->slots[next->head % LOG_RING_SLOTS];
+		log_output(slot->level, slot->time, slot->text);
+		__atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+	if (count && !log_syslog)
+		fflush(stderr);
+	return count;
+}
+
+static void log_wake_writer(void)
+{
+	pthread_mutex_lock(&writer_mutex);
+	writer_wakeup = 1;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+}
+
+static void *log_writer(void *arg)
+{
+	while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+		if (log_drain())
+			continue;
+
+		__atomic_store_n(&writer_idle, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		// a message published before the flag was visible is seen here
+		if (!log_drain()) {
+			pthread_mutex_lock(&writer_mutex);
+			while (!writer_wakeup && !__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+				pthread_cond_wait(&writer_cond, &writer_mutex);
+			writer_wakeup = 0;
+			pthread_mutex_unlock(&writer_mutex);
+		}
+		__atomic_store_n(&writer_idle, 0, __ATOMIC_RELAXED);
+	}
+	log_drain();
+	return NULL;
+}
+
+/**
+ * Move log output to a background thread. Call after daemonizing; until
+ * then and after log_stop_writer() messages are written directly.
+ */
+int log_start_writer(void)
+{
+	static int have_key = 0;
+
+	if (writer_running)
+		return 0;
+	if (!have_key) {
+		if (pthread_key_create(&ring_key, ring_release) != 0)
+			return -1;
+		have_key = 1;
+	}
+	writer_stop = 0;
+	writer_idle = 0;
+	writer_wakeup = 0;
+	if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0)
+		return -1;
+	__atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Write out what is still queued and go back to direct output. The rings
+ * stay around, threads that are still running may be about to use them.
+ */
+void log_stop_writer(void)
+{
+	if (!writer_running)
+		return;
+	__atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&writer_stop, 1, __ATOMIC_RELEASE);
+	log_wake_writer();
+	pthread_join(writer_thread, NULL);
+}
+
+void usbmuxd_log_write(enum loglevel level, const char *fmt, ...)
+{
+	va_list ap;
+	char buf[LOG_SLOT_TEXT];
+	char *text = buf;
+	int len;
+
+	if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+		struct log_ring *ring = get_thread_ring();
+		if (ring) {
+			uint32_t tail = ring->tail;
+			if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+				__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			struct log_slot *slot = &ring->slots[tail % LOG_RING_SLOTS];
+			va_start(ap, fmt);
+			len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+			va_end(ap);
+			if (len < (int)sizeof(slot->text)) {
+				slot->time = log_time();
+				slot->level = level;
+				__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				if (__atomic_load_n(&writer_idle, __ATOMIC_RELAXED))
+					log_wake_writer();
+				return;
+			}
+			// too long for a slot, goes out directly below
+		}
+	}
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf)) {
+		text = malloc(len + 1);
+		if (!text)
+			return;
+		va_start(ap, fmt);
+		vsnprintf(text, len + 1, fmt, ap);
+		va_end(ap);
+	}
+	log_output(level, log_time(), text);
+	if (text != buf)
+		free(text);
 }
@@ -32,11 +32,25 @@ enum loglevel {
 	LL_FLOOD,
 };
 
+// messages above this level are compiled out (--with-max-log-level)
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LL_FLOOD
+#endif
+
 extern unsigned int log_level;
 
 void log_enable_syslog();
 void log_disable_syslog();
+int log_start_writer(void);
+void log_stop_writer(void);
+
+void usbmuxd_log_write(enum loglevel level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 
-void usbmuxd_log(enum loglevel level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+// the arguments are only evaluated when the message is going to be logged
+#define usbmuxd_log(level, ...) \
+	do { \
+		if(((level) <= LOG_MAX_LEVEL) && ((int)(level) <= (int)log_level)) \
+			usbmuxd_log_write(level, __VA_ARGS__); \
+	} while(0)
 
 #endif
@@ -48,6 +48,7 @@
 #include "device.h"
 #include "client.h"
 #include "conf.h"
+#include "event.h"
 
 static const char *socket_path = "/var/run/usbmuxd";
 static const char *lockfile = "/var/run/usbmuxd.pid";
@@ -93,6 +94,10 @@ static int create_socket(void) {
 
 	bzero(&bind_addr, sizeof(bind_addr));
 	bind_addr.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(bind_addr.sun_path)) {
+		usbmuxd_log(LL_FATAL, "Socket path %s is too long", socket_path);
+		return -1;
+	}
 	strcpy(bind_addr.sun_path, socket_path);
 	if (bind(listenfd, (struct sockaddr*)&bind_addr, sizeof(bind_addr)) != 0) {
 		usbmuxd_log(LL_FATAL, "bind() failed: %s", strerror(errno));
@@ -141,7 +146,7 @@ static void set_signal_handlers(void)
 	struct sigaction sa;
 	sigset_t set;
 
-	// Mask all signals we handle. They will be unmasked by ppoll().
+	// Mask all signals we handle. They will be unmasked by event_wait().
 	sigemptyset(&set);
 	sigaddset(&set, SIGINT);
 	sigaddset(&set, SIGQUIT);
@@ -159,50 +164,38 @@ static void set_signal_handlers(void)
 	sigaction(SIGUSR2, &sa, NULL);
 }
 
-#ifndef HAVE_PPOLL
-static int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout, const sigset_t *sigmask)
-{
-	int ready;
-	sigset_t origmask;
-	int to = timeout->tv_sec*1000 + timeout->tv_nsec/1000000;
+static int accept_failed;
 
-	sigprocmask(SIG_SETMASK, sigmask, &origmask);
-	ready = poll(fds, nfds, to);
-	sigprocmask(SIG_SETMASK, &origmask, NULL);
-
-	return ready;
+static void listen_event_cb(struct event_watch *watch, short revents)
+{
+	if(client_accept(watch->fd) < 0) {
+		usbmuxd_log(LL_FATAL, "client_accept() failed");
+		accept_failed = 1;
+	}
 }
-#endif
 
 static int main_loop(int listenfd)
 {
-	int to, cnt, i, dto;
-	struct fdlist pollfds;
-	struct timespec tspec;
+	int to, cnt;
+	struct event_watch listen_watch;
 
 	sigset_t empty_sigset;
 	sigemptyset(&empty_sigset); // unmask all signals
 
-	fdlist_create(&pollfds);
+	// descriptors stay registered across iterations; clients and
+	// libusb add and remove their own as they come and go
+	if(event_add(&listen_watch, listenfd, POLLIN, listen_event_cb, NULL) < 0)
+		return -1;
+
+	accept_failed = 0;
 	while(!should_exit) {
 		usbmuxd_log(LL_FLOOD, "main_loop iteration");
+		// everything queued for the devices since the last wait goes out now
+		device_flush_tx();
 		to = usb_get_timeout();
 		usbmuxd_log(LL_FLOOD, "USB timeout is %d ms", to);
-		dto = device_get_timeout();
-		usbmuxd_log(LL_FLOOD, "Device timeout is %d ms", dto);
-		if(dto < to)
-			to = dto;
-
-		fdlist_reset(&pollfds);
-		fdlist_add(&pollfds, FD_LISTEN, listenfd, POLLIN);
-		usb_get_fds(&pollfds);
-		client_get_fds(&pollfds);
-		usbmuxd_log(LL_FLOOD, "fd count is %d", pollfds.count);
-
-		tspec.tv_sec = to / 1000;
-		tspec.tv_nsec = (to % 1000) * 1000000;
-		cnt = ppoll(pollfds.fds, pollfds.count, &tspec, &empty_sigset);
-		usbmuxd_log(LL_FLOOD, "poll() returned %d", cnt);
+
+		cnt = event_wait(to, &empty_sigset);
 		if(cnt == -1) {
 			if(errno == EINTR) {
 				if(should_exit) {
@@ -215,40 +208,21 @@ static int main_loop(int listenfd)
 					usb_discover();
 				}
 			}
-		} else if(cnt == 0) {
+			continue;
+		}
+		if(accept_failed) {
+			event_remove(&listen_watch);
+			return -1;
+		}
+		if(cnt == 0 || usb_events_pending()) {
 			if(usb_process() < 0) {
 				usbmuxd_log(LL_FATAL, "usb_process() failed");
-				fdlist_free(&pollfds);
+				event_remove(&listen_watch);
 				return -1;
 			}
-			device_check_timeouts();
-		} else {
-			int done_usb = 0;
-			for(i=0; i<pollfds.count; i++) {
-				if(pollfds.fds[i].revents) {
-					if(!done_usb && pollfds.owners[i] == FD_USB) {
-						if(usb_process() < 0) {
-							usbmuxd_log(LL_FATAL, "usb_process() failed");
-							fdlist_free(&pollfds);
-							return -1;
-						}
-						done_usb = 1;
-					}
-					if(pollfds.owners[i] == FD_LISTEN) {
-						if(client_accept(listenfd) < 0) {
-							usbmuxd_log(LL_FATAL, "client_accept() failed");
-							fdlist_free(&pollfds);
-							return -1;
-						}
-					}
-					if(pollfds.owners[i] == FD_CLIENT) {
-						client_process(pollfds.fds[i].fd, pollfds.fds[i].revents);
-					}
-				}
-			}
 		}
 	}
-	fdlist_free(&pollfds);
+	event_remove(&listen_watch);
 	return 0;
 }
 
@@ -366,6 +340,14 @@ static void usage()
 	printf("                       \tStarting another instance will trigger discovery instead.\n");
 	printf("  -z, --enable-exit\tEnable \"--exit\" request from other instances and exit\n");
 	printf("                   \tautomatically if no device is attached.\n");
+	printf("  -q, --rx-queue N\tKeep N USB read transfers queued per device (default 4).\n");
+	printf("  -a, --ack-policy P\tWhen to ACK device data: \"immediate\" or \"delayed\"\n");
+	printf("                    \t(default), optionally followed by \":BYTES\", the window\n");
+	printf("                    \tbelow which delayed ACKs are sent at once.\n");
+	printf("  -S, --socket PATH\tListen on PATH instead of %s.\n", socket_path);
+	printf("  -P, --pidfile PATH\tUse PATH as lock file instead of %s.\n", lockfile);
+	printf("  -t, --threads N\tSpread devices over N worker threads (default 0, all\n");
+	printf("                 \tdevices are handled by the main thread).\n");
 #ifdef HAVE_UDEV
 	printf("  -u, --udev\t\tRun in udev operation mode (implies -n and -z).\n");
 #endif
@@ -380,6 +362,25 @@ static void usage()
 	printf("\n");
 }
 
+static int parse_ack_policy(const char *arg)
+{
+	enum ack_policy policy;
+	const char *window = strchr(arg, ':');
+	size_t len = window ? (size_t)(window - arg) : strlen(arg);
+
+	if(len == strlen("immediate") && !strncmp(arg, "immediate", len))
+		policy = ACK_IMMEDIATE;
+	else if(len == strlen("delayed") && !strncmp(arg, "delayed", len))
+		policy = ACK_DELAYED;
+	else
+		return -1;
+
+	if(window && atoi(window + 1) <= 0)
+		return -1;
+	device_set_ack_policy(policy, window ? (uint32_t)atoi(window + 1) : 0);
+	return 0;
+}
+
 static void parse_opts(int argc, char **argv)
 {
 	static struct option longopts[] = {
@@ -389,6 +390,11 @@ static void parse_opts(int argc, char **argv)
 		{"user", 1, NULL, 'U'},
 		{"disable-hotplug", 0, NULL, 'n'},
 		{"enable-exit", 0, NULL, 'z'},
+		{"rx-queue", 1, NULL, 'q'},
+		{"ack-policy", 1, NULL, 'a'},
+		{"threads", 1, NULL, 't'},
+		{"socket", 1, NULL, 'S'},
+		{"pidfile", 1, NULL, 'P'},
 #ifdef HAVE_UDEV
 		{"udev", 0, NULL, 'u'},
 #endif
@@ -403,11 +409,11 @@ static void parse_opts(int argc, char **argv)
 	int c;
 
 #ifdef HAVE_SYSTEMD
-	const char* opts_spec = "hfvVuU:xXsnz";
+	const char* opts_spec = "hfvVuU:xXsnzq:a:t:S:P:";
 #elif HAVE_UDEV
-	const char* opts_spec = "hfvVuU:xXnz";
+	const char* opts_spec = "hfvVuU:xXnzq:a:t:S:P:";
 #else
-	const char* opts_spec = "hfvVU:xXnz";
+	const char* opts_spec = "hfvVU:xXnzq:a:t:S:P:";
 #endif
 
 	while (1) {
@@ -451,6 +457,31 @@ static void parse_opts(int argc, char **argv)
 		case 'z':
 			opt_enable_exit = 1;
 			break;
+		case 'a':
+			if(parse_ack_policy(optarg) < 0) {
+				fprintf(stderr, "usbmuxd: ERROR: invalid ACK policy '%s'\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'P':
+			lockfile = optarg;
+			break;
+		case 't':
+			if(atoi(optarg) < 0 || atoi(optarg) > 64) {
+				fprintf(stderr, "usbmuxd: ERROR: invalid number of threads '%s'\n", optarg);
+				exit(2);
+			}
+			device_set_threads(atoi(optarg));
+			break;
+		case 'q':
+			if(usb_set_rx_loops(atoi(optarg)) < 0) {
+				fprintf(stderr, "usbmuxd: ERROR: invalid RX queue depth '%s'\n", optarg);
+				exit(2);
+			}
+			break;
 		case 'x':
 			opt_exit = 1;
 			exit_signal = SIGUSR1;
@@ -559,6 +590,10 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// from here on threads are fine, log from a background writer
+	if (log_start_writer() < 0)
+		usbmuxd_log(LL_WARNING, "Could not start log writer thread, logging directly");
+
 	// now open the lockfile and place the lock
 	res = lfd = open(lockfile, O_WRONLY|O_CREAT|O_TRUNC|O_EXCL, 0644);
 	if(res < 0) {
@@ -671,8 +706,13 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if((res = event_init()) < 0)
+		goto terminate;
+
+	config_init();
 	client_init();
-	device_init();
+	if((res = device_init()) < 0)
+		goto terminate;
 	usbmuxd_log(LL_INFO, "Initializing USB");
 	if((res = usb_init()) < 0)
 		goto terminate;
@@ -702,9 +742,12 @@ int main(int argc, char *argv[])
 	usb_shutdown();
 	device_shutdown();
 	client_shutdown();
+	config_shutdown();
+	event_shutdown();
 	usbmuxd_log(LL_NOTICE, "Shutdown complete");
 
 terminate:
+	log_stop_writer();
 	log_disable_syslog();
 
 	if (res < 0)
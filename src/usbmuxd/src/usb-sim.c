@@ -0,0 +1,741 @@
+/*
+ * usb-sim.c
+ *
+ * Simulated device backend, built instead of usb.c with --with-simulator.
+ * It needs no USB hardware: every fake device answers the mux protocol
+ * in-process and runs simple services, so the daemon can be benchmarked
+ * on any Linux box.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "usb.h"
+#include "log.h"
+#include "device.h"
+#include "utils.h"
+#include "event.h"
+
+// The devices are configured through the environment, e.g.
+//   USBMUXD_SIM="devices=4,echo=7,sink=9,source=19,latency=125"
+// Connections to the echo port get their data back, the sink port
+// swallows everything and the source port sends data as fast as the
+// host window allows. Any other port refuses connections.
+#define SIM_ENV "USBMUXD_SIM"
+#define DEFAULT_SIM_DEVICES 1
+#define MAX_SIM_DEVICES 64
+#define DEFAULT_ECHO_PORT 7
+#define DEFAULT_SINK_PORT 9
+#define DEFAULT_SOURCE_PORT 19
+
+// Like usb.c, each device has a number of IN transfers queued (set with
+// --rx-queue). A packet from a device needs one of them and takes the
+// latency, in microseconds, to complete; the transfer is only queued
+// again once the main thread has processed the packet. With one
+// transfer, the device idles while the host works and vice versa.
+#define DEFAULT_RX_QUEUE 4
+#define MAX_RX_QUEUE 64
+#define DEFAULT_SIM_LATENCY 125	// one high-speed microframe
+
+// receive window the fake devices advertise, and the most they put in
+// one packet (a single USB_MRU transfer, so nothing has to be split)
+#define SIM_WINDOW 131072
+#define SIM_HEADER_SIZE 16
+#define SIM_MAX_PAYLOAD (USB_MRU - SIM_HEADER_SIZE - sizeof(struct tcphdr))
+
+enum sim_service {
+	SIM_ECHO,
+	SIM_SINK,
+	SIM_SOURCE
+};
+
+struct sim_conn {
+	uint16_t sport, dport;	// host side port, service port
+	enum sim_service service;
+	uint32_t seq;	// next sequence number we send
+	uint32_t ack;	// next sequence number expected from the host
+	uint32_t host_ack, host_win;
+	struct ringbuf pending;	// echo data waiting for host window
+};
+
+// a packet from a fake device, delivered on the main thread
+struct sim_packet {
+	struct sim_packet *next;
+	struct usb_device *dev;
+	uint64_t due;	// when its transfer completes, in microseconds
+	uint32_t length;
+	unsigned char data[];
+};
+
+struct sim_packet_list {
+	struct sim_packet *head, *tail;
+};
+
+struct usb_device {
+	uint32_t location;
+	char serial[256];
+	struct mux_device *mux_dev;
+	// usb_send() runs on device worker threads
+	pthread_mutex_t mutex;
+	int version_done;
+	uint16_t tx_seq, rx_seq;
+	struct collection conns;
+	// under rx_mutex: IN transfers not in flight, and the packets
+	// waiting for one
+	int rx_idle;
+	struct sim_packet_list backlog;
+};
+
+static struct collection device_list;
+static int num_sim_devices = DEFAULT_SIM_DEVICES;
+static uint16_t echo_port = DEFAULT_ECHO_PORT;
+static uint16_t sink_port = DEFAULT_SINK_PORT;
+static uint16_t source_port = DEFAULT_SOURCE_PORT;
+
+static int rx_queue = DEFAULT_RX_QUEUE;
+static int sim_latency = DEFAULT_SIM_LATENCY;
+
+// transfers in flight complete in order, as they all take sim_latency;
+// the bus thread moves them to rx_done when they are due
+static pthread_mutex_t rx_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rx_cond;
+static struct sim_packet_list rx_inflight, rx_done;
+static pthread_t bus_thread;
+static int bus_running;
+static int rx_fds[2] = {-1, -1};
+static struct event_watch rx_watch;
+static int sim_events_ready;
+
+static unsigned char source_data[SIM_MAX_PAYLOAD];
+
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sim_list_append(struct sim_packet_list *list, struct sim_packet *pkt)
+{
+	pkt->next = NULL;
+	if(list->tail)
+		list->tail->next = pkt;
+	else
+		list->head = pkt;
+	list->tail = pkt;
+}
+
+static struct sim_packet *sim_list_pop(struct sim_packet_list *list)
+{
+	struct sim_packet *pkt = list->head;
+	if(pkt) {
+		list->head = pkt->next;
+		if(!list->head)
+			list->tail = NULL;
+	}
+	return pkt;
+}
+
+static void sim_list_free(struct sim_packet_list *list)
+{
+	struct sim_packet *pkt, *next;
+	for(pkt = list->head; pkt; pkt = next) {
+		next = pkt->next;
+		free(pkt);
+	}
+	list->head = list->tail = NULL;
+}
+
+static void sim_wake_main(void)
+{
+	char c = 0;
+	if(write(rx_fds[1], &c, 1) < 0 && errno != EAGAIN)
+		usbmuxd_log(LL_ERROR, "Could not wake up the main loop: %s", strerror(errno));
+}
+
+/**
+ * Put a packet on an IN transfer of its device. Called with rx_mutex
+ * held.
+ */
+static void sim_start_transfer(struct sim_packet *pkt)
+{
+	if(!sim_latency) {
+		if(!rx_done.head)
+			sim_wake_main();
+		sim_list_append(&rx_done, pkt);
+		return;
+	}
+	pkt->due = sim_now() + sim_latency;
+	if(!rx_inflight.head)
+		pthread_cond_signal(&rx_cond);
+	sim_list_append(&rx_inflight, pkt);
+}
+
+static void sim_queue_packet(struct usb_device *dev, unsigned char *buf, uint32_t length)
+{
+	struct sim_packet *pkt = malloc(sizeof(struct sim_packet) + length);
+
+	pkt->next = NULL;
+	pkt->dev = dev;
+	pkt->length = length;
+	memcpy(pkt->data, buf, length);
+
+	pthread_mutex_lock(&rx_mutex);
+	if(dev->rx_idle > 0) {
+		dev->rx_idle--;
+		sim_start_transfer(pkt);
+	} else {
+		sim_list_append(&dev->backlog, pkt);
+	}
+	pthread_mutex_unlock(&rx_mutex);
+}
+
+/**
+ * The main thread is done with a packet, so its transfer is queued
+ * again and takes the next packet the device has, if any.
+ */
+static void sim_requeue_transfer(struct usb_device *dev)
+{
+	struct sim_packet *pkt;
+
+	pthread_mutex_lock(&rx_mutex);
+	pkt = sim_list_pop(&dev->backlog);
+	if(pkt) {
+		sim_start_transfer(pkt);
+	} else {
+		dev->rx_idle++;
+	}
+	pthread_mutex_unlock(&rx_mutex);
+}
+
+static void *sim_bus_thread(void *arg)
+{
+	pthread_mutex_lock(&rx_mutex);
+	while(bus_running) {
+		struct sim_packet *pkt = rx_inflight.head;
+		uint64_t now;
+		if(!pkt) {
+			pthread_cond_wait(&rx_cond, &rx_mutex);
+			continue;
+		}
+		now = sim_now();
+		if(pkt->due > now) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += (pkt->due - now) * 1000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&rx_cond, &rx_mutex, &ts);
+			continue;
+		}
+		sim_list_pop(&rx_inflight);
+		if(!rx_done.head)
+			sim_wake_main();
+		sim_list_append(&rx_done, pkt);
+	}
+	pthread_mutex_unlock(&rx_mutex);
+	return NULL;
+}
+
+static void sim_send(struct usb_device *dev, uint32_t proto, const void *header, int hdrlen, const unsigned char *payload, uint32_t length)
+{
+	uint32_t words[USB_MRU / 4];
+	unsigned char *buf = (unsigned char *)words;
+	uint32_t *mhdr = words;
+	uint16_t *seqs = (uint16_t *)(words + 3);
+	// the host expects the short v1 header until it has our version
+	int mux_header_size = (proto == 0) ? 8 : SIM_HEADER_SIZE;
+	uint32_t total = mux_header_size + hdrlen + length;
+
+	mhdr[0] = htonl(proto);
+	mhdr[1] = htonl(total);
+	if(mux_header_size == SIM_HEADER_SIZE) {
+		mhdr[2] = htonl(0xfeedface);
+		seqs[0] = htons(dev->tx_seq++);
+		seqs[1] = htons(dev->rx_seq);
+	}
+	memcpy(buf + mux_header_size, header, hdrlen);
+	if(length)
+		memcpy(buf + mux_header_size + hdrlen, payload, length);
+	sim_queue_packet(dev, buf, total);
+}
+
+static void sim_send_tcp(struct usb_device *dev, struct sim_conn *conn, uint16_t sport, uint16_t dport, uint8_t flags, const unsigned char *payload, uint32_t length)
+{
+	struct tcphdr th;
+	uint32_t window = SIM_WINDOW;
+
+	memset(&th, 0, sizeof(th));
+	th.th_sport = htons(dport);
+	th.th_dport = htons(sport);
+	th.th_flags = flags;
+	th.th_off = sizeof(th) / 4;
+	if(conn) {
+		th.th_seq = htonl(conn->seq);
+		th.th_ack = htonl(conn->ack);
+		if(conn->pending.size < window)
+			window -= conn->pending.size;
+		else
+			window = 0;
+	}
+	th.th_win = htons(window >> 8);
+	sim_send(dev, IPPROTO_TCP, &th, sizeof(th), payload, length);
+}
+
+/**
+ * Send what the connection's service has for the host, as far as the
+ * host's window allows.
+ *
+ * @return whether anything was sent.
+ */
+static int sim_pump(struct usb_device *dev, struct sim_conn *conn)
+{
+	int sent = 0;
+
+	while(1) {
+		uint32_t inflight = conn->seq - conn->host_ack;
+		uint32_t room = (conn->host_win > inflight) ? conn->host_win - inflight : 0;
+		uint32_t n = (room > SIM_MAX_PAYLOAD) ? SIM_MAX_PAYLOAD : room;
+		unsigned char buf[SIM_MAX_PAYLOAD];
+
+		if(conn->service == SIM_ECHO) {
+			struct iovec iov[2];
+			int cnt = ringbuf_peek(&conn->pending, iov);
+			uint32_t copied = 0;
+			int i;
+			if(n > conn->pending.size)
+				n = conn->pending.size;
+			for(i = 0; i < cnt && copied < n; i++) {
+				uint32_t part = (iov[i].iov_len < n - copied) ? iov[i].iov_len : n - copied;
+				memcpy(buf + copied, iov[i].iov_base, part);
+				copied += part;
+			}
+			ringbuf_consume(&conn->pending, n);
+		} else if(conn->service != SIM_SOURCE) {
+			n = 0;
+		}
+		if(!n)
+			break;
+		sim_send_tcp(dev, conn, conn->sport, conn->dport, TH_ACK, (conn->service == SIM_ECHO) ? buf : source_data, n);
+		conn->seq += n;
+		sent = 1;
+	}
+	return sent;
+}
+
+static struct sim_conn *sim_find_conn(struct usb_device *dev, uint16_t sport, uint16_t dport)
+{
+	FOREACH(struct sim_conn *conn, &dev->conns) {
+		if(conn->sport == sport && conn->dport == dport)
+			return conn;
+	} ENDFOREACH
+	return NULL;
+}
+
+static void sim_free_conn(struct usb_device *dev, struct sim_conn *conn)
+{
+	collection_remove(&dev->conns, conn);
+	ringbuf_free(&conn->pending);
+	free(conn);
+}
+
+static void sim_tcp_input(struct usb_device *dev, struct tcphdr *th, unsigned char *payload, uint32_t length)
+{
+	uint16_t sport = ntohs(th->th_sport);
+	uint16_t dport = ntohs(th->th_dport);
+	struct sim_conn *conn = sim_find_conn(dev, sport, dport);
+
+	if(th->th_flags & TH_RST) {
+		if(conn)
+			sim_free_conn(dev, conn);
+		return;
+	}
+
+	if(th->th_flags & TH_SYN) {
+		enum sim_service service;
+		if(conn)
+			return;
+		if(dport == echo_port)
+			service = SIM_ECHO;
+		else if(dport == sink_port)
+			service = SIM_SINK;
+		else if(dport == source_port)
+			service = SIM_SOURCE;
+		else {
+			sim_send_tcp(dev, NULL, sport, dport, TH_RST, NULL, 0);
+			return;
+		}
+		conn = malloc(sizeof(struct sim_conn));
+		memset(conn, 0, sizeof(struct sim_conn));
+		conn->sport = sport;
+		conn->dport = dport;
+		conn->service = service;
+		conn->ack = ntohl(th->th_seq) + 1;
+		conn->host_ack = 1;
+		conn->host_win = ntohs(th->th_win) << 8;
+		ringbuf_init(&conn->pending, SIM_WINDOW);
+		collection_add(&dev->conns, conn);
+		sim_send_tcp(dev, conn, sport, dport, TH_SYN | TH_ACK, NULL, 0);
+		conn->seq = 1;
+		return;
+	}
+
+	if(!conn) {
+		sim_send_tcp(dev, NULL, sport, dport, TH_RST, NULL, 0);
+		return;
+	}
+
+	conn->host_ack = ntohl(th->th_ack);
+	conn->host_win = ntohs(th->th_win) << 8;
+	if(length) {
+		conn->ack += length;
+		if(conn->service == SIM_ECHO && ringbuf_write(&conn->pending, payload, length) < length) {
+			usbmuxd_log(LL_ERROR, "Simulated device %s: echo overflow on port %d", dev->serial, dport);
+			sim_send_tcp(dev, conn, sport, dport, TH_RST, NULL, 0);
+			sim_free_conn(dev, conn);
+			return;
+		}
+	}
+	// data always gets an ACK, with the reply if there is one
+	if(!sim_pump(dev, conn) && length)
+		sim_send_tcp(dev, conn, sport, dport, TH_ACK, NULL, 0);
+}
+
+/**
+ * Play the device side for the mux packets the host sent in one transfer.
+ */
+static void sim_input(struct usb_device *dev, unsigned char *buf, int length)
+{
+	while(length > 0) {
+		uint32_t mhdr[4];
+		int mux_header_size = dev->version_done ? SIM_HEADER_SIZE : 8;
+		uint32_t proto, total;
+
+		if(length < mux_header_size)
+			break;
+		memcpy(mhdr, buf, mux_header_size);
+		proto = ntohl(mhdr[0]);
+		total = ntohl(mhdr[1]);
+		if(total < (uint32_t)mux_header_size || total > (uint32_t)length) {
+			usbmuxd_log(LL_ERROR, "Simulated device %s: bad packet length %d", dev->serial, total);
+			break;
+		}
+		if(mux_header_size == SIM_HEADER_SIZE)
+			dev->rx_seq = ntohs(((uint16_t *)(mhdr + 3))[0]);
+
+		switch(proto) {
+			case 0: {
+				uint32_t vh[3];
+				vh[0] = htonl(2);
+				vh[1] = htonl(0);
+				vh[2] = 0;
+				sim_send(dev, 0, vh, sizeof(vh), NULL, 0);
+				dev->version_done = 1;
+				break;
+			}
+			case 2:
+				dev->tx_seq = 0;
+				break;
+			case IPPROTO_TCP:
+				if(total >= mux_header_size + sizeof(struct tcphdr)) {
+					struct tcphdr *th = (struct tcphdr *)(buf + mux_header_size);
+					sim_tcp_input(dev, th, (unsigned char *)(th + 1), total - mux_header_size - sizeof(struct tcphdr));
+				}
+				break;
+			default:
+				break;
+		}
+		buf += total;
+		length -= total;
+	}
+}
+
+unsigned char *usb_get_tx_buffer(struct usb_device *dev)
+{
+	return malloc(USB_MTU);
+}
+
+void usb_put_tx_buffer(struct usb_device *dev, unsigned char *buf)
+{
+	free(buf);
+}
+
+int usb_send(struct usb_device *dev, unsigned char *buf, int length)
+{
+	pthread_mutex_lock(&dev->mutex);
+	sim_input(dev, buf, length);
+	pthread_mutex_unlock(&dev->mutex);
+	free(buf);
+	return 0;
+}
+
+const char *usb_get_serial(struct usb_device *dev)
+{
+	return dev->serial;
+}
+
+uint32_t usb_get_location(struct usb_device *dev)
+{
+	return dev->location;
+}
+
+uint16_t usb_get_pid(struct usb_device *dev)
+{
+	return PID_RANGE_LOW;
+}
+
+uint64_t usb_get_speed(struct usb_device *dev)
+{
+	return 480000000;
+}
+
+struct mux_device *usb_get_mux_device(struct usb_device *dev)
+{
+	return dev->mux_dev;
+}
+
+void usb_set_mux_device(struct usb_device *dev, struct mux_device *mux_dev)
+{
+	dev->mux_dev = mux_dev;
+}
+
+void usb_get_transfer_counts(struct usb_device *dev, int *rx, int *tx)
+{
+	// host to device packets are handed over synchronously
+	pthread_mutex_lock(&rx_mutex);
+	*rx = rx_queue - dev->rx_idle;
+	pthread_mutex_unlock(&rx_mutex);
+	*tx = 0;
+}
+
+static void sim_event_cb(struct event_watch *watch, short revents)
+{
+	sim_events_ready = 1;
+}
+
+int usb_events_pending(void)
+{
+	return sim_events_ready;
+}
+
+int usb_set_rx_loops(int count)
+{
+	if(count < 1 || count > MAX_RX_QUEUE)
+		return -1;
+	rx_queue = count;
+	return 0;
+}
+
+void usb_autodiscover(int enable)
+{
+}
+
+int usb_discover(void)
+{
+	return collection_count(&device_list);
+}
+
+int usb_get_timeout(void)
+{
+	return 100000;
+}
+
+int usb_process(void)
+{
+	struct sim_packet *pkt, *next;
+	char buf[64];
+
+	sim_events_ready = 0;
+	while(read(rx_fds[0], buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&rx_mutex);
+	pkt = rx_done.head;
+	rx_done.head = rx_done.tail = NULL;
+	pthread_mutex_unlock(&rx_mutex);
+
+	for(; pkt; pkt = next) {
+		struct usb_device *dev = pkt->dev;
+		next = pkt->next;
+		if(dev->mux_dev)
+			device_data_input(dev, pkt->data, pkt->length);
+		free(pkt);
+		sim_requeue_transfer(dev);
+	}
+	return 0;
+}
+
+int usb_process_timeout(int msec)
+{
+	uint64_t end = mstime64() + msec;
+	while(mstime64() < end) {
+		usb_process();
+		usleep(1000);
+	}
+	return 0;
+}
+
+static int sim_parse_config(const char *config)
+{
+	char *copy = strdup(config);
+	char *item, *saveptr = NULL;
+	int res = 0;
+
+	for(item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+		int num;
+		if(!value) {
+			res = -1;
+			break;
+		}
+		*value++ = '\0';
+		num = atoi(value);
+		if(!strcmp(item, "devices") && num >= 0 && num <= MAX_SIM_DEVICES)
+			num_sim_devices = num;
+		else if(!strcmp(item, "echo") && num > 0 && num < 65536)
+			echo_port = num;
+		else if(!strcmp(item, "sink") && num > 0 && num < 65536)
+			sink_port = num;
+		else if(!strcmp(item, "source") && num > 0 && num < 65536)
+			source_port = num;
+		else if(!strcmp(item, "latency") && num >= 0 && num <= 1000000)
+			sim_latency = num;
+		else {
+			res = -1;
+			break;
+		}
+	}
+	free(copy);
+	return res;
+}
+
+int usb_init(void)
+{
+	const char *config = getenv(SIM_ENV);
+	int i;
+
+	usbmuxd_log(LL_DEBUG, "usb_init for simulated devices");
+
+	if(config && sim_parse_config(config) < 0) {
+		usbmuxd_log(LL_FATAL, "Invalid %s setting '%s'", SIM_ENV, config);
+		return -1;
+	}
+
+	if(pipe(rx_fds) < 0) {
+		usbmuxd_log(LL_FATAL, "Could not create pipe: %s", strerror(errno));
+		return -1;
+	}
+	fcntl(rx_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(rx_fds[1], F_SETFL, O_NONBLOCK);
+	if(event_add(&rx_watch, rx_fds[0], POLLIN, sim_event_cb, NULL) < 0)
+		return -1;
+
+	if(sim_latency) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&rx_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		bus_running = 1;
+		if(pthread_create(&bus_thread, NULL, sim_bus_thread, NULL) != 0) {
+			usbmuxd_log(LL_FATAL, "Could not start the simulated bus thread");
+			bus_running = 0;
+			pthread_cond_destroy(&rx_cond);
+			return -1;
+		}
+	}
+
+	for(i = 0; i < (int)sizeof(source_data); i++)
+		source_data[i] = i & 0xff;
+
+	usbmuxd_log(LL_NOTICE, "Simulating %d device%s: echo on port %d, sink on port %d, source on port %d", num_sim_devices, (num_sim_devices == 1) ? "" : "s", echo_port, sink_port, source_port);
+	usbmuxd_log(LL_INFO, "Simulated devices have %d RX transfer%s of %d us latency", rx_queue, (rx_queue == 1) ? "" : "s", sim_latency);
+
+	collection_init(&device_list);
+	for(i = 0; i < num_sim_devices; i++) {
+		struct usb_device *usbdev = malloc(sizeof(struct usb_device));
+		memset(usbdev, 0, sizeof(struct usb_device));
+		usbdev->location = 0x100 + i;
+		snprintf(usbdev->serial, sizeof(usbdev->serial), "SIMULATED%031d", i + 1);
+		pthread_mutex_init(&usbdev->mutex, NULL);
+		collection_init(&usbdev->conns);
+		usbdev->rx_idle = rx_queue;
+		collection_add(&device_list, usbdev);
+		if(device_add(usbdev) < 0) {
+			usbmuxd_log(LL_ERROR, "Could not add simulated device %d", i + 1);
+			continue;
+		}
+	}
+	return collection_count(&device_list);
+}
+
+void usb_shutdown(void)
+{
+	usbmuxd_log(LL_DEBUG, "usb_shutdown");
+
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		if(usbdev->mux_dev)
+			device_remove(usbdev);
+	} ENDFOREACH
+	// whatever the devices still had to say goes nowhere now
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		usbdev->mux_dev = NULL;
+	} ENDFOREACH
+	usb_process();
+
+	if(bus_running) {
+		pthread_mutex_lock(&rx_mutex);
+		bus_running = 0;
+		pthread_cond_signal(&rx_cond);
+		pthread_mutex_unlock(&rx_mutex);
+		pthread_join(bus_thread, NULL);
+		pthread_cond_destroy(&rx_cond);
+	}
+	sim_list_free(&rx_inflight);
+	sim_list_free(&rx_done);
+
+	FOREACH(struct usb_device *usbdev, &device_list) {
+		sim_list_free(&usbdev->backlog);
+		FOREACH(struct sim_conn *conn, &usbdev->conns) {
+			sim_free_conn(usbdev, conn);
+		} ENDFOREACH
+		collection_free(&usbdev->conns);
+		pthread_mutex_destroy(&usbdev->mutex);
+		collection_remove(&device_list, usbdev);
+		free(usbdev);
+	} ENDFOREACH
+	collection_free(&device_list);
+
+	event_remove(&rx_watch);
+	close(rx_fds[0]);
+	close(rx_fds[1]);
+	rx_fds[0] = rx_fds[1] = -1;
+}
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <libusb.h>
 
@@ -35,6 +36,7 @@
 #include "log.h"
 #include "device.h"
 #include "utils.h"
+#include "event.h"
 
 #if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
 #define HAVE_LIBUSB_HOTPLUG_API 1
@@ -46,9 +48,16 @@
 
 // Number of parallel bulk transfers we have running for reading data from the device.
 // Older versions of usbmuxd kept only 1, which leads to a mostly dormant USB port.
-// 3 seems to be an all round sensible number - giving better read perf than
-// Apples usbmuxd, at least.
-#define NUM_RX_LOOPS 3
+// Transfers on one endpoint complete in submission order, so while one is being
+// processed the others keep the bus busy and packets split across them are
+// still reassembled in order by device_data_input(). Set with --rx-queue.
+#define DEFAULT_RX_LOOPS 4
+#define MAX_RX_LOOPS 64
+
+// Number of TX transfers and USB_MTU sized buffers kept per device, so the
+// send path does not allocate in the common case. More are allocated (and
+// freed again on completion) when all of them are in flight.
+#define NUM_TX_POOL 8
 
 struct usb_device {
 	libusb_device_handle *dev;
@@ -61,6 +70,13 @@ struct usb_device {
 	struct collection tx_xfers;
 	int wMaxPacketSize;
 	uint64_t speed;
+	struct mux_device *mux_dev;
+	// the TX pool and tx_xfers are shared with device worker threads
+	pthread_mutex_t tx_mutex;
+	unsigned char *tx_bufs[NUM_TX_POOL];
+	int num_tx_bufs;
+	struct libusb_transfer *tx_pool[NUM_TX_POOL];
+	int num_tx_pool;
 };
 
 static struct collection device_list;
@@ -70,6 +86,85 @@ static struct timeval next_dev_poll_time;
 static int devlist_failures;
 static int device_polling;
 static int device_hotplug = 1;
+static int num_rx_loops = DEFAULT_RX_LOOPS;
+
+// libusb's own descriptors, registered with the event loop as libusb
+// reports them rather than collected again on every iteration
+static struct collection usb_watches;
+static int usb_fds_ready;
+
+// zero length packets need a buffer, but never touch it
+static unsigned char zlp_buf[1];
+
+static void usb_fill_tx_pool(struct usb_device *dev)
+{
+	while(dev->num_tx_bufs < NUM_TX_POOL)
+		dev->tx_bufs[dev->num_tx_bufs++] = malloc(USB_MTU);
+	while(dev->num_tx_pool < NUM_TX_POOL)
+		dev->tx_pool[dev->num_tx_pool++] = libusb_alloc_transfer(0);
+}
+
+static void usb_free_tx_pool(struct usb_device *dev)
+{
+	while(dev->num_tx_bufs > 0)
+		free(dev->tx_bufs[--dev->num_tx_bufs]);
+	while(dev->num_tx_pool > 0)
+		libusb_free_transfer(dev->tx_pool[--dev->num_tx_pool]);
+}
+
+static struct libusb_transfer *get_tx_xfer(struct usb_device *dev)
+{
+	struct libusb_transfer *xfer = NULL;
+
+	pthread_mutex_lock(&dev->tx_mutex);
+	if(dev->num_tx_pool > 0)
+		xfer = dev->tx_pool[--dev->num_tx_pool];
+	pthread_mutex_unlock(&dev->tx_mutex);
+	if(!xfer)
+		xfer = libusb_alloc_transfer(0);
+	return xfer;
+}
+
+static void put_tx_xfer(struct usb_device *dev, struct libusb_transfer *xfer)
+{
+	pthread_mutex_lock(&dev->tx_mutex);
+	if(dev->num_tx_pool < NUM_TX_POOL) {
+		dev->tx_pool[dev->num_tx_pool++] = xfer;
+		xfer = NULL;
+	}
+	pthread_mutex_unlock(&dev->tx_mutex);
+	if(xfer)
+		libusb_free_transfer(xfer);
+}
+
+/**
+ * Get a USB_MTU sized buffer for an outgoing transfer from the device's
+ * pool. It goes back to the pool when the usb_send() it is passed to
+ * completes, or through usb_put_tx_buffer() if it is not sent after all.
+ */
+unsigned char *usb_get_tx_buffer(struct usb_device *dev)
+{
+	unsigned char *buf = NULL;
+
+	pthread_mutex_lock(&dev->tx_mutex);
+	if(dev->num_tx_bufs > 0)
+		buf = dev->tx_bufs[--dev->num_tx_bufs];
+	pthread_mutex_unlock(&dev->tx_mutex);
+	if(!buf)
+		buf = malloc(USB_MTU);
+	return buf;
+}
+
+void usb_put_tx_buffer(struct usb_device *dev, unsigned char *buf)
+{
+	pthread_mutex_lock(&dev->tx_mutex);
+	if(dev->num_tx_bufs < NUM_TX_POOL) {
+		dev->tx_bufs[dev->num_tx_bufs++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&dev->tx_mutex);
+	free(buf);
+}
 
 static void usb_disconnect(struct usb_device *dev)
 {
@@ -104,6 +199,8 @@ static void usb_disconnect(struct usb_device *dev)
 
 	collection_free(&dev->tx_xfers);
 	collection_free(&dev->rx_xfers);
+	usb_free_tx_pool(dev);
+	pthread_mutex_destroy(&dev->tx_mutex);
 	libusb_release_interface(dev->dev, dev->interface);
 	libusb_close(dev->dev);
 	dev->dev = NULL;
@@ -157,35 +254,56 @@ static void tx_callback(struct libusb_transfer *xfer)
 		// we'll do device_remove there too
 		dev->alive = 0;
 	}
-	if(xfer->buffer)
-		free(xfer->buffer);
+	if(xfer->buffer != zlp_buf)
+		usb_put_tx_buffer(dev, xfer->buffer);
+	pthread_mutex_lock(&dev->tx_mutex);
 	collection_remove(&dev->tx_xfers, xfer);
-	libusb_free_transfer(xfer);
+	pthread_mutex_unlock(&dev->tx_mutex);
+	put_tx_xfer(dev, xfer);
 }
 
-int usb_send(struct usb_device *dev, const unsigned char *buf, int length)
+static int submit_tx_xfer(struct usb_device *dev, struct libusb_transfer *xfer)
 {
 	int res;
-	struct libusb_transfer *xfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, (void*)buf, length, tx_callback, dev, 0);
+
+	// track it before submitting, the completion may run on another thread
+	pthread_mutex_lock(&dev->tx_mutex);
+	collection_add(&dev->tx_xfers, xfer);
+	pthread_mutex_unlock(&dev->tx_mutex);
 	if((res = libusb_submit_transfer(xfer)) < 0) {
+		pthread_mutex_lock(&dev->tx_mutex);
+		collection_remove(&dev->tx_xfers, xfer);
+		pthread_mutex_unlock(&dev->tx_mutex);
+	}
+	return res;
+}
+
+/**
+ * Submit a bulk transfer to the device. buf must come from
+ * usb_get_tx_buffer() and is owned by the USB layer afterwards,
+ * whether or not the submission succeeds.
+ */
+int usb_send(struct usb_device *dev, unsigned char *buf, int length)
+{
+	int res;
+	struct libusb_transfer *xfer = get_tx_xfer(dev);
+	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, buf, length, tx_callback, dev, 0);
+	if((res = submit_tx_xfer(dev, xfer)) < 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit TX transfer %p len %d to device %d-%d: %d", buf, length, dev->bus, dev->address, res);
-		libusb_free_transfer(xfer);
+		usb_put_tx_buffer(dev, buf);
+		put_tx_xfer(dev, xfer);
 		return res;
 	}
-	collection_add(&dev->tx_xfers, xfer);
 	if (length % dev->wMaxPacketSize == 0) {
 		usbmuxd_log(LL_DEBUG, "Send ZLP");
 		// Send Zero Length Packet
-		xfer = libusb_alloc_transfer(0);
-		void *buffer = malloc(1);
-		libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, buffer, 0, tx_callback, dev, 0);
-		if((res = libusb_submit_transfer(xfer)) < 0) {
+		xfer = get_tx_xfer(dev);
+		libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_out, zlp_buf, 0, tx_callback, dev, 0);
+		if((res = submit_tx_xfer(dev, xfer)) < 0) {
 			usbmuxd_log(LL_ERROR, "Failed to submit TX ZLP transfer to device %d-%d: %d", dev->bus, dev->address, res);
-			libusb_free_transfer(xfer);
+			put_tx_xfer(dev, xfer);
 			return res;
 		}
-		collection_add(&dev->tx_xfers, xfer);
 	}
 	return 0;
 }
@@ -249,6 +367,7 @@ static int start_rx_loop(struct usb_device *dev)
 	libusb_fill_bulk_transfer(xfer, dev->dev, dev->ep_in, buf, USB_MRU, rx_callback, dev, 0);
 	if((res = libusb_submit_transfer(xfer)) != 0) {
 		usbmuxd_log(LL_ERROR, "Failed to submit RX transfer to device %d-%d: %d", dev->bus, dev->address, res);
+		free(buf);
 		libusb_free_transfer(xfer);
 		return res;
 	}
@@ -430,6 +549,8 @@ static int usb_device_add(libusb_device* dev)
 
 	collection_init(&usbdev->tx_xfers);
 	collection_init(&usbdev->rx_xfers);
+	pthread_mutex_init(&usbdev->tx_mutex, NULL);
+	usb_fill_tx_pool(usbdev);
 
 	collection_add(&device_list, usbdev);
 
@@ -438,18 +559,19 @@ static int usb_device_add(libusb_device* dev)
 		return -1;
 	}
 
-	// Spin up NUM_RX_LOOPS parallel usb data retrieval loops
+	// Spin up num_rx_loops parallel usb data retrieval loops
 	// Old usbmuxds used only 1 rx loop, but that leaves the
 	// USB port sleeping most of the time
-	int rx_loops = NUM_RX_LOOPS;
-	for (rx_loops = NUM_RX_LOOPS; rx_loops > 0; rx_loops--) {
+	int rx_loops = num_rx_loops;
+	for (rx_loops = num_rx_loops; rx_loops > 0; rx_loops--) {
 		if(start_rx_loop(usbdev) < 0) {
-			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", NUM_RX_LOOPS - rx_loops);
+			usbmuxd_log(LL_WARNING, "Failed to start RX loop number %d", num_rx_loops - rx_loops);
+			break;
 		}
 	}
 
 	// Ensure we have at least 1 RX loop going
-	if (rx_loops == NUM_RX_LOOPS) {
+	if (rx_loops == num_rx_loops) {
 		usbmuxd_log(LL_FATAL, "Failed to start any RX loop for device %d-%d",
 					usbdev->bus, usbdev->address);
 		device_remove(usbdev);
@@ -458,9 +580,9 @@ static int usb_device_add(libusb_device* dev)
 	} else if (rx_loops > 0) {
 		usbmuxd_log(LL_WARNING, "Failed to start all %d RX loops. Going on with %d loops. "
 					"This may have negative impact on device read speed.",
-					NUM_RX_LOOPS, NUM_RX_LOOPS - rx_loops);
+					num_rx_loops, num_rx_loops - rx_loops);
 	} else {
-		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", NUM_RX_LOOPS);
+		usbmuxd_log(LL_DEBUG, "All %d RX loops started successfully", num_rx_loops);
 	}
 
 	return 0;
@@ -553,21 +675,108 @@ uint64_t usb_get_speed(struct usb_device *dev)
 	return dev->speed;
 }
 
-void usb_get_fds(struct fdlist *list)
+struct mux_device *usb_get_mux_device(struct usb_device *dev)
+{
+	return dev->mux_dev;
+}
+
+void usb_set_mux_device(struct usb_device *dev, struct mux_device *mux_dev)
+{
+	dev->mux_dev = mux_dev;
+}
+
+/**
+ * Count the bulk transfers currently submitted for the device.
+ * Must be called from the main thread, which owns the RX transfers.
+ */
+void usb_get_transfer_counts(struct usb_device *dev, int *rx, int *tx)
+{
+	*rx = collection_count(&dev->rx_xfers);
+	pthread_mutex_lock(&dev->tx_mutex);
+	*tx = collection_count(&dev->tx_xfers);
+	pthread_mutex_unlock(&dev->tx_mutex);
+}
+
+static void usb_fd_event_cb(struct event_watch *watch, short revents)
+{
+	usb_fds_ready = 1;
+}
+
+static void usb_pollfd_added(int fd, short events, void *user_data)
+{
+	struct event_watch *watch = malloc(sizeof(struct event_watch));
+	usbmuxd_log(LL_DEBUG, "usb_pollfd_added: fd %d events %d", fd, events);
+	if(event_add(watch, fd, events, usb_fd_event_cb, NULL) < 0) {
+		free(watch);
+		return;
+	}
+	collection_add(&usb_watches, watch);
+}
+
+static void usb_pollfd_removed(int fd, void *user_data)
+{
+	usbmuxd_log(LL_DEBUG, "usb_pollfd_removed: fd %d", fd);
+	FOREACH(struct event_watch *watch, &usb_watches) {
+		if(watch->fd == fd) {
+			event_remove(watch);
+			collection_remove(&usb_watches, watch);
+			free(watch);
+			break;
+		}
+	} ENDFOREACH
+}
+
+static int usb_watch_fds(void)
 {
 	const struct libusb_pollfd **usbfds;
 	const struct libusb_pollfd **p;
+
+	collection_init(&usb_watches);
+	usb_fds_ready = 0;
+
+	libusb_set_pollfd_notifiers(NULL, usb_pollfd_added, usb_pollfd_removed, NULL);
+
 	usbfds = libusb_get_pollfds(NULL);
 	if(!usbfds) {
 		usbmuxd_log(LL_ERROR, "libusb_get_pollfds failed");
-		return;
+		return -1;
 	}
 	p = usbfds;
 	while(*p) {
-		fdlist_add(list, FD_USB, (*p)->fd, (*p)->events);
+		usb_pollfd_added((*p)->fd, (*p)->events, NULL);
 		p++;
 	}
 	free(usbfds);
+	return 0;
+}
+
+static void usb_unwatch_fds(void)
+{
+	libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+	FOREACH(struct event_watch *watch, &usb_watches) {
+		event_remove(watch);
+		free(watch);
+	} ENDFOREACH
+	collection_free(&usb_watches);
+}
+
+int usb_events_pending(void)
+{
+	return usb_fds_ready;
+}
+
+/**
+ * Set the number of bulk IN transfers kept outstanding per device.
+ * Takes effect for devices attached afterwards.
+ *
+ * @return 0 on success, -1 if count is out of range.
+ */
+int usb_set_rx_loops(int count)
+{
+	if(count < 1 || count > MAX_RX_LOOPS)
+		return -1;
+	num_rx_loops = count;
+	return 0;
 }
 
 void usb_autodiscover(int enable)
@@ -617,6 +826,7 @@ int usb_process(void)
 	int res;
 	struct timeval tv;
 	tv.tv_sec = tv.tv_usec = 0;
+	usb_fds_ready = 0;
 	res = libusb_handle_events_timeout(NULL, &tv);
 	if(res < 0) {
 		usbmuxd_log(LL_ERROR, "libusb_handle_events_timeout failed: %d", res);
@@ -706,6 +916,11 @@ int usb_init(void)
 
 	collection_init(&device_list);
 
+	if(usb_watch_fds() < 0) {
+		libusb_exit(NULL);
+		return -1;
+	}
+
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
 		usbmuxd_log(LL_INFO, "Registering for libusb hotplug events");
@@ -742,5 +957,6 @@ void usb_shutdown(void)
 		usb_disconnect(usbdev);
 	} ENDFOREACH
 	collection_free(&device_list);
+	usb_unwatch_fds();
 	libusb_exit(NULL);
 }
@@ -48,6 +48,7 @@
 #define PID_RANGE_MAX 0x12af
 
 struct usb_device;
+struct mux_device;
 
 int usb_init(void);
 void usb_shutdown(void);
@@ -55,11 +56,17 @@ const char *usb_get_serial(struct usb_device *dev);
 uint32_t usb_get_location(struct usb_device *dev);
 uint16_t usb_get_pid(struct usb_device *dev);
 uint64_t usb_get_speed(struct usb_device *dev);
-void usb_get_fds(struct fdlist *list);
+struct mux_device *usb_get_mux_device(struct usb_device *dev);
+void usb_set_mux_device(struct usb_device *dev, struct mux_device *mux_dev);
+void usb_get_transfer_counts(struct usb_device *dev, int *rx, int *tx);
+int usb_events_pending(void);
 int usb_get_timeout(void);
-int usb_send(struct usb_device *dev, const unsigned char *buf, int length);
+unsigned char *usb_get_tx_buffer(struct usb_device *dev);
+void usb_put_tx_buffer(struct usb_device *dev, unsigned char *buf);
+int usb_send(struct usb_device *dev, unsigned char *buf, int length);
 int usb_discover(void);
 void usb_autodiscover(int enable);
+int usb_set_rx_loops(int count);
 int usb_process(void);
 int usb_process_timeout(int msec);
 
@@ -136,6 +136,171 @@ void collection_copy(struct collection *dest, struct collection *src)
 	memcpy(dest->list, src->list, sizeof(void*) * src->capacity);
 }
 
+/*
+ * Byte ring buffer. Data is appended at the tail and drained from the head
+ * without ever moving what is left, so enqueue and drain cost the same no
+ * matter how much is buffered. The head is reset whenever the buffer runs
+ * empty, which keeps the common case a single contiguous chunk.
+ */
+void ringbuf_init(struct ringbuf *rb, uint32_t capacity)
+{
+	rb->data = malloc(capacity);
+	rb->capacity = capacity;
+	rb->head = 0;
+	rb->size = 0;
+}
+
+void ringbuf_free(struct ringbuf *rb)
+{
+	free(rb->data);
+	rb->data = NULL;
+	rb->capacity = 0;
+	rb->head = 0;
+	rb->size = 0;
+}
+
+/**
+ * Enlarge the buffer to hold at least capacity bytes, keeping its content.
+ *
+ * @return 0 on success, -1 if the memory could not be allocated.
+ */
+int ringbuf_grow(struct ringbuf *rb, uint32_t capacity)
+{
+	struct iovec iov[2];
+	unsigned char *data;
+	int i, cnt;
+	uint32_t off = 0;
+
+	if(capacity <= rb->capacity)
+		return 0;
+	data = malloc(capacity);
+	if(!data)
+		return -1;
+	cnt = ringbuf_peek(rb, iov);
+	for(i = 0; i < cnt; i++) {
+		memcpy(data + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
+	}
+	free(rb->data);
+	rb->data = data;
+	rb->capacity = capacity;
+	rb->head = 0;
+	return 0;
+}
+
+/**
+ * Append up to len bytes, as many as there is room for.
+ *
+ * @return the number of bytes appended.
+ */
+uint32_t ringbuf_write(struct ringbuf *rb, const void *data, uint32_t len)
+{
+	uint32_t tail, chunk;
+
+	if(len > rb->capacity - rb->size)
+		len = rb->capacity - rb->size;
+	if(!len)
+		return 0;
+	tail = rb->head + rb->size;
+	if(tail >= rb->capacity)
+		tail -= rb->capacity;
+	chunk = rb->capacity - tail;
+	if(chunk > len)
+		chunk = len;
+	memcpy(rb->data + tail, data, chunk);
+	if(chunk < len)
+		memcpy(rb->data, (const unsigned char *)data + chunk, len - chunk);
+	rb->size += len;
+	return len;
+}
+
+/**
+ * Describe the buffered data as at most two chunks, suitable for writev()
+ * or sendmsg(). Nothing is consumed.
+ *
+ * @return the number of iovec entries filled in (0 if the buffer is empty).
+ */
+int ringbuf_peek(const struct ringbuf *rb, struct iovec iov[2])
+{
+	uint32_t first;
+
+	if(!rb->size)
+		return 0;
+	first = rb->capacity - rb->head;
+	if(first >= rb->size) {
+		iov[0].iov_base = rb->data + rb->head;
+		iov[0].iov_len = rb->size;
+		return 1;
+	}
+	iov[0].iov_base = rb->data + rb->head;
+	iov[0].iov_len = first;
+	iov[1].iov_base = rb->data;
+	iov[1].iov_len = rb->size - first;
+	return 2;
+}
+
+void ringbuf_consume(struct ringbuf *rb, uint32_t len)
+{
+	if(len >= rb->size) {
+		rb->head = 0;
+		rb->size = 0;
+		return;
+	}
+	rb->head += len;
+	if(rb->head >= rb->capacity)
+		rb->head -= rb->capacity;
+	rb->size -= len;
+}
+
+/*
+ * Intrusive multi-producer, single-consumer queue (Vyukov). Pushing is a
+ * single atomic exchange and never blocks; only the consumer pops. A pop
+ * can briefly come back empty while a push is halfway through, so the
+ * producer has to wake the consumer after pushing, not before.
+ */
+void mpsc_init(struct mpsc_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	__atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if(tail == &q->stub) {
+		if(!next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+	if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
 #ifndef HAVE_STPCPY
 /**
  * Copy characters from one string into another
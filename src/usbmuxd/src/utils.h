@@ -22,7 +22,9 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <poll.h>
+#include <sys/uio.h>
 #include <plist/plist.h>
 
 enum fdowner {
@@ -55,6 +57,34 @@ int collection_count(struct collection *col);
 void collection_free(struct collection *col);
 void collection_copy(struct collection *dest, struct collection *src);
 
+struct ringbuf {
+	unsigned char *data;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t size;
+};
+
+void ringbuf_init(struct ringbuf *rb, uint32_t capacity);
+void ringbuf_free(struct ringbuf *rb);
+int ringbuf_grow(struct ringbuf *rb, uint32_t capacity);
+uint32_t ringbuf_write(struct ringbuf *rb, const void *data, uint32_t len);
+int ringbuf_peek(const struct ringbuf *rb, struct iovec iov[2]);
+void ringbuf_consume(struct ringbuf *rb, uint32_t len);
+
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+
+struct mpsc_queue {
+	struct mpsc_node *head;	// producers append here
+	struct mpsc_node *tail;	// consumer pops here
+	struct mpsc_node stub;
+};
+
+void mpsc_init(struct mpsc_queue *q);
+void mpsc_push(struct mpsc_queue *q, struct mpsc_node *node);
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q);
+
 #define MERGE_(a,b) a ## _ ## b
 #define LABEL_(a,b) MERGE_(a, b)
 #define UNIQUE_VAR(a) LABEL_(a, __LINE__)
@@ -0,0 +1,486 @@
+/*
+ * usbmuxd-bench.c
+ *
+ * Throughput and latency benchmark for usbmuxd. Opens a number of
+ * connections spread over the attached devices and pushes data through
+ * them for a fixed time. Meant to be run against a daemon built with
+ * --with-simulator, whose fake devices run echo/sink/source services.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+#include "usbmuxd-proto.h"
+
+#define MAX_CONNECTIONS 1024
+#define MAX_DEVICES 64
+
+enum bench_mode {
+	MODE_SOURCE,	// device sends, we read
+	MODE_SINK,	// we send, device discards
+	MODE_ECHO	// one block in flight per connection, timed round trip
+};
+
+struct bench_conn {
+	int fd;
+	uint32_t sent;	// echo: bytes of the current block written
+	uint32_t received;	// echo: bytes of the current block read back
+	uint64_t start;	// echo: when the current block went out
+};
+
+static const char *socket_path = USBMUXD_SOCKET_FILE;
+static enum bench_mode mode = MODE_SOURCE;
+static int num_devices = 1;
+static int num_conns = 1;
+static int port = 0;
+static uint32_t block_size = 16384;
+static int duration = 10;
+static int daemon_pid = 0;
+
+static uint64_t *latencies;
+static size_t num_latencies;
+static size_t latency_capacity;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_latency(uint64_t usec)
+{
+	if(num_latencies == latency_capacity) {
+		latency_capacity = latency_capacity ? latency_capacity * 2 : 65536;
+		latencies = realloc(latencies, latency_capacity * sizeof(uint64_t));
+	}
+	latencies[num_latencies++] = usec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(int p)
+{
+	if(!num_latencies)
+		return 0;
+	return latencies[(num_latencies - 1) * p / 100];
+}
+
+/**
+ * CPU time (user + system) used so far by a process, in seconds,
+ * or -1 if it cannot be read.
+ */
+static double process_cpu(int pid)
+{
+	char path[64];
+	char buf[1024];
+	unsigned long utime, stime;
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if(!f)
+		return -1;
+	if(!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	// the command name may contain spaces, fields continue after the last ')'
+	p = strrchr(buf, ')');
+	if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double self_cpu(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int connect_daemon(void)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Could not connect to %s: %s\n", socket_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int read_full(int fd, void *buf, size_t len, int timeout)
+{
+	size_t got = 0;
+	while(got < len) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		ssize_t res;
+		if(poll(&pfd, 1, timeout) <= 0)
+			return -1;
+		res = read(fd, (char *)buf + got, len - got);
+		if(res <= 0)
+			return -1;
+		got += res;
+	}
+	return 0;
+}
+
+/**
+ * Read one message from the daemon into buf.
+ *
+ * @return the message type, or -1 on error.
+ */
+static int read_message(int fd, void *buf, size_t size, int timeout)
+{
+	struct usbmuxd_header *hdr = buf;
+	if(read_full(fd, hdr, sizeof(*hdr), timeout) < 0)
+		return -1;
+	if(hdr->length < sizeof(*hdr) || hdr->length > size)
+		return -1;
+	if(read_full(fd, hdr + 1, hdr->length - sizeof(*hdr), timeout) < 0)
+		return -1;
+	return hdr->message;
+}
+
+static void fill_header(struct usbmuxd_header *hdr, uint32_t length, uint32_t message, uint32_t tag)
+{
+	hdr->length = length;
+	hdr->version = USBMUXD_PROTOCOL_VERSION;
+	hdr->message = message;
+	hdr->tag = tag;
+}
+
+/**
+ * Collect the ids of up to max devices the daemon reports.
+ *
+ * @return the number of devices found.
+ */
+static int get_devices(uint32_t *ids, int max)
+{
+	struct usbmuxd_listen_request req;
+	unsigned char buf[1024];
+	int count = 0;
+	int fd = connect_daemon();
+	if(fd < 0)
+		return -1;
+
+	fill_header(&req.header, sizeof(req), MESSAGE_LISTEN, 1);
+	if(write(fd, &req, sizeof(req)) != sizeof(req) || read_message(fd, buf, sizeof(buf), 5000) != MESSAGE_RESULT) {
+		fprintf(stderr, "Listen request failed\n");
+		close(fd);
+		return -1;
+	}
+	while(count < max) {
+		int msg = read_message(fd, buf, sizeof(buf), 2000);
+		if(msg < 0)
+			break;
+		if(msg == MESSAGE_DEVICE_ADD) {
+			struct usbmuxd_device_record *rec = (void *)(buf + sizeof(struct usbmuxd_header));
+			ids[count++] = rec->device_id;
+		}
+	}
+	close(fd);
+	return count;
+}
+
+static int open_connection(uint32_t device_id)
+{
+	struct usbmuxd_connect_request req;
+	struct usbmuxd_result_msg res;
+	int fd = connect_daemon();
+	if(fd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	fill_header(&req.header, sizeof(req), MESSAGE_CONNECT, 2);
+	req.device_id = device_id;
+	req.port = htons(port);
+	if(write(fd, &req, sizeof(req)) != sizeof(req) || read_message(fd, &res, sizeof(res), 5000) != MESSAGE_RESULT) {
+		fprintf(stderr, "Connect request to device %d failed\n", device_id);
+		close(fd);
+		return -1;
+	}
+	if(res.result != RESULT_OK) {
+		fprintf(stderr, "Device %d refused connection to port %d (%d)\n", device_id, port, res.result);
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	return fd;
+}
+
+static void usage(const char *argv0)
+{
+	printf("Usage: %s [OPTIONS]\n", argv0);
+	printf("Measure usbmuxd throughput and latency, typically against simulated devices.\n\n");
+	printf("  -s, --socket PATH\tusbmuxd socket (default %s)\n", USBMUXD_SOCKET_FILE);
+	printf("  -m, --mode MODE\t\"source\" (read from the device, default), \"sink\"\n");
+	printf("                 \t(write to it) or \"echo\" (timed round trips)\n");
+	printf("  -p, --port PORT\tdevice port (default 19, 9 or 7 by mode)\n");
+	printf("  -d, --devices M\tspread connections over M devices (default 1)\n");
+	printf("  -c, --connections N\tnumber of connections (default 1)\n");
+	printf("  -b, --block BYTES\tread/write/echo block size (default 16384)\n");
+	printf("  -t, --time SECONDS\tlength of the run (default 10)\n");
+	printf("  -u, --usbmuxd-pid PID\taccount CPU time of this usbmuxd process\n");
+	printf("  -h, --help\t\tprint this message\n");
+}
+
+static int parse_options(int argc, char **argv)
+{
+	static struct option longopts[] = {
+		{"socket", 1, NULL, 's'},
+		{"mode", 1, NULL, 'm'},
+		{"port", 1, NULL, 'p'},
+		{"devices", 1, NULL, 'd'},
+		{"connections", 1, NULL, 'c'},
+		{"block", 1, NULL, 'b'},
+		{"time", 1, NULL, 't'},
+		{"usbmuxd-pid", 1, NULL, 'u'},
+		{"help", 0, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+
+	while((c = getopt_long(argc, argv, "s:m:p:d:c:b:t:u:h", longopts, NULL)) != -1) {
+		switch(c) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'm':
+			if(!strcmp(optarg, "source"))
+				mode = MODE_SOURCE;
+			else if(!strcmp(optarg, "sink"))
+				mode = MODE_SINK;
+			else if(!strcmp(optarg, "echo"))
+				mode = MODE_ECHO;
+			else
+				return -1;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			num_devices = atoi(optarg);
+			break;
+		case 'c':
+			num_conns = atoi(optarg);
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 't':
+			duration = atoi(optarg);
+			break;
+		case 'u':
+			daemon_pid = atoi(optarg);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			return -1;
+		}
+	}
+	if(num_devices < 1 || num_devices > MAX_DEVICES || num_conns < 1 || num_conns > MAX_CONNECTIONS
+	   || block_size < 1 || duration < 1 || port < 0 || port > 65535)
+		return -1;
+	if(!port)
+		port = (mode == MODE_SOURCE) ? 19 : (mode == MODE_SINK) ? 9 : 7;
+	return 0;
+}
+
+static const char *mode_name(void)
+{
+	return (mode == MODE_SOURCE) ? "source" : (mode == MODE_SINK) ? "sink" : "echo";
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_conn conns[MAX_CONNECTIONS];
+	struct pollfd pfds[MAX_CONNECTIONS];
+	uint32_t ids[MAX_DEVICES];
+	unsigned char *out, *in;
+	uint64_t bytes = 0;
+	uint64_t start, end, elapsed;
+	double cpu_start, cpu_end, daemon_start = -1, daemon_end = -1;
+	double gb;
+	int found, i;
+
+	if(parse_options(argc, argv) < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	found = get_devices(ids, num_devices);
+	if(found < num_devices) {
+		fprintf(stderr, "Only %d of %d devices found\n", (found < 0) ? 0 : found, num_devices);
+		return 1;
+	}
+
+	for(i = 0; i < num_conns; i++) {
+		memset(&conns[i], 0, sizeof(conns[i]));
+		conns[i].fd = open_connection(ids[i % num_devices]);
+		if(conns[i].fd < 0)
+			return 1;
+		pfds[i].fd = conns[i].fd;
+	}
+
+	out = malloc(block_size);
+	in = malloc(block_size);
+	for(i = 0; i < (int)block_size; i++)
+		out[i] = i & 0xff;
+
+	printf("%s: %d connection%s over %d device%s, port %d, %u byte blocks, %d s\n", mode_name(),
+		num_conns, (num_conns == 1) ? "" : "s", num_devices, (num_devices == 1) ? "" : "s", port, block_size, duration);
+
+	cpu_start = self_cpu();
+	if(daemon_pid)
+		daemon_start = process_cpu(daemon_pid);
+	start = now_us();
+	end = start + (uint64_t)duration * 1000000;
+
+	while(1) {
+		uint64_t now = now_us();
+		int n;
+		if(now >= end)
+			break;
+		for(i = 0; i < num_conns; i++) {
+			struct bench_conn *conn = &conns[i];
+			if(mode == MODE_SOURCE)
+				pfds[i].events = POLLIN;
+			else if(mode == MODE_SINK)
+				pfds[i].events = POLLOUT;
+			else {
+				if(conn->sent == 0)
+					conn->start = now;
+				pfds[i].events = (conn->sent < block_size) ? (POLLIN | POLLOUT) : POLLIN;
+			}
+		}
+		n = poll(pfds, num_conns, (end - now) / 1000 + 1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		for(i = 0; i < num_conns && n > 0; i++) {
+			struct bench_conn *conn = &conns[i];
+			ssize_t res;
+			if(!pfds[i].revents)
+				continue;
+			n--;
+			if(pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+				fprintf(stderr, "Connection %d closed by usbmuxd\n", i);
+				return 1;
+			}
+			if(mode == MODE_SOURCE) {
+				res = read(conn->fd, in, block_size);
+				if(res > 0)
+					bytes += res;
+			} else if(mode == MODE_SINK) {
+				res = write(conn->fd, out, block_size);
+				if(res > 0)
+					bytes += res;
+			} else {
+				if((pfds[i].revents & POLLOUT) && conn->sent < block_size) {
+					res = write(conn->fd, out + conn->sent, block_size - conn->sent);
+					if(res > 0)
+						conn->sent += res;
+				}
+				if(pfds[i].revents & POLLIN) {
+					res = read(conn->fd, in, block_size - conn->received);
+					if(res > 0)
+						conn->received += res;
+					if(conn->received == block_size) {
+						add_latency(now_us() - conn->start);
+						bytes += block_size;
+						conn->sent = 0;
+						conn->received = 0;
+					}
+				}
+				continue;
+			}
+			if(res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+				fprintf(stderr, "Connection %d failed: %s\n", i, res ? strerror(errno) : "closed");
+				return 1;
+			}
+		}
+	}
+
+	elapsed = now_us() - start;
+	cpu_end = self_cpu();
+	if(daemon_pid)
+		daemon_end = process_cpu(daemon_pid);
+	for(i = 0; i < num_conns; i++)
+		close(conns[i].fd);
+
+	gb = bytes / 1e9;
+	qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+	printf("throughput: %.1f MB/s (%" PRIu64 " bytes in %.2f s)\n", bytes / (elapsed / 1e6) / 1e6, bytes, elapsed / 1e6);
+	if(mode == MODE_ECHO)
+		printf("latency:    p50 %" PRIu64 " us, p99 %" PRIu64 " us over %zu round trips\n", percentile(50), percentile(99), num_latencies);
+	if(gb > 0) {
+		if(daemon_start >= 0 && daemon_end >= 0)
+			printf("cpu:        usbmuxd %.2f s/GB, benchmark %.2f s/GB\n", (daemon_end - daemon_start) / gb, (cpu_end - cpu_start) / gb);
+		else
+			printf("cpu:        benchmark %.2f s/GB (pass -u to include usbmuxd)\n", (cpu_end - cpu_start) / gb);
+	}
+	// one line with everything, to compare runs between commits
+	printf("RESULT mode=%s devices=%d connections=%d block=%u seconds=%.2f mbps=%.1f p50_us=%" PRIu64 " p99_us=%" PRIu64 " usbmuxd_cpu_s_per_gb=%.3f bench_cpu_s_per_gb=%.3f\n",
+		mode_name(), num_devices, num_conns, block_size, elapsed / 1e6, bytes / (elapsed / 1e6) / 1e6,
+		percentile(50), percentile(99),
+		(gb > 0 && daemon_start >= 0 && daemon_end >= 0) ? (daemon_end - daemon_start) / gb : 0,
+		(gb > 0) ? (cpu_end - cpu_start) / gb : 0);
+
+	free(out);
+	free(in);
+	free(latencies);
+	return 0;
+}